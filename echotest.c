@@ -7,7 +7,7 @@
 #include "stdmod.h"
 #include "pstreams_echo.h"
 
-extern P_STREAMTAB echo_streamtab;
+extern const P_STREAMTAB echo_streamtab;
 
 int MSGSIZE=85;
 FILE *ltfile=NULL;
@@ -25,7 +25,7 @@ extern "C" {
  * rolls over and goes negative just like lbolt variable in unix(drv_getparm)
  * only difference is valid
  */
-int32 clockticks();
+int32 my_clockticks();
 
 UTIME my_time();
 
@@ -35,6 +35,8 @@ ushort my_htons(ushort hostshort);
 ulong my_ntohl(ulong netlong);
 ushort my_ntohs(ushort netshort);
 void my_sleep(long millisecs);
+void *my_slaballoc(void *arg, uint32 size);
+void my_slabfree(void *arg, void *ptr, uint32 size);
 
 LOGFILE *LOGOPEN(const char *filename, const char *mode);
 int LOGWRITE(LOGFILE *, const char *format, ...);
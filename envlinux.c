@@ -16,8 +16,6 @@ FILE: env.c
 char diagbuf[2048];
 
 
-PDBG(extern P_STREAMHEAD *dbgstrm);
-
 /*
  * rolls over and goes negative just like lbolt variable in unix(drv_getparm)
  * only difference is valid
@@ -25,7 +23,11 @@ PDBG(extern P_STREAMHEAD *dbgstrm);
 int32 my_clockticks()
 {
     static ulong prev_ticks = 0;
-    ulong curticks = time(0)*1000; //in milliseconds
+    struct timespec now;
+    ulong curticks;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    curticks = (ulong)now.tv_sec*1000 + now.tv_nsec/1000000; //in milliseconds
     if(prev_ticks != 0)
     {
         PDBG(uint32 diff = curticks - prev_ticks);
@@ -59,9 +61,29 @@ ushort my_ntohs(ushort netshort)
     return ntohs(netshort);
 }
 
+/*
+ * backing allocator for elastic pools(LOPBACKING) - plain heap
+ */
+void *my_slaballoc(void *arg, uint32 size)
+{
+    (void)arg;
+    return malloc(size);
+}
+
+void my_slabfree(void *arg, void *ptr, uint32 size)
+{
+    (void)arg;
+    (void)size;
+    free(ptr);
+}
+
 void my_sleep(long millisecs)
 {
-   sleep(millisecs/1000);
+    struct timespec ts;
+
+    ts.tv_sec = millisecs/1000;
+    ts.tv_nsec = (millisecs%1000)*1000000L;
+    nanosleep(&ts, NULL);
 }
 
 int my_fprintf(LOGFILE *file, const char *fmt, ...)
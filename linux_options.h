@@ -34,21 +34,114 @@ typedef FILE LOGFILE;
 #define VMEMSIZE  1024*1024
 #define PMEMSIZE  96*1024
 /*
- *for o2kpkt,o2kses hdr - note these do not co-exist because 
- *o2kseg makes a copy, and release its in msg
+ * default data buffer size classes {size, count, align} - used when
+ * pstreams_open is given no table of its own. Sizes ascend.
+ *  16 - for o2kpkt,o2kses hdr - note these do not co-exist because 
+ *       o2kseg makes a copy, and release its in msg
+ *  256 - this being default segment size
+ *  4 pages - page aligned buffers for large messages. A message beyond the
+ *       largest class is a chain of such blocks - see pstreams_allocmsg
  */
-#define POOL16SIZE 256
+#define PSTREAMS_PAGESIZE 4096
+#define PSTREAMS_SIZECLASSES {{16, 256, 0}, {64, 16, 0}, {256, 32, 0}, \
+                              {512, 8, 0}, {1792, 2, 0}, \
+                              {4*PSTREAMS_PAGESIZE, 8, PSTREAMS_PAGESIZE}}
+/*
+ * default bytes of data kept inline in each P_DATAB(FASTBUF) - large enough
+ * for a protocol header or a MY_PROTO with an address. Size classes upto
+ * this size go unused.
+ */
+#define PSTREAMS_INLINESIZE 32
+
+/*most size classes a stream can have*/
+#define MAXSIZECLASSES 16
+/*bytes per entry of the size to class map - a power of 2*/
+#define SIZECLASSGRAIN 16
+
+/*
+ * scatter-gather send - message block chains go out with sendmsg/writev
+ * straight from their blocks, upto PSTREAMS_MAXIOV blocks. Longer chains
+ * (or platforms without it) are pulled up into one block first.
+ */
+#define PSTREAMS_SENDMSG
+#define PSTREAMS_MAXIOV 16
+
+/*
+ * batched datagram receive - udpdev reads upto PSTREAMS_UDPRXBATCH datagrams
+ * per recvmmsg call. The batch size can be changed per stream with
+ * UDPDEV_RXBATCH; 0 or 1 reads one datagram at a time.
+ */
+#define PSTREAMS_RECVMMSG
+#define PSTREAMS_UDPRXBATCH 8
 
-#define POOL64SIZE 16 
+/*
+ * batched datagram send - udpdev queues outbound datagrams and sends them
+ * with one sendmmsg call once PSTREAMS_UDPTXBATCH datagrams or
+ * PSTREAMS_UDPTXBYTES bytes are queued, or the oldest has waited
+ * PSTREAMS_UDPTXDELAY milliseconds(0 - at the next service pass). Changed
+ * per stream with UDPDEV_TXBATCH; a count of 0 or 1 sends each datagram as
+ * it comes.
+ */
+#define PSTREAMS_SENDMMSG
+#define PSTREAMS_UDPTXBATCH 16
+#define PSTREAMS_UDPTXBYTES 8192
+#define PSTREAMS_UDPTXDELAY 0
 
 /*
- * this being default segment size
- */ 
-#define POOL256SIZE 32
+ * device fd readiness(pstreams_pollwait) - epoll where available, select
+ * otherwise - a set per stream. MAXPOLLFDS bounds the fds a stream registers
+ * for select, and the events taken per epoll_wait.
+ */
+#define PSTREAMS_EPOLL
+#define MAXPOLLFDS 64
 
-#define POOL512SIZE 8
+/*
+ * streamhead notify fd(pstreams_notifyfd) - an eventfd that is readable while
+ * the streamhead holds messages for the application, for its own poll loop.
+ */
+#define PSTREAMS_EVENTFD
 
-#define POOL1792SIZE 2
+/*
+ * multi-producer ingress(pstreams_ingress) - slots in the ring through which
+ * threads other than the stream's own send messages down it. A power of 2.
+ */
+#define PSTREAMS_INGRESS 256
+
+/*
+ * pipeline execution(pstreams_pin) - a pushed module may run on a worker
+ * thread of its own, upto PSTREAMS_MAXWORKERS per stream. pstreams_putnext
+ * to a queue run by another thread goes through a ring of PSTREAMS_SPSCSIZE
+ * slots(a power of 2). Needs PSTREAMS_INGRESS and PSTREAMS_EVENTFD.
+ */
+#define PSTREAMS_PIPELINE
+#define PSTREAMS_SPSCSIZE 64
+#define PSTREAMS_MAXWORKERS 4
+
+/*
+ * stream scheduler(pstreams_schedstart) - a pool of upto PSTREAMS_MAXSCHED
+ * threads that run many streams, each stream on one thread at a time. An
+ * idle thread takes ready streams from busy ones. Needs PSTREAMS_EPOLL and
+ * PSTREAMS_EVENTFD.
+ */
+#define PSTREAMS_SCHED
+#define PSTREAMS_MAXSCHED 16
+
+/*
+ * priority bands per queue, including band 0 for ordinary data. A message of
+ * a higher b_band goes in the top band. At most 9 - see pstreams_getq.
+ */
+#define PSTREAMS_NBAND 4
+
+/*
+ * per-thread magazine cache in front of listop pools - LOP_MAGSIZE objects
+ * are held per magazine, for upto LOP_MAXMAGS pools per thread(a stream has
+ * upto MAXSIZECLASSES+3). A magazine holds no more than 1/LOP_MAGSHARE of its
+ * pool; pools too small for that are not cached.
+ * A LOP_MAGSIZE of 0 disables the cache.
+ */
+#define LOP_MAGSIZE 32
+#define LOP_MAXMAGS 64
+#define LOP_MAGSHARE 4
 
 /*BLOCK 1. machine dependent codes for memory alignment constraints*/
     /*number bits in the data bus*/
@@ -116,6 +209,10 @@ typedef char		boolean;
 #define MIN(x,y) ((x) < (y) ? (x) : (y))
 #endif
 
+#ifndef MAX
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+#endif
+
 #ifndef MIN3
 #define MIN3(x,y,z) MIN((x), MIN((y), (z)))
 #endif
@@ -136,6 +233,17 @@ typedef char		boolean;
 #define VCONSOLEWRITE my_vprintf
 #define VLOGWRITE my_vfprintf
 #define LOGFLUSH fflush
+
+/*thread local storage and spinlocks - used by listop*/
+#define P_THREADLOCAL __thread
+typedef volatile int P_SPINLOCK;
+#define P_SPINLOCK_ACQUIRE(l) while(__sync_lock_test_and_set((l), 1)) { while(*(l)) ; }
+#define P_SPINLOCK_RELEASE(l) __sync_lock_release(l)
+/*atomics - used by the ingress ring(pstreams_ingress)*/
+typedef volatile long P_ATOMIC;
+#define P_ATOMIC_CAS(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#define P_ATOMIC_ADD(p, v) __sync_fetch_and_add((p), (v)) /*the value before*/
+#define P_MEMBARRIER() __sync_synchronize()
 /*#define PDEV_INIT WSAStartup
 */
 /*#define PDEV_ERROR WSAGetLastError*/
@@ -144,6 +252,12 @@ typedef char		boolean;
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <errno.h>
 #include <time.h>
 #include <assert.h>
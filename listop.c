@@ -54,6 +54,16 @@ by the actual object.
 /*given the pool object step to the pool header*/
 #define GETLISTHDR(pobj)  ((LISTHDR *)((char *)(pobj) - sizeof(LISTHDR)))
 
+/*round x up to a multiple of a, a power of 2*/
+#define ALIGNUP(x, a) (((x) + (a) - 1) & ~((UA)(a) - 1))
+
+/*skip past slab header to the first list header in slab*/
+#define GETSLABOBJ(pslab) ((LISTHDR *)((char *)(pslab) + WALIGN(sizeof(LOPSLAB))))
+
+/*is given list header within the placement area of the pool*/
+#define INPOOLBASE(ppool, plhdr) ((char *)(plhdr) >= (char *)(ppool)->mptr && \
+                                  (char *)(plhdr) < (char *)(ppool)->endptr)
+
 
 /******************************************************************************
 Name: lop_getpoolsize
@@ -65,7 +75,57 @@ Caveats:
 ******************************************************************************/
 uint32 lop_getpoolsize(SIZET objectsize, uint32 count)
 {
-    return sizeof(POOLHDR) + (WALIGN(objectsize)+sizeof(LISTHDR))*count;
+    return lop_getpoolsizealign(objectsize, count, 0);
+}
+
+/*last pool generation handed out - see lop_getmag*/
+static P_ATOMIC lop_gen;
+
+/******************************************************************************
+Name: lop_stride
+Purpose: distance between consecutive list headers in a pool of given object
+    size and alignment
+Parameters:
+Caveats: align is a power of 2, 0 for word alignment
+******************************************************************************/
+static uint32 lop_stride(SIZET objectsize, uint32 align)
+{
+    uint32 stride = WALIGN(objectsize)+sizeof(LISTHDR);
+
+    if(align > WORDBOUNDARY)
+    {
+        stride = ALIGNUP(stride, align);
+    }
+
+    return stride;
+}
+
+/******************************************************************************
+Name: lop_firstobj
+Purpose: first list header at or after p, whose object is aligned as given
+Parameters:
+Caveats: 
+******************************************************************************/
+static LISTHDR *lop_firstobj(void *p, uint32 align)
+{
+    if(align <= WORDBOUNDARY)
+    {
+        return (LISTHDR *)p;
+    }
+
+    return (LISTHDR *)(ALIGNUP((UA)p+sizeof(LISTHDR), align) - sizeof(LISTHDR));
+}
+
+/******************************************************************************
+Name: lop_getpoolsizealign
+Purpose: as lop_getpoolsize, for objects aligned at given boundary
+Parameters: align: power of 2. 0 for word alignment
+Caveats: 
+******************************************************************************/
+uint32 lop_getpoolsizealign(SIZET objectsize, uint32 count, uint32 align)
+{
+    return sizeof(POOLHDR) + lop_stride(objectsize, align)*count +
+        (align > WORDBOUNDARY ? align : 0);
 }
 
 /******************************************************************************
@@ -80,22 +140,37 @@ and should be stored in POOLHDR. This would be used to free pplacement at releas
 Currently, the endgame is not played out well - lop_free is called at all times.
 ******************************************************************************/
 POOLHDR *lop_allocpool(SIZET objectsize, uint32 count, void *pplacement)
+{
+    return lop_allocpoolalign(objectsize, count, 0, pplacement);
+}
+
+/******************************************************************************
+Name: lop_allocpoolalign
+Purpose: as lop_allocpool, with every object starting on an align boundary.
+    pplacement should hold lop_getpoolsizealign() bytes.
+    Objects are not threaded here - lop_take carves them off the placement
+    area one at a time, once the freelist runs dry, so a pool costs the same
+    to set up whatever its count.
+Parameters: align: power of 2. 0 for word alignment
+Caveats: an object is zeroed when it is first carved, not before.
+******************************************************************************/
+POOLHDR *lop_allocpoolalign(SIZET objectsize, uint32 count, uint32 align, void *pplacement)
 {
     POOLHDR *ppool;/*pointer to pool*/
-    LISTHDR *plhdr;/*pointer to list header*/
     uint32 adjobjectsize; /*object size after word alignment*/
     uint32 allocsize; /*total memory needed for pool*/
-    uint32 i;/*temp - for loop only*/
 
     if(!objectsize || !count)
     {
         return NULL;
     }
 
-    /*adjust size of object to end on word boundaries*/
-    adjobjectsize = WALIGN(objectsize);
+    ASSERT(!(align & (align-1))); /*power of 2*/
+
+    /*adjust size of object to end on word(or align) boundaries*/
     ASSERT(objectsize == WALIGN(objectsize)); /*not really needed - but...*/
-    allocsize = lop_getpoolsize(adjobjectsize, count);
+    adjobjectsize = lop_stride(objectsize, align) - sizeof(LISTHDR);
+    allocsize = lop_getpoolsizealign(objectsize, count, align);
 
     if(pplacement)
     {
@@ -108,46 +183,24 @@ POOLHDR *lop_allocpool(SIZET objectsize, uint32 count, void *pplacement)
         ppool = (POOLHDR *)lop_malloc(allocsize);
     }
 
-    memset(ppool, 0, allocsize);
+    memset(ppool, 0, sizeof(POOLHDR)); /*objects - see lop_carve*/
 
     /*the following assignments are some statistics used during debugging*/
     ppool->mptr = pplacement;
     ppool->msize = allocsize;
     ppool->objsize = adjobjectsize;
+    ppool->align = align;
     ppool->endptr = (char *)ppool+allocsize;
 
-    ppool->pfreelist = (LISTHDR *)GETPOOLOBJ(ppool);
-    ppool->freecount = ppool->count = count;
+    ppool->pfreelist = NULL;
+    ppool->pcarve = lop_firstobj(GETPOOLOBJ(ppool), align);
+    ppool->freecount = ppool->count = ppool->basecount = ppool->carvecount = count;
+    ppool->gen = (uint32)P_ATOMIC_ADD(&lop_gen, 1) + 1;
 
 #ifdef PDBG_ON
     ppool->lowat = ppool->freecount;
 #endif
 
-    plhdr = ppool->pfreelist;
-    for(i=1; i<count; i++) /*count starts with 1 since, plhdr has been assigned first one*/
-    {
-        ASSERT((char *)plhdr >= (char *)ppool->mptr); /*bounds check*/
-        ASSERT((char *)plhdr < (char *)ppool->endptr);/*bounds check*/
-
-        plhdr->pnext = (LISTHDR *)((char *)plhdr+sizeof(LISTHDR)+adjobjectsize);
-        plhdr = plhdr->pnext;
-
-#ifdef MMGR_DEBUG
-        if((char*)plhdr + adjobjectsize >= (char *)ppool->endptr)
-        {
-            printf("overflowing:\n");
-            printf("start: 0x%x end: 0x%x step: 0x%x "
-                "end-start: 0x%x allocsize: 0x%x, count: %d\n",
-                ppool->pfreelist, plhdr, adjobjectsize,
-                ((int)plhdr - (int)ppool->pfreelist),
-                allocsize, count);
-            ASSERT(0);
-        }
-#endif
-
-    }
-    plhdr->pnext = ppool->pfreelist; /*circular link list*/
-
     ASSERT(lop_checkpool(ppool) == LISTOP_SUCCESS);
 
     return ppool;
@@ -167,6 +220,31 @@ lop_releasepool(POOLHDR *pool)
      * memory to NULLs.
      */
 
+    lop_cacheflush(pool);
+
+    /*magazines of other threads still naming the pool are stale from here*/
+    if(pool)
+    {
+        pool->gen = (uint32)P_ATOMIC_ADD(&lop_gen, 1) + 1;
+    }
+
+    /*return slabs of an elastic pool to their backing allocator*/
+    if(pool && pool->pslabs)
+    {
+        while(pool->pslabs)
+        {
+            LOPSLAB *pslab = pool->pslabs;
+
+            pool->pslabs = pslab->pnext;
+            pool->pbacking->pf_free(pool->pbacking->arg, pslab, pslab->size);
+        }
+
+        /*freelist may thread through the slabs - the pool is done with*/
+        pool->pfreelist = NULL;
+        pool->freecount = pool->count = 0;
+        pool->pbacking = NULL;
+    }
+
     if(pool && pool->mptr)
     {
         /*do only if not placement(stored in pool)*/
@@ -177,28 +255,149 @@ lop_releasepool(POOLHDR *pool)
 }
 
 /******************************************************************************
-Name: lop_alloc
-Purpose: get a free object from given pool
+Name: lop_findslab
+Purpose: find the slab of an elastic pool holding given list header, by
+    address - for bounds checks of objects that may not be the pool's.
+Parameters:
+Caveats: returns NULL for objects in the placement area. A walk of the
+    slabs - the pool's own objects name their slab in plhdr->pslab
+******************************************************************************/
+static LOPSLAB *
+lop_findslab(POOLHDR *ppool, LISTHDR *plhdr)
+{
+    LOPSLAB *pslab;
+
+    for(pslab = ppool->pslabs; pslab; pslab = pslab->pnext)
+    {
+        if((char *)plhdr >= (char *)pslab && (char *)plhdr < (char *)pslab->endptr)
+        {
+            return pslab;
+        }
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Name: lop_owns
+Purpose: bounds check - is given list header part of given pool
 Parameters:
 Caveats: 
 ******************************************************************************/
-void *lop_alloc(POOLHDR *ppool)
+static int
+lop_owns(POOLHDR *ppool, LISTHDR *plhdr)
 {
-    LISTHDR *plhdr; /*allocated object*/
+    return INPOOLBASE(ppool, plhdr) || lop_findslab(ppool, plhdr) != NULL;
+}
 
-    if(!ppool)
+/******************************************************************************
+Name: lop_grow
+Purpose: chain a new slab onto an exhausted elastic pool. Caller holds the
+    pool lock.
+Parameters:
+Caveats: the freelist must be empty
+******************************************************************************/
+static LRET
+lop_grow(POOLHDR *ppool)
+{
+    const LOPBACKING *pbacking = ppool->pbacking;
+    LOPSLAB *pslab;
+    LISTHDR *plhdr;
+    uint32 count;
+    uint32 size;
+    uint32 i;
+
+    ASSERT(!ppool->pfreelist);
+
+    count = pbacking->growcount ? pbacking->growcount : ppool->basecount;
+    size = WALIGN(sizeof(LOPSLAB)) + (ppool->objsize+sizeof(LISTHDR))*count +
+        (ppool->align > WORDBOUNDARY ? ppool->align : 0);
+
+    pslab = (LOPSLAB *)pbacking->pf_alloc(pbacking->arg, size);
+    if(!pslab)
     {
-        return NULL;
+        return LISTOP_FAILURE;
     }
 
-    /*debug mode*/
-    ASSERT(lop_checkpool(ppool) == LISTOP_SUCCESS);
+    pslab->count = count;
+    pslab->inuse = 0;
+    pslab->size = size;
+    pslab->idlesince = ppool->clock;
+    pslab->endptr = (char *)pslab+size;
+    pslab->pnext = ppool->pslabs;
+    ppool->pslabs = pslab;
+
+    /*thread the new objects into a circular freelist, tail is the last one*/
+    plhdr = lop_firstobj(GETSLABOBJ(pslab), ppool->align);
+    for(i=1; i<count; i++)
+    {
+        plhdr->pslab = pslab;
+        plhdr->pnext = (LISTHDR *)((char *)plhdr+sizeof(LISTHDR)+ppool->objsize);
+        plhdr = plhdr->pnext;
+    }
+    plhdr->pslab = pslab;
+    plhdr->pnext = lop_firstobj(GETSLABOBJ(pslab), ppool->align);
+    ppool->pfreelist = plhdr;
+
+    ppool->count += count;
+    ppool->freecount += count;
+
+    return LISTOP_SUCCESS;
+}
+
+/******************************************************************************
+Name: lop_carve
+Purpose: hand out the next object of the placement area that has never been
+    on the freelist. Caller holds the pool lock.
+Parameters:
+Caveats: carvecount must be non 0
+******************************************************************************/
+static LISTHDR *lop_carve(POOLHDR *ppool)
+{
+    LISTHDR *plhdr = ppool->pcarve;
+
+    ASSERT(ppool->carvecount > 0);
+    ASSERT(INPOOLBASE(ppool, plhdr)); /*bounds check*/
+
+    memset(plhdr, 0, sizeof(LISTHDR)+ppool->objsize);
+
+    ppool->pcarve = (LISTHDR *)((char *)plhdr+sizeof(LISTHDR)+ppool->objsize);
+    ppool->carvecount--;
+
+    return plhdr;
+}
+
+/******************************************************************************
+Name: lop_take
+Purpose: get a free object from given pool. Caller holds the pool lock.
+    Objects given back are handed out again before new ones are carved.
+Parameters:
+Caveats: 
+******************************************************************************/
+static void *lop_take(POOLHDR *ppool)
+{
+    LISTHDR *plhdr; /*allocated object*/
+
+    if(!ppool->pfreelist && ppool->carvecount)
+    {
+        plhdr = lop_carve(ppool);
+        ppool->freecount--;
+
+#ifdef PDBG_ON
+        ppool->lowat = MIN(ppool->lowat, ppool->freecount);
+#endif
+
+        return GETLISTOBJ(plhdr);
+    }
 
     if(!ppool->pfreelist)
     {
         ASSERT(ppool->freecount == 0);
 
-        return NULL; /*empty*/
+        if(!ppool->pbacking || lop_grow(ppool) != LISTOP_SUCCESS)
+        {
+            return NULL; /*empty*/
+        }
     }
 
     /*
@@ -221,6 +420,11 @@ void *lop_alloc(POOLHDR *ppool)
 
     plhdr->pnext = NULL; /*init for safety*/
 
+    if(plhdr->pslab)
+    {
+        plhdr->pslab->inuse++;
+    }
+
     ASSERT(ppool->freecount >=0);
     ppool->freecount--; /*update count in parallel - just for safety*/
     ASSERT(ppool->freecount >=0);
@@ -229,10 +433,68 @@ void *lop_alloc(POOLHDR *ppool)
     ppool->lowat = MIN(ppool->lowat, ppool->freecount);
 #endif
     
+    return GETLISTOBJ(plhdr);
+}
+
+/******************************************************************************
+Name: lop_alloc
+Purpose: get a free object from given pool
+Parameters:
+Caveats: 
+******************************************************************************/
+void *lop_alloc(POOLHDR *ppool)
+{
+    void *pobj;
+
+    if(!ppool)
+    {
+        return NULL;
+    }
+
+    P_SPINLOCK_ACQUIRE(&ppool->lock);
+
     /*debug mode*/
     ASSERT(lop_checkpool(ppool) == LISTOP_SUCCESS);
 
-    return GETLISTOBJ(plhdr);
+    pobj = lop_take(ppool);
+
+    /*debug mode*/
+    ASSERT(lop_checkpool(ppool) == LISTOP_SUCCESS);
+    P_SPINLOCK_RELEASE(&ppool->lock);
+
+    return pobj;
+}
+
+/******************************************************************************
+Name: lop_allocn
+Purpose: get upto n free objects from given pool, taking the pool lock once.
+    Returns the number of objects placed in pobjs.
+Parameters:
+Caveats: 
+******************************************************************************/
+uint32 lop_allocn(POOLHDR *ppool, void **pobjs, uint32 n)
+{
+    uint32 i;
+
+    if(!ppool)
+    {
+        return 0;
+    }
+
+    P_SPINLOCK_ACQUIRE(&ppool->lock);
+    for(i=0; i<n; i++)
+    {
+        if((pobjs[i] = lop_take(ppool)) == NULL)
+        {
+            break;
+        }
+    }
+
+    /*debug mode*/
+    ASSERT(lop_checkpool(ppool) == LISTOP_SUCCESS);
+    P_SPINLOCK_RELEASE(&ppool->lock);
+
+    return i;
 }
 
 /******************************************************************************
@@ -508,31 +770,32 @@ lop_delink(LISTHDR **plist, void *pcurrobj, void *pprevobj)
 }
 
 /******************************************************************************
-Name: lop_release
-Purpose:  release given object into given pool
+Name: lop_give
+Purpose: return given object to given pool. Caller holds the pool lock.
 Parameters:
 Caveats: 
 ******************************************************************************/
-LRET
-lop_release(POOLHDR *ppool, void *pobj)
+static void lop_give(POOLHDR *ppool, void *pobj)
 {
     LISTHDR *plhdr;
 
-    ASSERT(ppool);
-    ASSERT(pobj);
-
-    if(!ppool || !pobj)
-    {
-        return LISTOP_FAILURE;
-    }
-
     plhdr = GETLISTHDR(pobj);
 
-    ASSERT((char *)plhdr >= (char *)ppool->mptr); /*bounds check*/
-    ASSERT((char *)plhdr < (char *)ppool->endptr);/*bounds check*/
+    ASSERT(lop_owns(ppool, plhdr)); /*bounds check*/
 
     ASSERT(plhdr->pnext == NULL);
 
+    if(plhdr->pslab)
+    {
+        LOPSLAB *pslab = plhdr->pslab;
+
+        ASSERT(pslab->inuse > 0);
+        if(--pslab->inuse == 0)
+        {
+            pslab->idlesince = ppool->clock;
+        }
+    }
+
     if(ppool->pfreelist)
     {
         ASSERT(ppool->pfreelist->pnext);
@@ -549,8 +812,349 @@ lop_release(POOLHDR *ppool, void *pobj)
     ppool->pfreelist = plhdr;
 
     ppool->freecount++;
+}
+
+/******************************************************************************
+Name: lop_release
+Purpose:  release given object into given pool
+Parameters:
+Caveats: 
+******************************************************************************/
+LRET
+lop_release(POOLHDR *ppool, void *pobj)
+{
+    ASSERT(ppool);
+    ASSERT(pobj);
+
+    if(!ppool || !pobj)
+    {
+        return LISTOP_FAILURE;
+    }
+
+    P_SPINLOCK_ACQUIRE(&ppool->lock);
+    lop_give(ppool, pobj);
+    P_SPINLOCK_RELEASE(&ppool->lock);
+
+    return LISTOP_SUCCESS;
+}
+
+/******************************************************************************
+Name: lop_releasen
+Purpose:  release n objects into given pool, taking the pool lock once.
+Parameters:
+Caveats: 
+******************************************************************************/
+uint32
+lop_releasen(POOLHDR *ppool, void **pobjs, uint32 n)
+{
+    uint32 i;
+
+    ASSERT(ppool);
+
+    P_SPINLOCK_ACQUIRE(&ppool->lock);
+    for(i=0; i<n; i++)
+    {
+        lop_give(ppool, pobjs[i]);
+    }
+    P_SPINLOCK_RELEASE(&ppool->lock);
+
+    return n;
+}
+
+#if(LOP_MAGSIZE > 0)
+/*
+ * The calling thread's magazines. Pools hash into this table with
+ * linear probing; a pool that finds no free slot bypasses the cache.
+ * A freed slot is filled from further along its chain, so a chain never
+ * has a hole - see lop_delmag.
+ */
+static P_THREADLOCAL LOPMAG lop_magtab[LOP_MAXMAGS];
+
+#define LOP_MAGSLOT(ppool) ((uint32)(((UA)(ppool) / sizeof(POOLHDR)) % LOP_MAXMAGS))
+
+/******************************************************************************
+Name: lop_delmag
+Purpose: free magazine slot i of the calling thread - entries further along
+    the probe chain that may no longer be found past i move back into it
+Parameters:
+Caveats: objects still held are forgotten - flush them first
+******************************************************************************/
+static void
+lop_delmag(uint32 i)
+{
+    uint32 j = i;
+    uint32 home;
+
+    for(;;)
+    {
+        lop_magtab[i].ppool = NULL;
+        lop_magtab[i].count = 0;
+
+        for(;;)
+        {
+            j = (j + 1) % LOP_MAXMAGS;
+            if(!lop_magtab[j].ppool)
+            {
+                return; /*end of the chain*/
+            }
+
+            /*stays, if its home slot lies cyclically in (i, j]*/
+            home = LOP_MAGSLOT(lop_magtab[j].ppool);
+            if(i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            {
+                continue;
+            }
+            break;
+        }
+
+        lop_magtab[i] = lop_magtab[j];
+        i = j;
+    }
+}
+
+/******************************************************************************
+Name: lop_getmag
+Purpose: find (or claim) the calling thread's magazine for given pool
+Parameters:
+Caveats: returns NULL if all magazines of this thread are taken by other pools,
+    or the pool is too small to cache - objects in a magazine are out of
+    reach of other threads. A magazine of an older generation of the pool -
+    released since, its memory made into a pool again - is dropped unflushed.
+******************************************************************************/
+static LOPMAG *
+lop_getmag(POOLHDR *ppool)
+{
+    uint32 slot = LOP_MAGSLOT(ppool);
+    uint32 i;
+
+    for(i=0; i<LOP_MAXMAGS; i++)
+    {
+        LOPMAG *pmag = &lop_magtab[(slot + i) % LOP_MAXMAGS];
+
+        if(pmag->ppool == ppool)
+        {
+            if(pmag->gen == ppool->gen)
+            {
+                return pmag;
+            }
+            /*objects of the pool that was here are forgotten*/
+            if(ppool->count/LOP_MAGSHARE == 0)
+            {
+                lop_delmag((slot + i) % LOP_MAXMAGS); /*too small to cache now*/
+                return NULL;
+            }
+            pmag->count = 0;
+            pmag->gen = ppool->gen;
+            pmag->limit = MIN(LOP_MAGSIZE, ppool->count/LOP_MAGSHARE);
+            return pmag;
+        }
+        if(!pmag->ppool)
+        {
+            /*a thread may hold upto 1/LOP_MAGSHARE of the pool*/
+            if(ppool->count/LOP_MAGSHARE == 0)
+            {
+                return NULL;
+            }
+            pmag->ppool = ppool;
+            pmag->gen = ppool->gen;
+            pmag->limit = MIN(LOP_MAGSIZE, ppool->count/LOP_MAGSHARE);
+            pmag->count = 0;
+            return pmag;
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+/******************************************************************************
+Name: lop_cachealloc
+Purpose: get a free object from the calling thread's magazine for given pool.
+    An empty magazine is refilled from the pool with half its limit.
+Parameters:
+Caveats: 
+******************************************************************************/
+void *
+lop_cachealloc(POOLHDR *ppool)
+{
+#if(LOP_MAGSIZE > 0)
+    LOPMAG *pmag;
+
+    if(!ppool)
+    {
+        return NULL;
+    }
+
+    pmag = lop_getmag(ppool);
+    if(!pmag || pmag->limit == 0)
+    {
+        return lop_alloc(ppool);
+    }
+
+    if(pmag->count == 0)
+    {
+        pmag->count = lop_allocn(ppool, pmag->objs, (pmag->limit+1)/2);
+        if(pmag->count == 0)
+        {
+            return NULL; /*pool is exhausted*/
+        }
+    }
+
+    return pmag->objs[--pmag->count];
+#else
+    return lop_alloc(ppool);
+#endif
+}
+
+/******************************************************************************
+Name: lop_cacherelease
+Purpose: release given object into the calling thread's magazine for given pool.
+    A full magazine flushes half its limit back to the pool.
+Parameters:
+Caveats: 
+******************************************************************************/
+LRET
+lop_cacherelease(POOLHDR *ppool, void *pobj)
+{
+#if(LOP_MAGSIZE > 0)
+    LOPMAG *pmag;
+
+    ASSERT(ppool);
+    ASSERT(pobj);
+    ASSERT(GETLISTHDR(pobj)->pnext == NULL);
+
+    if(!ppool || !pobj)
+    {
+        return LISTOP_FAILURE;
+    }
+
+    pmag = lop_getmag(ppool);
+    if(!pmag)
+    {
+        return lop_release(ppool, pobj);
+    }
+
+    if(pmag->count >= pmag->limit)
+    {
+        uint32 half = pmag->limit/2;
+
+        lop_releasen(ppool, &pmag->objs[pmag->count-half], half);
+        pmag->count -= half;
+        if(pmag->count == pmag->limit) /*a limit of 1*/
+        {
+            return lop_release(ppool, pobj);
+        }
+    }
+
+    pmag->objs[pmag->count++] = pobj;
 
     return LISTOP_SUCCESS;
+#else
+    return lop_release(ppool, pobj);
+#endif
+}
+
+/******************************************************************************
+Name: lop_cacheflush
+Purpose: return objects held in the calling thread's magazine for given pool
+    to that pool, and free the magazine. A NULL pool flushes all magazines of
+    the calling thread.
+Parameters:
+Caveats: other threads' magazines are not touched. With a NULL pool, every
+    pool the thread has a magazine for must still be there - a thread that
+    did not flush a released pool's magazine flushes the pools it uses by name
+******************************************************************************/
+void
+lop_cacheflush(POOLHDR *ppool)
+{
+#if(LOP_MAGSIZE > 0)
+    uint32 i;
+
+    if(ppool)
+    {
+        uint32 slot = LOP_MAGSLOT(ppool);
+
+        for(i=0; i<LOP_MAXMAGS; i++)
+        {
+            LOPMAG *pmag = &lop_magtab[(slot + i) % LOP_MAXMAGS];
+
+            if(!pmag->ppool)
+            {
+                return; /*end of the chain - none*/
+            }
+            if(pmag->ppool == ppool)
+            {
+                if(pmag->gen == ppool->gen)
+                {
+                    lop_releasen(ppool, pmag->objs, pmag->count);
+                }
+                lop_delmag((slot + i) % LOP_MAXMAGS);
+                return;
+            }
+        }
+        return;
+    }
+
+    for(i=0; i<LOP_MAXMAGS; i++)
+    {
+        LOPMAG *pmag = &lop_magtab[i];
+
+        if(pmag->ppool && pmag->gen == pmag->ppool->gen)
+        {
+            lop_releasen(pmag->ppool, pmag->objs, pmag->count);
+        }
+        pmag->ppool = NULL;
+        pmag->count = 0;
+    }
+#endif
+}
+
+/******************************************************************************
+Name: lop_availcount
+Purpose: objects the calling thread can get from given pool without it
+    growing - those free in the pool, and those in the thread's magazine.
+Parameters:
+Caveats: read without the pool lock - an estimate, as other threads take and
+    give back objects meanwhile.
+******************************************************************************/
+uint32
+lop_availcount(POOLHDR *ppool)
+{
+    uint32 count;
+#if(LOP_MAGSIZE > 0)
+    uint32 slot;
+    uint32 i;
+#endif
+
+    if(!ppool)
+    {
+        return 0;
+    }
+
+    count = ppool->freecount;
+
+#if(LOP_MAGSIZE > 0)
+    slot = LOP_MAGSLOT(ppool);
+    for(i=0; i<LOP_MAXMAGS; i++)
+    {
+        LOPMAG *pmag = &lop_magtab[(slot + i) % LOP_MAXMAGS];
+
+        if(!pmag->ppool)
+        {
+            break; /*end of the chain - none*/
+        }
+        if(pmag->ppool == ppool)
+        {
+            if(pmag->gen == ppool->gen)
+            {
+                count += pmag->count;
+            }
+            break;
+        }
+    }
+#endif
+
+    return count;
 }
 
 /******************************************************************************
@@ -648,6 +1252,132 @@ lop_findprev(LISTHDR *pcurrlhdr)
     return pprevlhdr;
 }
 
+/******************************************************************************
+Name: lop_setbacking
+Purpose: makes given pool elastic - when its freelist runs dry new slabs are
+    obtained from pbacking.
+Parameters:
+Caveats: NULL makes the pool fixed again, only once all slabs are returned
+******************************************************************************/
+void
+lop_setbacking(POOLHDR *ppool, const LOPBACKING *pbacking)
+{
+    ASSERT(ppool);
+
+    P_SPINLOCK_ACQUIRE(&ppool->lock);
+    ASSERT(pbacking || !ppool->pslabs);
+    ppool->pbacking = pbacking;
+    P_SPINLOCK_RELEASE(&ppool->lock);
+}
+
+/******************************************************************************
+Name: lop_unthread
+Purpose: remove the free objects of given slab from the freelist. Caller holds
+    the pool lock.
+Parameters:
+Caveats: all objects of the slab must be free
+******************************************************************************/
+static void
+lop_unthread(POOLHDR *ppool, LOPSLAB *pslab)
+{
+    LISTHDR *plhdr;
+    LISTHDR *pnext;
+    LISTHDR *phead=NULL; /*rebuilt freelist*/
+    LISTHDR *ptail=NULL;
+    uint32 n = ppool->freecount - ppool->carvecount; /*on the freelist*/
+    uint32 i;
+
+    ASSERT(pslab->inuse == 0);
+
+    plhdr = ppool->pfreelist ? ppool->pfreelist->pnext : NULL;
+    for(i=0; i<n; i++)
+    {
+        pnext = plhdr->pnext;
+        if(plhdr->pslab == pslab)
+        {
+            plhdr->pnext = NULL;
+            ppool->freecount--;
+        }
+        else
+        {
+            if(ptail)
+            {
+                ptail->pnext = plhdr;
+            }
+            else
+            {
+                phead = plhdr;
+            }
+            ptail = plhdr;
+        }
+        plhdr = pnext;
+    }
+
+    if(ptail)
+    {
+        ptail->pnext = phead; /*circular link list*/
+    }
+    ppool->pfreelist = ptail;
+
+    ppool->count -= pslab->count;
+}
+
+/******************************************************************************
+Name: lop_trimpool
+Purpose: return the slabs of an elastic pool that have had no objects in use
+    for the cooldown period of the backing allocator. Returns count of slabs
+    given back.
+Parameters:
+    in: now - current time in the units of LOPBACKING.cooldown. Also used to
+        stamp slabs as they go idle, so call this periodically.
+Caveats: objects in other threads' magazines keep their slab in use
+******************************************************************************/
+uint32
+lop_trimpool(POOLHDR *ppool, uint32 now)
+{
+    LOPSLAB **ppslab;
+    LOPSLAB *pslab;
+    uint32 trimmed = 0;
+
+    if(!ppool || !ppool->pslabs)
+    {
+        if(ppool)
+        {
+            ppool->clock = now;
+        }
+        return 0;
+    }
+
+    /*give back what this thread holds so idle slabs can be seen as such*/
+    lop_cacheflush(ppool);
+
+    P_SPINLOCK_ACQUIRE(&ppool->lock);
+    ppool->clock = now;
+
+    ppslab = &ppool->pslabs;
+    while((pslab = *ppslab) != NULL)
+    {
+        if(pslab->inuse == 0 &&
+            (uint32)(now - pslab->idlesince) >= ppool->pbacking->cooldown)
+        {
+            lop_unthread(ppool, pslab);
+            *ppslab = pslab->pnext;
+            ppool->pbacking->pf_free(ppool->pbacking->arg, pslab, pslab->size);
+            trimmed++;
+        }
+        else
+        {
+            ppslab = &pslab->pnext;
+        }
+    }
+
+    /*debug mode*/
+    ASSERT(lop_checkpool(ppool) == LISTOP_SUCCESS);
+    P_SPINLOCK_RELEASE(&ppool->lock);
+
+    return trimmed;
+}
+
 /******************************************************************************
 Name: lop_checkpool
 Purpose: debug mode checks
@@ -666,8 +1396,7 @@ lop_checkpool(POOLHDR *ppool)
 
     for(count=0; plhdr && (count < ppool->count); count++)
     {
-        ASSERT((char *)plhdr >= (char *)ppool->mptr); /*bounds check*/
-        ASSERT((char *)plhdr < (char *)ppool->endptr);/*bounds check*/
+        ASSERT(lop_owns(ppool, plhdr)); /*bounds check*/
 
         plhdr = plhdr->pnext;
         ASSERT(plhdr); /*plhdr can't go NULL midway*/
@@ -25,9 +25,33 @@ enum LISTOP_STATUS {LISTOP_SUCCESS, LISTOP_FAILURE};
 
 typedef int LRET;
 
+/*
+ * backing allocator for elastic pools - supplies a new slab when the
+ * freelist of a pool runs dry, and takes back slabs that have stayed idle
+ * for cooldown time units (as measured by the 'now' given to lop_trimpool)
+ */
+typedef struct lopbacking {
+	void *(*pf_alloc)(void *arg, uint32 size);
+	void (*pf_free)(void *arg, void *ptr, uint32 size);
+	void *arg; /*passed as is to pf_alloc and pf_free*/
+	uint32 growcount; /*objects per slab. 0 - same as the initial pool count*/
+	uint32 cooldown; /*idle time before a slab is returned*/
+} LOPBACKING;
+
+/*sizeof(lopslab) is rounded up to a word boundary, objects follow it*/
+typedef struct lopslab {
+	struct lopslab *pnext;
+	uint32 count; /*count of objects in this slab*/
+	uint32 inuse; /*count of objects of this slab not on the freelist*/
+	uint32 size; /*bytes obtained from the backing allocator*/
+	uint32 idlesince; /*pool clock at which inuse dropped to 0*/
+	void *endptr; /*first byte past this slab*/
+} LOPSLAB;
+
 /*sizeof(listhdr) is required to end on a word boundary*/
 typedef struct listhdr {
 	struct listhdr *pnext;
+	LOPSLAB *pslab; /*slab of an elastic pool holding the object - NULL in the placement area*/
 } LISTHDR;
 
 /*sizeof(poolhdr) is required to end on a word boundary*/
@@ -35,6 +59,7 @@ typedef struct poolhdr {
 	LISTHDR *pfreelist;
 	LISTHDR *palloclist;
 	uint32 objsize; /*size of each object in pool, not including LISTHDR*/
+	uint32 align; /*object alignment, 0 for word alignment*/
 	uint32 count; /*count of all elements in pool*/
 	uint32 freecount;	/*count of free elements in pool*/
 #ifdef PDBG_ON
@@ -43,12 +68,44 @@ typedef struct poolhdr {
 	uint32 msize; /*size of memory used by this pool*/
 	void *mptr; /*ptr. to memory supplied to this pool, for its creation*/
 	void *endptr; /*address of last of the consecutive bytes used = (char *)WALIGN(mptr)+msize*/
+	P_SPINLOCK lock; /*guards pfreelist and freecount against other threads*/
+	uint32 basecount; /*count of objects in the placement area*/
+	const LOPBACKING *pbacking; /*NULL for a fixed pool*/
+	LOPSLAB *pslabs; /*slabs chained on by an elastic pool*/
+	uint32 clock; /*last 'now' seen by lop_trimpool*/
+	LISTHDR *pcarve; /*next object of the placement area never handed out*/
+	uint32 carvecount; /*objects from pcarve on - free, but not on pfreelist*/
+	uint32 gen; /*new each time the pool is made or released - see lop_getmag*/
 } POOLHDR;
 
+#if(LOP_MAGSIZE > 0)
+/*
+ * magazine - a bounded per-thread stack of free objects taken from a pool.
+ * Objects in a magazine are counted as allocated by the pool.
+ */
+typedef struct lopmag {
+	POOLHDR *ppool; /*pool the objects belong to - NULL if magazine is unused*/
+	uint32 gen; /*ppool->gen when the magazine was claimed*/
+	uint32 limit; /*objects it may hold - upto LOP_MAGSIZE*/
+	uint32 count; /*objects held in objs*/
+	void *objs[LOP_MAGSIZE];
+} LOPMAG;
+#endif
+
 /*function prototypes*/
 uint32 lop_getpoolsize(SIZET adjobjectsize, uint32 count);
 POOLHDR *lop_allocpool(SIZET objectsize, uint32 count, void *pplacement);
+uint32 lop_getpoolsizealign(SIZET objectsize, uint32 count, uint32 align);
+POOLHDR *lop_allocpoolalign(SIZET objectsize, uint32 count, uint32 align, void *pplacement);
 void *lop_alloc(POOLHDR *ppool);
+uint32 lop_allocn(POOLHDR *ppool, void **pobjs, uint32 n);
+uint32 lop_releasen(POOLHDR *ppool, void **pobjs, uint32 n);
+void *lop_cachealloc(POOLHDR *ppool);
+LRET lop_cacherelease(POOLHDR *ppool, void *pobj);
+void lop_cacheflush(POOLHDR *ppool);
+uint32 lop_availcount(POOLHDR *ppool);
+void lop_setbacking(POOLHDR *ppool, const LOPBACKING *pbacking);
+uint32 lop_trimpool(POOLHDR *ppool, uint32 now);
 void *lop_allocarray(POOLHDR *ppool, int arraysize);
 LRET lop_releasepool(POOLHDR *pool);
 LRET lop_release(POOLHDR *ppool, void *pobj);
@@ -16,8 +16,6 @@ FILE: env.c
 char diagbuf[2048];
 
 
-PDBG(extern P_STREAMHEAD *dbgstrm);
-
 /*
  * rolls over and goes negative just like lbolt variable in unix(drv_getparm)
  * only difference is valid
@@ -59,6 +57,22 @@ ushort my_ntohs(ushort netshort)
     return ntohs(netshort);
 }
 
+/*
+ * backing allocator for elastic pools(LOPBACKING) - plain heap
+ */
+void *my_slaballoc(void *arg, uint32 size)
+{
+    (void)arg;
+    return malloc(size);
+}
+
+void my_slabfree(void *arg, void *ptr, uint32 size)
+{
+    (void)arg;
+    (void)size;
+    free(ptr);
+}
+
 
 int my_fprintf(LOGFILE *file, const char *fmt, ...)
 {
@@ -28,13 +28,13 @@ Activity:
  * themselves modelled as modules. The declarations below
  * are the streamtabs for these modules.
  */
-extern P_STREAMTAB stddev_streamtab; /*module interfacing to a NULL device*/
-extern P_STREAMTAB stdapp_streamtab; /*module interfacing to application*/
+extern const P_STREAMTAB stddev_streamtab; /*module interfacing to a NULL device*/
+extern const P_STREAMTAB stdapp_streamtab; /*module interfacing to application*/
 #ifdef PSTREAMS_UDP
-extern P_STREAMTAB udpdev_streamtab; /*module interfacing to UDP device*/
+extern const P_STREAMTAB udpdev_streamtab; /*module interfacing to UDP device*/
 #endif
 #ifdef PSTREAMS_TCP
-extern P_STREAMTAB tcpdev_streamtab; /*module interfacing to TCP device*/
+extern const P_STREAMTAB tcpdev_streamtab; /*module interfacing to TCP device*/
 #endif
 
 /*
@@ -49,7 +49,228 @@ const P_FREE_RTN FREEDATA = {(void (*)(void))pstreams_mem_free, NULL};
 #endif
 
 /*DEBUG mode*/
-PDBG(P_STREAMHEAD *dbgstrm=NULL;)
+
+/*does size class c hold P_MDBBLOCKs - see P_STREAMCONF.combined*/
+#define CLASSCOMBINED(strm, c) ((strm)->combined && (strm)->classpool[c]->align <= WORDBOUNDARY)
+
+static P_MSGB *
+pstreams_allocmdb(P_STREAMHEAD *strmhead, int32 size, int c);
+static void
+pstreams_qcancel(P_QUEUE *q);
+static P_QUEUE *
+pstreams_backq(P_QUEUE *q);
+static void
+pstreams_backenable(P_QUEUE *q);
+static int
+pstreams_readparts(P_STREAMHEAD *strmhead, P_MSGB *ctlmsg, P_MSGB *datmsg,
+                   P_BUF *ctlbuf, P_BUF *msgbuf);
+static void
+pstreams_notify(P_QUEUE *q, P_BOOL ready);
+#ifdef PSTREAMS_INGRESS
+static void
+pstreams_ingressdrain(P_STREAMHEAD *strmhead, P_BOOL drop);
+#endif
+#ifdef PSTREAMS_PIPELINE
+static int
+pstreams_ringput(P_QUEUE *wrq, P_MSGB *msg);
+static int
+pstreams_ringroom(P_QUEUE *q);
+static void
+pstreams_wake(P_QUEUE *q);
+static void
+pstreams_xtimeout(P_QUEUE *q);
+static void
+pstreams_pipedrain(P_STREAMHEAD *strmhead);
+static P_BOOL
+pstreams_pipeready(P_QUEUE *q);
+static void
+pstreams_unpin(P_STREAMHEAD *strmhead, P_WORKER *w);
+static void
+pstreams_ringfree(P_STREAMHEAD *strmhead, P_QUEUE *q);
+static void
+pstreams_handback(P_QUEUE *q);
+static void *
+pstreams_worker(void *arg);
+static P_BOOL
+pstreams_ringpush(P_QUEUE *q, P_MSGB *msg);
+static int
+pstreams_spillflush(P_QUEUE *q);
+static int
+pstreams_ringdrain(P_QUEUE *q);
+#endif
+static void
+pstreams_pollmark(P_QUEUE *q);
+static void *
+pstreams_cachealloc(P_STREAMHEAD *strmhead, POOLHDR *ppool);
+static LRET
+pstreams_cacherelease(P_STREAMHEAD *strmhead, POOLHDR *ppool, void *pobj);
+#ifdef PSTREAMS_SCHED
+static void
+pstreams_schedready(P_STREAMHEAD *strmhead);
+static void
+pstreams_scheddetach(P_STREAMHEAD *strmhead);
+static void
+pstreams_schedwake(P_SCHED *sched);
+static void
+pstreams_schedunlink(P_SCHED *sched, P_STREAMHEAD *strmhead);
+static void
+pstreams_schedflushreq(P_SCHEDWORKER *k, P_BOOL locked);
+static void
+pstreams_schedflush(P_SCHEDWORKER *k);
+static void
+pstreams_schedpush(P_SCHEDLIST *list, P_STREAMHEAD *strmhead);
+static void
+pstreams_schedtimer(P_SCHED *sched, P_STREAMHEAD *strmhead, int32 wait);
+static void *
+pstreams_schedworker(void *arg);
+static P_BOOL
+pstreams_schedpending(P_SCHED *sched);
+#endif
+
+#if PSTREAMS_NBAND < 2 || PSTREAMS_NBAND > 9
+#error PSTREAMS_NBAND must be 2 to 9 - q_bandmap has a bit per band above 0
+#endif
+
+#if defined(PSTREAMS_PIPELINE) && !(defined(PSTREAMS_INGRESS) && defined(PSTREAMS_EVENTFD))
+#error PSTREAMS_PIPELINE wakes the stream thread through the ingress eventfd
+#endif
+
+#if defined(PSTREAMS_SCHED) && !(defined(PSTREAMS_EPOLL) && defined(PSTREAMS_EVENTFD))
+#error PSTREAMS_SCHED polls with epoll and is woken through an eventfd
+#endif
+
+#ifdef PSTREAMS_PIPELINE
+/*worker running on this thread - NULL on the stream's own, see pstreams_pin*/
+static P_THREADLOCAL P_WORKER *pstreams_self;
+#endif
+
+/*
+ * the thread servicing a stream puts this thread's tag in its cachetag - only
+ * that thread, and the stream's pinned workers, keep objects of the stream's
+ * pools in their magazines. See pstreams_cachealloc
+ */
+static P_THREADLOCAL char pstreams_cachetag;
+
+#ifdef PSTREAMS_SCHED
+/*scheduler thread running on this thread - see pstreams_schedstart*/
+static P_THREADLOCAL P_SCHEDWORKER *pstreams_schedself;
+
+/*P_STREAMHEAD.schedstate*/
+#define SCHEDIDLE 0 /*nothing to do - till an fd or timer makes it ready*/
+#define SCHEDQUEUED 1 /*on a run list*/
+#define SCHEDRUNNING 2
+#define SCHEDRERUN 3 /*running, and made ready again meanwhile*/
+#define SCHEDGONE 4 /*being taken off the scheduler*/
+#endif
+
+/*band info of band b(> 0) of q - bands above the top one share it*/
+#define QBAND(q, b) (&(q)->q_bandinfo[MIN((b), PSTREAMS_NBAND-1)-1])
+
+/******************************************************************************
+Name: pstreams_initclasses
+Purpose: carves a buffer pool per size class out of the stream's memory and
+    builds the size to class map. Classes within the inline buffer are dropped.
+Parameters:
+    in: conf - classes to use. NULL or no classes - PSTREAMS_SIZECLASSES
+Caveats: sets perrno on failure. strmhead->combined and inlinesize must be set.
+******************************************************************************/
+static int
+pstreams_initclasses(P_STREAMHEAD *strmhead, const P_STREAMCONF *conf)
+{
+    static const P_SIZECLASS defclasses[] = PSTREAMS_SIZECLASSES;
+    const P_SIZECLASS *classes = defclasses;
+    int nclasses = sizeof(defclasses)/sizeof(defclasses[0]);
+    uint32 nmap;
+    uint32 idx;
+    uint32 objsize;
+    void *mptr;
+    int c;
+    int n; /*classes kept*/
+
+    if(conf && conf->classes && conf->nclasses > 0)
+    {
+        classes = conf->classes;
+        nclasses = conf->nclasses;
+    }
+
+    if(nclasses > MAXSIZECLASSES)
+    {
+        pstreams_console("ERROR: %d size classes given. At most %d supported",
+            nclasses, MAXSIZECLASSES);
+        strmhead->perrno = P_BADPARAM;
+        return P_STREAMS_FAILURE;
+    }
+
+    for(c=0, n=0; c<nclasses; c++)
+    {
+        /*mem_free tells classes apart by size*/
+        if(!classes[c].size || !classes[c].count ||
+            (classes[c].align & (classes[c].align-1)) ||
+            (c && classes[c].size <= classes[c-1].size))
+        {
+            pstreams_console("ERROR: size class %d {%lu, %lu, %lu} is not valid. "
+                "Sizes must ascend, with a power of 2 alignment",
+                c, (unsigned long)classes[c].size, (unsigned long)classes[c].count,
+                (unsigned long)classes[c].align);
+            strmhead->perrno = P_BADPARAM;
+            return P_STREAMS_FAILURE;
+        }
+
+        if(classes[c].size <= strmhead->inlinesize)
+        {
+            continue; /*the inline buffer of P_DATAB serves these sizes*/
+        }
+
+        /*combined objects carry their P_MSGB and P_DATAB ahead of the buffer*/
+        objsize = WALIGN(classes[c].size);
+        if(strmhead->combined && classes[c].align <= WORDBOUNDARY)
+        {
+            objsize += sizeof(P_MDBBLOCK);
+        }
+
+        mptr = pstreams_memassign(strmhead->mem, lop_getpoolsizealign(
+            objsize, classes[c].count, classes[c].align));
+        if(!mptr)
+        {
+            pstreams_console("ERROR: given buffer insufficient for local memory. "
+                "buffer size: %d. POOL%lu requires: %d+memory for alignment",
+                strmhead->mem->limit-strmhead->mem->base, (unsigned long)classes[c].size,
+                lop_getpoolsizealign(objsize, classes[c].count, classes[c].align));
+            strmhead->perrno = P_OUTOFMEMORY;
+            return P_STREAMS_FAILURE;
+        }
+        strmhead->classpool[n] = lop_allocpoolalign(objsize,
+            classes[c].count, classes[c].align, mptr);
+        strmhead->classsize[n] = classes[c].size;
+        n++;
+    }
+    strmhead->nclasses = nclasses = n;
+    strmhead->sizemap = NULL;
+    if(!nclasses)
+    {
+        return P_STREAMS_SUCCESS; /*all messages fit inline*/
+    }
+
+    /*size to class map - each entry names the smallest class for its grain*/
+    nmap = (strmhead->classsize[nclasses-1]-1)/SIZECLASSGRAIN + 1;
+    strmhead->sizemap = (uint8 *)pstreams_memassign(strmhead->mem, nmap);
+    if(!strmhead->sizemap)
+    {
+        strmhead->perrno = P_OUTOFMEMORY;
+        return P_STREAMS_FAILURE;
+    }
+
+    for(idx=0, c=0; idx<nmap; idx++)
+    {
+        while(strmhead->classsize[c] <= idx*SIZECLASSGRAIN)
+        {
+            c++;
+        }
+        strmhead->sizemap[idx] = (uint8)c;
+    }
+
+    return P_STREAMS_SUCCESS;
+}
 
 /******************************************************************************
 Name: pstreams_open
@@ -61,10 +282,11 @@ Parameters:
     in: pmem -persistent memory for use within PSTREAMS. Memory
         contents persist across PSTREAMS creations. Could be memory-mapped
         and shared across processes too.
+    in: conf - tunables for this stream. NULL for the defaults
   Caveats: memory allocated here
 ******************************************************************************/
 P_STREAMHEAD *
-pstreams_open(int devid, P_MEM *mem, P_MEM *pmem)
+pstreams_open(int devid, P_MEM *mem, P_MEM *pmem, const P_STREAMCONF *conf)
 {
     P_STREAMHEAD *strmhead=NULL;
     void *mptr=NULL;
@@ -75,16 +297,19 @@ pstreams_open(int devid, P_MEM *mem, P_MEM *pmem)
         pstreams_console("ERROR: given buffer for local memory is empty");
     }
 
-    pstreams_console("pstreams_open: memory at start. vmem avail = %lu bytes. pmem avail = %lu bytes.\r\n" 
-            " vmem=(0x%lX, 0x%lX). pmem=(0x%lX, 0x%lX)",
-        (unsigned long)(mem->limit-mem->base),
-        (unsigned long)(pmem->limit-pmem->base),
-        mem->base, mem->limit,
-        pmem->base, pmem->limit);
+    if(!conf || !conf->quiet)
+    {
+        pstreams_console("pstreams_open: memory at start. vmem avail = %lu bytes. pmem avail = %lu bytes.\r\n" 
+                " vmem=(0x%lX, 0x%lX). pmem=(0x%lX, 0x%lX)",
+            (unsigned long)(mem->limit-mem->base),
+            (unsigned long)(pmem->limit-pmem->base),
+            mem->base, mem->limit,
+            pmem->base, pmem->limit);
+    }
 
     /*TODO : validate mem and pmem*/
 
-    if((mem->limit - (char *)WORDALIGN(mem->base)) < sizeof(P_STREAMHEAD))
+    if((mem->limit - (char *)WORDALIGN(mem->base)) < (long)sizeof(P_STREAMHEAD))
     {
         pstreams_console("ERROR: given buffer insufficient for local memory. "
             "buffer size: %d. Required atleast: %d+memory for alignment",
@@ -95,9 +320,6 @@ pstreams_open(int devid, P_MEM *mem, P_MEM *pmem)
     strmhead = (P_STREAMHEAD *)pstreams_memassign(mem, sizeof(P_STREAMHEAD));
     ASSERT(strmhead);
 
-    /*debug mode*/
-    PDBG(dbgstrm = strmhead);
-        
     strmhead->mem = mem;
     strmhead->pmem = pmem;
 
@@ -107,25 +329,32 @@ pstreams_open(int devid, P_MEM *mem, P_MEM *pmem)
     strmhead->ltfile=stderr;
 
     strmhead->perrno = P_NOERROR; /*no errors at start*/
+    strmhead->notifyfd = INVALID_SOCKET; /*till the app asks for one*/
+    strmhead->cachetag = &pstreams_cachetag;
+    strmhead->runhead = strmhead->runtail = NULL;
+    strmhead->timerq = NULL;
+#ifdef PSTREAMS_EPOLL
+    strmhead->epfd = INVALID_SOCKET; /*made below, with the queues*/
+#else
+    strmhead->npollfds = 0;
+#endif
+    strmhead->polled = P_FALSE;
 
     switch(devid)
     {
         case P_NULL:
             /*The NULL device, this device drops all messages to it*/
-            stddev_init(); /*for now stddev is a NULL device*/
-            strmhead->devmod = stddev_streamtab;/*structure copy*/
+            strmhead->devmod = stddev_streamtab;/*structure copy - for now stddev is a NULL device*/
             break;
 #ifdef PSTREAMS_UDP
         case P_UDP:
             /*UDP device*/
-            udpdev_init();
             strmhead->devmod = udpdev_streamtab;/*structure copy*/
             break;
 #endif
 #ifdef PSTREAMS_TCP
         case P_TCP:
             /*TCP device*/
-            tcpdev_init();
             strmhead->devmod = tcpdev_streamtab;/*structure copy*/
             break;
 #endif
@@ -137,7 +366,6 @@ pstreams_open(int devid, P_MEM *mem, P_MEM *pmem)
 
     strmhead->devid    = (P_STREAMS_DEVID) devid;
 
-    stdapp_init();
     strmhead->appmod = stdapp_streamtab;/*structure copy*/
 
     /*the top and bottom modules(appmod and devmod resp.) have been created*/
@@ -166,87 +394,131 @@ pstreams_open(int devid, P_MEM *mem, P_MEM *pmem)
     }
     strmhead->msgpool = lop_allocpool(sizeof(P_MSGB), MAXMSGBS, mptr);
 
-    mptr = pstreams_memassign(strmhead->mem, lop_getpoolsize(sizeof(P_DATAB), MAXDATABS));
+    /*room kept around data in messages built by putmsg - see pstreams_reserve*/
+    strmhead->headroom = conf ? conf->headroom : 0;
+    strmhead->tailroom = conf ? conf->tailroom : 0;
+
+    /*P_DATABs carry inlinesize bytes of data with them - see FASTBUF*/
+    strmhead->inlinesize = (conf && conf->inlinesize) ? conf->inlinesize : PSTREAMS_INLINESIZE;
+    strmhead->inlinesize = WALIGN(MAX(strmhead->inlinesize, FASTBUFSIZE));
+
+    mptr = pstreams_memassign(strmhead->mem,
+        lop_getpoolsize(P_DATABSIZE(strmhead->inlinesize), MAXDATABS));
     if(!mptr)
     {
         pstreams_console("ERROR: given buffer insufficient for local memory. "
             "buffer size: %d. P_DATABs require: %d+memory for alignment",
-            mem->limit-mem->base, lop_getpoolsize(sizeof(P_DATAB), MAXDATABS));
+            mem->limit-mem->base,
+            lop_getpoolsize(P_DATABSIZE(strmhead->inlinesize), MAXDATABS));
         strmhead->perrno = P_OUTOFMEMORY;
         return NULL;
     }
-    strmhead->datapool = lop_allocpool(sizeof(P_DATAB), MAXDATABS, mptr);
+    strmhead->datapool = lop_allocpool(P_DATABSIZE(strmhead->inlinesize), MAXDATABS, mptr);
 
-#if(POOL16SIZE > 0)
-    mptr = pstreams_memassign(strmhead->mem, lop_getpoolsize(16, POOL16SIZE));
-    if(!mptr)
+    /*combined P_MSGB+P_DATAB objects for messages that need no data buffer*/
+    strmhead->combined = conf ? conf->combined : P_FALSE;
+    strmhead->mdbpool = NULL;
+    PDBG(strmhead->mdbmsgs = 0);
+    if(strmhead->combined)
     {
-        pstreams_console("ERROR: given buffer insufficient for local memory. "
-            "buffer size: %d. POOL16 requires: %d+memory for alignment",
-            mem->limit-mem->base, lop_getpoolsize(16, POOL16SIZE));
-        strmhead->perrno = P_OUTOFMEMORY;
-        return NULL;
+        /*P_DATAB is the last member of P_MDBBLOCK - its inline buffer extends it*/
+        uint32 mdbsize = offsetof(P_MDBBLOCK, datab) + P_DATABSIZE(strmhead->inlinesize);
+
+        mptr = pstreams_memassign(strmhead->mem, lop_getpoolsize(mdbsize, MAXMDBS));
+        if(!mptr)
+        {
+            pstreams_console("ERROR: given buffer insufficient for local memory. "
+                "buffer size: %d. P_MDBBLOCKs require: %d+memory for alignment",
+                mem->limit-mem->base, lop_getpoolsize(mdbsize, MAXMDBS));
+            strmhead->perrno = P_OUTOFMEMORY;
+            return NULL;
+        }
+        strmhead->mdbpool = lop_allocpool(mdbsize, MAXMDBS, mptr);
     }
-    strmhead->pool16 = lop_allocpool(16, POOL16SIZE, mptr);
-#endif
 
-#if(POOL64SIZE > 0)
-    mptr = pstreams_memassign(strmhead->mem, lop_getpoolsize(64, POOL64SIZE));
-    if(!mptr)
+    /*data buffer pools, by size class*/
+    if(pstreams_initclasses(strmhead, conf) != P_STREAMS_SUCCESS)
     {
-        pstreams_console("ERROR: given buffer insufficient for local memory. "
-            "buffer size: %d. POOL64 requires: %d+memory for alignment",
-            mem->limit-mem->base, lop_getpoolsize(64, POOL64SIZE));
-        strmhead->perrno = P_OUTOFMEMORY;
         return NULL;
     }
-    strmhead->pool64 = lop_allocpool(64, POOL64SIZE, mptr);
-#endif
 
-#if(POOL256SIZE > 0)
-    mptr = pstreams_memassign(strmhead->mem, lop_getpoolsize(256, POOL256SIZE));
-    if(!mptr)
+    /*pools carved out above are the floor, elastic pools grow beyond it*/
+    strmhead->backing = conf ? conf->backing : NULL;
+    strmhead->trimtime = my_time();
+    if(strmhead->backing)
     {
-        pstreams_console("ERROR: given buffer insufficient for local memory. "
-            "buffer size: %d. POOL256 requires: %d+memory for alignment",
-            mem->limit-mem->base, lop_getpoolsize(256, POOL256SIZE));
-        strmhead->perrno = P_OUTOFMEMORY;
-        return NULL;
+        int i;
+
+        lop_setbacking(strmhead->msgpool, strmhead->backing);
+        lop_setbacking(strmhead->datapool, strmhead->backing);
+        if(strmhead->mdbpool)
+        {
+            lop_setbacking(strmhead->mdbpool, strmhead->backing);
+        }
+        for(i=0; i<strmhead->nclasses; i++)
+        {
+            lop_setbacking(strmhead->classpool[i], strmhead->backing);
+        }
     }
-    strmhead->pool256 = lop_allocpool(256, POOL256SIZE, mptr);
-#endif
 
-#if(POOL512SIZE > 0)
-    mptr = pstreams_memassign(strmhead->mem, lop_getpoolsize(512, POOL512SIZE));
-    if(!mptr)
+#ifdef PSTREAMS_INGRESS
+    /*ring for messages from other threads - see pstreams_ingress*/
+    strmhead->ingring = (P_INGSLOT *)pstreams_memassign(strmhead->mem,
+        PSTREAMS_INGRESS*sizeof(P_INGSLOT));
+    if(!strmhead->ingring)
     {
         pstreams_console("ERROR: given buffer insufficient for local memory. "
-            "buffer size: %d. POOL512 requires: %d+memory for alignment",
-            mem->limit-mem->base, lop_getpoolsize(512, POOL512SIZE));
+            "buffer size: %d. ingress ring requires: %d+memory for alignment",
+            mem->limit-mem->base, PSTREAMS_INGRESS*sizeof(P_INGSLOT));
         strmhead->perrno = P_OUTOFMEMORY;
         return NULL;
     }
-    strmhead->pool512 = lop_allocpool(512, POOL512SIZE, mptr);
+    {
+        int i;
+
+        for(i=0; i<PSTREAMS_INGRESS; i++)
+        {
+            strmhead->ingring[i].s_seq = i; /*free for position i*/
+            strmhead->ingring[i].s_msg = NULL;
+        }
+    }
+    strmhead->ingtail = 0;
+    strmhead->inghead = 0;
+    strmhead->ingcount = 0;
+    strmhead->ingfd = INVALID_SOCKET;
 #endif
 
-#if(POOL1792SIZE > 0)
-    mptr = pstreams_memassign(strmhead->mem, lop_getpoolsize(1792, POOL1792SIZE));
-    if(!mptr)
+#ifdef PSTREAMS_PIPELINE
     {
-        pstreams_console("ERROR: given buffer insufficient for local memory. "
-            "buffer size: %d. POOL1792 requires: %d+memory for alignment",
-            mem->limit-mem->base, lop_getpoolsize(1792, POOL1792SIZE));
-        strmhead->perrno = P_OUTOFMEMORY;
-        return NULL;
+        int i;
+
+        for(i=0; i<PSTREAMS_MAXWORKERS; i++)
+        {
+            strmhead->workers[i].w_q[0] = strmhead->workers[i].w_q[1] = NULL;
+        }
     }
-    strmhead->pool1792 = lop_allocpool(1792, POOL1792SIZE, mptr);
+    strmhead->nworkers = 0;
+    strmhead->wakepending = 0;
+#endif
+
+#ifdef PSTREAMS_SCHED
+    strmhead->sched = NULL;
+    strmhead->schedstate = SCHEDIDLE;
+    strmhead->schedlink = strmhead->schedtlink = NULL;
+    strmhead->schedlist = NULL;
+    strmhead->schedtimed = P_FALSE;
+    strmhead->schedrun = NULL;
+    strmhead->schedarg = NULL;
 #endif
 
     /*DEBUG messages*/
-    pstreams_console("pstreams_open: memory at close. vmem avail = %lu bytes. "
-        "pmem avail = %lu bytes\n",
-        (unsigned long)(strmhead->mem->limit-strmhead->mem->base),
-        (unsigned long)(strmhead->pmem->limit-strmhead->pmem->base));
+    if(!conf || !conf->quiet)
+    {
+        pstreams_console("pstreams_open: memory at close. vmem avail = %lu bytes. "
+            "pmem avail = %lu bytes\n",
+            (unsigned long)(strmhead->mem->limit-strmhead->mem->base),
+            (unsigned long)(strmhead->pmem->limit-strmhead->pmem->base));
+    }
 
     pstreams_init_queue(strmhead, &strmhead->appwrq, strmhead->appmod.st_wrinit);
     pstreams_init_queue(strmhead, &strmhead->apprdq, strmhead->appmod.st_rdinit);
@@ -267,6 +539,22 @@ pstreams_open(int devid, P_MEM *mem, P_MEM *pmem)
     pstreams_connect_queue(&strmhead->appwrq, &strmhead->devwrq);
     pstreams_connect_queue(&strmhead->devrdq, &strmhead->apprdq);
 
+#ifdef PSTREAMS_EPOLL
+    /*the stream's own poll set - without it pstreams_fdregister fails*/
+    strmhead->epfd = epoll_create1(EPOLL_CLOEXEC);
+#endif
+
+#if defined(PSTREAMS_INGRESS) && defined(PSTREAMS_EVENTFD)
+    /*producers wake the stream's thread through appwrq - see pstreams_ingress*/
+    strmhead->ingfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if(strmhead->ingfd != INVALID_SOCKET &&
+        pstreams_fdregister(&strmhead->appwrq, strmhead->ingfd) != P_STREAMS_SUCCESS)
+    {
+        close(strmhead->ingfd);
+        strmhead->ingfd = INVALID_SOCKET;
+    }
+#endif
+
     if(strmhead && strmhead->appwrq.q_qinfo.qi_qopen)
     {
         if(strmhead->appwrq.q_qinfo.qi_qopen(&strmhead->appwrq) != P_STREAMS_SUCCESS)
@@ -305,6 +593,127 @@ pstreams_open(int devid, P_MEM *mem, P_MEM *pmem)
     return strmhead;
 }
 
+/******************************************************************************
+Name: pstreams_mktemplate
+Purpose: build a template for streams alike - on devid, with conf, and mods
+    pushed in the order given. A stream of the template is built in mem and
+    pmem and closed again, to check it stands up and to size it.
+Parameters:
+    out: tmpl - the template
+    in: conf - NULL for the defaults. Copied; what it points to(backing,
+        classes) must outlive the template
+    in: mods - nmods modules, upto MAXQUEUES/2
+    in: mem, pmem - as for pstreams_open. The trial stream is built in mem,
+        which must hold a whole stream. Once it is closed, the bytes it took
+        are zeroed and mem->base is put back - mem can take a stream again
+Caveats: sample usage:
+        pstreams_mktemplate(&tmpl, P_NULL, &conf, mods, 2, &scratch, &pmem);
+        for(i=0; i<n; i++)
+            strm[i] = pstreams_tmplopen(&tmpl, &mem[i], &pmem);
+******************************************************************************/
+int
+pstreams_mktemplate(P_STREAMTMPL *tmpl, int devid, const P_STREAMCONF *conf,
+                    const P_STREAMTAB **mods, int nmods, P_MEM *mem, P_MEM *pmem)
+{
+    P_STREAMHEAD *strmhead=NULL;
+    char *start=NULL;
+    int i=0;
+
+    if(!tmpl || !mem || nmods < 0 || nmods > MAXQUEUES/2)
+    {
+        return P_STREAMS_FAILURE;
+    }
+
+    memset(tmpl, 0, sizeof(*tmpl));
+    tmpl->devid = devid;
+    if(conf)
+    {
+        tmpl->conf = *conf; /*structure copy*/
+    }
+    for(i=0; i<nmods; i++)
+    {
+        tmpl->mods[i] = mods[i];
+    }
+    tmpl->nmods = nmods;
+
+    /*trial stream - built the way pstreams_tmplopen will*/
+    start = mem->base;
+    strmhead = pstreams_open(devid, mem, pmem, conf);
+    if(!strmhead)
+    {
+        return P_STREAMS_FAILURE;
+    }
+
+    for(i=0; i<nmods; i++)
+    {
+        if(pstreams_push(strmhead, mods[i]) != P_STREAMS_SUCCESS)
+        {
+            pstreams_close(strmhead);
+            memset(start, 0, mem->base - start);
+            mem->base = start;
+            return P_STREAMS_FAILURE;
+        }
+    }
+
+    /*modules take their areas in open - counted too. slack for a mem unaligned*/
+    tmpl->memsize = (uint32)(mem->base - start) + WORDBOUNDARY;
+
+    pstreams_close(strmhead);
+
+    /*the trial stream's memory is the caller's again*/
+    memset(start, 0, mem->base - start);
+    mem->base = start;
+
+    return P_STREAMS_SUCCESS;
+}
+
+/******************************************************************************
+Name: pstreams_tmplopen
+Purpose: stand up a stream of given template in mem and pmem - pstreams_open
+    and the template's pushes, quietly. Pools are set up in time independent
+    of their sizes(see lop_allocpoolalign), so this takes microseconds.
+Parameters:
+    in: tmpl - made by pstreams_mktemplate
+    in: mem, pmem - as for pstreams_open. mem needs tmpl->memsize bytes
+Caveats: returns NULL, without touching mem, if mem is short of
+    tmpl->memsize; NULL too if the device or a module fails to open.
+******************************************************************************/
+P_STREAMHEAD *
+pstreams_tmplopen(const P_STREAMTMPL *tmpl, P_MEM *mem, P_MEM *pmem)
+{
+    P_STREAMHEAD *strmhead=NULL;
+    P_STREAMCONF conf;
+    int i=0;
+
+    if(!mem || !mem->buf || (uint32)(mem->limit - mem->base) < tmpl->memsize)
+    {
+        pstreams_console("ERROR: pstreams_tmplopen: given buffer insufficient for local memory. "
+            "buffer size: %d. template requires: %lu",
+            mem ? (int)(mem->limit-mem->base) : 0, (unsigned long)tmpl->memsize);
+        return NULL;
+    }
+
+    conf = tmpl->conf; /*structure copy*/
+    conf.quiet = P_TRUE;
+
+    strmhead = pstreams_open(tmpl->devid, mem, pmem, &conf);
+    if(!strmhead)
+    {
+        return NULL;
+    }
+
+    for(i=0; i<tmpl->nmods; i++)
+    {
+        if(pstreams_push(strmhead, tmpl->mods[i]) != P_STREAMS_SUCCESS)
+        {
+            pstreams_close(strmhead);
+            return NULL;
+        }
+    }
+
+    return strmhead;
+}
+
 /******************************************************************************
 Name: pstreams_setltfile
 Purpose: designates a file for log and trace messages output to supplant the
@@ -334,6 +743,28 @@ pstreams_close(P_STREAMHEAD *strmhead)
 
     /*TODO verify - free allocated pools and strmhead*/
 
+#ifdef PSTREAMS_SCHED
+    if(strmhead->sched)
+    {
+        pstreams_schedremove(strmhead);
+    }
+#endif
+
+#ifdef PSTREAMS_PIPELINE
+    /*all queues back on this thread before any goes*/
+    {
+        int i;
+
+        for(i=0; i<PSTREAMS_MAXWORKERS; i++)
+        {
+            if(strmhead->workers[i].w_q[0])
+            {
+                pstreams_unpin(strmhead, &strmhead->workers[i]);
+            }
+        }
+    }
+#endif
+
     /*empty the stream*/
     while(pstreams_pop(strmhead) != 0) ;
 
@@ -352,6 +783,66 @@ pstreams_close(P_STREAMHEAD *strmhead)
     }
     
     /*not closing app end*/
+
+#ifdef PSTREAMS_PIPELINE
+    pstreams_ringfree(strmhead, &strmhead->appwrq);
+    pstreams_ringfree(strmhead, &strmhead->apprdq);
+    pstreams_ringfree(strmhead, wrq);
+    pstreams_ringfree(strmhead, rdq);
+#endif
+
+#ifdef PSTREAMS_INGRESS
+    /*messages still in the ring are dropped - their producers are done*/
+    pstreams_ingressdrain(strmhead, P_TRUE);
+#ifdef PSTREAMS_EVENTFD
+    if(strmhead->ingfd != INVALID_SOCKET)
+    {
+        pstreams_fdunregister(&strmhead->appwrq, strmhead->ingfd);
+        close(strmhead->ingfd);
+        strmhead->ingfd = INVALID_SOCKET;
+    }
+#endif
+#endif
+
+#ifdef PSTREAMS_EPOLL
+    if(strmhead->epfd != INVALID_SOCKET)
+    {
+        close(strmhead->epfd);
+        strmhead->epfd = INVALID_SOCKET;
+    }
+#endif
+
+#ifdef PSTREAMS_EVENTFD
+    if(strmhead->notifyfd != INVALID_SOCKET)
+    {
+        close(strmhead->notifyfd);
+        strmhead->notifyfd = INVALID_SOCKET;
+        strmhead->apprdq.q_flag &= ~QNOTIFY;
+    }
+#endif
+
+    /*objects cached by this thread go back to the stream's pools*/
+    pstreams_cacheflush(strmhead);
+
+    /*
+     * slabs of elastic pools go back to their backing allocator; a magazine
+     * another thread still has for a pool is dropped, not used, should the
+     * memory become a pool again
+     */
+    {
+        int i;
+
+        lop_releasepool(strmhead->msgpool);
+        lop_releasepool(strmhead->datapool);
+        if(strmhead->mdbpool)
+        {
+            lop_releasepool(strmhead->mdbpool);
+        }
+        for(i=0; i<strmhead->nclasses; i++)
+        {
+            lop_releasepool(strmhead->classpool[i]);
+        }
+    }
     
     /*TODO - release local and persistent memory*/
 
@@ -465,10 +956,21 @@ pstreams_pop(P_STREAMHEAD *strmhead)
 
     ASSERT(mi_idnum == rdq->q_qinfo.qi_minfo->mi_idnum);
 
+#ifdef PSTREAMS_PIPELINE
+    /*the module's worker stops first; messages left between threads go*/
+    if(wrq->q_worker)
+    {
+        pstreams_unpin(strmhead, wrq->q_worker);
+    }
+    pstreams_ringfree(strmhead, wrq);
+    pstreams_ringfree(strmhead, rdq);
+#endif
+
     if(wrq->q_qinfo.qi_qclose)
     {
         wrq->q_qinfo.qi_qclose(wrq);
     }
+    pstreams_qcancel(wrq);
     strmhead->appwrq.q_next = wrq->q_next;
     wrq->q_next = NULL; /*for safety*/
     lop_release(strmhead->qpool, wrq);
@@ -478,6 +980,7 @@ pstreams_pop(P_STREAMHEAD *strmhead)
     {
         rdq->q_qinfo.qi_qclose(rdq);
     }
+    pstreams_qcancel(rdq);
     strmhead->apprdq.q_next = rdq->q_next;
     rdq->q_next = NULL; /*for safety*/
     lop_release(strmhead->qpool, rdq);
@@ -568,28 +1071,21 @@ pstreams_allocmsgb(P_STREAMHEAD *strmhead, int32 size, unsigned int priority)
 #endif
 
 /******************************************************************************
-Name: pstreams_putmsg
-Purpose: Apps use this function to send messages down the stream.
-Parameters: ctlbuf for control part of message. msgbuf for data part of message.
-Caveats: memory allocated
+Name: pstreams_buildmsg
+Purpose: build the message for pstreams_putmsg from the application's buffers -
+    a P_M_PROTO block from ctlbuf, linked to P_M_DATA from msgbuf
+Parameters: *tmsg - the message; NULL if both buffers are empty
+Caveats: memory allocated. P_STREAMS_FAILURE if it can't be - out of memory.
+    perrno is left to the caller: pstreams_ingress runs on other threads.
 ******************************************************************************/
-int
-pstreams_putmsg(P_STREAMHEAD *strmhead, P_BUF *ctlbuf, P_BUF *msgbuf, int flags)
+static int
+pstreams_buildmsg(P_STREAMHEAD *strmhead, P_BUF *ctlbuf, P_BUF *msgbuf, int flags,
+                  P_MSGB **tmsg)
 {
     P_MSGB *ctl=NULL; /*control part of msg*/
     P_MSGB *msg=NULL; /*data part of msg */
-    P_MSGB *tmsg=NULL;/*total msg*/
 
-    if((flags != RS_HIPRI) && !pstreams_canput(&strmhead->appwrq))
-    {
-#ifdef PSTREAMS_LT
-        pstreams_log(&strmhead->appwrq, PSTREAMS_LTERROR, 
-            "putmsg on STREAMHEAD failed with flow control restrictions");
-#endif /*PSTREAMS_LT*/
-
-        strmhead->perrno = P_BUSY; /*for now, only putmsg()'s canput() failure causes P_BUSY*/
-        return P_STREAMS_FAILURE;
-    }
+    *tmsg = NULL;
 
     /*
      * ctlbuf holds the control part of the message. For eg. that this message
@@ -603,7 +1099,6 @@ pstreams_putmsg(P_STREAMHEAD *strmhead, P_BUF *ctlbuf, P_BUF *msgbuf, int flags)
         ctl = pstreams_allocb(strmhead, ctlbuf->len, 0);
         if(!ctl)
         {
-            strmhead->perrno = P_OUTOFMEMORY;
             return P_STREAMS_FAILURE;
         }
         ctl->b_datap->db_type = P_M_PROTO;
@@ -615,6 +1110,7 @@ pstreams_putmsg(P_STREAMHEAD *strmhead, P_BUF *ctlbuf, P_BUF *msgbuf, int flags)
 
         memcpy(ctl->b_wptr, ctlbuf->buf, ctlbuf->len);
         ctl->b_wptr += ctlbuf->len;
+        ctl->b_msglen = ctlbuf->len;
 
 #ifdef PSTREAMS_LT
         pstreams_log(NULL, PSTREAMS_LTDEBUG, "pstreams_putmsg: ctl bytes %d.", 
@@ -627,17 +1123,25 @@ pstreams_putmsg(P_STREAMHEAD *strmhead, P_BUF *ctlbuf, P_BUF *msgbuf, int flags)
     {
         ASSERT(msgbuf->maxlen >= msgbuf->len); /*I'm using maxlen!! Maybe needed for release*/
 
-        msg = pstreams_allocb(strmhead, msgbuf->len, 0);
+        /*room for modules to prepend headers(and append trailers) in place*/
+        if(pstreams_mpool(strmhead, 
+            msgbuf->len + strmhead->headroom + strmhead->tailroom) > 0)
+        {
+            msg = pstreams_allocbr(strmhead, msgbuf->len, 0);
+        }
+        else
+        {
+            /*beyond the largest buffer - a chain of blocks*/
+            msg = pstreams_allocmsg(strmhead, msgbuf->len);
+        }
         if(!msg)
         {
-            strmhead->perrno = P_OUTOFMEMORY;
             pstreams_freemsg(strmhead, ctl);
             return P_STREAMS_FAILURE;
         }
         msg->b_datap->db_type = P_M_DATA;
 
-        memcpy(msg->b_wptr, msgbuf->buf, msgbuf->len);
-        msg->b_wptr += msgbuf->len;
+        pstreams_msgwrite(msg, msgbuf);
 
 #ifdef PSTREAMS_LT
         pstreams_log(NULL, PSTREAMS_LTDEBUG, "pstreams_putmsg: msg bytes %d.", 
@@ -645,29 +1149,236 @@ pstreams_putmsg(P_STREAMHEAD *strmhead, P_BUF *ctlbuf, P_BUF *msgbuf, int flags)
 #endif /*PSTREAMS_LT*/
     }
 
-    if(ctl)
-    {
-        tmsg = ctl;
-    }
-    if(msg)
+    if(ctl && msg)
     {
-        if(tmsg)
-        {
-            tmsg->b_cont = msg;
-        }
-        else
-        {
-            tmsg = msg;
-        }
+        pstreams_linkb(ctl, msg);
     }
 
-    (void) strmhead->appwrq.q_qinfo.qi_putp(&strmhead->appwrq, tmsg);
+    *tmsg = ctl ? ctl : msg;
 
-    PDBG(flags=0); /*keep compiler happy*/
+    return P_STREAMS_SUCCESS;
+}
+
+/******************************************************************************
+Name: pstreams_putmsg
+Purpose: Apps use this function to send messages down the stream.
+Parameters: ctlbuf for control part of message. msgbuf for data part of message.
+Caveats: memory allocated
+******************************************************************************/
+int
+pstreams_putmsg(P_STREAMHEAD *strmhead, P_BUF *ctlbuf, P_BUF *msgbuf, int flags)
+{
+    P_MSGB *tmsg=NULL;/*total msg*/
+
+    if((flags != RS_HIPRI) && !pstreams_canput(&strmhead->appwrq))
+    {
+#ifdef PSTREAMS_LT
+        pstreams_log(&strmhead->appwrq, PSTREAMS_LTERROR, 
+            "putmsg on STREAMHEAD failed with flow control restrictions");
+#endif /*PSTREAMS_LT*/
+
+        strmhead->perrno = P_BUSY; /*for now, only putmsg()'s canput() failure causes P_BUSY*/
+        return P_STREAMS_FAILURE;
+    }
+
+    if(pstreams_buildmsg(strmhead, ctlbuf, msgbuf, flags, &tmsg) != P_STREAMS_SUCCESS)
+    {
+        strmhead->perrno = P_OUTOFMEMORY;
+        return P_STREAMS_FAILURE;
+    }
+
+    (void) strmhead->appwrq.q_qinfo.qi_putp(&strmhead->appwrq, tmsg);
 
     return P_STREAMS_SUCCESS;
 }
 
+/******************************************************************************
+Name: pstreams_putmmsg
+Purpose: Apps use this function to send upto nmsgs messages down the stream in
+    one call - as pstreams_putmsg for each of msgs[], but with one flow control
+    check for the lot. Like sendmmsg.
+Parameters: msgs[i].ctlbuf and msgs[i].msgbuf as the ctlbuf and msgbuf of
+    pstreams_putmsg; a part with len 0 is left out. flags apply to all.
+Caveats: returns the count of messages sent - from the front of msgs[]. -1 if
+    none went: perrno is P_BUSY for flow control, P_OUTOFMEMORY if the first
+    could not be built. The batch may take the queue past its high water mark.
+******************************************************************************/
+int
+pstreams_putmmsg(P_STREAMHEAD *strmhead, P_MMSG *msgs, int nmsgs, int flags)
+{
+    P_MSGB *tmsg=NULL;
+    int nsent=0;
+
+    if((flags != RS_HIPRI) && !pstreams_canput(&strmhead->appwrq))
+    {
+#ifdef PSTREAMS_LT
+        pstreams_log(&strmhead->appwrq, PSTREAMS_LTERROR, 
+            "putmmsg on STREAMHEAD failed with flow control restrictions");
+#endif /*PSTREAMS_LT*/
+
+        strmhead->perrno = P_BUSY;
+        return -1;
+    }
+
+    for(nsent = 0; nsent < nmsgs; nsent++)
+    {
+        if(pstreams_buildmsg(strmhead, &msgs[nsent].ctlbuf, &msgs[nsent].msgbuf,
+            flags, &tmsg) != P_STREAMS_SUCCESS)
+        {
+            break; /*out of memory*/
+        }
+
+        if(tmsg)
+        {
+            (void) strmhead->appwrq.q_qinfo.qi_putp(&strmhead->appwrq, tmsg);
+        }
+    }
+
+    /*a later message running out of memory is reported by the next call -
+     *as sendmmsg, the count is the result*/
+    if(nsent == 0 && nmsgs > 0)
+    {
+        strmhead->perrno = P_OUTOFMEMORY;
+        return -1;
+    }
+
+    return nsent;
+}
+
+#ifdef PSTREAMS_INGRESS
+/******************************************************************************
+Name: pstreams_ingress
+Purpose: putmsg for threads other than the one running the stream - any number
+    of them at once. The message is built here, on the caller's thread, then
+    handed over through a lock-free ring; pstreams_callsrvp, on the stream's
+    thread, drains the ring down the stream in order of arrival. Producers
+    touch no queue or module state, and don't wait on each other.
+Parameters: as pstreams_putmsg
+Caveats: returns P_NOERROR, or the error - P_BUSY with the ring full(the
+    stream is not keeping up), P_OUTOFMEMORY. perrno, the stream thread's, is
+    not touched. Buffers come from the stream's pools - see lop_cachealloc.
+    Without an eventfd(PSTREAMS_EVENTFD) a stream waiting in pstreams_pollwait
+    sees the message only once its wait ends.
+******************************************************************************/
+int
+pstreams_ingress(P_STREAMHEAD *strmhead, P_BUF *ctlbuf, P_BUF *msgbuf, int flags)
+{
+    P_MSGB *tmsg=NULL;
+    P_INGSLOT *slot=NULL;
+    unsigned long pos;
+    long dif;
+
+    if(pstreams_buildmsg(strmhead, ctlbuf, msgbuf, flags, &tmsg) != P_STREAMS_SUCCESS)
+    {
+        return P_OUTOFMEMORY;
+    }
+    if(!tmsg)
+    {
+        return P_NOERROR; /*nothing to send*/
+    }
+
+    /*claim the slot for the tail position*/
+    for(pos = strmhead->ingtail; ; pos = strmhead->ingtail)
+    {
+        slot = &strmhead->ingring[pos & (PSTREAMS_INGRESS-1)];
+        dif = (long)((unsigned long)slot->s_seq - pos);
+
+        if(dif == 0)
+        {
+            if(P_ATOMIC_CAS(&strmhead->ingtail, (long)pos, (long)(pos+1)))
+            {
+                break;
+            }
+        }
+        else if(dif < 0)
+        {
+            /*not yet drained from a lap ago - full*/
+            pstreams_freemsg(strmhead, tmsg);
+            return P_BUSY;
+        }
+        /*else another producer took it - try again*/
+    }
+
+    slot->s_msg = tmsg;
+    P_MEMBARRIER(); /*the msg is seen before the slot is*/
+    slot->s_seq = pos+1;
+
+    if(P_ATOMIC_ADD(&strmhead->ingcount, 1) == 0)
+    {
+#ifdef PSTREAMS_EVENTFD
+        uint64_t one=1;
+
+        if(strmhead->ingfd != INVALID_SOCKET)
+        {
+            (void) write(strmhead->ingfd, &one, sizeof(one));
+        }
+#endif
+    }
+
+    return P_NOERROR;
+}
+
+/******************************************************************************
+Name: pstreams_ingressdrain
+Purpose: take the messages from pstreams_ingress off the ring, in order, and
+    put them down the stream - or free them(drop)
+Parameters:
+Caveats: stream's thread only. Stops when appwrq is flow controlled -
+    pstreams_waittime has the stream run again once it isn't.
+******************************************************************************/
+static void
+pstreams_ingressdrain(P_STREAMHEAD *strmhead, P_BOOL drop)
+{
+    P_INGSLOT *slot=NULL;
+    P_MSGB *msg=NULL;
+    long n=0;
+
+#ifdef PSTREAMS_EVENTFD
+    uint64_t count;
+
+    if(pstreams_fdready(&strmhead->appwrq))
+    {
+        (void) read(strmhead->ingfd, &count, sizeof(count));
+    }
+#endif
+
+    for(n = 0; n < PSTREAMS_INGRESS; n++)
+    {
+        slot = &strmhead->ingring[strmhead->inghead & (PSTREAMS_INGRESS-1)];
+        if((long)((unsigned long)slot->s_seq - (strmhead->inghead+1)) != 0)
+        {
+            break; /*empty - or its producer is still filling it*/
+        }
+        if(!drop && !pstreams_canput(&strmhead->appwrq))
+        {
+            break;
+        }
+        P_MEMBARRIER(); /*the msg is read after the slot is seen*/
+
+        msg = slot->s_msg;
+        slot->s_msg = NULL;
+        P_MEMBARRIER();
+        slot->s_seq = strmhead->inghead + PSTREAMS_INGRESS; /*free for the next lap*/
+        strmhead->inghead++;
+
+        if(drop)
+        {
+            pstreams_freemsg(strmhead, msg);
+        }
+        else
+        {
+            (void) strmhead->appwrq.q_qinfo.qi_putp(&strmhead->appwrq, msg);
+        }
+    }
+
+    if(n && P_ATOMIC_ADD(&strmhead->ingcount, -n) - n > 0 && !drop)
+    {
+        /*more came in, or is on its way - another pass*/
+        pstreams_qenable(&strmhead->appwrq);
+    }
+}
+#endif /*PSTREAMS_INGRESS*/
+
 /******************************************************************************
 Name: pstreams_esmsgput - extended streams putmsg
 Purpose: Apps use this function to send messages down the stream. Similar to 
@@ -722,6 +1433,7 @@ pstreams_esmsgput(P_STREAMHEAD *strmhead, P_ESBUF *ctlbuf, P_ESBUF *msgbuf, int
 
         memcpy(ctl->b_wptr, ctlbuf->buf, ctlbuf->len);
         ctl->b_wptr += ctlbuf->len;
+        ctl->b_msglen = ctlbuf->len;
 
 #ifdef PSTREAMS_LT
         pstreams_log(NULL, PSTREAMS_LTDEBUG, "pstreams_putmsg: ctl bytes %d.", 
@@ -758,6 +1470,7 @@ pstreams_esmsgput(P_STREAMHEAD *strmhead, P_ESBUF *ctlbuf, P_ESBUF *msgbuf, int
 
         /*no need to copy - just advance write pointer*/
         msg->b_wptr += msgbuf->len;
+        msg->b_msglen = msgbuf->len;
 
 #ifdef PSTREAMS_LT
         pstreams_log(NULL, PSTREAMS_LTDEBUG, "pstreams_putmsg: msg bytes %d.", 
@@ -773,7 +1486,7 @@ pstreams_esmsgput(P_STREAMHEAD *strmhead, P_ESBUF *ctlbuf, P_ESBUF *msgbuf, int
     {
         if(tmsg)
         {
-            tmsg->b_cont = msg;
+            pstreams_linkb(tmsg, msg);
         }
         else
         {
@@ -788,6 +1501,44 @@ pstreams_esmsgput(P_STREAMHEAD *strmhead, P_ESBUF *ctlbuf, P_ESBUF *msgbuf, int
     return P_STREAMS_SUCCESS;
 }
 
+/******************************************************************************
+Name: pstreams_getparts
+Purpose: take the next message off the streamhead, split into its control and
+    data parts - for pstreams_getmsg and pstreams_getloan
+Parameters: *ctlmsg and *datmsg are NULL for a part the message has not,
+    and both when no message is waiting
+Caveats: P_STREAMS_FAILURE if the stream has an error(perrno)
+******************************************************************************/
+static int
+pstreams_getparts(P_STREAMHEAD *strmhead, P_MSGB **ctlmsg, P_MSGB **datmsg)
+{
+    P_MSGB *msg=NULL;
+
+    *ctlmsg = *datmsg = NULL;
+
+    if(strmhead->perrno != 0)
+    {
+        return P_STREAMS_FAILURE;
+    }
+
+    msg = pstreams_getq(&strmhead->apprdq);
+    if(!msg)
+    {
+        /*no message*/
+        return P_STREAMS_SUCCESS;
+    }
+
+#ifdef PSTREAMS_LT
+    pstreams_log(NULL, PSTREAMS_LTDEBUG, "pstreams_getmsg: msg bytes %d.",
+            pstreams_msgsize(msg));
+#endif /*PSTREAMS_LT*/
+
+    pstreams_sift(&strmhead->apprdq, msg, ctl_or_data,
+        datmsg, ctlmsg);
+
+    return P_STREAMS_SUCCESS;
+}
+
 /******************************************************************************
 Name: pstreams_getmsg
 Purpose: Apps use this function to get messages of the streamhead
@@ -798,10 +1549,8 @@ Caveats:
 int
 pstreams_getmsg(P_STREAMHEAD *strmhead, P_BUF *ctlbuf, P_BUF *msgbuf, int *pflags)
 {
-    P_MSGB *msg=NULL;
     P_MSGB *ctlmsg=NULL;
     P_MSGB *datmsg=NULL;
-    int all_is_well=P_TRUE;
     
     if(pflags)  /*unused for now*/
     {
@@ -821,127 +1570,404 @@ pstreams_getmsg(P_STREAMHEAD *strmhead, P_BUF *ctlbuf, P_BUF *msgbuf, int *pflag
         PDBG(memset(msgbuf->buf, 0, msgbuf->maxlen));
     }
 
-    if(strmhead->perrno != 0)
+    if(pstreams_getparts(strmhead, &ctlmsg, &datmsg) != P_STREAMS_SUCCESS)
     {
         return P_STREAMS_FAILURE;
     }
 
-    msg = pstreams_getq(&strmhead->apprdq);
-    if(!msg)
+    if(pstreams_readparts(strmhead, ctlmsg, datmsg, ctlbuf, msgbuf) != P_STREAMS_SUCCESS)
     {
-        /*no message*/
-        return P_STREAMS_SUCCESS;
+        strmhead->perrno = P_READBUF_TOOSMALL;
+        return P_STREAMS_FAILURE;
     }
+    
+    return P_STREAMS_SUCCESS;
+}
 
-#ifdef PSTREAMS_LT
-    pstreams_log(NULL, PSTREAMS_LTDEBUG, "pstreams_getmsg: msg bytes %d.",
-            pstreams_msgsize(msg));
-#endif /*PSTREAMS_LT*/
-
-    pstreams_sift(&strmhead->apprdq, msg, ctl_or_data,
-        &datmsg, &ctlmsg);
-
-    PDBG(msg = NULL);
+/******************************************************************************
+Name: pstreams_getmsgwait
+Purpose: Apps use this function to wait for messages of the streamhead - as
+    pstreams_getmsg, once a message is there or timeout milliseconds have
+    gone(-1 - no limit, 0 - just look). Meanwhile the stream is run here:
+    pstreams_callsrvp, then pstreams_pollwait upto its next timer - so a
+    message is taken as soon as its input is, and an idle stream costs no CPU.
+Parameters: as pstreams_getmsg
+Caveats: on timeout returns P_STREAMS_SUCCESS with lens 0, as pstreams_getmsg
+    with no message; likewise at once if the stream can get nothing - no timers
+    and no device fds. Only this stream's fds are waited on.
+******************************************************************************/
+int
+pstreams_getmsgwait(P_STREAMHEAD *strmhead, P_BUF *ctlbuf, P_BUF *msgbuf, int *pflags,
+                    int32 timeout)
+{
+    int32 start = my_clockticks();
+    int32 wait=0;
+    int32 left=0;
 
-    if(datmsg)
+    for(;;)
     {
-        msgbuf->len = (int)pstreams_msgsize(datmsg);
-        if(msgbuf->maxlen >= msgbuf->len)
+        if(!pstreams_qsize(&strmhead->apprdq) && strmhead->perrno == 0)
         {
-            msgbuf->len = pstreams_msgread(msgbuf, datmsg);
-            pstreams_msgconsume(datmsg, msgbuf->len);
-            pstreams_freemsg(strmhead, datmsg);
+            if(pstreams_callsrvp(strmhead) < 0)
+            {
+                return P_STREAMS_FAILURE;
+            }
         }
-        else
+
+        if(pstreams_qsize(&strmhead->apprdq) || strmhead->perrno != 0)
         {
-            /*not enough memory - inform user*/
-            msgbuf->len = -1;
-            memset(msgbuf->buf, 0, msgbuf->maxlen);
-            all_is_well = P_FALSE;
+            break;
         }
-    }
-
-    if(ctlmsg)
-    {
-        /*
-         * the only ctlmsg sent up is P_M_PROTO
-         */
-        ASSERT(ctlmsg->b_datap->db_type == P_M_PROTO);
 
-        ctlbuf->len = (int)pstreams_msgsize(ctlmsg);
-        if(ctlbuf->maxlen >= ctlbuf->len)
+        wait = pstreams_waittime(strmhead);
+        if(timeout >= 0)
         {
-            ctlbuf->len = pstreams_msgread(ctlbuf, ctlmsg);
-            pstreams_msgconsume(ctlmsg, ctlbuf->len);
-            pstreams_freemsg(strmhead, ctlmsg);
+            left = timeout - (my_clockticks() - start);
+            if(left <= 0)
+            {
+                break;
+            }
+            wait = (wait < 0) ? left : MIN(wait, left);
         }
-        else
+
+        if(pstreams_pollwait(strmhead, wait) == 0 && wait < 0)
         {
-            /*not enough memory - inform user*/
-            ctlbuf->len = -1;
-            memset(ctlbuf->buf, 0, ctlbuf->maxlen);
-            all_is_well = P_FALSE;
+            break; /*nothing to wait on*/
         }
     }
 
-    if(!all_is_well)
+    return pstreams_getmsg(strmhead, ctlbuf, msgbuf, pflags);
+}
+
+/******************************************************************************
+Name: pstreams_notifyfd
+Purpose: a handle for the application's own poll loop - readable while the
+    streamhead holds messages for pstreams_getmsg, and not once they are all
+    taken
+Parameters:
+Caveats: INVALID_SOCKET if it can't be had - where there is no eventfd
+    (PSTREAMS_EVENTFD). The fd is the stream's; pstreams_close closes it.
+    It tells of messages already at the streamhead: the stream must still be
+    run(pstreams_callsrvp) to bring them there.
+******************************************************************************/
+SOCKET
+pstreams_notifyfd(P_STREAMHEAD *strmhead)
+{
+#ifdef PSTREAMS_EVENTFD
+    if(strmhead->notifyfd == INVALID_SOCKET)
     {
-        /*msg goes back in*/
-        if(ctlmsg)
-        {
-            pstreams_linkb(ctlmsg, datmsg); /*null datmsg is OK*/
-            msg = ctlmsg;
-        }
-        else if(datmsg)
+        strmhead->notifyfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        if(strmhead->notifyfd == INVALID_SOCKET)
         {
-            msg = datmsg;
+#ifdef PSTREAMS_LT
+            pstreams_log(&strmhead->apprdq, PSTREAMS_LTERROR,
+                "pstreams_notifyfd: eventfd failed. error %d", errno);
+#endif /*PSTREAMS_LT*/
+            return INVALID_SOCKET;
         }
-        if(msg)
+
+        strmhead->apprdq.q_flag |= QNOTIFY;
+        if(pstreams_qsize(&strmhead->apprdq))
         {
-            lop_push(&strmhead->apprdq.q_msglist, msg);
+            pstreams_notify(&strmhead->apprdq, P_TRUE);
         }
-
-        strmhead->perrno = P_READBUF_TOOSMALL;
-
-        return P_STREAMS_FAILURE;
     }
-    
-    return P_STREAMS_SUCCESS;
+#endif
+
+    return strmhead->notifyfd;
 }
 
 /******************************************************************************
-Name: pstreams_msgcount
-Purpose: Apps use this function to get count of messages waiting to be read
-Parameters: 
-Caveats:
+Name: pstreams_notify
+Purpose: make the streamhead's notify fd readable(ready), or not
+Parameters: q - apprdq, with QNOTIFY
+Caveats: called as apprdq goes from empty to not, and back - so the eventfd
+    count is 1 while messages wait, 0 otherwise
 ******************************************************************************/
-int
-pstreams_msgcount(P_STREAMHEAD *strmhead)
+static void
+pstreams_notify(P_QUEUE *q, P_BOOL ready)
 {
-    return pstreams_qsize(&strmhead->apprdq);
+#ifdef PSTREAMS_EVENTFD
+    SOCKET fd = PSTRMHEAD(q)->notifyfd;
+    uint64_t count=1;
+
+    if(ready)
+    {
+        (void) write(fd, &count, sizeof(count));
+    }
+    else
+    {
+        (void) read(fd, &count, sizeof(count));
+    }
+#else
+    PDBG(q=NULL);/*keep compiler happy*/
+    PDBG(ready=P_FALSE);/*keep compiler happy*/
+#endif
 }
 
 /******************************************************************************
-Name: pstreams_msgread
-Purpose: reads from msg onto wbuf. *msg is not modified. Steps thru message 
-    continuations via msg->b_cont
-Parameters:
-Caveats: 
+Name: pstreams_getmmsg
+Purpose: Apps use this function to get upto nmsgs messages of the streamhead
+    in one call - as pstreams_getmsg into each of msgs[]. Like recvmmsg.
+Parameters: on return msgs[i].ctlbuf and msgs[i].msgbuf hold the parts of the
+    i'th message, as the ctlbuf and msgbuf of pstreams_getmsg
+Caveats: returns the count of messages got - 0 if none waiting. A message too
+    big for its buffers stays first on the streamhead and ends the batch; if it
+    is the first, -1 with perrno P_READBUF_TOOSMALL(its lens -1) as
+    pstreams_getmsg. -1 too if the stream has an error.
 ******************************************************************************/
-uint
-pstreams_msgread(P_BUF *wbuf, P_MSGB *msg)
+int
+pstreams_getmmsg(P_STREAMHEAD *strmhead, P_MMSG *msgs, int nmsgs, int *pflags)
 {
-    int32 size=0;
-    uint32 chunksize=0;
-    char *wptr = (char *)wbuf->buf;/*pointer to next byte to write*/
+    P_MSGB *ctlmsg=NULL;
+    P_MSGB *datmsg=NULL;
+    int ngot=0;
 
-    while(msg)
+    if(pflags)  /*unused for now*/
     {
-        chunksize = pstreams_msg1size(msg);
-        if(chunksize > 0)
-        {
-            if(wbuf->maxlen < size)
-            {
+        *pflags = 0;
+    }
+
+    for(ngot = 0; ngot < nmsgs; ngot++)
+    {
+        msgs[ngot].ctlbuf.len = 0;
+        msgs[ngot].msgbuf.len = 0;
+
+        if(pstreams_getparts(strmhead, &ctlmsg, &datmsg) != P_STREAMS_SUCCESS)
+        {
+            return ngot > 0 ? ngot : -1;
+        }
+        if(!ctlmsg && !datmsg)
+        {
+            break; /*no more messages*/
+        }
+
+        if(pstreams_readparts(strmhead, ctlmsg, datmsg,
+            &msgs[ngot].ctlbuf, &msgs[ngot].msgbuf) != P_STREAMS_SUCCESS)
+        {
+            if(ngot > 0)
+            {
+                /*the app gets it on the next call*/
+                msgs[ngot].ctlbuf.len = 0;
+                msgs[ngot].msgbuf.len = 0;
+                break;
+            }
+            strmhead->perrno = P_READBUF_TOOSMALL;
+            return -1;
+        }
+    }
+
+    return ngot;
+}
+
+/******************************************************************************
+Name: pstreams_readparts
+Purpose: read the parts of a message from pstreams_getparts into the
+    application's buffers, and free it - for pstreams_getmsg and
+    pstreams_getmmsg
+Parameters:
+Caveats: if either part does not fit its buffer, the message goes back first
+    on the streamhead - untouched - with that buffer's len -1, and
+    P_STREAMS_FAILURE returned
+******************************************************************************/
+static int
+pstreams_readparts(P_STREAMHEAD *strmhead, P_MSGB *ctlmsg, P_MSGB *datmsg,
+                   P_BUF *ctlbuf, P_BUF *msgbuf)
+{
+    P_MSGB *msg=NULL;
+    int all_is_well=P_TRUE;
+
+    /*
+     * the only ctlmsg sent up is P_M_PROTO
+     */
+    ASSERT(!ctlmsg || ctlmsg->b_datap->db_type == P_M_PROTO);
+
+    if(datmsg && (!msgbuf || msgbuf->maxlen < (int)pstreams_msgsize(datmsg)))
+    {
+        /*not enough memory - inform user*/
+        if(msgbuf)
+        {
+            msgbuf->len = -1;
+            memset(msgbuf->buf, 0, msgbuf->maxlen);
+        }
+        all_is_well = P_FALSE;
+    }
+    if(ctlmsg && (!ctlbuf || ctlbuf->maxlen < (int)pstreams_msgsize(ctlmsg)))
+    {
+        /*not enough memory - inform user*/
+        if(ctlbuf)
+        {
+            ctlbuf->len = -1;
+            memset(ctlbuf->buf, 0, ctlbuf->maxlen);
+        }
+        all_is_well = P_FALSE;
+    }
+
+    if(!all_is_well)
+    {
+        /*msg goes back in*/
+        if(ctlmsg)
+        {
+            pstreams_linkb(ctlmsg, datmsg); /*null datmsg is OK*/
+            msg = ctlmsg;
+        }
+        else
+        {
+            msg = datmsg;
+        }
+        pstreams_putbq(&strmhead->apprdq, msg); /*to the front of its band*/
+
+        return P_STREAMS_FAILURE;
+    }
+
+    if(datmsg)
+    {
+        msgbuf->len = pstreams_msgread(msgbuf, datmsg);
+        pstreams_freemsg(strmhead, datmsg);
+    }
+    if(ctlmsg)
+    {
+        ctlbuf->len = pstreams_msgread(ctlbuf, ctlmsg);
+        pstreams_freemsg(strmhead, ctlmsg);
+    }
+
+    return P_STREAMS_SUCCESS;
+}
+
+/******************************************************************************
+Name: pstreams_getloan
+Purpose: Apps use this function to get messages of the streamhead without a
+    copy - as pstreams_getmsg, but the message's own blocks are lent to the
+    application instead of read into its buffers. Walk them with
+    pstreams_loanseg, then hand them back with pstreams_loanrelease:
+        P_LOAN loan;
+        P_MSGB *blk;
+        P_BUF seg;
+
+        if(pstreams_getloan(strm, &loan, &flags) == P_STREAMS_SUCCESS)
+        {
+            for(blk = loan.datmsg; pstreams_loanseg(&blk, &seg); )
+            {
+                ...seg.buf, seg.len...
+            }
+            pstreams_loanrelease(strm, &loan);
+        }
+Parameters: on return loan holds the control and data parts, if any - both
+    NULL when no message is waiting
+Caveats: the blocks are read only - they may be shared with duplicates held
+    by modules. Until released they hold pool memory, and the streamhead no
+    longer counts them for flow control; release each loan promptly.
+******************************************************************************/
+int
+pstreams_getloan(P_STREAMHEAD *strmhead, P_LOAN *loan, int *pflags)
+{
+    if(pflags)  /*unused for now*/
+    {
+        *pflags = 0;
+    }
+
+    loan->ctllen = loan->datlen = 0;
+
+    if(pstreams_getparts(strmhead, &loan->ctlmsg, &loan->datmsg) != P_STREAMS_SUCCESS)
+    {
+        return P_STREAMS_FAILURE;
+    }
+
+    if(loan->ctlmsg)
+    {
+        /*
+         * the only ctlmsg sent up is P_M_PROTO
+         */
+        ASSERT(loan->ctlmsg->b_datap->db_type == P_M_PROTO);
+
+        loan->ctllen = (int)pstreams_msgsize(loan->ctlmsg);
+    }
+    if(loan->datmsg)
+    {
+        loan->datlen = (int)pstreams_msgsize(loan->datmsg);
+    }
+
+    return P_STREAMS_SUCCESS;
+}
+
+/******************************************************************************
+Name: pstreams_loanseg
+Purpose: the next block of a loaned part, as a buffer - seg->buf and seg->len
+    (seg->maxlen the same). Empty blocks are passed over.
+Parameters: *blk - set to loan.ctlmsg or loan.datmsg to start; moved on
+Caveats: P_FALSE, with seg empty, when there are no more blocks
+******************************************************************************/
+P_BOOL
+pstreams_loanseg(P_MSGB **blk, P_BUF *seg)
+{
+    while(*blk && (*blk)->b_rptr == (*blk)->b_wptr)
+    {
+        *blk = (*blk)->b_cont;
+    }
+
+    if(!*blk)
+    {
+        seg->buf = NULL;
+        seg->len = seg->maxlen = 0;
+        return P_FALSE;
+    }
+
+    seg->buf = (char *)(*blk)->b_rptr;
+    seg->len = seg->maxlen = (int)pstreams_msg1size(*blk);
+    *blk = (*blk)->b_cont;
+
+    return P_TRUE;
+}
+
+/******************************************************************************
+Name: pstreams_loanrelease
+Purpose: hand back the blocks of a loan from pstreams_getloan
+Parameters:
+Caveats: the loan is emptied - releasing it again is harmless
+******************************************************************************/
+void
+pstreams_loanrelease(P_STREAMHEAD *strmhead, P_LOAN *loan)
+{
+    pstreams_freemsg(strmhead, loan->ctlmsg);
+    pstreams_freemsg(strmhead, loan->datmsg);
+
+    loan->ctlmsg = loan->datmsg = NULL;
+    loan->ctllen = loan->datlen = 0;
+}
+
+/******************************************************************************
+Name: pstreams_msgcount
+Purpose: Apps use this function to get count of messages waiting to be read
+Parameters: 
+Caveats:
+******************************************************************************/
+int
+pstreams_msgcount(P_STREAMHEAD *strmhead)
+{
+    return pstreams_qsize(&strmhead->apprdq);
+}
+
+/******************************************************************************
+Name: pstreams_msgread
+Purpose: reads from msg onto wbuf. *msg is not modified. Steps thru message 
+    continuations via msg->b_cont
+Parameters:
+Caveats: 
+******************************************************************************/
+uint
+pstreams_msgread(P_BUF *wbuf, P_MSGB *msg)
+{
+    int32 size=0;
+    uint32 chunksize=0;
+    char *wptr = (char *)wbuf->buf;/*pointer to next byte to write*/
+
+    while(msg)
+    {
+        chunksize = pstreams_msg1size(msg);
+        if(chunksize > 0)
+        {
+            if(wbuf->maxlen < size)
+            {
                 /*assign and return 'read' length*/
                 return (wbuf->len = size);
             }
@@ -987,6 +2013,7 @@ pstreams_msgwrite(P_MSGB *msg, P_BUF *rbuf)
             bytestocopy -= chunksize;
         }
         
+        MSGCHANGED(msg);
         msg = msg->b_cont;
         /*
          * the below ASSERT checks that once we start the copy subsequent
@@ -1009,6 +2036,8 @@ int
 pstreams_msgconsume(P_MSGB *msg, uint32 bytes)
 {
     uint32 chunksize=0;
+    P_MSGB *head = msg;
+    int32 msglen = msg ? msg->b_msglen : -1;
 
     while(msg && bytes>0)
     {
@@ -1018,11 +2047,18 @@ pstreams_msgconsume(P_MSGB *msg, uint32 bytes)
             msg->b_rptr += chunksize;
             ASSERT(msg->b_rptr <= msg->b_wptr);
             bytes -= chunksize;
+            msglen -= chunksize;
         }
         
+        MSGCHANGED(msg);
         msg = msg->b_cont;
     }
 
+    if(head && msglen >= 0)
+    {
+        head->b_msglen = msglen; /*was known - still is*/
+    }
+
     return (bytes == 0 ? P_STREAMS_SUCCESS : P_STREAMS_FAILURE);
 }
 
@@ -1047,6 +2083,7 @@ pstreams_msgerase(P_MSGB *msg, uint32 bytes)
     {
         bytes -= pstreams_msg1erase(msg, bytes);
     }
+    MSGCHANGED(msg);
 
     return bytes; /*represents bytes yet to be erased*/
 }
@@ -1067,222 +2104,2201 @@ pstreams_msg1erase(P_MSGB *msg, uint32 bytes)
         chunksize = MIN(bytes, pstreams_msg1size(msg));
         msg->b_wptr -= chunksize;
         ASSERT(msg->b_rptr <= msg->b_wptr);
+        MSGCHANGED(msg);
     }
 
     return chunksize;
 }
 
+/*
+ * fd readiness - each stream has its own set of fds. A device registers the
+ * fd behind its read queue; pstreams_pollwait() waits on the stream's fds
+ * and marks the queues whose fd is ready(QFDREADY), and enables them, so a
+ * device rsrvp runs only when there is something to read.
+ * Register and wait from the thread servicing the stream.
+ */
+
 /******************************************************************************
-Name: pstreams_callsrvp
-Purpose: public function to be called periodically to enable queues. This will
-    not needed in a multi-threaded environment.
-Parameters:
-Caveats:
+Name: pstreams_fdregister
+Purpose: have q marked ready(QFDREADY) whenever fd is readable
+Parameters: q - read queue of a device
+Caveats: an fd is registered once
 ******************************************************************************/
 int
-pstreams_callsrvp(P_STREAMHEAD *strmhead)
+pstreams_fdregister(P_QUEUE *q, SOCKET fd)
 {
-    P_QUEUE *dq; /*downstream queues*/
-    P_QUEUE *uq; /*upstream queues*/
-
-/*DEBUG mode*/
-//pstreams_checkmem(strmhead);
+    P_STREAMHEAD *strmhead = PSTRMHEAD(q);
+#ifdef PSTREAMS_EPOLL
+    struct epoll_event ev;
 
-    /*step thru downstream queues calling srvp() on each*/
-    for(dq=&strmhead->appwrq;
-        dq;
-        dq = dq->q_next)
+    if(strmhead->epfd == INVALID_SOCKET)
     {
-#ifdef PSTREAMS_LT
-        pstreams_log(dq, PSTREAMS_LTDEBUG, "pstreams_callsrvp");
-#endif /*PSTREAMS_LT*/
-
-        if(dq->q_qinfo.qi_srvp)
-        {
-            if(dq->q_qinfo.qi_srvp(dq) != P_STREAMS_SUCCESS)
-            {
-                return P_STREAMS_FAILURE;
-            }
-        }
-        else
-        {
-            /*default*/
-            if(pstreams_srvp(dq) != P_STREAMS_SUCCESS)
-            {
-                return P_STREAMS_FAILURE;
-            }
-        }
+        strmhead->perrno = P_OUTOFMEMORY; /*no epoll set - see pstreams_open*/
+        return P_STREAMS_FAILURE;
     }
 
-    /*step thru upstream queues calling srvp() on each*/
-    for(uq=&strmhead->devrdq;
-        uq;
-        uq = uq->q_next)
-    {
-#ifdef PSTREAMS_LT
-        pstreams_log(uq, PSTREAMS_LTDEBUG, "pstreams_callsrvp");
-#endif /*PSTREAMS_LT*/
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN; /*level-triggered - unread data is reported again*/
+    ev.data.ptr = q;
 
-        if(uq->q_qinfo.qi_srvp)
-        {
-            if(uq->q_qinfo.qi_srvp(uq) != P_STREAMS_SUCCESS)
-            {
-                return P_STREAMS_FAILURE;
-            }
-        }
-        else
-        {
-            /*default*/
-            if(pstreams_srvp(uq) != P_STREAMS_SUCCESS)
-            {
-                return P_STREAMS_FAILURE;
-            }
-        }
+    if(epoll_ctl(strmhead->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        strmhead->perrno = errno;
+        return P_STREAMS_FAILURE;
+    }
+#else
+    if(strmhead->npollfds == MAXPOLLFDS)
+    {
+        strmhead->perrno = P_OUTOFMEMORY;
+        return P_STREAMS_FAILURE;
     }
 
-/*DEBUG mode*/
-//pstreams_checkmem(strmhead);
+    strmhead->pollfds[strmhead->npollfds].fd = fd;
+    strmhead->pollfds[strmhead->npollfds].q = q;
+    strmhead->npollfds++;
+#endif
 
     return P_STREAMS_SUCCESS;
 }
 
 /******************************************************************************
-Name: pstreams_srvp
-Purpose: default service procedure. 
+Name: pstreams_fdunregister
+Purpose: undo pstreams_fdregister - before fd is closed
 Parameters:
 Caveats:
 ******************************************************************************/
-int
-pstreams_srvp(P_QUEUE *q)
+void
+pstreams_fdunregister(P_QUEUE *q, SOCKET fd)
 {
-    P_MSGB *msg=NULL;
+    P_STREAMHEAD *strmhead = PSTRMHEAD(q);
+#ifdef PSTREAMS_EPOLL
+    struct epoll_event ev; /*ignored, but must be non-NULL for older kernels*/
 
-    while(pstreams_canput(q->q_next))
+    if(strmhead->epfd != INVALID_SOCKET)
     {
-        msg = pstreams_getq(q);
-        if(!msg)
-        {
-            break; /*queue empty*/
-        }
-
-        /*module specific processing go here*/
+        epoll_ctl(strmhead->epfd, EPOLL_CTL_DEL, fd, &ev);
+    }
+#else
+    int i;
 
-        /*send this msg onward*/
-        if(pstreams_putnext(q, msg) != P_STREAMS_SUCCESS)
+    for(i=0; i<strmhead->npollfds; i++)
+    {
+        if(strmhead->pollfds[i].fd == fd && strmhead->pollfds[i].q == q)
         {
-            return P_STREAMS_FAILURE;
+            strmhead->pollfds[i] = strmhead->pollfds[--strmhead->npollfds];
+            break;
         }
     }
+#endif
 
-    return P_STREAMS_SUCCESS;
+    q->q_flag &= ~QFDREADY;
 }
 
 /******************************************************************************
-Name: pstreams_qsize
-Purpose: counts number of messages in queue, but not the number of bytes in those
-         messages
-Parameters: 
-Caveats:
+Name: pstreams_fdready
+Purpose: tells a device whether its fd was found readable, and clears the mark
+Parameters: q - the queue given to pstreams_fdregister
+Caveats: with nothing read the fd is found ready again on the next wait
 ******************************************************************************/
-int pstreams_qsize(P_QUEUE *q)
+P_BOOL
+pstreams_fdready(P_QUEUE *q)
 {
-    return lop_listlen(q->q_msglist);
+    if(q->q_flag & QFDREADY)
+    {
+        q->q_flag &= ~QFDREADY;
+        return P_TRUE;
+    }
 
+    return P_FALSE;
 }
 
 /******************************************************************************
-Name: pstreams_getq
-Purpose: get oldest message of a queue
+Name: pstreams_pollwait
+Purpose: wait upto timeout milliseconds(-1 - no limit, 0 - just look) for
+    any fd registered by strmhead's devices to become readable, and mark and
+    enable its queue.
+    An application servicing many streams waits on their pstreams_pollfd()s
+    instead, then calls pstreams_callsrvp() on the ready ones.
 Parameters:
-Caveats:
+Caveats: returns count of ready fds, -1 on error
 ******************************************************************************/
-P_MSGB *
-pstreams_getq(P_QUEUE *q)
+int
+pstreams_pollwait(P_STREAMHEAD *strmhead, int32 timeout)
 {
-    P_MSGB *msg = NULL;
+    int nready=0;
+    int i;
+#ifdef PSTREAMS_EPOLL
+    struct epoll_event evs[MAXPOLLFDS];
 
-    if ( (msg = (P_MSGB *)lop_dequeue(&q->q_msglist)) == NULL )
+    if(strmhead->epfd == INVALID_SOCKET)
     {
-        q->q_flag |= QWANTR; /*want to read from this q*/
-        /*need to back-enable*/
+        return 0; /*nothing registered*/
     }
-    else
+
+    nready = epoll_wait(strmhead->epfd, evs, MAXPOLLFDS, timeout);
+
+    for(i=0; i<nready; i++)
     {
-        q->q_count -= pstreams_msgsize(msg);
+        pstreams_pollmark((P_QUEUE *)evs[i].data.ptr);
+    }
+#else
+    fd_set fds;
+    SOCKET maxfd=0;
+    struct timeval tv={0};
+
+    if(!strmhead->npollfds)
+    {
+        return 0; /*nothing registered*/
+    }
+
+    FD_ZERO(&fds);
+    for(i=0; i<strmhead->npollfds; i++)
+    {
+        FD_SET(strmhead->pollfds[i].fd, &fds);
+        maxfd = MAX(maxfd, strmhead->pollfds[i].fd);
+    }
+
+    tv.tv_sec = timeout/1000;
+    tv.tv_usec = (timeout%1000)*1000;
+
+    nready = select(maxfd+1, &fds, NULL, NULL, timeout < 0 ? NULL : &tv);
+
+    for(i=0; i<strmhead->npollfds && nready > 0; i++)
+    {
+        if(FD_ISSET(strmhead->pollfds[i].fd, &fds))
+        {
+            pstreams_pollmark(strmhead->pollfds[i].q);
+        }
+    }
+#endif
+
+    if(nready < 0)
+    {
+#ifdef PSTREAMS_LT
+        pstreams_log(&strmhead->appwrq, PSTREAMS_LTERROR, "pstreams_pollwait: wait failed. "
+            "error %d", errno);
+#endif /*PSTREAMS_LT*/
+        return -1;
+    }
+
+    strmhead->polled = P_TRUE;
+
+    return nready;
+}
+
+/******************************************************************************
+Name: pstreams_pollfd
+Purpose: an fd that is readable while a device fd of strmhead is - for an
+    application waiting on many streams in its own poll loop
+Parameters:
+Caveats: INVALID_SOCKET without epoll(PSTREAMS_EPOLL). Readiness is not
+    taken by waiting on it - pstreams_callsrvp takes it.
+******************************************************************************/
+SOCKET
+pstreams_pollfd(P_STREAMHEAD *strmhead)
+{
+#ifdef PSTREAMS_EPOLL
+    return strmhead->epfd;
+#else
+    strmhead = NULL; /*unused*/
+    return INVALID_SOCKET;
+#endif
+}
+
+/******************************************************************************
+Name: pstreams_pollmark
+Purpose: q's fd was found readable - mark q(QFDREADY) and enable it
+Parameters: q - as given to pstreams_fdregister
+Caveats: the thread servicing q's stream
+******************************************************************************/
+static void
+pstreams_pollmark(P_QUEUE *q)
+{
+    q->q_flag |= QFDREADY;
+    pstreams_qenable(q);
+}
+
+#ifdef PSTREAMS_SCHED
+/******************************************************************************
+Name: pstreams_schedstart
+Purpose: start a pool of nworkers threads to run streams - see
+    pstreams_schedadd. Each thread has a run list of ready streams; a
+    thread with none takes from another's, and the first idle one waits on
+    the fds of all streams and their timers for the rest(pstreams_schedpoll).
+Parameters: sched - storage for the scheduler, till pstreams_schedstop
+Caveats:
+******************************************************************************/
+int
+pstreams_schedstart(P_SCHED *sched, int nworkers)
+{
+    struct epoll_event ev;
+    int i=0;
+
+    if(nworkers < 1 || nworkers > PSTREAMS_MAXSCHED)
+    {
+        return P_STREAMS_FAILURE;
+    }
+
+    memset(sched, 0, sizeof(*sched));
+    sched->s_nworkers = nworkers;
+
+    sched->s_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(sched->s_epfd == INVALID_SOCKET)
+    {
+        return P_STREAMS_FAILURE;
+    }
+
+    sched->s_wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if(sched->s_wakefd == INVALID_SOCKET)
+    {
+        close(sched->s_epfd);
+        return P_STREAMS_FAILURE;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; /*not a stream - see pstreams_schedpoll*/
+    if(epoll_ctl(sched->s_epfd, EPOLL_CTL_ADD, sched->s_wakefd, &ev) < 0)
+    {
+        close(sched->s_wakefd);
+        close(sched->s_epfd);
+        return P_STREAMS_FAILURE;
+    }
+
+    pthread_mutex_init(&sched->s_lock, NULL);
+    pthread_cond_init(&sched->s_cond, NULL);
+
+    for(i=0; i<nworkers; i++)
+    {
+        sched->s_workers[i].k_sched = sched;
+        sched->s_workers[i].k_idx = i;
+    }
+
+    for(i=0; i<nworkers; i++)
+    {
+        if(pthread_create(&sched->s_workers[i].k_thread, NULL, pstreams_schedworker,
+            &sched->s_workers[i]) != 0)
+        {
+            sched->s_nworkers = i;
+            pstreams_schedstop(sched);
+            return P_STREAMS_FAILURE;
+        }
+    }
+
+    return P_STREAMS_SUCCESS;
+}
+
+/******************************************************************************
+Name: pstreams_schedstop
+Purpose: stop the threads of sched. Its streams are the application's to
+    run again.
+Parameters:
+Caveats: not from a scheduler thread. A stream being run is finished first.
+******************************************************************************/
+void
+pstreams_schedstop(P_SCHED *sched)
+{
+    P_STREAMHEAD *strm=NULL;
+    uint64_t one = 1;
+    int i=0;
+
+    sched->s_stop = 1;
+    (void) write(sched->s_wakefd, &one, sizeof(one));
+    pthread_mutex_lock(&sched->s_lock);
+    pthread_cond_broadcast(&sched->s_cond);
+    pthread_mutex_unlock(&sched->s_lock);
+
+    for(i=0; i<sched->s_nworkers; i++)
+    {
+        pthread_join(sched->s_workers[i].k_thread, NULL);
+    }
+
+    /*nothing runs its streams any more - queued, timed or idle*/
+    while((strm = sched->s_streams) != NULL)
+    {
+        sched->s_streams = strm->schedanext;
+        pstreams_scheddetach(strm);
+    }
+    sched->s_timerq = NULL;
+    for(i=0; i<sched->s_nworkers; i++)
+    {
+        sched->s_workers[i].k_runq.l_head = sched->s_workers[i].k_runq.l_tail = NULL;
+    }
+
+    close(sched->s_wakefd);
+    sched->s_wakefd = INVALID_SOCKET;
+    close(sched->s_epfd); /*the streams' sets leave it with it*/
+    sched->s_epfd = INVALID_SOCKET;
+
+    pthread_cond_destroy(&sched->s_cond);
+    pthread_mutex_destroy(&sched->s_lock);
+}
+
+/******************************************************************************
+Name: pstreams_schedadd
+Purpose: have sched run strmhead from now on - its service procedures, when
+    a device has input, a timer expires or a queue is enabled; then run(arg),
+    for the application's part, as pstreams_putmsg and pstreams_getmsg.
+Parameters: run - NULL for none
+Caveats: the application no longer calls pstreams_callsrvp for strmhead, nor
+    anything else of it outside run() - other threads send down it with
+    pstreams_ingress. Streams are run one thread at a time each, in any order.
+    P_BADPARAM if strmhead is on a scheduler already.
+    The stream's epoll set joins the scheduler's, one-shot - it is armed
+    again after each run of the stream.
+******************************************************************************/
+int
+pstreams_schedadd(P_SCHED *sched, P_STREAMHEAD *strmhead,
+                  void (*run)(P_STREAMHEAD *strmhead, void *arg), void *arg)
+{
+    struct epoll_event ev;
+
+    if(strmhead->sched || strmhead->epfd == INVALID_SOCKET)
+    {
+        strmhead->perrno = P_BADPARAM;
+        return P_STREAMS_FAILURE;
+    }
+
+    strmhead->schedrun = run;
+    strmhead->schedarg = arg;
+    strmhead->schedstate = SCHEDIDLE;
+    strmhead->schedtimed = P_FALSE;
+    strmhead->schedfdready = 0;
+    strmhead->schedlast = NULL;
+    P_MEMBARRIER();
+    strmhead->sched = sched;
+
+    pthread_mutex_lock(&sched->s_lock);
+    strmhead->schedaprev = NULL;
+    strmhead->schedanext = sched->s_streams;
+    if(sched->s_streams)
+    {
+        sched->s_streams->schedaprev = strmhead;
+    }
+    sched->s_streams = strmhead;
+    pthread_mutex_unlock(&sched->s_lock);
+
+    /*objects this thread cached go back - scheduler threads run it now*/
+    pstreams_cacheflush(strmhead);
+    strmhead->cachetag = NULL;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN|EPOLLONESHOT;
+    ev.data.ptr = strmhead;
+    if(epoll_ctl(sched->s_epfd, EPOLL_CTL_ADD, strmhead->epfd, &ev) < 0)
+    {
+        strmhead->perrno = errno;
+        pthread_mutex_lock(&sched->s_lock);
+        pstreams_schedunlink(sched, strmhead);
+        pthread_mutex_unlock(&sched->s_lock);
+        strmhead->sched = NULL;
+        return P_STREAMS_FAILURE;
+    }
+
+    /*first pass - for what the stream had pending*/
+    pstreams_schedready(strmhead);
+
+    return P_STREAMS_SUCCESS;
+}
+
+/******************************************************************************
+Name: pstreams_schedremove
+Purpose: take strmhead off its scheduler - the application runs it again
+Parameters:
+Caveats: waits for a run in progress to finish - not from strmhead's run().
+    pstreams_close does this for a stream still on a scheduler. Waits too
+    for the poller to be done with streams it found - it may hold this one.
+******************************************************************************/
+int
+pstreams_schedremove(P_STREAMHEAD *strmhead)
+{
+    struct epoll_event ev; /*ignored - as in pstreams_fdunregister*/
+    P_SCHED *sched = strmhead->sched;
+    P_SCHEDWORKER *last=NULL;
+    P_SCHEDLIST *list=NULL;
+    P_STREAMHEAD *prev=NULL;
+    P_STREAMHEAD *strm=NULL;
+    P_STREAMHEAD **pstrm=NULL;
+    uint64_t one = 1;
+
+    if(!sched)
+    {
+        strmhead->perrno = P_BADPARAM;
+        return P_STREAMS_FAILURE;
+    }
+
+    /*
+     * s_nremoving is counted before the state is looked at; a run ends by
+     * setting the state, then looking at s_nremoving - see
+     * pstreams_schedrunone
+     */
+    pthread_mutex_lock(&sched->s_lock);
+    P_ATOMIC_ADD(&sched->s_nremoving, 1);
+
+    for(;;)
+    {
+        if(P_ATOMIC_CAS(&strmhead->schedstate, SCHEDIDLE, SCHEDGONE))
+        {
+            break;
+        }
+
+        if(strmhead->schedstate == SCHEDQUEUED && (list = strmhead->schedlist) != NULL)
+        {
+            /*unlink it - unless a thread has just taken it to run*/
+            P_SPINLOCK_ACQUIRE(&list->l_lock);
+            for(prev = NULL, strm = list->l_head; strm && strm != strmhead; strm = strm->schedlink)
+            {
+                prev = strm;
+            }
+            if(strm)
+            {
+                if(prev)
+                {
+                    prev->schedlink = strm->schedlink;
+                }
+                else
+                {
+                    list->l_head = strm->schedlink;
+                }
+                if(list->l_tail == strm)
+                {
+                    list->l_tail = prev;
+                }
+                strmhead->schedstate = SCHEDGONE;
+            }
+            P_SPINLOCK_RELEASE(&list->l_lock);
+
+            if(strmhead->schedstate == SCHEDGONE)
+            {
+                break;
+            }
+        }
+
+        pthread_cond_wait(&sched->s_cond, &sched->s_lock); /*it is being run*/
+    }
+
+    /*its fds are the application's to wait on again*/
+    epoll_ctl(sched->s_epfd, EPOLL_CTL_DEL, strmhead->epfd, &ev);
+
+    if(strmhead->schedtimed)
+    {
+        for(pstrm = &sched->s_timerq; *pstrm != strmhead; pstrm = &(*pstrm)->schedtlink)
+        {
+            ;
+        }
+        *pstrm = strmhead->schedtlink;
+    }
+    pstreams_schedunlink(sched, strmhead);
+
+    /*the thread that ran it last gives back the objects it holds*/
+    if((last = strmhead->schedlast) != NULL)
+    {
+        pstreams_schedflushreq(last, P_TRUE);
+    }
+
+    /*
+     * neither the timer list nor s_epfd give it to the poller any more - but
+     * the poller may have taken it from them already. It sees SCHEDGONE
+     */
+    while(sched->s_pollbusy || (last && last->k_flush))
+    {
+        (void) write(sched->s_wakefd, &one, sizeof(one)); /*out of epoll_wait*/
+        pthread_cond_wait(&sched->s_cond, &sched->s_lock);
+    }
+    P_ATOMIC_ADD(&sched->s_nremoving, -1);
+    pthread_mutex_unlock(&sched->s_lock);
+
+    pstreams_scheddetach(strmhead);
+
+    return P_STREAMS_SUCCESS;
+}
+
+/******************************************************************************
+Name: pstreams_schedunlink
+Purpose: take strmhead off the list of all streams of sched
+Parameters:
+Caveats: the caller holds s_lock
+******************************************************************************/
+static void
+pstreams_schedunlink(P_SCHED *sched, P_STREAMHEAD *strmhead)
+{
+    if(strmhead->schedaprev)
+    {
+        strmhead->schedaprev->schedanext = strmhead->schedanext;
+    }
+    else
+    {
+        sched->s_streams = strmhead->schedanext;
+    }
+    if(strmhead->schedanext)
+    {
+        strmhead->schedanext->schedaprev = strmhead->schedaprev;
+    }
+}
+
+/******************************************************************************
+Name: pstreams_scheddetach
+Purpose: strmhead is off every list of its scheduler - forget the scheduler
+Parameters:
+Caveats: List links are left - the caller may be walking them
+******************************************************************************/
+static void
+pstreams_scheddetach(P_STREAMHEAD *strmhead)
+{
+    strmhead->cachetag = &pstreams_cachetag; /*the application's again*/
+    strmhead->schedlast = NULL;
+    strmhead->sched = NULL;
+    strmhead->schedlist = NULL;
+    strmhead->schedtimed = P_FALSE;
+    strmhead->schedstate = SCHEDIDLE;
+}
+
+/******************************************************************************
+Name: pstreams_schedready
+Purpose: strmhead has something to do - put it on a run list, unless it is
+    on one already. A stream being run is run again after.
+Parameters:
+Caveats: any thread. The list is the calling scheduler thread's own, else
+    one in turn; a waiting thread is woken to take it.
+******************************************************************************/
+static void
+pstreams_schedready(P_STREAMHEAD *strmhead)
+{
+    P_SCHED *sched = strmhead->sched;
+    P_SCHEDLIST *list=NULL;
+    P_BOOL own=P_FALSE;
+    uint64_t one = 1;
+    long state;
+
+    for(;;)
+    {
+        state = strmhead->schedstate;
+        if(state == SCHEDIDLE)
+        {
+            if(P_ATOMIC_CAS(&strmhead->schedstate, SCHEDIDLE, SCHEDQUEUED))
+            {
+                break;
+            }
+        }
+        else if(state == SCHEDRUNNING)
+        {
+            if(P_ATOMIC_CAS(&strmhead->schedstate, SCHEDRUNNING, SCHEDRERUN))
+            {
+                return;
+            }
+        }
+        else
+        {
+            return; /*queued, to be run again, or being taken off*/
+        }
+    }
+
+    own = (pstreams_schedself && pstreams_schedself->k_sched == sched);
+    if(own)
+    {
+        list = &pstreams_schedself->k_runq;
+    }
+    else
+    {
+        list = &sched->s_workers[(unsigned long)P_ATOMIC_ADD(&sched->s_next, 1) % sched->s_nworkers].k_runq;
+    }
+    pstreams_schedpush(list, strmhead);
+
+    /*a waiting thread takes it - or the poller, if none is waiting*/
+    P_MEMBARRIER();
+    if(sched->s_nsleeping)
+    {
+        pstreams_schedwake(sched);
+    }
+    else if(!own)
+    {
+        (void) write(sched->s_wakefd, &one, sizeof(one));
+    }
+}
+
+/******************************************************************************
+Name: pstreams_schedwake
+Purpose: wake a thread waiting on s_cond, to take a ready stream
+Parameters:
+Caveats: all of them while a pstreams_schedremove waits there too - else it
+    may be the one to take the signal
+******************************************************************************/
+static void
+pstreams_schedwake(P_SCHED *sched)
+{
+    pthread_mutex_lock(&sched->s_lock);
+    if(sched->s_nremoving)
+    {
+        pthread_cond_broadcast(&sched->s_cond);
+    }
+    else
+    {
+        pthread_cond_signal(&sched->s_cond);
+    }
+    pthread_mutex_unlock(&sched->s_lock);
+}
+
+/******************************************************************************
+Name: pstreams_schedpush
+Purpose: put strmhead at the end of a run list
+Parameters:
+Caveats: strmhead is SCHEDQUEUED
+******************************************************************************/
+static void
+pstreams_schedpush(P_SCHEDLIST *list, P_STREAMHEAD *strmhead)
+{
+    strmhead->schedlink = NULL;
+
+    P_SPINLOCK_ACQUIRE(&list->l_lock);
+    strmhead->schedlist = list;
+    if(list->l_tail)
+    {
+        list->l_tail->schedlink = strmhead;
+    }
+    else
+    {
+        list->l_head = strmhead;
+    }
+    list->l_tail = strmhead;
+    P_SPINLOCK_RELEASE(&list->l_lock);
+}
+
+/******************************************************************************
+Name: pstreams_schedtake
+Purpose: the next stream for scheduler thread idx to run - from the head of
+    its own run list, else stolen from the head of another's
+Parameters:
+Caveats: NULL if all lists are empty
+******************************************************************************/
+static P_STREAMHEAD *
+pstreams_schedtake(P_SCHED *sched, int idx)
+{
+    P_SCHEDLIST *list=NULL;
+    P_STREAMHEAD *strm=NULL;
+    int i=0;
+
+    for(i=0; i<sched->s_nworkers && !strm; i++)
+    {
+        list = &sched->s_workers[(idx + i) % sched->s_nworkers].k_runq;
+        if(!list->l_head)
+        {
+            continue; /*a look without the lock - an empty list is common*/
+        }
+
+        P_SPINLOCK_ACQUIRE(&list->l_lock);
+        if((strm = list->l_head) != NULL)
+        {
+            list->l_head = strm->schedlink;
+            if(!list->l_head)
+            {
+                list->l_tail = NULL;
+            }
+            strm->schedlink = NULL;
+            strm->schedlist = NULL;
+        }
+        P_SPINLOCK_RELEASE(&list->l_lock);
+    }
+
+    return strm;
+}
+
+/******************************************************************************
+Name: pstreams_schedrunone
+Purpose: run strmhead once on the calling scheduler thread - its service
+    procedures, then the application's run(). It goes back on this thread's
+    run list if it has more to do, or was made ready meanwhile; on the timer
+    list if it waits for a timer.
+Parameters:
+Caveats: objects of the stream's pools do not stay in this thread's
+    magazines once it runs elsewhere, or is taken off - the thread that ran
+    it before is asked to flush. Its fds are looked at only if the poller
+    found its epoll set readable.
+******************************************************************************/
+static void
+pstreams_schedrunone(P_SCHEDWORKER *k, P_STREAMHEAD *strmhead)
+{
+    struct epoll_event ev;
+    P_SCHED *sched = k->k_sched;
+    int32 wait=-1;
+
+    strmhead->schedstate = SCHEDRUNNING;
+    P_MEMBARRIER();
+
+    if(strmhead->schedlast != k)
+    {
+        if(strmhead->schedlast)
+        {
+            pstreams_schedflushreq(strmhead->schedlast, P_FALSE);
+        }
+        strmhead->schedlast = k;
+        strmhead->cachetag = &pstreams_cachetag;
+    }
+
+    if(!strmhead->schedfdready || !P_ATOMIC_CAS(&strmhead->schedfdready, 1, 0))
+    {
+        strmhead->polled = P_TRUE; /*nothing new since it was last armed*/
+    }
+
+    if(pstreams_callsrvp(strmhead) < 0)
+    {
+#ifdef PSTREAMS_LT
+        pstreams_log(&strmhead->appwrq, PSTREAMS_LTERROR, "pstreams_schedrunone: srvp failed. error %d",
+            strmhead->perrno);
+#endif /*PSTREAMS_LT*/
+    }
+    if(strmhead->schedrun)
+    {
+        strmhead->schedrun(strmhead, strmhead->schedarg);
+    }
+
+    /*armed again - fds still readable make it ready at once*/
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN|EPOLLONESHOT;
+    ev.data.ptr = strmhead;
+    epoll_ctl(sched->s_epfd, EPOLL_CTL_MOD, strmhead->epfd, &ev);
+
+    wait = pstreams_waittime(strmhead);
+    if(wait > 0)
+    {
+        pstreams_schedtimer(sched, strmhead, wait);
+    }
+
+    if(wait == 0 || !P_ATOMIC_CAS(&strmhead->schedstate, SCHEDRUNNING, SCHEDIDLE))
+    {
+        strmhead->schedstate = SCHEDQUEUED; /*SCHEDRERUN - still ours*/
+        pstreams_schedpush(&k->k_runq, strmhead);
+    }
+
+    /*a pstreams_schedremove may be waiting for the run to end*/
+    P_MEMBARRIER();
+    if(sched->s_nremoving)
+    {
+        pthread_mutex_lock(&sched->s_lock);
+        pthread_cond_broadcast(&sched->s_cond);
+        pthread_mutex_unlock(&sched->s_lock);
+    }
+}
+
+/******************************************************************************
+Name: pstreams_schedflushreq
+Purpose: have scheduler thread k give back the objects its magazines hold -
+    a stream it ran has moved to another thread, or is being taken off
+Parameters: locked - the caller holds s_lock
+Caveats: k is woken if idle. Done once k_flush is 0 again
+******************************************************************************/
+static void
+pstreams_schedflushreq(P_SCHEDWORKER *k, P_BOOL locked)
+{
+    P_SCHED *sched = k->k_sched;
+    uint64_t one = 1;
+
+    k->k_flush = 1;
+    P_MEMBARRIER();
+    if(k->k_idle)
+    {
+        (void) write(sched->s_wakefd, &one, sizeof(one));
+        if(!locked)
+        {
+            pthread_mutex_lock(&sched->s_lock);
+        }
+        pthread_cond_broadcast(&sched->s_cond);
+        if(!locked)
+        {
+            pthread_mutex_unlock(&sched->s_lock);
+        }
+    }
+}
+
+/******************************************************************************
+Name: pstreams_schedflush
+Purpose: scheduler thread k gives back the objects its magazines hold, as
+    asked by pstreams_schedflushreq
+Parameters:
+Caveats: all magazines - they hold objects only of streams k ran
+******************************************************************************/
+static void
+pstreams_schedflush(P_SCHEDWORKER *k)
+{
+    P_SCHED *sched = k->k_sched;
+
+    lop_cacheflush(NULL);
+    P_MEMBARRIER();
+    k->k_flush = 0;
+
+    if(sched->s_nremoving)
+    {
+        pthread_mutex_lock(&sched->s_lock);
+        pthread_cond_broadcast(&sched->s_cond);
+        pthread_mutex_unlock(&sched->s_lock);
+    }
+}
+
+/******************************************************************************
+Name: pstreams_schedtimer
+Purpose: have strmhead made ready in wait milliseconds - it goes on the
+    scheduler's timer list, and the poller is woken if it would wait longer
+Parameters:
+Caveats: a later call replaces the due time
+******************************************************************************/
+static void
+pstreams_schedtimer(P_SCHED *sched, P_STREAMHEAD *strmhead, int32 wait)
+{
+    uint64_t one = 1;
+    P_BOOL wake = P_FALSE;
+
+    pthread_mutex_lock(&sched->s_lock);
+    strmhead->scheddue = my_clockticks() + wait;
+    if(!strmhead->schedtimed)
+    {
+        strmhead->schedtimed = P_TRUE;
+        strmhead->schedtlink = sched->s_timerq;
+        sched->s_timerq = strmhead;
+    }
+    if(sched->s_inpoll && (!sched->s_timed || strmhead->scheddue - sched->s_polldue < 0))
+    {
+        wake = P_TRUE;
+    }
+    pthread_mutex_unlock(&sched->s_lock);
+
+    if(wake)
+    {
+        (void) write(sched->s_wakefd, &one, sizeof(one));
+    }
+}
+
+/******************************************************************************
+Name: pstreams_schedpoll
+Purpose: the poller's turn - wait on the fds of all streams till one is
+    ready, a timer is due, or a stream is made ready from outside; make
+    the streams with input or an expired timer ready
+Parameters:
+Caveats: one thread at a time(s_polling). From taking streams off the timer
+    list till done with them, s_pollbusy holds off pstreams_schedremove -
+    streams it took off meanwhile are SCHEDGONE, and left alone.
+******************************************************************************/
+static void
+pstreams_schedpoll(P_SCHED *sched)
+{
+    struct epoll_event evs[MAXPOLLFDS];
+    P_STREAMHEAD *expired=NULL;
+    P_STREAMHEAD *strm=NULL;
+    P_STREAMHEAD **pstrm=NULL;
+    uint64_t count;
+    int32 now=0;
+    int32 wait=-1;
+    int nready=0;
+    int i=0;
+
+    /*expired timers out; the nearest of the rest is how long to wait*/
+    pthread_mutex_lock(&sched->s_lock);
+    now = my_clockticks();
+    for(pstrm = &sched->s_timerq; (strm = *pstrm) != NULL; )
+    {
+        if(now - strm->scheddue >= 0)
+        {
+            *pstrm = strm->schedtlink;
+            strm->schedtimed = P_FALSE;
+            strm->schedtlink = expired;
+            expired = strm;
+        }
+        else
+        {
+            if(wait < 0 || strm->scheddue - now < wait)
+            {
+                wait = strm->scheddue - now;
+            }
+            pstrm = &strm->schedtlink;
+        }
+    }
+    if(expired || pstreams_schedpending(sched))
+    {
+        wait = 0; /*just look - there is work already*/
+    }
+    sched->s_pollbusy = P_TRUE;
+    sched->s_inpoll = P_TRUE;
+    sched->s_timed = (wait >= 0);
+    sched->s_polldue = now + wait;
+    pthread_mutex_unlock(&sched->s_lock);
+
+    while((strm = expired) != NULL)
+    {
+        expired = strm->schedtlink;
+        strm->schedtlink = NULL;
+        if(strm->schedstate != SCHEDGONE)
+        {
+            pstreams_schedready(strm);
+        }
+    }
+
+    nready = sched->s_stop ? 0 : epoll_wait(sched->s_epfd, evs, MAXPOLLFDS, wait);
+
+    pthread_mutex_lock(&sched->s_lock);
+    sched->s_inpoll = P_FALSE;
+    pthread_mutex_unlock(&sched->s_lock);
+
+    for(i=0; i<nready; i++)
+    {
+        if((strm = (P_STREAMHEAD *)evs[i].data.ptr) == NULL)
+        {
+            (void) read(sched->s_wakefd, &count, sizeof(count));
+            continue;
+        }
+        if(strm->schedstate != SCHEDGONE)
+        {
+            strm->schedfdready = 1; /*its run looks at its fds*/
+            pstreams_schedready(strm);
+        }
+    }
+
+    /*done with the streams found - a pstreams_schedremove may go on*/
+    pthread_mutex_lock(&sched->s_lock);
+    sched->s_pollbusy = P_FALSE;
+    if(sched->s_nremoving)
+    {
+        pthread_cond_broadcast(&sched->s_cond);
+    }
+    pthread_mutex_unlock(&sched->s_lock);
+}
+
+/******************************************************************************
+Name: pstreams_schedpending
+Purpose: is a stream waiting on any run list of sched
+Parameters:
+Caveats: a look without the locks
+******************************************************************************/
+static P_BOOL
+pstreams_schedpending(P_SCHED *sched)
+{
+    int i=0;
+
+    for(i=0; i<sched->s_nworkers; i++)
+    {
+        if(sched->s_workers[i].k_runq.l_head)
+        {
+            return P_TRUE;
+        }
+    }
+
+    return P_FALSE;
+}
+
+/******************************************************************************
+Name: pstreams_schedworker
+Purpose: a scheduler thread - runs ready streams, its own first, then others';
+    with none, takes the poll, or waits for a stream to be made ready
+Parameters: the P_SCHEDWORKER
+Caveats:
+******************************************************************************/
+static void *
+pstreams_schedworker(void *arg)
+{
+    P_SCHEDWORKER *k = (P_SCHEDWORKER *)arg;
+    P_SCHED *sched = k->k_sched;
+    P_STREAMHEAD *strm=NULL;
+
+    pstreams_schedself = k;
+
+    while(!sched->s_stop)
+    {
+        if(k->k_flush)
+        {
+            pstreams_schedflush(k);
+        }
+
+        if((strm = pstreams_schedtake(sched, k->k_idx)) != NULL)
+        {
+            pstreams_schedrunone(k, strm);
+            continue;
+        }
+
+        /*idle - from here a flush asked for wakes it*/
+        k->k_idle = 1;
+        P_MEMBARRIER();
+        if(k->k_flush)
+        {
+            k->k_idle = 0;
+            continue;
+        }
+
+        if(P_ATOMIC_CAS(&sched->s_polling, 0, 1))
+        {
+            pstreams_schedpoll(sched);
+            sched->s_polling = 0;
+            k->k_idle = 0;
+
+            /*another idle thread polls while this one runs what was found*/
+            P_MEMBARRIER();
+            if(sched->s_nsleeping)
+            {
+                pstreams_schedwake(sched);
+            }
+            continue;
+        }
+
+        /*
+         * idle, and another thread polls - wait to be woken. s_nsleeping is
+         * counted before looking again; pstreams_schedready puts first,
+         * then looks at s_nsleeping
+         */
+        pthread_mutex_lock(&sched->s_lock);
+        P_ATOMIC_ADD(&sched->s_nsleeping, 1);
+        P_MEMBARRIER();
+        if(!sched->s_stop && sched->s_polling && !pstreams_schedpending(sched) && !k->k_flush)
+        {
+            pthread_cond_wait(&sched->s_cond, &sched->s_lock);
+        }
+        P_ATOMIC_ADD(&sched->s_nsleeping, -1);
+        pthread_mutex_unlock(&sched->s_lock);
+        k->k_idle = 0;
+    }
+
+    /*its magazines go with the thread*/
+    pstreams_schedflush(k);
+
+    return NULL;
+}
+
+#endif /*PSTREAMS_SCHED*/
+
+/******************************************************************************
+Name: pstreams_callsrvp
+Purpose: public function to be called periodically to run service procedures.
+    This will not needed in a multi-threaded environment.
+    Only queues that are enabled get their srvp run - by pstreams_putq, by a
+    device fd found readable, by an expired pstreams_qtimeout, or by
+    pstreams_qenable. Queues enabled by a srvp run in the same call, upto
+    MAXSRVPRUNS service procedures in all.
+Parameters:
+Caveats: returns the count of service procedures run - 0 for an idle stream;
+    -1 if one failed. Looks for device input with pstreams_pollwait(0), unless
+    the application has called pstreams_pollwait() on it since the last pass.
+******************************************************************************/
+int
+pstreams_callsrvp(P_STREAMHEAD *strmhead)
+{
+    P_QUEUE *q;
+    P_QUEUE **pq;
+    int32 now;
+    int nrun=0;
+
+/*DEBUG mode*/
+//pstreams_checkmem(strmhead);
+
+    /*look for idle slabs once a second*/
+    if(strmhead->backing && my_time() != strmhead->trimtime)
+    {
+        pstreams_trimpools(strmhead);
+    }
+
+    /*mark devices with input - unless the application just waited for it*/
+    if(!strmhead->polled)
+    {
+        pstreams_pollwait(strmhead, 0);
+    }
+    strmhead->polled = P_FALSE;
+
+#ifdef PSTREAMS_INGRESS
+    /*messages from other threads go down first*/
+    if(strmhead->ingcount || (strmhead->appwrq.q_flag & QFDREADY))
+    {
+        pstreams_ingressdrain(strmhead, P_FALSE);
+    }
+#endif
+
+#ifdef PSTREAMS_PIPELINE
+    /*messages and enables from the workers*/
+    if(strmhead->nworkers)
+    {
+        pstreams_pipedrain(strmhead);
+    }
+#endif
+
+    /*expired timers enable their queues*/
+    if(strmhead->timerq)
+    {
+        now = my_clockticks();
+        for(pq = &strmhead->timerq; (q = *pq) != NULL; )
+        {
+            if(now - q->q_timeout >= 0)
+            {
+                *pq = q->q_tlink;
+                q->q_tlink = NULL;
+                q->q_flag &= ~QTIMEOUT;
+                pstreams_qenable(q);
+            }
+            else
+            {
+                pq = &q->q_tlink;
+            }
+        }
+    }
+
+    /*run the enabled queues in order*/
+    while((q = strmhead->runhead) != NULL && nrun < MAXSRVPRUNS)
+    {
+        strmhead->runhead = q->q_link;
+        if(!strmhead->runhead)
+        {
+            strmhead->runtail = NULL;
+        }
+        q->q_link = NULL;
+        q->q_flag &= ~QENAB; /*the srvp may enable q again*/
+
+#ifdef PSTREAMS_LT
+        pstreams_log(q, PSTREAMS_LTDEBUG, "pstreams_callsrvp");
+#endif /*PSTREAMS_LT*/
+
+        nrun++;
+
+        if(q->q_qinfo.qi_srvp)
+        {
+            if(q->q_qinfo.qi_srvp(q) != P_STREAMS_SUCCESS)
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            /*default*/
+            if(pstreams_srvp(q) != P_STREAMS_SUCCESS)
+            {
+                return -1;
+            }
+        }
+    }
+
+/*DEBUG mode*/
+//pstreams_checkmem(strmhead);
+
+    return nrun;
+}
+
+/******************************************************************************
+Name: pstreams_srvp
+Purpose: default service procedure. 
+Parameters:
+Caveats:
+******************************************************************************/
+int
+pstreams_srvp(P_QUEUE *q)
+{
+    P_MSGB *msg=NULL;
+
+    while((msg = pstreams_getq(q)) != NULL)
+    {
+        /*flow control is per band - a high priority msg is not held up by data*/
+        if(!pstreams_bcanput(q->q_next, msg->b_band))
+        {
+            pstreams_putbq(q, msg);
+            break;
+        }
+
+        /*module specific processing go here*/
+
+        /*send this msg onward*/
+        if(pstreams_putnext(q, msg) != P_STREAMS_SUCCESS)
+        {
+            return P_STREAMS_FAILURE;
+        }
+    }
+
+    return P_STREAMS_SUCCESS;
+}
+
+/******************************************************************************
+Name: pstreams_qsize
+Purpose: counts number of messages in queue, but not the number of bytes in those
+         messages
+Parameters: 
+Caveats: kept up to date by putq/putbq/getq - see q_nmsg
+******************************************************************************/
+int pstreams_qsize(P_QUEUE *q)
+{
+    return q->q_nmsg;
+}
+
+/******************************************************************************
+Name: pstreams_getq
+Purpose: get oldest message of the highest priority band of a queue that has
+    any
+Parameters:
+Caveats: the band is found from q_bandmap in constant time
+******************************************************************************/
+P_MSGB *
+pstreams_getq(P_QUEUE *q)
+{
+    /*highest bit set in a nibble*/
+    static const unsigned char hibit[16] = {0,0,1,1,2,2,2,2,3,3,3,3,3,3,3,3};
+    P_MSGB *msg = NULL;
+
+    if(q->q_bandmap)
+    {
+        int b = (q->q_bandmap & 0xf0) ? 4 + hibit[q->q_bandmap >> 4] : hibit[q->q_bandmap];
+        P_QBAND *qb = &q->q_bandinfo[b];
+
+        msg = (P_MSGB *)lop_dequeue(&qb->qb_msglist);
+        if(!qb->qb_msglist)
+        {
+            q->q_bandmap &= ~(1 << b);
+        }
+
+        q->q_flag &= ~QWANTR;
+        q->q_nmsg--;
+        q->q_nblk -= pstreams_countmsgcont(msg);
+        qb->qb_count -= pstreams_msgsize(msg);
+
+        if(qb->qb_count < qb->qb_hiwat)
+        {
+            qb->qb_flag &= ~QFULL;
+        }
+
+        /*back-enable, as for band 0 below*/
+        if((qb->qb_flag & QWANTW) && (qb->qb_count < qb->qb_lowat || qb->qb_count == 0))
+        {
+            qb->qb_flag &= ~QWANTW;
+            pstreams_backenable(q);
+        }
+    }
+    else if ( (msg = (P_MSGB *)lop_dequeue(&q->q_msglist)) == NULL )
+    {
+        q->q_flag |= QWANTR; /*want to read from this q - next putq enables it*/
+    }
+    else
+    {
+        q->q_flag &= ~QWANTR;
+        q->q_nmsg--;
+        q->q_nblk -= pstreams_countmsgcont(msg);
+        q->q_count -= pstreams_msgsize(msg);
 
         if(q->q_count < q->q_hiwat)
         {
-            /*allow previous queue to give us data*/
-            q->q_flag &= ~QFULL; /*clear QFULL bit*/
+            /*allow previous queue to give us data*/
+            q->q_flag &= ~QFULL; /*clear QFULL bit*/
+        }
+
+        /*
+         * back-enable: the queue refused by canput() is run again once we
+         * drain below the low water mark - or empty, should q_lowat be 0
+         */
+        if((q->q_flag & QWANTW) && (q->q_count < q->q_lowat || q->q_count == 0))
+        {
+            q->q_flag &= ~QWANTW;
+            pstreams_backenable(q);
+        }
+    }
+
+    if((q->q_flag & QNOTIFY) && msg && q->q_nmsg == 0)
+    {
+        pstreams_notify(q, P_FALSE); /*emptied*/
+    }
+
+#ifdef PSTREAMS_LT
+    pstreams_log(q, PSTREAMS_LTINFO, "gettq: removed %d bytes from q",
+                pstreams_msgsize(msg));
+#endif /*PSTREAMS_LT*/
+
+    return msg;
+}
+
+/******************************************************************************
+Name: pstreams_putnext
+Purpose: send message downstream
+Parameters:
+Caveats:
+******************************************************************************/
+int
+pstreams_putnext(P_QUEUE *wrq, P_MSGB *msg)
+{
+#ifdef PSTREAMS_LT
+    pstreams_log(wrq, PSTREAMS_LTINFO, "pstreams_putnext: transferred %d bytes to %s.",
+            pstreams_msgsize(msg), wrq->q_next->q_qinfo.qi_minfo->mi_idname);
+#endif /*PSTREAMS_LT*/
+
+#ifdef PSTREAMS_PIPELINE
+    if(wrq->q_next->q_worker != pstreams_self)
+    {
+        /*q_next runs on another thread - see pstreams_pin*/
+        return pstreams_ringput(wrq, msg);
+    }
+#endif
+
+    return wrq->q_next->q_qinfo.qi_putp(wrq->q_next, msg);
+}
+
+/******************************************************************************
+Name: pstreams_qenable
+Purpose: schedule q's service procedure - q goes on the end of its stream's
+    run queue, for the next pstreams_callsrvp.
+Parameters:
+Caveats: a queue already enabled(QENAB) keeps its place. QNOENB does not
+    apply - it only stops pstreams_putq from enabling. A queue run by another
+    thread(pstreams_pin) is enabled by that thread, once woken.
+******************************************************************************/
+void
+pstreams_qenable(P_QUEUE *q)
+{
+    P_STREAMHEAD *strmhead = PSTRMHEAD(q);
+
+#ifdef PSTREAMS_PIPELINE
+    if(q->q_worker != pstreams_self)
+    {
+        q->q_xenab = 1;
+        pstreams_wake(q);
+        return;
+    }
+    if(q->q_worker)
+    {
+        q->q_flag |= QENAB; /*its worker looks for QENAB itself*/
+        return;
+    }
+#endif
+
+    if(q->q_flag & QENAB)
+    {
+        return;
+    }
+
+    q->q_flag |= QENAB;
+    q->q_link = NULL;
+
+    if(strmhead->runtail)
+    {
+        strmhead->runtail->q_link = q;
+    }
+    else
+    {
+        strmhead->runhead = q;
+    }
+    strmhead->runtail = q;
+}
+
+/******************************************************************************
+Name: pstreams_qtimeout
+Purpose: enable q after ms milliseconds - for service procedures that have
+    timers to run, rather than messages.
+Parameters:
+Caveats: q has at most one timer pending; the earlier of two stands. From a
+    thread other than q's the timer is handed over, as for pstreams_qenable -
+    q's thread sets it, upto a millisecond late.
+******************************************************************************/
+void
+pstreams_qtimeout(P_QUEUE *q, int32 ms)
+{
+    P_STREAMHEAD *strmhead = PSTRMHEAD(q);
+    int32 when = my_clockticks() + ms;
+
+#ifdef PSTREAMS_PIPELINE
+    if(q->q_worker != pstreams_self)
+    {
+        long due = (long)(when | 1); /*never 0*/
+        long old;
+
+        for(;;)
+        {
+            old = q->q_xtimeout;
+            if(old && (int32)(due - old) >= 0)
+            {
+                return; /*an earlier one is handed over already*/
+            }
+            if(P_ATOMIC_CAS(&q->q_xtimeout, old, due))
+            {
+                break;
+            }
+        }
+        pstreams_wake(q);
+        return;
+    }
+#endif
+
+    if(q->q_flag & QTIMEOUT)
+    {
+        if(when - q->q_timeout < 0) /*difference - my_clockticks() rolls over*/
+        {
+            q->q_timeout = when;
+        }
+        return;
+    }
+
+    q->q_flag |= QTIMEOUT;
+    q->q_timeout = when;
+#ifdef PSTREAMS_PIPELINE
+    if(q->q_worker)
+    {
+        return; /*its worker keeps the timer - owner's thread only*/
+    }
+#endif
+    q->q_tlink = strmhead->timerq;
+    strmhead->timerq = q;
+}
+
+/******************************************************************************
+Name: pstreams_backq
+Purpose: find the queue whose q_next is q - the one feeding q, and so the one
+    that set QWANTW on q in pstreams_canput()
+Parameters:
+Caveats: NULL for the top queue of either side - appwrq's writer is the
+    application, which learns of the room by retrying pstreams_putmsg()
+******************************************************************************/
+static P_QUEUE *
+pstreams_backq(P_QUEUE *q)
+{
+    P_STREAMHEAD *strmhead = PSTRMHEAD(q);
+    P_QUEUE *bq = (q->q_flag & QREADR) ? &strmhead->devrdq : &strmhead->appwrq;
+
+    for(; bq; bq = bq->q_next)
+    {
+        if(bq->q_next == q)
+        {
+            return bq;
+        }
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Name: pstreams_backenable
+Purpose: run the service procedure of the queue feeding q - q has room again
+    for what canput() refused
+Parameters:
+Caveats:
+******************************************************************************/
+static void
+pstreams_backenable(P_QUEUE *q)
+{
+    P_QUEUE *bq = pstreams_backq(q);
+
+    if(bq)
+    {
+        pstreams_qenable(bq);
+    }
+}
+
+/******************************************************************************
+Name: pstreams_qcancel
+Purpose: take q off its stream's run queue and timer list - before q goes
+Parameters:
+Caveats:
+******************************************************************************/
+static void
+pstreams_qcancel(P_QUEUE *q)
+{
+    P_STREAMHEAD *strmhead = PSTRMHEAD(q);
+    P_QUEUE **pq;
+    P_QUEUE *prev=NULL;
+
+    if(q->q_flag & QENAB)
+    {
+        for(pq = &strmhead->runhead; *pq; prev = *pq, pq = &(*pq)->q_link)
+        {
+            if(*pq == q)
+            {
+                *pq = q->q_link;
+                if(strmhead->runtail == q)
+                {
+                    strmhead->runtail = prev;
+                }
+                break;
+            }
+        }
+    }
+
+    if(q->q_flag & QTIMEOUT)
+    {
+        for(pq = &strmhead->timerq; *pq; pq = &(*pq)->q_tlink)
+        {
+            if(*pq == q)
+            {
+                *pq = q->q_tlink;
+                break;
+            }
+        }
+    }
+
+    q->q_flag &= ~(QENAB|QTIMEOUT);
+    q->q_link = q->q_tlink = NULL;
+}
+
+/******************************************************************************
+Name: pstreams_waittime
+Purpose: milliseconds the stream may be left alone - till its earliest
+    pstreams_qtimeout. 0 if it has queues enabled; -1 if it has nothing
+    pending at all. Device input is not counted - see pstreams_pollwait.
+Parameters:
+Caveats: sample usage:
+        pstreams_pollwait(strm, pstreams_waittime(strm));
+        pstreams_callsrvp(strm);
+******************************************************************************/
+int32
+pstreams_waittime(P_STREAMHEAD *strmhead)
+{
+    P_QUEUE *q;
+    int32 now;
+    int32 wait=-1;
+
+    if(strmhead->runhead)
+    {
+        return 0;
+    }
+#ifdef PSTREAMS_INGRESS
+    if(strmhead->ingcount > 0 && !(strmhead->appwrq.q_flag & QFULL))
+    {
+        return 0; /*other threads' messages can go down*/
+    }
+#endif
+#ifdef PSTREAMS_PIPELINE
+    if(strmhead->nworkers)
+    {
+        for(q = &strmhead->appwrq; q; q = q->q_next)
+        {
+            if(!q->q_worker && pstreams_pipeready(q))
+            {
+                return 0;
+            }
+        }
+        for(q = &strmhead->devrdq; q; q = q->q_next)
+        {
+            if(!q->q_worker && pstreams_pipeready(q))
+            {
+                return 0;
+            }
+        }
+    }
+#endif
+
+    now = my_clockticks();
+    for(q = strmhead->timerq; q; q = q->q_tlink)
+    {
+        int32 left = MAX(q->q_timeout - now, 0);
+
+        if(wait < 0 || left < wait)
+        {
+            wait = left;
+        }
+    }
+
+    return wait;
+}
+
+#ifdef PSTREAMS_PIPELINE
+/******************************************************************************
+Name: pstreams_pin
+Purpose: run a pushed module's queue pair on a worker thread of its own.
+    pstreams_putnext to the module, and from it, then goes through a ring
+    between the two threads(P_SPSC) - the stream's thread still runs the
+    application and device queues, and modules not pinned.
+Parameters: mi_idnum of the module, as returned by pstreams_pop
+Caveats: from the stream's thread, before traffic flows - a module stays
+    pinned till popped or the stream closed. Push and pop change the queue
+    chain the workers walk: pop from the top only. P_BADPARAM for a module not
+    on the stream, or already pinned, or with PSTREAMS_MAXWORKERS in use.
+******************************************************************************/
+int
+pstreams_pin(P_STREAMHEAD *strmhead, ushort mi_idnum)
+{
+    P_QUEUE *wrq=NULL;
+    P_QUEUE *q=NULL;
+    P_WORKER *w=NULL;
+    pthread_condattr_t attr;
+    ushort flags=0;
+    int i=0;
+
+    for(wrq = strmhead->appwrq.q_next; wrq != &strmhead->devwrq; wrq = wrq->q_next)
+    {
+        if(wrq->q_qinfo.qi_minfo->mi_idnum == mi_idnum)
+        {
+            break;
+        }
+    }
+
+    for(i=0; i<PSTREAMS_MAXWORKERS; i++)
+    {
+        if(!strmhead->workers[i].w_q[0])
+        {
+            w = &strmhead->workers[i];
+            break;
         }
+    }
 
-        if(q->q_count < q->q_lowat)
+    if(wrq == &strmhead->devwrq || wrq->q_worker || !w)
+    {
+        strmhead->perrno = P_BADPARAM;
+        return P_STREAMS_FAILURE;
+    }
+
+    if(strmhead->ingfd == INVALID_SOCKET)
+    {
+        strmhead->perrno = P_GENERALERROR; /*no way to wake the stream's thread*/
+        return P_STREAMS_FAILURE;
+    }
+
+    w->w_q[0] = wrq;
+    w->w_q[1] = RD(wrq);
+    w->w_sleeping = 0;
+    w->w_stop = 0;
+
+    pthread_mutex_init(&w->w_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); /*as my_clockticks*/
+    pthread_cond_init(&w->w_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    /*off the stream's run queue and timer list - the worker keeps its own*/
+    for(i=0; i<2; i++)
+    {
+        q = w->w_q[i];
+        flags = q->q_flag & (QENAB|QTIMEOUT);
+        pstreams_qcancel(q);
+        q->q_worker = w;
+        q->q_flag |= flags;
+    }
+    strmhead->nworkers++;
+    P_MEMBARRIER();
+
+    if(pthread_create(&w->w_thread, NULL, pstreams_worker, w) != 0)
+    {
+        for(i=0; i<2; i++)
         {
-            /*need to back-enable*/
+            pstreams_handback(w->w_q[i]);
         }
+        pthread_cond_destroy(&w->w_cond);
+        pthread_mutex_destroy(&w->w_lock);
+        w->w_q[0] = w->w_q[1] = NULL;
+        strmhead->nworkers--;
+
+        strmhead->perrno = P_GENERALERROR;
+        return P_STREAMS_FAILURE;
+    }
+
+    return P_STREAMS_SUCCESS;
+}
+
+/******************************************************************************
+Name: pstreams_unpin
+Purpose: stop the worker w, and give its queues back to the stream's thread
+Parameters:
+Caveats: stream's thread only. Messages the worker left in rings go on in
+    pstreams_pipedrain.
+******************************************************************************/
+static void
+pstreams_unpin(P_STREAMHEAD *strmhead, P_WORKER *w)
+{
+    int i=0;
+
+    w->w_stop = 1;
+    pstreams_wake(w->w_q[0]);
+    pthread_join(w->w_thread, NULL);
+
+    pthread_cond_destroy(&w->w_cond);
+    pthread_mutex_destroy(&w->w_lock);
+
+    for(i=0; i<2; i++)
+    {
+        pstreams_handback(w->w_q[i]);
+    }
+    w->w_q[0] = w->w_q[1] = NULL;
+    strmhead->nworkers--;
+
+    pstreams_pipedrain(strmhead);
+}
 
+/******************************************************************************
+Name: pstreams_handback
+Purpose: q is run by the stream's thread again - its pending enable and
+    timer go on the stream's run queue and timer list
+Parameters:
+Caveats: the worker that ran q has stopped
+******************************************************************************/
+static void
+pstreams_handback(P_QUEUE *q)
+{
+    ushort flags = q->q_flag & (QENAB|QTIMEOUT);
+
+    q->q_flag &= ~(QENAB|QTIMEOUT);
+    q->q_worker = NULL;
+
+    if(q->q_xenab)
+    {
+        q->q_xenab = 0;
+        flags |= QENAB;
+    }
+
+    if(flags & QENAB)
+    {
+        pstreams_qenable(q);
+    }
+    if(flags & QTIMEOUT)
+    {
+        pstreams_qtimeout(q, MAX(q->q_timeout - my_clockticks(), 0));
+    }
+    pstreams_xtimeout(q);
+}
+
+/******************************************************************************
+Name: pstreams_xtimeout
+Purpose: set the timer a pstreams_qtimeout from another thread handed over
+Parameters:
+Caveats: the thread running q
+******************************************************************************/
+static void
+pstreams_xtimeout(P_QUEUE *q)
+{
+    long due;
+
+    while((due = q->q_xtimeout) != 0)
+    {
+        if(P_ATOMIC_CAS(&q->q_xtimeout, due, 0))
+        {
+            pstreams_qtimeout(q, MAX((int32)due - my_clockticks(), 0));
+            break;
+        }
     }
+}
+
+/******************************************************************************
+Name: pstreams_worker
+Purpose: thread of a pinned module - pstreams_callsrvp for its queue pair.
+    Takes what came through the rings, runs the srvp of a queue enabled or
+    whose timer expired, and sleeps when there is nothing to do.
+Parameters: the P_WORKER
+Caveats: a failing srvp is logged; the worker goes on.
+******************************************************************************/
+static void *
+pstreams_worker(void *arg)
+{
+    P_WORKER *w = (P_WORKER *)arg;
+    P_QUEUE *q=NULL;
+    struct timespec ts;
+    int32 now=0;
+    int32 wait=-1;
+    int nrun=0;
+    int i=0;
+
+    pstreams_self = w;
+
+    while(!w->w_stop)
+    {
+        nrun = 0;
+        wait = -1;
+        now = my_clockticks();
 
+        for(i=0; i<2; i++)
+        {
+            q = w->w_q[i];
+
+            if(q->q_xenab && P_ATOMIC_CAS(&q->q_xenab, 1, 0))
+            {
+                q->q_flag |= QENAB;
+            }
+            if(q->q_xtimeout)
+            {
+                pstreams_xtimeout(q);
+            }
+
+            if(q->q_flag & QTIMEOUT)
+            {
+                if(now - q->q_timeout >= 0)
+                {
+                    q->q_flag &= ~QTIMEOUT;
+                    q->q_flag |= QENAB;
+                }
+                else if(wait < 0 || q->q_timeout - now < wait)
+                {
+                    wait = q->q_timeout - now;
+                }
+            }
+
+            if(q->q_spill)
+            {
+                nrun += pstreams_spillflush(q);
+            }
+            nrun += pstreams_ringdrain(q);
+
+            if(q->q_flag & QENAB)
+            {
+                q->q_flag &= ~QENAB; /*the srvp may enable q again*/
+                nrun++;
+
+                if((q->q_qinfo.qi_srvp ? q->q_qinfo.qi_srvp(q) : pstreams_srvp(q)) 
+                    != P_STREAMS_SUCCESS)
+                {
 #ifdef PSTREAMS_LT
-    pstreams_log(q, PSTREAMS_LTINFO, "gettq: removed %d bytes from q",
-                pstreams_msgsize(msg));
+                    pstreams_log(q, PSTREAMS_LTERROR, "pstreams_worker: srvp failed. error %d",
+                        PSTRMHEAD(q)->perrno);
 #endif /*PSTREAMS_LT*/
+                }
+            }
+        }
 
-    return msg;
+        if(nrun)
+        {
+            continue;
+        }
+
+        /*
+         * idle - sleep till woken, or the nearest timer. w_sleeping is set
+         * before looking again; a waker puts first, then looks at w_sleeping
+         */
+        pthread_mutex_lock(&w->w_lock);
+        w->w_sleeping = 1;
+        P_MEMBARRIER();
+        if(!w->w_stop && !pstreams_pipeready(w->w_q[0]) && !pstreams_pipeready(w->w_q[1]))
+        {
+            if(wait < 0)
+            {
+                pthread_cond_wait(&w->w_cond, &w->w_lock);
+            }
+            else
+            {
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                ts.tv_sec += wait/1000;
+                ts.tv_nsec += (wait%1000)*1000000L;
+                if(ts.tv_nsec >= 1000000000L)
+                {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&w->w_cond, &w->w_lock, &ts);
+            }
+        }
+        w->w_sleeping = 0;
+        pthread_mutex_unlock(&w->w_lock);
+    }
+
+    /*objects cached by this thread go back to the stream's pools*/
+    pstreams_cacheflush(PSTRMHEAD(w->w_q[0]));
+
+    return NULL;
+}
+
+/******************************************************************************
+Name: pstreams_wake
+Purpose: have the thread running q look at it - after a message was put in
+    its ring, or it was enabled from another thread
+Parameters:
+Caveats: the stream's thread is woken through ingfd, once till it runs
+    pstreams_pipedrain(wakepending)
+******************************************************************************/
+static void
+pstreams_wake(P_QUEUE *q)
+{
+    P_WORKER *w = q->q_worker;
+    P_STREAMHEAD *strmhead = PSTRMHEAD(q);
+    uint64_t one = 1;
+
+    P_MEMBARRIER(); /*what was put is seen before w_sleeping is looked at*/
+
+    if(w)
+    {
+        if(w->w_sleeping)
+        {
+            pthread_mutex_lock(&w->w_lock);
+            pthread_cond_signal(&w->w_cond);
+            pthread_mutex_unlock(&w->w_lock);
+        }
+    }
+    else if(P_ATOMIC_CAS(&strmhead->wakepending, 0, 1))
+    {
+        (void) write(strmhead->ingfd, &one, sizeof(one));
+    }
+}
+
+/******************************************************************************
+Name: pstreams_ringpush
+Purpose: put msg in the ring of q - from the thread running the queue before q
+Parameters:
+Caveats: P_FALSE if the ring is full. The caller wakes q's thread.
+******************************************************************************/
+static P_BOOL
+pstreams_ringpush(P_QUEUE *q, P_MSGB *msg)
+{
+    P_SPSC *r = &q->q_ring;
+
+    if(r->r_tail - r->r_head >= PSTREAMS_SPSCSIZE)
+    {
+        return P_FALSE;
+    }
+
+    r->r_slot[r->r_tail & (PSTREAMS_SPSCSIZE-1)] = msg;
+    P_MEMBARRIER(); /*the slot is filled before the consumer sees it*/
+    r->r_tail++;
+
+    return P_TRUE;
+}
+
+/******************************************************************************
+Name: pstreams_ringput
+Purpose: pstreams_putnext to a queue run by another thread - msg goes in the
+    ring of wrq->q_next. If the ring is full msg waits on wrq's spill list,
+    behind any there already, till the ring has room.
+Parameters:
+Caveats: as putnext to a module that queues, a caller that puts without
+    pstreams_canput is not refused - the spill list grows instead.
+******************************************************************************/
+static int
+pstreams_ringput(P_QUEUE *wrq, P_MSGB *msg)
+{
+    P_QUEUE *q = wrq->q_next;
+
+    if(!wrq->q_spill && pstreams_ringpush(q, msg))
+    {
+        pstreams_wake(q);
+        return P_STREAMS_SUCCESS;
+    }
+
+    lop_queue(&wrq->q_spill, msg);
+
+    /*back-enable wrq once q takes from its ring - or now, if it just did*/
+    q->q_ring.r_wantw = 1;
+    P_MEMBARRIER();
+    pstreams_spillflush(wrq);
+
+    return P_STREAMS_SUCCESS;
+}
+
+/******************************************************************************
+Name: pstreams_spillflush
+Purpose: move messages waiting on q's spill list to the ring of q->q_next,
+    in order, while it has room
+Parameters:
+Caveats: thread running q only. returns the count moved
+******************************************************************************/
+static int
+pstreams_spillflush(P_QUEUE *q)
+{
+    P_MSGB *msg=NULL;
+    int n=0;
+
+    while(q->q_spill)
+    {
+        msg = (P_MSGB *)lop_dequeue(&q->q_spill);
+        if(!pstreams_ringpush(q->q_next, msg))
+        {
+            lop_push(&q->q_spill, msg); /*back at the head*/
+            break;
+        }
+        n++;
+    }
+
+    if(n)
+    {
+        pstreams_wake(q->q_next);
+    }
+
+    return n;
+}
+
+/******************************************************************************
+Name: pstreams_ringroom
+Purpose: pstreams_canput for a queue run by another thread - whether its
+    ring has room
+Parameters:
+Caveats: on P_FALSE the ring is marked r_wantw, and the caller's queue is
+    back-enabled once q takes from it.
+******************************************************************************/
+static int
+pstreams_ringroom(P_QUEUE *q)
+{
+    P_SPSC *r = &q->q_ring;
+
+    if(r->r_tail - r->r_head < PSTREAMS_SPSCSIZE)
+    {
+        return P_TRUE;
+    }
+
+    r->r_wantw = 1;
+    P_MEMBARRIER(); /*look again - q may have taken before r_wantw was set*/
+
+    return (r->r_tail - r->r_head < PSTREAMS_SPSCSIZE) ? P_TRUE : P_FALSE;
+}
+
+/******************************************************************************
+Name: pstreams_ringdrain
+Purpose: take the messages in q's ring, in order, and put them to q - on the
+    thread running q. Back-enables the queue before q if it found the ring
+    full.
+Parameters:
+Caveats: stops while q is QFULL - the ring then fills, and the thread before
+    is held back by pstreams_canput. returns the count taken
+******************************************************************************/
+static int
+pstreams_ringdrain(P_QUEUE *q)
+{
+    P_SPSC *r = &q->q_ring;
+    P_MSGB *msg=NULL;
+    int n=0;
+
+    for(n = 0; n < PSTREAMS_SPSCSIZE && !(q->q_flag & QFULL) && r->r_head != r->r_tail; n++)
+    {
+        P_MEMBARRIER(); /*the slot is read after r_tail is seen*/
+        msg = r->r_slot[r->r_head & (PSTREAMS_SPSCSIZE-1)];
+        P_MEMBARRIER();
+        r->r_head++;
+
+        (void) q->q_qinfo.qi_putp(q, msg);
+    }
+
+    if(n && r->r_wantw && P_ATOMIC_CAS(&r->r_wantw, 1, 0))
+    {
+        pstreams_backenable(q);
+    }
+
+    return n;
+}
+
+/******************************************************************************
+Name: pstreams_pipeready
+Purpose: has q work that came from another thread - messages in its ring it
+    can take, an enable, or spilled messages the next ring has room for
+Parameters:
+Caveats: for the thread running q
+******************************************************************************/
+static P_BOOL
+pstreams_pipeready(P_QUEUE *q)
+{
+    if(q->q_xenab || q->q_xtimeout)
+    {
+        return P_TRUE;
+    }
+    if(q->q_ring.r_head != q->q_ring.r_tail && !(q->q_flag & QFULL))
+    {
+        return P_TRUE;
+    }
+    if(q->q_spill && q->q_next->q_ring.r_tail - q->q_next->q_ring.r_head < PSTREAMS_SPSCSIZE)
+    {
+        return P_TRUE;
+    }
+
+    return P_FALSE;
+}
+
+/******************************************************************************
+Name: pstreams_pipedrain
+Purpose: the stream's thread's part of pstreams_worker - for the queues it
+    runs, take the enables, spilled messages and rings the workers filled
+Parameters:
+Caveats: from pstreams_callsrvp
+******************************************************************************/
+static void
+pstreams_pipedrain(P_STREAMHEAD *strmhead)
+{
+    P_QUEUE *q=NULL;
+    int i=0;
+
+    strmhead->wakepending = 0;
+    P_MEMBARRIER(); /*a wake from here on writes ingfd again*/
+
+    for(i=0; i<2; i++)
+    {
+        for(q = i ? &strmhead->devrdq : &strmhead->appwrq; q; q = q->q_next)
+        {
+            if(q->q_worker)
+            {
+                continue;
+            }
+
+            if(q->q_xenab && P_ATOMIC_CAS(&q->q_xenab, 1, 0))
+            {
+                pstreams_qenable(q);
+            }
+            if(q->q_xtimeout)
+            {
+                pstreams_xtimeout(q);
+            }
+            if(q->q_spill)
+            {
+                pstreams_spillflush(q);
+            }
+            pstreams_ringdrain(q);
+        }
+    }
 }
 
 /******************************************************************************
-Name: pstreams_putnext
-Purpose: send message downstream
+Name: pstreams_ringfree
+Purpose: free the messages left in q's ring and on its spill list - before
+    q goes
 Parameters:
-Caveats:
+Caveats: no thread puts to q any more
 ******************************************************************************/
-int
-pstreams_putnext(P_QUEUE *wrq, P_MSGB *msg)
+static void
+pstreams_ringfree(P_STREAMHEAD *strmhead, P_QUEUE *q)
 {
-#ifdef PSTREAMS_LT
-    pstreams_log(wrq, PSTREAMS_LTINFO, "pstreams_putnext: transferred %d bytes to %s.",
-            pstreams_msgsize(msg), wrq->q_next->q_qinfo.qi_minfo->mi_idname);
-#endif /*PSTREAMS_LT*/
+    P_SPSC *r = &q->q_ring;
 
-    return wrq->q_next->q_qinfo.qi_putp(wrq->q_next, msg);
+    while(r->r_head != r->r_tail)
+    {
+        pstreams_freemsg(strmhead, r->r_slot[r->r_head & (PSTREAMS_SPSCSIZE-1)]);
+        r->r_head++;
+    }
+    r->r_wantw = 0;
+
+    while(q->q_spill)
+    {
+        pstreams_freemsg(strmhead, (P_MSGB *)lop_dequeue(&q->q_spill));
+    }
 }
+#endif /*PSTREAMS_PIPELINE*/
 
 /******************************************************************************
 Name: pstreams_putq
-Purpose: inserts message in queue's message list
+Purpose: inserts message at the end of its band in queue's message list
 Parameters:
-Caveats:
+Caveats: bands are kept apart, so a high priority msg does not wait behind
+    the data; pstreams_getq takes from the highest band first.
 ******************************************************************************/
 int 
 pstreams_putq(P_QUEUE *q, P_MSGB *msg)
 {
-    /*
-     * TODO : find correct place in queue to insert msg. Think
-     * high priority msgs
-     */
-    if((q->q_msglist=lop_queue(&q->q_msglist, msg)) == NULL)
+    if(msg->b_band > 0)
     {
-        return P_STREAMS_FAILURE;
-    }
+        P_QBAND *qb = QBAND(q, msg->b_band);
+
+        if((qb->qb_msglist=lop_queue(&qb->qb_msglist, msg)) == NULL)
+        {
+            return P_STREAMS_FAILURE;
+        }
 
-    q->q_count += pstreams_msgsize(msg);
+        q->q_bandmap |= 1 << (qb - q->q_bandinfo);
+        qb->qb_count += pstreams_msgsize(msg);
 
-    if(q->q_count >= q->q_hiwat)
-    {
-        q->q_flag |= QFULL;
+        if(qb->qb_count >= qb->qb_hiwat)
+        {
+            qb->qb_flag |= QFULL;
+        }
     }
+    else
+    {
+        if((q->q_msglist=lop_queue(&q->q_msglist, msg)) == NULL)
+        {
+            return P_STREAMS_FAILURE;
+        }
 
-    /*if msg is a high priority msg q->q_enabled = P_TRUE*/
+        q->q_count += pstreams_msgsize(msg);
 
-    if(q->q_flag & QWANTR) /*someone wants to read from me*/
-    {
-        if(!(q->q_flag & QNOENB))
+        if(q->q_count >= q->q_hiwat)
         {
-            q->q_enabled = P_TRUE;
+            q->q_flag |= QFULL;
         }
     }
 
+    q->q_nmsg++;
+    q->q_nblk += pstreams_countmsgcont(msg);
+
+    if((q->q_flag & QNOTIFY) && q->q_nmsg == 1)
+    {
+        pstreams_notify(q, P_TRUE); /*no longer empty*/
+    }
+
+    /*
+     * the srvp is scheduled if it found the queue empty last time round(QWANTR),
+     * and always for a high priority msg
+     */
+    if(((q->q_flag & QWANTR) && !(q->q_flag & QNOENB)) || msg->b_band > 0)
+    {
+        pstreams_qenable(q);
+    }
+
 #ifdef PSTREAMS_LT
     pstreams_log(q, PSTREAMS_LTINFO, "putq: added %d bytes to q",
                 pstreams_msgsize(msg));
@@ -1322,28 +4338,55 @@ pstreams_putbq(P_QUEUE *q, P_MSGB *msg)
      * this case lop_push() adds the msg to the front of the
      * queue; the place from which it presumably was just dequeued
      */
-    if((q->q_msglist=lop_push(&q->q_msglist, msg)) == NULL)
+    if(msg->b_band > 0)
     {
-        return P_STREAMS_FAILURE;
-    }
+        P_QBAND *qb = QBAND(q, msg->b_band);
+
+        if((qb->qb_msglist=lop_push(&qb->qb_msglist, msg)) == NULL)
+        {
+            return P_STREAMS_FAILURE;
+        }
 
-    q->q_count += pstreams_msgsize(msg);
+        q->q_bandmap |= 1 << (qb - q->q_bandinfo);
+        qb->qb_count += pstreams_msgsize(msg);
 
-    if(q->q_count >= q->q_hiwat)
-    {
-        q->q_flag |= QFULL;
+        if(qb->qb_count >= qb->qb_hiwat)
+        {
+            qb->qb_flag |= QFULL;
+        }
     }
+    else
+    {
+        if((q->q_msglist=lop_push(&q->q_msglist, msg)) == NULL)
+        {
+            return P_STREAMS_FAILURE;
+        }
 
-    /*if msg is a high priority msg q->q_enabled = P_TRUE*/
+        q->q_count += pstreams_msgsize(msg);
 
-    if(q->q_flag & QWANTR) /*someone wants to read from me*/
-    {
-        if(!(q->q_flag & QNOENB))
+        if(q->q_count >= q->q_hiwat)
         {
-            q->q_enabled = P_TRUE;
+            q->q_flag |= QFULL;
         }
     }
 
+    q->q_nmsg++;
+    q->q_nblk += pstreams_countmsgcont(msg);
+
+    if((q->q_flag & QNOTIFY) && q->q_nmsg == 1)
+    {
+        pstreams_notify(q, P_TRUE); /*no longer empty*/
+    }
+
+    /*
+     * not enabled - the srvp putting a msg back is waiting on the queue
+     * downstream, save for a high priority msg
+     */
+    if(msg->b_band > 0)
+    {
+        pstreams_qenable(q);
+    }
+
 #ifdef PSTREAMS_LT
     pstreams_log(q, PSTREAMS_LTINFO, "putbq: added %d bytes back to q",
                 pstreams_msgsize(msg));
@@ -1394,9 +4437,13 @@ pstreams_putctl(P_QUEUE *q, int ctlflag)
     
 /******************************************************************************
 Name: pstreams_canput
-Purpose: 
+Purpose: test whether q has room for another message
 Parameters:
-Caveats:
+Caveats: on P_FALSE q is marked QWANTW - pstreams_getq enables the caller's
+    queue once q drains below q_lowat, so a srvp that finds canput() failing
+    should putbq() its message and return, rather than poll.
+    For q run by another thread(pstreams_pin) the room is that of its ring -
+    the thread stops taking from the ring while q is QFULL.
 ******************************************************************************/
 int
 pstreams_canput(P_QUEUE *q)
@@ -1406,6 +4453,13 @@ pstreams_canput(P_QUEUE *q)
         return P_FALSE;
     }
 
+#ifdef PSTREAMS_PIPELINE
+    if(q->q_worker != pstreams_self)
+    {
+        return pstreams_ringroom(q);
+    }
+#endif
+
     /*
      *beware q_hiwat must be below max capacity by atleast max message size
      *otherwise the next could be large enough to swamp us
@@ -1428,6 +4482,48 @@ pstreams_canput(P_QUEUE *q)
     return P_TRUE;
 }
 
+/******************************************************************************
+Name: pstreams_bcanput
+Purpose: test whether band of q has room for another message - as
+    pstreams_canput, with flow control kept per band
+Parameters:
+Caveats: band 0 is pstreams_canput(q) - as is any band of a queue run by
+    another thread, whose ring is shared by all bands.
+******************************************************************************/
+int
+pstreams_bcanput(P_QUEUE *q, unsigned char band)
+{
+    P_QBAND *qb=NULL;
+
+    if(!q || band == 0)
+    {
+        return pstreams_canput(q);
+    }
+
+#ifdef PSTREAMS_PIPELINE
+    if(q->q_worker != pstreams_self)
+    {
+        return pstreams_ringroom(q);
+    }
+#endif
+
+    qb = QBAND(q, band);
+
+    /*clear QFULL if below low water mark*/
+    if(qb->qb_count < qb->qb_lowat)
+    {
+        qb->qb_flag &= ~QFULL;
+    }
+
+    if(qb->qb_flag & QFULL)
+    {
+        qb->qb_flag |= QWANTW;
+        return P_FALSE;
+    }
+
+    return P_TRUE;
+}
+
 /******************************************************************************
 Name: pstreams_put_strmhead
 Purpose: 
@@ -1451,17 +4547,21 @@ Parameters:
 Caveats:
 ******************************************************************************/
 int 
-pstreams_init_queue(P_STREAMHEAD *strmhead, P_QUEUE *q, P_QINIT *qi)
+pstreams_init_queue(P_STREAMHEAD *strmhead, P_QUEUE *q, const P_QINIT *qi)
 {
+    int i=0;
+
     pstreams_put_strmhead(q, strmhead);
 
     /*populate q->q_info structure - 
-     * note qi->qi_minfo and qi->qi_mstat are only shallow copied
+     * note qi->qi_minfo is only shallow copied - module tables are shared
+     * by every stream, and read only. statistics are the queue's own.
      */
     /*q->q_qinfo = *qi; - compiler flaky on struct copies...so*/
     q->q_qinfo.qi_mchk = qi->qi_mchk;
     q->q_qinfo.qi_minfo = qi->qi_minfo;
-    q->q_qinfo.qi_mstat = qi->qi_mstat;
+    q->q_qinfo.qi_mstat = &q->q_mstat;
+    memset(&q->q_mstat, 0, sizeof(q->q_mstat));
     q->q_qinfo.qi_putp = qi->qi_putp;
     q->q_qinfo.qi_qclose = qi->qi_qclose;
     q->q_qinfo.qi_qopen = qi->qi_qopen;
@@ -1469,19 +4569,41 @@ pstreams_init_queue(P_STREAMHEAD *strmhead, P_QUEUE *q, P_QINIT *qi)
 
     q->q_msglist = NULL;
     q->q_ptr = NULL;
-    q->q_enabled = P_TRUE;
     q->q_next = NULL;
-
+    q->q_link = NULL;
+    q->q_tlink = NULL;
+    q->q_timeout = 0;
+#ifdef PSTREAMS_PIPELINE
+    q->q_worker = NULL;
+    q->q_xenab = 0;
+    q->q_xtimeout = 0;
+    q->q_ring.r_head = q->q_ring.r_tail = 0;
+    q->q_ring.r_wantw = 0;
+    q->q_spill = NULL;
+#endif
 
     /*get some defaults from qi*/
     q->q_count = 0;
-    q->q_flag = QRESET;
+    q->q_nmsg = 0;
+    q->q_nblk = 0;
+    q->q_flag = QWANTR; /*first putq enables*/
     q->q_ptr = NULL;/*to be set by the module's open()proc*/
     q->q_minpsz = qi->qi_minfo->mi_minpsz;
     q->q_maxpsz = qi->qi_minfo->mi_maxpsz;
     q->q_hiwat = qi->qi_minfo->mi_hiwat;
     q->q_lowat = qi->qi_minfo->mi_lowat;
 
+    /*bands above 0 start with the queue's water marks*/
+    q->q_bandmap = 0;
+    for(i = 0; i < PSTREAMS_NBAND-1; i++)
+    {
+        q->q_bandinfo[i].qb_msglist = NULL;
+        q->q_bandinfo[i].qb_count = 0;
+        q->q_bandinfo[i].qb_flag = 0;
+        q->q_bandinfo[i].qb_hiwat = q->q_hiwat;
+        q->q_bandinfo[i].qb_lowat = q->q_lowat;
+    }
+
     return P_STREAMS_SUCCESS;
 }
 
@@ -1550,8 +4672,8 @@ pstreams_relmsg(P_QUEUE *q, P_MSGB *msg)
             {
                 if(msg->b_datap->db_base)
                 {
-                    int32 poolsize = 
-                        pstreams_mpool((int)(msg->b_datap->db_lim - msg->b_datap->db_base));
+                    int32 poolsize = pstreams_mpool(strmhead,
+                        (int)(msg->b_datap->db_lim - msg->b_datap->db_base));
                     pstreams_mem_free(strmhead, msg->b_datap->db_base, poolsize);
                 }
             }
@@ -1578,23 +4700,32 @@ pstreams_relmsg(P_QUEUE *q, P_MSGB *msg)
 Name: pstreams_msgsize
 Purpose: Calculate the size of "msg", including continuations
 Parameters:
-Caveats:
+Caveats: the size is kept in msg->b_msglen, so this only steps thru the
+    continuations the first time after msg was marked changed(MSGCHANGED)
 ******************************************************************************/
-/*uses tail recursion*/
-ushort pstreams_msgsize(P_MSGB *msg)
+uint32 pstreams_msgsize(P_MSGB *msg)
 {
-    ushort msgsiz=0;
+    P_MSGB *msgiter=NULL;
+    uint32 msgsiz=0;
 
     if(!msg)
     {
         return 0;
     }
 
-    msgsiz = msg->b_wptr - msg->b_rptr;/*could be call to pstreams_msg1size()*/
-    ASSERT(msgsiz < MAXDATABSIZE);
+    if(msg->b_msglen >= 0)
+    {
+        return (uint32)msg->b_msglen;
+    }
+
+    for(msgiter = msg; msgiter; msgiter = msgiter->b_cont)
+    {
+        msgsiz += pstreams_msg1size(msgiter);
+    }
+
+    msg->b_msglen = (int32)msgsiz;
 
-    /*recursively add msgsize until end of list b_cont*/
-    return msgsiz + pstreams_msgsize(msg->b_cont); 
+    return msgsiz;
 }
 
 /******************************************************************************
@@ -1603,14 +4734,14 @@ Purpose: Calculate the size of this message block. Do not consider continuations
 Parameters:
 Caveats:
 ******************************************************************************/
-ushort pstreams_msg1size(P_MSGB *msg)
+uint32 pstreams_msg1size(P_MSGB *msg)
 {
-    ushort msgsiz=0;
+    uint32 msgsiz=0;
 
     ASSERT(msg);
 
+    ASSERT(msg->b_rptr <= msg->b_wptr);
     msgsiz = msg->b_wptr - msg->b_rptr;
-    ASSERT(msgsiz < MAXDATABSIZE);
 
     return msgsiz;
 }
@@ -1657,6 +4788,265 @@ uint32 pstreams_unwritbytes(P_MSGB *msg)
     return unwritbytes + pstreams_unwritbytes(msg->b_cont);
 }
 
+#ifdef PSTREAMS_SENDMSG
+/******************************************************************************
+Name: pstreams_msgtoiov
+Purpose: describe the data of a message(all continuations) in an iovec, for
+    scatter-gather send with sendmsg/writev. Empty blocks are skipped.
+Parameters: maxiov - entries available in iov
+Caveats: returns count of entries used, -1 if msg needs more than maxiov
+******************************************************************************/
+int
+pstreams_msgtoiov(P_MSGB *msg, struct iovec *iov, int maxiov)
+{
+    int niov=0;
+
+    for(; msg; msg = msg->b_cont)
+    {
+        if(msg->b_wptr == msg->b_rptr)
+        {
+            continue;
+        }
+        if(niov == maxiov)
+        {
+            return -1;
+        }
+        iov[niov].iov_base = (void *)msg->b_rptr;
+        iov[niov].iov_len = msg->b_wptr - msg->b_rptr;
+        niov++;
+    }
+
+    return niov;
+}
+
+/******************************************************************************
+Name: pstreams_msgroomiov
+Purpose: describe the unwritten room of a message(all continuations) in an
+    iovec, for scatter-gather receive with recvmsg/readv straight into its
+    blocks. See pstreams_msgfill for the bytes read.
+Parameters: maxiov - entries available in iov
+Caveats: returns count of entries used, -1 if msg needs more than maxiov
+******************************************************************************/
+int
+pstreams_msgroomiov(P_MSGB *msg, struct iovec *iov, int maxiov)
+{
+    int niov=0;
+
+    for(; msg; msg = msg->b_cont)
+    {
+        if(pstreams_unwrit1bytes(msg) == 0)
+        {
+            continue;
+        }
+        if(niov == maxiov)
+        {
+            return -1;
+        }
+        iov[niov].iov_base = (void *)msg->b_wptr;
+        iov[niov].iov_len = pstreams_unwrit1bytes(msg);
+        niov++;
+    }
+
+    return niov;
+}
+#endif
+
+/******************************************************************************
+Name: pstreams_msgfill
+Purpose: take in len bytes read straight into the room of msg - advances the
+    write pointers block by block, then frees the blocks left empty at the end
+Parameters:
+Caveats: P_STREAMS_FAILURE, with msg untouched, if msg has less than len bytes
+    of room. The first block stays even if empty.
+******************************************************************************/
+int
+pstreams_msgfill(P_STREAMHEAD *strmhead, P_MSGB *msg, uint32 len)
+{
+    uint32 chunksize=0;
+
+    if(!msg || pstreams_unwritbytes(msg) < len)
+    {
+        return P_STREAMS_FAILURE;
+    }
+
+    for(;;)
+    {
+        chunksize = MIN(pstreams_unwrit1bytes(msg), len);
+        msg->b_wptr += chunksize;
+        MSGCHANGED(msg);
+        len -= chunksize;
+
+        if(len == 0)
+        {
+            break;
+        }
+        msg = msg->b_cont;
+    }
+
+    pstreams_freemsg(strmhead, msg->b_cont);
+    msg->b_cont = NULL;
+
+    return P_STREAMS_SUCCESS;
+}
+
+/******************************************************************************
+Name: pstreams_cursorinit
+Purpose: set a cursor to the first byte of msg - for reading headers across
+    b_cont blocks without pulling the message up:
+        P_MSGCURSOR cur;
+        MYHDR hdrbuf, *hdr;
+
+        pstreams_cursorinit(&cur, msg);
+        hdr = (MYHDR *)pstreams_cursorread(&cur, &hdrbuf, sizeof(MYHDR));
+        ...
+        pstreams_msgconsume(msg, cur.c_off);
+Parameters:
+Caveats: the cursor is good while the blocks of msg are neither consumed,
+    freed nor relinked - set it again after.
+******************************************************************************/
+void
+pstreams_cursorinit(P_MSGCURSOR *cur, P_MSGB *msg)
+{
+    cur->c_msg = msg;
+    cur->c_ptr = msg ? msg->b_rptr : NULL;
+    cur->c_off = 0;
+}
+
+/******************************************************************************
+Name: pstreams_cursormove
+Purpose: move cur on by len bytes - copying them out to "to", or in from
+    "from", when given
+Parameters:
+Caveats: P_STREAMS_FAILURE if the message ends first - cur is then left at the
+    end, and what was copied is partial.
+******************************************************************************/
+static int
+pstreams_cursormove(P_MSGCURSOR *cur, unsigned char *to,
+                    const unsigned char *from, uint32 len)
+{
+    uint32 chunksize=0;
+
+    while(len > 0)
+    {
+        /*past the end of this block - on to the next with data*/
+        while(cur->c_msg && cur->c_ptr >= cur->c_msg->b_wptr)
+        {
+            cur->c_msg = cur->c_msg->b_cont;
+            cur->c_ptr = cur->c_msg ? cur->c_msg->b_rptr : NULL;
+        }
+        if(!cur->c_msg)
+        {
+            return P_STREAMS_FAILURE;
+        }
+
+        chunksize = MIN((uint32)(cur->c_msg->b_wptr - cur->c_ptr), len);
+        if(to)
+        {
+            memcpy(to, cur->c_ptr, chunksize);
+            to += chunksize;
+        }
+        else if(from)
+        {
+            memcpy(cur->c_ptr, from, chunksize);
+            from += chunksize;
+        }
+        cur->c_ptr += chunksize;
+        cur->c_off += chunksize;
+        len -= chunksize;
+    }
+
+    return P_STREAMS_SUCCESS;
+}
+
+/******************************************************************************
+Name: pstreams_cursorpeek
+Purpose: the next len bytes at cur, without moving it. Points straight into the
+    block when they are all in it; otherwise they are copied to buf - which
+    must hold len bytes - and buf is returned.
+Parameters:
+Caveats: NULL if fewer than len bytes are left. Only the bytes themselves are
+    given - a struct cast from a block pointer may be unaligned.
+******************************************************************************/
+void *
+pstreams_cursorpeek(P_MSGCURSOR *cur, void *buf, uint32 len)
+{
+    P_MSGCURSOR look = *cur;
+
+    /*fast path - contiguous in the current block*/
+    if(cur->c_msg && (uint32)(cur->c_msg->b_wptr - cur->c_ptr) >= len)
+    {
+        return cur->c_ptr;
+    }
+
+    if(pstreams_cursormove(&look, (unsigned char *)buf, NULL, len) != P_STREAMS_SUCCESS)
+    {
+        return NULL;
+    }
+
+    return buf;
+}
+
+/******************************************************************************
+Name: pstreams_cursorread
+Purpose: as pstreams_cursorpeek, then moves cur past the bytes
+Parameters:
+Caveats: NULL, with cur unmoved, if fewer than len bytes are left
+******************************************************************************/
+void *
+pstreams_cursorread(P_MSGCURSOR *cur, void *buf, uint32 len)
+{
+    void *bytes = pstreams_cursorpeek(cur, buf, len);
+
+    if(bytes)
+    {
+        pstreams_cursorskip(cur, len);
+    }
+
+    return bytes;
+}
+
+/******************************************************************************
+Name: pstreams_cursorskip
+Purpose: move cur on by len bytes
+Parameters:
+Caveats: P_STREAMS_FAILURE, with cur unmoved, if fewer than len bytes are left
+******************************************************************************/
+int
+pstreams_cursorskip(P_MSGCURSOR *cur, uint32 len)
+{
+    P_MSGCURSOR look = *cur;
+
+    if(pstreams_cursormove(&look, NULL, NULL, len) != P_STREAMS_SUCCESS)
+    {
+        return P_STREAMS_FAILURE;
+    }
+
+    *cur = look;
+    return P_STREAMS_SUCCESS;
+}
+
+/******************************************************************************
+Name: pstreams_cursorwrite
+Purpose: overwrite the next len bytes at cur with data, and move past them -
+    to fill in header fields of a message already built
+Parameters:
+Caveats: P_STREAMS_FAILURE, with msg and cur untouched, if fewer than len bytes
+    are left. Only written bytes are overwritten; the message does not grow.
+    Blocks shared with a duplicate(db_ref > 1) change for the duplicate too.
+******************************************************************************/
+int
+pstreams_cursorwrite(P_MSGCURSOR *cur, const void *data, uint32 len)
+{
+    P_MSGCURSOR look = *cur;
+
+    if(pstreams_cursormove(&look, NULL, NULL, len) != P_STREAMS_SUCCESS)
+    {
+        return P_STREAMS_FAILURE;
+    }
+
+    return pstreams_cursormove(cur, NULL, (const unsigned char *)data, len);
+}
+
 /******************************************************************************
 Name: pstreams_msg1copy
 Purpose: copy "bytetocopy" bytes from "from" messageblock to "to" messageblock
@@ -1671,6 +5061,7 @@ pstreams_msg1copy(P_MSGB *to, P_MSGB *from, uint32 bytestocopy)
 
     memcpy(to->b_wptr, from->b_rptr, bytestocopy);
     to->b_wptr += bytestocopy;
+    MSGCHANGED(to);
     ASSERT(to->b_wptr <= to->b_datap->db_lim);/*don't overrun the edge*/
     /*from->b_rptr += bytestocopy; - note: copying doesn't consume */
 
@@ -1694,6 +5085,8 @@ pstreams_msgcpy(P_MSGB *to, P_MSGB *from, uint32 bytestocopy)
     ASSERT(to);
     ASSERT(pstreams_msgsize(from) >= bytestocopy);
     ASSERT(pstreams_unwritbytes(to) >= bytestocopy);
+
+    MSGCHANGED(to); /*blocks further on are marked by pstreams_msg1copy*/
     
     while(bytestocopy && from)
     {
@@ -1807,6 +5200,7 @@ pstreams_addmsg(P_MSGB **msg, P_MSGB *tailmsg)
     msgiter = *msg;
     while(msgiter)
     {
+        MSGCHANGED(msgiter);
         if(!msgiter->b_cont)
         {
             msgiter->b_cont = tailmsg;
@@ -1867,6 +5261,7 @@ pstreams_sift(P_QUEUE *q, P_MSGB *msg, int (*sift)(P_QUEUE *q, P_MSGB *msg),
     {
         msg_next = msg->b_cont;
         msg->b_cont = NULL; /*delink current msg*/
+        MSGCHANGED(msg);
 
         switch(siftval=sift(q, msg))
         {
@@ -1905,6 +5300,7 @@ pstreams_ctlexpress(P_QUEUE *q, P_MSGB *msg, P_BOOL (*myctl)(P_QUEUE *, P_MSGB *
     {
         msg_next = msg->b_cont;
         msg->b_cont = NULL; /*delink current msg*/
+        MSGCHANGED(msg);
 
         switch(msg->b_datap->db_type)
         {
@@ -1946,7 +5342,7 @@ int
 pstreams_log(P_QUEUE *q, P_LTCODE ltcode, const char *fmt,...)
 {
     va_list ap;
-    char *modulename="STRMHEAD";
+    const char *modulename="STRMHEAD";
     int32 q_count=-1;
     LOGFILE *ltfile=NULL;
     P_STREAMHEAD *strmhead=NULL;
@@ -1971,7 +5367,7 @@ pstreams_log(P_QUEUE *q, P_LTCODE ltcode, const char *fmt,...)
     {
         modulename = q->q_qinfo.qi_minfo->mi_idname;
         q_count = q->q_count;
-        msg_count = pstreams_countmsg(q->q_msglist);
+        msg_count = pstreams_qcountmsg(q);
     }
 
     va_start(ap, fmt);
@@ -2070,6 +5466,19 @@ pstreams_countmsg(LISTHDR *msglist)
     return count;
 }
 
+/******************************************************************************
+Name: pstreams_qcountmsg
+Purpose: pstreams_countmsg for all bands of a queue - the message blocks queued
+Parameters:
+Caveats: kept up to date by putq/putbq/getq - see q_nblk. A module that
+    changes the blocks of a message while it is queued must count again.
+******************************************************************************/
+int
+pstreams_qcountmsg(P_QUEUE *q)
+{
+    return q->q_nblk;
+}
+
 /******************************************************************************
 Name: pstreams_mchk
 Purpose: 
@@ -2086,8 +5495,8 @@ pstreams_mchk(P_QUEUE *q, P_GETVAL *get)
 
     ASSERT(get->type == GETMSGCNT);
 
-    msgcount += pstreams_countmsg(q->q_msglist);
-    msgcount += pstreams_countmsg(q->q_peer->q_msglist);
+    msgcount += pstreams_qcountmsg(q);
+    msgcount += pstreams_qcountmsg(q->q_peer);
 
     get->val.msgcount += msgcount;
 
@@ -2141,7 +5550,9 @@ pstreams_checkmem(P_STREAMHEAD *strmhead)
                     "\t\tmodules say Sum of MBLKs in use=%d", mod_msgcount);
 #endif /*PSTREAMS_LT*/
 
+    pstreams_cacheflush(strmhead); /*magazines hold free, not in-use, MBLKs*/
     lop_msgcount = strmhead->msgpool->count - strmhead->msgpool->freecount;
+    PDBG(lop_msgcount += strmhead->mdbmsgs); /*combined P_MSGBs*/
 
 #ifdef PSTREAMS_LT
     pstreams_log(&strmhead->apprdq, (P_LTCODE)(PSTREAMS_LTDEBUG-1), 
@@ -2183,22 +5594,21 @@ pstreams_console(const char *fmt,...)
 Name: pstreams_memassign
 Purpose: allocate and return memory of given size from given mem chunk
 Parameters: 
-Caveats: 
+Caveats: quiet unless mem falls short - it is called many times per open
 ******************************************************************************/
 void *
 pstreams_memassign(P_MEM *mem, int32 size)
 {
     void *rptr=NULL; /*returned ptr*/
 
-    /*DEBUG mode*/
     {
         unsigned long end = (unsigned long)mem->limit;
         unsigned long start = (unsigned long)mem->base;
         unsigned long diff = end - start;
-        pstreams_console("pstreams_memassign: start=0x%lX, end=0x%lX, diff=%lu bytes."
-            " assigning %ld bytes", start, end, diff, size);
         if((int32)diff < size)
         {
+            pstreams_console("pstreams_memassign: start=0x%lX, end=0x%lX, diff=%lu bytes."
+                " short of %ld bytes", start, end, diff, size);
             return rptr;
         }
     }
@@ -2221,6 +5631,56 @@ pstreams_memassign(P_MEM *mem, int32 size)
     return rptr;
 }
 
+/******************************************************************************
+Name: pstreams_allocmdb
+Purpose: allocate a message block, its data block and data buffer as one
+    P_MDBBLOCK, from size class c or from mdbpool if c is MDBCLASS
+Parameters: size - 0 for no buffer. Upto inlinesize for the built-in one
+Caveats: 
+******************************************************************************/
+static P_MSGB *
+pstreams_allocmdb(P_STREAMHEAD *strmhead, int32 size, int c)
+{
+    P_MDBBLOCK *mdb;
+    P_DATAB *datab;
+
+    mdb = (P_MDBBLOCK *)pstreams_cachealloc(strmhead, c == MDBCLASS ?
+        strmhead->mdbpool : strmhead->classpool[c]);
+    if(!mdb)
+    {
+        return NULL;
+    }
+    memset(mdb, 0, sizeof(P_MDBBLOCK)); /*not init'd in lop_alloc*/
+    PDBG(strmhead->mdbmsgs++);
+
+    datab = &mdb->datab;
+    mdb->msgb.b_datap = datab;
+    datab->db_ref = 1; /*reference count is 1, on creation*/
+    datab->db_flags = DBF_COMBINED;
+    datab->db_class = (unsigned char)c;
+
+    if(c != MDBCLASS)
+    {
+        datab->db_base = MDBDATA(mdb);
+        datab->db_lim = datab->db_base + strmhead->classsize[c];
+    }
+    else if(size > 0)
+    {
+        datab->db_base = datab->FASTBUF;
+        datab->db_lim = datab->db_base + strmhead->inlinesize;
+    }
+    mdb->msgb.b_rptr = mdb->msgb.b_wptr = datab->db_base;
+    MSGCHANGED(&mdb->msgb); /*the module writing it may not say*/
+
+#ifdef PSTREAMS_LT
+    pstreams_log(&strmhead->appwrq, PSTREAMS_LTDEBUG, 
+        "pstreams_allocmdb: bytes %d/%d.",
+            size, pstreams_unwritbytes(&mdb->msgb));
+#endif /*PSTREAMS_LT*/
+
+    return &mdb->msgb;
+}
+
 /******************************************************************************
 Name: pstreams_allocb
 Purpose: allocate a P_MSGB structure(message block). This also allocates a
@@ -2242,18 +5702,33 @@ pstreams_allocb(P_STREAMHEAD *strmhead, int32 size, uint priority)
      * priority, like in man allocb, is no longer used
      */
 
-    msgb = (P_MSGB *)lop_alloc(strmhead->msgpool);
+    if(strmhead->combined)
+    {
+        int c = ((uint32)size > strmhead->inlinesize) ? pstreams_sizeclass(strmhead, size) : MDBCLASS;
+
+        if(c == MDBCLASS || (c >= 0 && CLASSCOMBINED(strmhead, c)))
+        {
+            msgb = pstreams_allocmdb(strmhead, size, c);
+            if(msgb || c != MDBCLASS)
+            {
+                return msgb;
+            }
+            /*mdbpool exhausted - try seperate blocks*/
+        }
+    }
+
+    msgb = (P_MSGB *)pstreams_cachealloc(strmhead, strmhead->msgpool);
     if(!msgb)
     {
         return NULL;
     }
     memset(msgb, 0, sizeof(P_MSGB)); /*not init'd in lop_alloc*/
+    MSGCHANGED(msgb); /*the module writing it may not say*/
 
-    ASSERT(lop_checkpool(strmhead->datapool) == LISTOP_SUCCESS);
-
-    msgb->b_datap = (P_DATAB *)lop_alloc(strmhead->datapool);
+    msgb->b_datap = (P_DATAB *)pstreams_cachealloc(strmhead, strmhead->datapool);
     if(!msgb->b_datap)
     {
+        pstreams_cacherelease(strmhead, strmhead->msgpool, msgb);
         return NULL;
     }
 
@@ -2267,11 +5742,19 @@ pstreams_allocb(P_STREAMHEAD *strmhead, int32 size, uint priority)
         unsigned char *data = NULL;
 
         /*roundup size to pre-defined buffer sizes*/
-        size = pstreams_mpool(size);
+        size = pstreams_mpool(strmhead, size);
+        if(!size)
+        {
+            /*larger than the largest size class*/
+            pstreams_cacherelease(strmhead, strmhead->datapool, msgb->b_datap);
+            msgb->b_datap=NULL;
+            pstreams_cacherelease(strmhead, strmhead->msgpool, msgb);
+            return NULL;
+        }
 
-        if(size <= FASTBUFSIZE) 
+        if((uint32)size <= strmhead->inlinesize) 
         {
-            ASSERT(size == FASTBUFSIZE); /*s'posed to be rounded up*/
+            ASSERT((uint32)size == strmhead->inlinesize); /*s'posed to be rounded up*/
 
             /*use built-in small buffer instead of allocating from pool*/
             data = msgb->b_datap->FASTBUF;
@@ -2282,9 +5765,9 @@ pstreams_allocb(P_STREAMHEAD *strmhead, int32 size, uint priority)
             data = pstreams_mem_alloc(strmhead, size, PSTREAMS_BLOCK);
             if(!data)
             {
-                lop_release(strmhead->datapool, msgb->b_datap);
+                pstreams_cacherelease(strmhead, strmhead->datapool, msgb->b_datap);
                 msgb->b_datap=NULL;
-                lop_release(strmhead->msgpool, msgb);
+                pstreams_cacherelease(strmhead, strmhead->msgpool, msgb);
                 return NULL;
             }
         }
@@ -2313,6 +5796,136 @@ pstreams_allocb(P_STREAMHEAD *strmhead, int32 size, uint priority)
     return msgb;
 }
 
+/******************************************************************************
+Name: pstreams_allocbr
+Purpose: pstreams_allocb with the stream's headroom and tailroom reserved
+    around size bytes - b_rptr and b_wptr start headroom bytes into the buffer
+Parameters: as pstreams_allocb
+Caveats: 
+******************************************************************************/
+P_MSGB *
+pstreams_allocbr(P_STREAMHEAD *strmhead, int32 size, uint priority)
+{
+    P_MSGB *msgb;
+
+    msgb = pstreams_allocb(strmhead, 
+        size + strmhead->headroom + strmhead->tailroom, priority);
+    if(msgb && msgb->b_datap->db_base)
+    {
+        msgb->b_rptr = msgb->b_wptr = msgb->b_datap->db_base + strmhead->headroom;
+    }
+
+    return msgb;
+}
+
+/******************************************************************************
+Name: pstreams_allocmsg
+Purpose: allocate room for size bytes as a message of one or more blocks -
+    for messages larger than the largest size class, e.g. a 64K datagram.
+    Each block is of the largest size class but the last, which is just large
+    enough for what is left.
+Parameters:
+Caveats: NULL if out of memory. The blocks are empty - see pstreams_msgfill
+******************************************************************************/
+P_MSGB *
+pstreams_allocmsg(P_STREAMHEAD *strmhead, int32 size)
+{
+    uint32 maxsize = strmhead->nclasses > 0 ? 
+        strmhead->classsize[strmhead->nclasses-1] : strmhead->inlinesize;
+    P_MSGB *msg=NULL;
+    P_MSGB *tail=NULL;
+    P_MSGB *msgb=NULL;
+    int32 blocksize=0;
+
+    do
+    {
+        blocksize = MIN((uint32)size, maxsize);
+        msgb = pstreams_allocb(strmhead, blocksize, 0);
+        if(!msgb)
+        {
+            pstreams_freemsg(strmhead, msg);
+            return NULL;
+        }
+
+        /*empty blocks, to be written by the caller - b_msglen is unknown*/
+        if(tail)
+        {
+            tail->b_cont = msgb;
+        }
+        else
+        {
+            msg = msgb;
+        }
+        tail = msgb;
+        size -= blocksize;
+    } while(size > 0);
+
+    return msg;
+}
+
+/******************************************************************************
+Name: pstreams_reserve
+Purpose: adds to the headroom and tailroom reserved in messages built by
+    pstreams_allocbr and pstreams_putmsg. Modules call this from their open
+    routine for the bytes of header(and trailer) they add to each message.
+Parameters:
+Caveats: 
+******************************************************************************/
+void
+pstreams_reserve(P_STREAMHEAD *strmhead, uint32 headroom, uint32 tailroom)
+{
+    strmhead->headroom += headroom;
+    strmhead->tailroom += tailroom;
+}
+
+/******************************************************************************
+Name: pstreams_prepend
+Purpose: makes room for len data bytes ahead of msg and returns the message
+    with b_rptr at those bytes, for the caller to fill. If the first block of
+    msg is unshared P_M_DATA with len bytes free ahead of b_rptr, b_rptr just
+    moves back; else a new block(with the stream's headroom) is linked ahead.
+Parameters: msg - NULL for a message of just the len bytes
+Caveats: returns NULL if out of memory - msg is then left as it was
+******************************************************************************/
+P_MSGB *
+pstreams_prepend(P_STREAMHEAD *strmhead, P_MSGB *msg, int32 len)
+{
+    P_MSGB *hdrmsg;
+
+    if(msg && 
+        msg->b_datap->db_ref == 1 &&
+        msg->b_datap->db_type == P_M_DATA &&
+        msg->b_datap->db_base &&
+        msg->b_rptr - msg->b_datap->db_base >= len)
+    {
+        msg->b_rptr -= len;
+        if(msg->b_msglen >= 0)
+        {
+            msg->b_msglen += len;
+        }
+        return msg;
+    }
+
+    hdrmsg = pstreams_allocb(strmhead, strmhead->headroom + len, 0);
+    if(!hdrmsg)
+    {
+        strmhead->perrno = P_OUTOFMEMORY;
+        return NULL;
+    }
+    hdrmsg->b_datap->db_type = P_M_DATA;
+    hdrmsg->b_rptr = hdrmsg->b_datap->db_base + strmhead->headroom;
+    hdrmsg->b_wptr = hdrmsg->b_rptr + len;
+    hdrmsg->b_msglen = len + pstreams_msgsize(msg);
+
+    if(msg)
+    {
+        hdrmsg->b_band = msg->b_band;
+        hdrmsg->b_cont = msg;
+    }
+
+    return hdrmsg;
+}
+
 /******************************************************************************
 Name: pstreams_esballoc
 Purpose: allocates P_MSGB structure(message block) with a P_DATAB using a caller 
@@ -2349,6 +5962,7 @@ pstreams_esballoc(P_STREAMHEAD *strmhead, unsigned char *base, int32 size, int p
     
     /*read-ptr and write-ptr of message block point to start of data block*/
     msgb->b_rptr = msgb->b_wptr = msgb->b_datap->db_base;
+    MSGCHANGED(msgb);
 
     msgb->b_datap->db_frtnp = free_rtn;
 
@@ -2361,130 +5975,137 @@ pstreams_esballoc(P_STREAMHEAD *strmhead, unsigned char *base, int32 size, int p
     return msgb;
 }
     
-int32
-pstreams_mpool(int32 size)
+/******************************************************************************
+Name: pstreams_sizeclass
+Purpose: index of the smallest size class holding size bytes, or -1 if size
+    is beyond the largest class. O(1) - the size map names the class to
+    start from, and only classes sharing its SIZECLASSGRAIN are stepped over.
+Parameters:
+Caveats: 
+******************************************************************************/
+int
+pstreams_sizeclass(P_STREAMHEAD *strmhead, int32 size)
 {
-    int32 adjsize=0; /*adjusted size*/
+    int c;
 
-    if(size == 0)
-    {
-        adjsize = size;
-    }
-    else if(size <= FASTBUFSIZE)
+    if(size <= 0 || !strmhead->nclasses ||
+        (uint32)size > strmhead->classsize[strmhead->nclasses-1])
     {
-        adjsize = FASTBUFSIZE;
+        return -1;
     }
-#if(POOL16SIZE > 0)
-    else if(size <= 16)
+
+    c = strmhead->sizemap[(size-1)/SIZECLASSGRAIN];
+    while(strmhead->classsize[c] < (uint32)size)
     {
-        adjsize = 16;
+        c++;
     }
-#endif
-#if(POOL64SIZE > 0)
-    else if(size <= 64)
+
+    return c;
+}
+
+/******************************************************************************
+Name: pstreams_mpool
+Purpose: rounds size up to the buffer size that will be allocated for it.
+    0 if no buffer is large enough.
+Parameters:
+Caveats: 
+******************************************************************************/
+int32
+pstreams_mpool(P_STREAMHEAD *strmhead, int32 size)
+{
+    int c;
+
+    if(size <= 0)
     {
-        adjsize = 64;
+        return 0;
     }
-#endif
-#if(POOL256SIZE > 0)
-    else if(size <= 256)
+    else if((uint32)size <= strmhead->inlinesize)
     {
-        adjsize = 256;
+        return strmhead->inlinesize;
     }
-#endif
-#if(POOL512SIZE > 0)
-    else if(size <= 512)
+
+    c = pstreams_sizeclass(strmhead, size);
+
+    return c < 0 ? 0 : (int32)strmhead->classsize[c];
+}
+
+/******************************************************************************
+Name: pstreams_rdbufsize
+Purpose: size of the buffer a device reads into - the stream's largest size
+    class of no more than limit bytes.
+Parameters: limit - the device's cap, so that a small read does not take a
+    buffer sized for bulk
+Caveats: the smallest class if even that is beyond limit. 0 for a stream
+    with no size classes
+******************************************************************************/
+int32
+pstreams_rdbufsize(P_STREAMHEAD *strmhead, int32 limit)
+{
+    int c;
+
+    if(!strmhead->nclasses)
     {
-        adjsize = 512;
+        return 0;
     }
-#endif
-#if(POOL1792SIZE > 0)
-    else if(size <= 1792)
+
+    for(c = strmhead->nclasses-1; c > 0 && strmhead->classsize[c] > (uint32)limit; c--)
     {
-        adjsize = 1792;
+        ;
     }
-#endif
 
-    return adjsize;
+    return (int32)strmhead->classsize[c];
+}
+
+/******************************************************************************
+Name: pstreams_bufavail
+Purpose: buffers of size's class the calling thread can have now without the
+    pool growing - for a device to size a batch of reads by.
+Parameters:
+Caveats: an estimate - see lop_availcount. 0 beyond the largest class.
+******************************************************************************/
+uint32
+pstreams_bufavail(P_STREAMHEAD *strmhead, int32 size)
+{
+    int c = pstreams_sizeclass(strmhead, size);
+
+    return c < 0 ? 0 : lop_availcount(strmhead->classpool[c]);
 }
 
 unsigned char *
 pstreams_mem_alloc(P_STREAMHEAD *strmhead, int32 size, int flag)
 {
-    switch(size)
-    {
-#if(POOL16SIZE > 0)
-    case 16:
-        return lop_alloc(strmhead->pool16);
-#endif
-#if(POOL64SIZE > 0)
-    case 64:
-        return lop_alloc(strmhead->pool64);
-#endif
-#if(POOL256SIZE > 0)
-    case 256:
-        return lop_alloc(strmhead->pool256);
-#endif
-#if(POOL512SIZE > 0)
-    case 512:
-        return lop_alloc(strmhead->pool512);
-#endif
-#if(POOL1792SIZE > 0)
-    case 1792:
-        return lop_alloc(strmhead->pool1792);
-#endif
-    default:
-        return NULL;
-    }
+    int c = pstreams_sizeclass(strmhead, size);
 
     PDBG(flag=0); /*unused*/
 
-    return NULL; /*never here*/
+    if(c < 0 || strmhead->classsize[c] != (uint32)size)
+    {
+        return NULL; /*not a size class*/
+    }
+
+    return pstreams_cachealloc(strmhead, strmhead->classpool[c]);
 }
 
 /*
- * Used only on pool64,...type pools
+ * Used only on size class pools - size is as returned by pstreams_mpool
  */
 void
 pstreams_mem_free(P_STREAMHEAD *strmhead, void *buf, int32 size)
 {
-    switch(size)
+    int c;
+
+    if(size == 0 || (uint32)size == strmhead->inlinesize)
     {
-    case 0:
-        break;
-    case FASTBUFSIZE:
-        /*nothing to release as this buffer is built in to every P_DATAB*/
-        break;
-#if(POOL16SIZE > 0)
-    case 16:
-        lop_release(strmhead->pool16, buf);
-        break;
-#endif
-#if(POOL64SIZE > 0)
-    case 64:
-        lop_release(strmhead->pool64, buf);
-        break;
-#endif
-#if(POOL256SIZE > 0)
-    case 256:
-        lop_release(strmhead->pool256, buf);
-        break;
-#endif
-#if(POOL512SIZE > 0)
-    case 512:
-        lop_release(strmhead->pool512, buf);
-        break;
-#endif
-#if(POOL1792SIZE > 0)
-    case 1792:
-        lop_release(strmhead->pool1792, buf);
-        break;
-#endif
-    default:
-        return ;
+        /*nothing to release as FASTBUF is built in to every P_DATAB*/
+        return;
     }
 
-    return; /*never here*/
+    c = pstreams_sizeclass(strmhead, size);
+    ASSERT(c >= 0 && strmhead->classsize[c] == (uint32)size);
+    if(c >= 0 && strmhead->classsize[c] == (uint32)size)
+    {
+        pstreams_cacherelease(strmhead, strmhead->classpool[c], buf);
+    }
 }
 
 /******************************************************************************
@@ -2520,6 +6141,7 @@ pstreams_dupmsg(P_STREAMHEAD *strmhead, P_MSGB *initmsg)
         if(msgiter_prev)
         {
             msgiter_prev->b_cont = msgiter;
+            MSGCHANGED(msgiter_prev);
         }
         else
         {
@@ -2557,7 +6179,7 @@ pstreams_dupb(P_STREAMHEAD *strmhead, P_MSGB *initmsg)
             return NULL;
         }
 
-        msgb = (P_MSGB *)lop_alloc(strmhead->msgpool);
+        msgb = (P_MSGB *)pstreams_cachealloc(strmhead, strmhead->msgpool);
         if(!msgb)
         {
             return NULL;
@@ -2570,6 +6192,7 @@ pstreams_dupb(P_STREAMHEAD *strmhead, P_MSGB *initmsg)
         msgb->b_datap = initmsg->b_datap;
         msgb->b_rptr = initmsg->b_rptr;
         msgb->b_wptr = initmsg->b_wptr;
+        MSGCHANGED(msgb);
         msgb->b_band = initmsg->b_band;
     }
     
@@ -2594,7 +6217,7 @@ pstreams_dupnmsg(P_STREAMHEAD *strmhead, P_MSGB *initmsg, int32 len)
     PDBG(P_MSGB *original_msg=initmsg);
     PDBG(int32 original_len=len);
 
-    if(pstreams_msgsize(initmsg) < len)
+    if((int32)pstreams_msgsize(initmsg) < len)
     {
         len = pstreams_msgsize(initmsg);
     }
@@ -2615,18 +6238,19 @@ pstreams_dupnmsg(P_STREAMHEAD *strmhead, P_MSGB *initmsg, int32 len)
         }
 
         /*adjust msgiter's block length*/
-        if(len < pstreams_msg1size(msgiter))
+        if(len < (int32)pstreams_msg1size(msgiter))
         {
             pstreams_msg1erase(msgiter, pstreams_msg1size(msgiter) - len);
         }
 
-        ASSERT(len >= pstreams_msg1size(msgiter));
+        ASSERT(len >= (int32)pstreams_msg1size(msgiter));
 
         len -= pstreams_msg1size(msgiter);
 
         if(msgiter_prev)
         {
             msgiter_prev->b_cont = msgiter;
+            MSGCHANGED(msgiter_prev);
         }
         else
         {
@@ -2674,6 +6298,7 @@ pstreams_copymsg(P_STREAMHEAD *strmhead, P_MSGB *initmsg)
         if(msgiter_prev)
         {
             msgiter_prev->b_cont = msgiter;
+            MSGCHANGED(msgiter_prev);
         }
         else
         {
@@ -2747,7 +6372,7 @@ pstreams_msgpullup(P_STREAMHEAD *strmhead, P_MSGB *initmsg, int32 len)
     {
         len = pstreams_msgsize(initmsg);
     }
-    else if(len == 0 || len > pstreams_msgsize(initmsg))
+    else if(len == 0 || len > (int32)pstreams_msgsize(initmsg))
     {
         return NULL; /*invalid usage case*/
     }
@@ -2763,13 +6388,14 @@ pstreams_msgpullup(P_STREAMHEAD *strmhead, P_MSGB *initmsg, int32 len)
 
     while(len)
     {
-        int32 copylen = MIN(pstreams_msg1size(initmsg), len);
+        int32 copylen = MIN((int32)pstreams_msg1size(initmsg), len);
 
         ASSERT(initmsg);
 
         rptr = initmsg->b_rptr;
         memcpy(msg->b_wptr, rptr, copylen);
         msg->b_wptr += copylen;
+        MSGCHANGED(msg);
         rptr += copylen;
         len -= copylen;
 
@@ -2824,14 +6450,22 @@ pstreams_linkb(P_MSGB *msg, P_MSGB *tailmsg)
 {
     P_MSGB *msgiter=NULL;
 
+    int32 msglen=-1;
+
     if(!msg)
     {
         return P_STREAMS_FAILURE;
     }
 
+    if(msg->b_msglen >= 0)
+    {
+        msglen = msg->b_msglen + pstreams_msgsize(tailmsg);
+    }
+
     msgiter = msg;
     while(msgiter)
     {
+        MSGCHANGED(msgiter);
         if(!msgiter->b_cont)
         {
             msgiter->b_cont = tailmsg;
@@ -2841,6 +6475,8 @@ pstreams_linkb(P_MSGB *msg, P_MSGB *tailmsg)
         msgiter = msgiter->b_cont;
     }
 
+    msg->b_msglen = msglen;
+
     return P_STREAMS_SUCCESS;
 }
 
@@ -2861,6 +6497,7 @@ pstreams_unlinkb(P_MSGB *msg)
         tail = msg->b_cont;
         head = msg;
         head->b_cont = NULL; /*unlink the head*/
+        head->b_msglen = pstreams_msg1size(head);
     }
 
     return tail;
@@ -2903,6 +6540,9 @@ Caveats:
 void
 pstreams_freeb(P_STREAMHEAD *strmhead, P_MSGB *msg)
 {
+    P_DATAB *datab = msg->b_datap;
+    P_MDBBLOCK *mdb = (datab->db_flags & DBF_COMBINED) ? MDBBLOCK(datab) : NULL;
+
     ASSERT(msg->b_datap->db_ref > 0);
         
     /*decrement datablocks reference count*/
@@ -2929,30 +6569,53 @@ pstreams_freeb(P_STREAMHEAD *strmhead, P_MSGB *msg)
                     (int)(msg->b_datap->db_lim - msg->b_datap->db_base));
             }
         }
-        else
+        else if(!mdb) /*combined buffers go with their P_MDBBLOCK*/
         {
             /*this is pstreams allocated memory*/
             if(msg->b_datap->db_base)
             {
                 if(msg->b_datap->db_base != msg->b_datap->FASTBUF) /*skip forFASTBUF*/
                 {
-                    int32 poolsize = 
-                        pstreams_mpool((int)(msg->b_datap->db_lim - msg->b_datap->db_base));
+                    int32 poolsize = pstreams_mpool(strmhead,
+                        (int)(msg->b_datap->db_lim - msg->b_datap->db_base));
                     pstreams_mem_free(strmhead, msg->b_datap->db_base, poolsize);
                 }
                 else
                 {
-                    ASSERT((int)(msg->b_datap->db_lim - msg->b_datap->db_base) == FASTBUFSIZE);
+                    ASSERT((uint32)(msg->b_datap->db_lim - msg->b_datap->db_base) == strmhead->inlinesize);
                 }
             }
         }
 
-        PDBG(memset(msg->b_datap, 0, sizeof(P_DATAB)));
-        lop_release(strmhead->datapool, msg->b_datap);
+        if(mdb)
+        {
+            /*message block, data block and buffer - all in one*/
+            if(msg == &mdb->msgb)
+            {
+                PDBG(strmhead->mdbmsgs--);
+                msg = NULL; /*goes with the P_MDBBLOCK*/
+            }
+            pstreams_cacherelease(strmhead, datab->db_class == MDBCLASS ?
+                strmhead->mdbpool : strmhead->classpool[datab->db_class], mdb);
+        }
+        else
+        {
+            PDBG(memset(msg->b_datap, 0, sizeof(P_DATAB)));
+            pstreams_cacherelease(strmhead, strmhead->datapool, msg->b_datap);
+        }
+    }
+    else if(mdb && msg == &mdb->msgb)
+    {
+        /*a duplicate still refers to the data - the P_MDBBLOCK stays till then*/
+        PDBG(strmhead->mdbmsgs--);
+        msg = NULL;
     }
 
-    PDBG(memset(msg, 0, sizeof(P_MSGB)));
-    lop_release(strmhead->msgpool, msg);
+    if(msg)
+    {
+        PDBG(memset(msg, 0, sizeof(P_MSGB)));
+        pstreams_cacherelease(strmhead, strmhead->msgpool, msg);
+    }
 
     return;
 }
@@ -2987,7 +6650,7 @@ pstreams_comparemsg(P_STREAMHEAD *strm, P_MSGB *msg1, P_MSGB *msg2)
 /*for DEBUG only*/
 #define PGETLISTHDR(pobj)  ((LISTHDR *)((char *)(pobj) - sizeof(LISTHDR)))
 int
-pstreams_checkmsg(P_MSGB *msg)
+pstreams_checkmsg(P_STREAMHEAD *strm, P_MSGB *msg)
 {
     P_MSGB *mblk=NULL;
 
@@ -2999,9 +6662,10 @@ pstreams_checkmsg(P_MSGB *msg)
         {
             CONSOLEWRITE("pstreams_checkmsg: msgb=0x%lx, plhdr=0x%lx, plhdr->pnext=0x%lx", 
         mblk, plhdr, plhdr->pnext);
-            CONSOLEWRITE("pstreams_checkmsg: msgpool's lowat = %ld", dbgstrm->msgpool->lowat);
+            CONSOLEWRITE("pstreams_checkmsg: msgpool's lowat = %ld", strm->msgpool->lowat);
             return P_STREAMS_FAILURE;
         }
+        if(!(mblk->b_datap->db_flags & DBF_COMBINED)) /*combined: no LISTHDR of its own*/
         {
             P_DATAB *datab = mblk->b_datap;
             LISTHDR *plhdr = PGETLISTHDR(datab);
@@ -3009,7 +6673,7 @@ pstreams_checkmsg(P_MSGB *msg)
             {
                 CONSOLEWRITE("pstreams_checkmsg: datab=0x%lx, plhdr=0x%lx, plhdr->pnext=0x%lx", 
                 datab, plhdr, plhdr->pnext);
-                CONSOLEWRITE("pstreams_checkmsg: datapool's lowat = %ld", dbgstrm->datapool->lowat);
+                CONSOLEWRITE("pstreams_checkmsg: datapool's lowat = %ld", strm->datapool->lowat);
                 return P_STREAMS_FAILURE;
             }
     }
@@ -3017,35 +6681,133 @@ pstreams_checkmsg(P_MSGB *msg)
     return P_STREAMS_SUCCESS;
 }
 
+/******************************************************************************
+Name: pstreams_cachealloc
+Purpose: an object of one of strmhead's pools - from the calling thread's
+    magazine if it services the stream(cachetag) or is a pinned worker of it,
+    else from the pool itself
+Parameters:
+Caveats: objects in the magazine of any other thread - a producer of
+    pstreams_ingress, say - would be out of the stream's reach
+******************************************************************************/
+static void *
+pstreams_cachealloc(P_STREAMHEAD *strmhead, POOLHDR *ppool)
+{
+#ifdef PSTREAMS_PIPELINE
+    if(pstreams_self && pstreams_self->w_q[0] && PSTRMHEAD(pstreams_self->w_q[0]) == strmhead)
+    {
+        return lop_cachealloc(ppool);
+    }
+#endif
+    if(strmhead->cachetag == &pstreams_cachetag)
+    {
+        return lop_cachealloc(ppool);
+    }
+
+    return lop_alloc(ppool);
+}
+
+/******************************************************************************
+Name: pstreams_cacherelease
+Purpose: the reverse of pstreams_cachealloc
+Parameters:
+Caveats:
+******************************************************************************/
+static LRET
+pstreams_cacherelease(P_STREAMHEAD *strmhead, POOLHDR *ppool, void *pobj)
+{
+#ifdef PSTREAMS_PIPELINE
+    if(pstreams_self && pstreams_self->w_q[0] && PSTRMHEAD(pstreams_self->w_q[0]) == strmhead)
+    {
+        return lop_cacherelease(ppool, pobj);
+    }
+#endif
+    if(strmhead->cachetag == &pstreams_cachetag)
+    {
+        return lop_cacherelease(ppool, pobj);
+    }
+
+    return lop_release(ppool, pobj);
+}
+
+/******************************************************************************
+Name: pstreams_cacheflush
+Purpose: return objects held in the calling thread's magazines back to the
+    pools of given stream
+Parameters:
+Caveats: magazines of other threads are not flushed
+******************************************************************************/
+void
+pstreams_cacheflush(P_STREAMHEAD *strm)
+{
+    int i;
+
+    lop_cacheflush(strm->msgpool);
+    lop_cacheflush(strm->datapool);
+    if(strm->mdbpool)
+    {
+        lop_cacheflush(strm->mdbpool);
+    }
+    for(i=0; i<strm->nclasses; i++)
+    {
+        lop_cacheflush(strm->classpool[i]);
+    }
+}
+
+/******************************************************************************
+Name: pstreams_trimpools
+Purpose: give slabs of elastic pools that stayed idle through the cooldown
+    back to the backing allocator
+Parameters:
+Caveats: noop for a stream opened without a backing allocator
+******************************************************************************/
+void
+pstreams_trimpools(P_STREAMHEAD *strm)
+{
+    uint32 now;
+    int i;
+
+    if(!strm->backing)
+    {
+        return;
+    }
+
+    strm->trimtime = my_time();
+    now = (uint32)strm->trimtime;
+
+    lop_trimpool(strm->msgpool, now);
+    lop_trimpool(strm->datapool, now);
+    lop_trimpool(strm->mdbpool, now);
+    for(i=0; i<strm->nclasses; i++)
+    {
+        lop_trimpool(strm->classpool[i], now);
+    }
+}
+
     /*DEBUGMODE*/
 void
 pstreams_memstats(P_STREAMHEAD *strm)
 {
+    int i;
+
+    pstreams_cacheflush(strm);
+
     CONSOLEWRITE("PSTREAMS MEMORY STATS:");
     CONSOLEWRITE("MEMORY: msgpool - lowat=%ld,freecount=%ld,count=%ld", 
     strm->msgpool->lowat, strm->msgpool->freecount, strm->msgpool->count);
     CONSOLEWRITE("MEMORY: datapool - lowat=%ld,freecount=%ld,count=%ld",
     strm->datapool->lowat, strm->datapool->freecount, strm->datapool->count);
-#if(POOL16SIZE > 0)
-    CONSOLEWRITE("MEMORY: pool16 - lowat=%ld,freecount=%ld,count=%ld", 
-    strm->pool16->lowat, strm->pool16->freecount, strm->pool16->count);
-#endif
-#if(POOL64SIZE > 0)
-     CONSOLEWRITE("MEMORY: pool64 - lowat=%ld,freecount=%ld,count=%ld", 
-     strm->pool64->lowat, strm->pool64->freecount, strm->pool64->count);
-#endif
-#if(POOL256SIZE > 0)
-     CONSOLEWRITE("MEMORY: pool256 - lowat=%ld,freecount=%ld,count=%ld", 
-     strm->pool256->lowat, strm->pool256->freecount, strm->pool256->count);
-#endif
-#if(POOL512SIZE > 0)
-     CONSOLEWRITE("MEMORY: pool512 - lowat=%ld,freecount=%ld,count=%ld", 
-     strm->pool512->lowat, strm->pool512->freecount, strm->pool512->count);
-#endif
-#if(POOL1792SIZE > 0)
-     CONSOLEWRITE("MEMORY: pool1792 - lowat=%ld,freecount=%ld,count=%ld", 
-     strm->pool1792->lowat, strm->pool1792->freecount, strm->pool1792->count);
-#endif
+    if(strm->mdbpool)
+    {
+        CONSOLEWRITE("MEMORY: mdbpool - lowat=%ld,freecount=%ld,count=%ld",
+        strm->mdbpool->lowat, strm->mdbpool->freecount, strm->mdbpool->count);
+    }
+    for(i=0; i<strm->nclasses; i++)
+    {
+        CONSOLEWRITE("MEMORY: pool%lu - lowat=%ld,freecount=%ld,count=%ld",
+        strm->classsize[i], strm->classpool[i]->lowat,
+        strm->classpool[i]->freecount, strm->classpool[i]->count);
+    }
 }
 
 /*END pstreams.c*/
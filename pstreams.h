@@ -14,6 +14,7 @@ design for layered protocols
 #ifndef PSTREAMS_H
 #define PSTREAMS_H
 #include <stdio.h>
+#include <stddef.h>
 #include "listop.h" 
 #include "options.h"
 
@@ -41,8 +42,10 @@ enum P_DEFINES
     MAXQUEUES=12,
     MAXMSGBS=352, 
     MAXDATABS=320,
-    FASTBUFSIZE=4, /*4 bytes*/ 
-    MAXDATABSIZE=2048, /*used for debugmode sanity checks*/
+    MAXMDBS=128, /*combined P_MSGB+P_DATAB objects, for messages within FASTBUF*/
+    MAXSRVPRUNS=64, /*service procedures run by one pstreams_callsrvp*/
+    FASTBUFSIZE=4, /*4 bytes - least inline buffer, see P_STREAMCONF.inlinesize*/ 
+    MAXDATABSIZE=2048, /*for the deprecated pstreams_allocmsgb*/
     MAXFILENAMESIZE=255
 };
 
@@ -52,7 +55,8 @@ enum P_ERRORCODE
     P_OUTOFMEMORY,
     P_READBUF_TOOSMALL,
     P_BUSY,  /*flow control restriction - temporary*/
-    P_GENERALERROR
+    P_GENERALERROR,
+    P_BADPARAM /*invalid argument or configuration*/
 };
 
 /*log and trace codes passed to pstreams_log()*/
@@ -115,7 +119,10 @@ enum P_QFLAG
     QWANTW = 0x0004, 
     QFULL  = 0x0008,
     QREADR = 0x0010, 
-    QNOENB = 0x0040
+    QNOENB = 0x0040,
+    QFDREADY = 0x0080, /*device fd found readable - see pstreams_pollwait*/
+    QTIMEOUT = 0x0100, /*on the stream's timer list - see pstreams_qtimeout*/
+    QNOTIFY = 0x0200 /*streamhead read queue with a notify fd - see pstreams_notifyfd*/
 };
 
 /*recv/send (RS) priority message flags.
@@ -144,11 +151,11 @@ enum P_GETVALCODE
 typedef struct pmodule_info
 {
     ushort mi_idnum;    /*module ID number*/
-    char *mi_idname;    /*module ID name*/
+    const char *mi_idname;    /*module ID name*/
     short mi_minpsz;    /*default min pdu size in bytes*/
     short mi_maxpsz;    /*default max pdu size* in bytes*/
-    ushort mi_hiwat;    /*default bytes for 'high water' level - flow control*/
-    ushort mi_lowat;    /*default bytes for 'low water' level - flow control*/
+    uint32 mi_hiwat;    /*default bytes for 'high water' level - flow control*/
+    uint32 mi_lowat;    /*default bytes for 'low water' level - flow control*/
 } P_MODINFO;
 
 /*module related statistics*/
@@ -187,17 +194,18 @@ typedef struct p_qinit
     int (*qi_qclose)(); /*ptr to proc. called when module is closed or popped*/
     int (*qi_mchk)(); /*special - debug mode hook*/
 #endif
-    P_MODINFO *qi_minfo; /*module specific default values*/
-    P_MODSTAT *qi_mstat; /*collect statistics for this queue's module*/
+    const P_MODINFO *qi_minfo; /*module specific default values - shared, read only*/
+    P_MODSTAT *qi_mstat; /*collect statistics for this queue's module - NULL in a
+        module's table; pstreams_init_queue points it at the queue's own q_mstat*/
 } P_QINIT;
 
 /*this is what represents a module*/
 typedef struct p_streamtab 
 {
-    P_QINIT *st_rdinit;    /* read QUEUE */
-    P_QINIT *st_wrinit;    /* write QUEUE */
-    P_QINIT *st_muxrinit;  /* lower read QUEUE for MUX - unused*/
-    P_QINIT *st_muxwinit;  /* lower write QUEUE for MUX - unused*/
+    const P_QINIT *st_rdinit;    /* read QUEUE */
+    const P_QINIT *st_wrinit;    /* write QUEUE */
+    const P_QINIT *st_muxrinit;  /* lower read QUEUE for MUX - unused*/
+    const P_QINIT *st_muxwinit;  /* lower write QUEUE for MUX - unused*/
 } P_STREAMTAB;
 
 
@@ -245,7 +253,12 @@ typedef enum p_ctl_cmds
     TCPDEV_BIND,
     TCPDEV_CONNECT,
     TCPDEV_DISCONNECT,
-    TCPDEV_CLOSE
+    TCPDEV_CLOSE,
+
+    UDPDEV_RXBATCH, /*int32 - datagrams per batched read*/
+    UDPDEV_RXADDR, /*int32 - non-zero to send up source addresses*/
+    UDPDEV_FADDR, /*P_M_PROTO sent up ahead of a datagram, with its source address*/
+    UDPDEV_TXBATCH /*UDPTXBATCH - batched send thresholds*/
 } P_CTLCODE;
 
 
@@ -268,16 +281,29 @@ typedef struct p_datab
     unsigned char    *db_base;
     unsigned char    *db_lim;
     unsigned char    db_ref; /*number of MESSAGE blocks referencing this*/
-#ifndef PSTREAMS_LEAN
-    unsigned char    db_flags; /*unused*/
-#endif
+    unsigned char    db_flags; /*of type P_DBFLAGS*/
+    unsigned char    db_class; /*size class of a DBF_COMBINED block, MDBCLASS for mdbpool*/
     unsigned char    db_type; /*of type P_M_TYPES*/
 #ifndef PSTREAMS_LEAN
     struct msgb    *db_msgaddr; /*unused - backptr to MSGB*/
 #endif
-    unsigned char FASTBUF[FASTBUFSIZE]; /*small built-in buffer*/
+    /*
+     *small built-in buffer - must be the last member. P_DATABs from the
+     *pools of a stream extend it to the stream's inlinesize
+     */
+    unsigned char FASTBUF[FASTBUFSIZE];
 } P_DATAB;
 
+/*bytes taken by a P_DATAB with n bytes of inline buffer, pointer aligned*/
+#define P_DATABSIZE(n) MAX(sizeof(P_DATAB), \
+    (offsetof(P_DATAB, FASTBUF) + (n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+/*P_DATAB flags*/
+enum P_DBFLAGS
+{
+    DBF_COMBINED=0x01 /*P_DATAB is part of a P_MDBBLOCK*/
+};
+
 /*MESSAGE block - each block is associated with one DATA block. 
  *Message blocks can be linked together to denote a logical connection -
  *for example, protocol header in one block followed by the message
@@ -293,16 +319,80 @@ typedef struct p_msgb
     unsigned char *b_rptr; /*1st unread data byte of buffer*/
     unsigned char *b_wptr; /*1st unwritten data byte of buffer*/
     P_DATAB    *b_datap;        /*data block*/
+    int32 b_msglen; /*bytes from this block on, as pstreams_msgsize. -1 if unknown*/
     unsigned char    b_band; /*message priority*/
 #ifndef PSTREAMS_LEAN
     unsigned short    b_flag; /*used by streamhead - unused now*/
 #endif
 } P_MSGB;
 
+/*
+ * combined allocation - a P_MSGB, its P_DATAB and the data buffer in one
+ * pool object. The data buffer, if any, follows the P_MDBBLOCK. The object
+ * goes back to its pool when db_ref drops to 0; the embedded P_MSGB is
+ * simply abandoned if freed while a duplicate still refers to the data.
+ */
+typedef struct p_mdbblock
+{
+    P_MSGB msgb;
+    P_DATAB datab;
+} P_MDBBLOCK;
+
+#define MDBCLASS 0xFF /*db_class of P_MDBBLOCKs from mdbpool - no data buffer*/
+#define MDBDATA(mdb) ((unsigned char *)((mdb)+1))
+#define MDBBLOCK(datab) ((P_MDBBLOCK *)((char *)(datab) - offsetof(P_MDBBLOCK, datab)))
+
+/*
+ * b_msglen is kept by the pstreams_msg*() and link primitives. Code that moves
+ * b_rptr, b_wptr or b_cont itself marks the message(its first block) changed,
+ * and pstreams_msgsize works the size out again when next asked.
+ */
+#define MSGCHANGED(msg) ((msg)->b_msglen = -1)
+
+/*
+ * a position in a message, across its b_cont blocks - for parsing headers
+ * without pstreams_msgpullup. See pstreams_cursorinit.
+ */
+typedef struct p_msgcursor
+{
+    P_MSGB *c_msg; /*block holding the position. NULL at the end*/
+    unsigned char *c_ptr; /*next byte, in c_msg*/
+    uint32 c_off; /*bytes moved past since pstreams_cursorinit*/
+} P_MSGCURSOR;
+
+/*
+ * a priority band of a queue - for bands 1 and up. Band 0 is the queue's
+ * own q_msglist, q_count and QFULL/QWANTW flags.
+ */
+typedef struct p_qband
+{
+    LISTHDR *qb_msglist; /*messages of this band, oldest first*/
+    uint32 qb_count; /*count of outstanding bytes queued in this band*/
+    ushort qb_flag;  /*QFULL/QWANTW of this band*/
+    uint32 qb_hiwat; /*hi water mark - in bytes*/
+    uint32 qb_lowat; /*lo water mark - in bytes*/
+} P_QBAND;
+
+#ifdef PSTREAMS_PIPELINE
+/*
+ * ring of messages put to a queue from another thread - see pstreams_pin.
+ * One producer(the thread running the queue before) and one consumer(the
+ * thread running the queue).
+ */
+typedef struct p_spsc
+{
+    P_ATOMIC r_head; /*next slot to take - consumer's*/
+    P_ATOMIC r_tail; /*next slot to fill - producer's*/
+    P_ATOMIC r_wantw; /*producer found the ring full - back-enable it*/
+    P_MSGB *r_slot[PSTREAMS_SPSCSIZE];
+} P_SPSC;
+#endif
+
 /*the queue itself*/
 typedef struct p_queue
 {
     P_QINIT q_qinfo; /*info on processing routines for queue*/
+    P_MODSTAT q_mstat; /*this instance's statistics - see qi_mstat*/
 
     LISTHDR *q_msglist; /*queue of messages - whence the name*/
     void *strmhead;     /*pointer to its streamhead*//*TODO remove void * */
@@ -313,16 +403,42 @@ typedef struct p_queue
                               *one half of a stream module may find 
                               *the queue associated with the other half"*/
     void *q_ptr;    /*private data store*/
-    ushort q_count; /*count of outstanding bytes queued*/
+    uint32 q_count; /*count of outstanding bytes queued*/
+    int32 q_nmsg;   /*count of messages queued - all bands*/
+    int32 q_nblk;   /*count of message blocks queued - all bands*/
     ushort q_flag;    /*state of queue - treated as a bit flag*/
     short  q_minpsz; /*min packet size - unused*/
     short q_maxpsz; /*max packet size - unused*/
-    ushort q_hiwat; /*hi water mark - in bytes*/
-    ushort q_lowat; /*lo water mark - in bytes*/
-    P_BOOL q_enabled; /*special - TRUE if enabled for srvp*/
+    uint32 q_hiwat; /*hi water mark - in bytes*/
+    uint32 q_lowat; /*lo water mark - in bytes*/
+    struct p_queue *q_link; /*next on the stream's run queue, while QENAB*/
+    struct p_queue *q_tlink; /*next on the stream's timer list, while QTIMEOUT*/
+    int32 q_timeout; /*my_clockticks() at which the timer enables this queue*/
+    P_QBAND q_bandinfo[PSTREAMS_NBAND-1]; /*bands 1 and up*/
+    unsigned char q_bandmap; /*bit b-1 set while band b has messages*/
     P_LTCODE ltfilter; /*log trace filter - higher => more restrictive*/
+#ifdef PSTREAMS_PIPELINE
+    struct p_worker *q_worker; /*thread running this queue - NULL for the stream's*/
+    P_ATOMIC q_xenab; /*pstreams_qenable from another thread*/
+    P_ATOMIC q_xtimeout; /*pstreams_qtimeout from another thread - its due time|1, 0 for none*/
+    P_SPSC q_ring; /*messages from the queue before, when on another thread*/
+    LISTHDR *q_spill; /*messages for q_next that did not fit its ring, in order*/
+#endif
 } P_QUEUE;
 
+#ifdef PSTREAMS_PIPELINE
+/*thread running a pinned module's queue pair - see pstreams_pin*/
+typedef struct p_worker
+{
+    P_QUEUE *w_q[2]; /*write and read queue - NULL while the worker is free*/
+    pthread_t w_thread;
+    pthread_mutex_t w_lock;
+    pthread_cond_t w_cond;
+    P_ATOMIC w_sleeping; /*waiting on w_cond - signal it*/
+    P_ATOMIC w_stop;
+} P_WORKER;
+#endif
+
 typedef struct p_buf /*like strbuf in stropts.h*/
 {
     int maxlen;   /* size of buf below  - used for reading*/
@@ -338,6 +454,20 @@ typedef struct p_esbuf /*like strbuf in stropts.h*/
     P_FREE_RTN *fr_rtnp; /*used to free buf*/
 } P_ESBUF;
 
+typedef struct p_loan /*a received message lent to the app - see pstreams_getloan*/
+{
+    int ctllen;   /* bytes of control part. 0 if none */
+    int datlen;   /* bytes of data part. 0 if none */
+    P_MSGB *ctlmsg; /* blocks of control part - read only */
+    P_MSGB *datmsg; /* blocks of data part - read only */
+} P_LOAN;
+
+typedef struct p_mmsg /*a message of pstreams_putmmsg/pstreams_getmmsg - like mmsghdr*/
+{
+    P_BUF ctlbuf; /* control part */
+    P_BUF msgbuf; /* data part */
+} P_MMSG;
+
 /*internal definition*/
 typedef struct p_mem 
 {
@@ -346,6 +476,129 @@ typedef struct p_mem
     void *buf;        /* pointer to buffer */
 } P_MEM;
 
+/*
+ * a data buffer size class - a pool of count buffers of size bytes, each
+ * starting on an align boundary(power of 2, 0 for word alignment)
+ */
+typedef struct p_sizeclass
+{
+    uint32 size;
+    uint32 count;
+    uint32 align;
+} P_SIZECLASS;
+
+/*
+ * tunables given to pstreams_open. A NULL configuration gives the compiled
+ * defaults of options.h
+ */
+typedef struct p_streamconf
+{
+    /*
+     *backing allocator for the message, data and buffer pools. When set,
+     *these pools grow by slabs under load and return idle slabs after the
+     *cooldown (in seconds). NULL - fixed pools carved out of mem only
+     */
+    const LOPBACKING *backing;
+
+    /*
+     *data buffer size classes, ascending by size. nclasses of them upto
+     *MAXSIZECLASSES. NULL - PSTREAMS_SIZECLASSES of options.h
+     */
+    const P_SIZECLASS *classes;
+    int nclasses;
+
+    /*
+     *P_TRUE - allocb takes message block, data block and data buffer as one
+     *object from the size class(or mdbpool), freeb returns it in one go.
+     *Classes aligned beyond a word keep separate buffers
+     */
+    P_BOOL combined;
+
+    /*
+     *bytes of data kept inline in each P_DATAB - messages upto this size
+     *never touch a size class pool. 0 - PSTREAMS_INLINESIZE of options.h
+     */
+    uint32 inlinesize;
+
+    /*
+     *bytes kept free ahead of(and after) the data of messages built by
+     *putmsg, for headers prepended in place. Modules add their own share
+     *with pstreams_reserve
+     */
+    uint32 headroom;
+    uint32 tailroom;
+
+    /*
+     *P_TRUE - pstreams_open makes no memory reports on the console. Errors
+     *are still reported. Streams stood up from a template are always quiet
+     */
+    P_BOOL quiet;
+} P_STREAMCONF;
+
+#ifdef PSTREAMS_INGRESS
+/*
+ * a slot of the ingress ring - see pstreams_ingress. s_seq tells whose turn
+ * it is: the ring position a producer may fill it for, or that position+1
+ * once it holds s_msg for the stream's thread.
+ */
+typedef struct p_ingslot
+{
+    P_ATOMIC s_seq;
+    P_MSGB *s_msg;
+} P_INGSLOT;
+#endif
+
+#ifndef PSTREAMS_EPOLL
+/*a device fd of a stream, and its read queue - see pstreams_fdregister*/
+typedef struct p_pollfd
+{
+    SOCKET fd;
+    P_QUEUE *q;
+} P_POLLFD;
+#endif
+
+#ifdef PSTREAMS_SCHED
+/*ready streams of a scheduler thread - see pstreams_schedstart*/
+typedef struct p_schedlist
+{
+    P_SPINLOCK l_lock;
+    struct p_streamhead *l_head;
+    struct p_streamhead *l_tail;
+} P_SCHEDLIST;
+
+typedef struct p_schedworker
+{
+    struct p_sched *k_sched;
+    int k_idx;
+    pthread_t k_thread;
+    P_SCHEDLIST k_runq; /*taken from by this thread first, by idle ones after*/
+    P_ATOMIC k_flush; /*a stream it ran has moved on - flush its magazines*/
+    P_ATOMIC k_idle; /*about to poll or wait on s_cond*/
+} P_SCHEDWORKER;
+
+/*a pool of threads running streams - storage is the application's*/
+typedef struct p_sched
+{
+    P_SCHEDWORKER s_workers[PSTREAMS_MAXSCHED];
+    int s_nworkers;
+    P_ATOMIC s_next; /*run list for a stream made ready by other threads*/
+    P_ATOMIC s_stop;
+    P_ATOMIC s_polling; /*a thread has the poll - see pstreams_schedpoll*/
+    P_ATOMIC s_nsleeping; /*threads waiting on s_cond*/
+    P_ATOMIC s_nremoving; /*pstreams_schedremove calls waiting on s_cond*/
+    pthread_mutex_t s_lock; /*s_cond, the timer list and the s_inpoll state*/
+    pthread_cond_t s_cond;
+    struct p_streamhead *s_timerq; /*streams with a pstreams_qtimeout pending*/
+    struct p_streamhead *s_streams; /*all streams added*/
+    P_BOOL s_pollbusy; /*the poller holds streams it took from the timer list or s_epfd*/
+    P_BOOL s_inpoll; /*the poller is waiting - till s_polldue, if s_timed*/
+    P_BOOL s_timed;
+    int32 s_polldue;
+    SOCKET s_epfd; /*epoll set of the streams' own sets, and s_wakefd*/
+    SOCKET s_wakefd; /*eventfd in s_epfd - interrupts the poller*/
+} P_SCHED;
+#endif
+
 typedef struct p_streamhead /*my own*/
 {
 #ifdef M2STRICTTYPES
@@ -368,20 +621,73 @@ typedef struct p_streamhead /*my own*/
     POOLHDR *msgpool;
     POOLHDR *datapool;
     POOLHDR *qpool;
-#if(POOL16SIZE > 0)
-    POOLHDR *pool16;
-#endif
-#if(POOL64SIZE > 0)
-    POOLHDR *pool64;
+
+    /*data buffer pools, one per size class, by ascending size*/
+    int nclasses;
+    POOLHDR *classpool[MAXSIZECLASSES];
+    uint32 classsize[MAXSIZECLASSES];
+    /*size class to start looking from, by (size-1)/SIZECLASSGRAIN*/
+    uint8 *sizemap;
+
+    uint32 inlinesize; /*bytes of FASTBUF in this stream's P_DATABs*/
+    uint32 headroom; /*see pstreams_reserve*/
+    uint32 tailroom;
+
+    /*combined allocation - see P_MDBBLOCK*/
+    P_BOOL combined;
+    POOLHDR *mdbpool;
+    PDBG(int32 mdbmsgs;) /*embedded P_MSGBs in use*/
+    const LOPBACKING *backing; /*NULL unless pools are elastic*/
+    const char *cachetag; /*of the thread servicing it - see pstreams_cachealloc*/
+    UTIME trimtime; /*last time idle slabs were looked for*/
+
+    /*queues enabled(QENAB) for their srvp, in order - see pstreams_qenable*/
+    P_QUEUE *runhead;
+    P_QUEUE *runtail;
+    P_QUEUE *timerq; /*queues with a pending pstreams_qtimeout*/
+
+    SOCKET notifyfd; /*readable while apprdq has messages - see pstreams_notifyfd*/
+
+    /*device fds of this stream - see pstreams_fdregister*/
+#ifdef PSTREAMS_EPOLL
+    SOCKET epfd; /*epoll set of them*/
+#else
+    P_POLLFD pollfds[MAXPOLLFDS];
+    int npollfds;
 #endif
-#if(POOL256SIZE > 0)
-    POOLHDR *pool256;
+    P_BOOL polled; /*events gathered by a pstreams_pollwait() not yet serviced*/
+
+#ifdef PSTREAMS_INGRESS
+    /*ring through which other threads send messages - see pstreams_ingress*/
+    P_INGSLOT *ingring;
+    P_ATOMIC ingtail; /*next ring position for a producer*/
+    unsigned long inghead; /*next ring position to drain - stream's thread only*/
+    P_ATOMIC ingcount; /*messages put in the ring and not yet drained*/
+    SOCKET ingfd; /*eventfd written as ingcount leaves 0, to wake pstreams_pollwait*/
 #endif
-#if(POOL512SIZE > 0)
-    POOLHDR *pool512;
+
+#ifdef PSTREAMS_PIPELINE
+    /*threads running pinned modules - see pstreams_pin*/
+    P_WORKER workers[PSTREAMS_MAXWORKERS];
+    int nworkers;
+    P_ATOMIC wakepending; /*ingfd written for the workers, not yet serviced*/
 #endif
-#if(POOL1792SIZE > 0)
-    POOLHDR *pool1792;
+
+#ifdef PSTREAMS_SCHED
+    /*see pstreams_schedadd*/
+    P_SCHED *sched; /*running this stream - NULL if the application does*/
+    P_ATOMIC schedstate;
+    struct p_streamhead *schedlink; /*next on a run list*/
+    P_SCHEDLIST *schedlist; /*that list, while queued*/
+    P_ATOMIC schedfdready; /*its epoll set was found readable by the poller*/
+    struct p_schedworker *schedlast; /*ran it last - its magazines may hold the stream's objects*/
+    struct p_streamhead *schedanext; /*on the scheduler's list of all its streams*/
+    struct p_streamhead *schedaprev;
+    struct p_streamhead *schedtlink; /*next on the scheduler's timer list*/
+    P_BOOL schedtimed; /*on it*/
+    int32 scheddue; /*my_clockticks() of its earliest timer*/
+    void (*schedrun)(struct p_streamhead *strmhead, void *arg);
+    void *schedarg;
 #endif
 
     /*takes the place of errno in unix systems*/
@@ -392,6 +698,20 @@ typedef struct p_streamhead /*my own*/
     char ltfname[MAXFILENAMESIZE];
 } P_STREAMHEAD;
 
+/*
+ * a recipe for streams alike - device, tunables and modules. Built and
+ * checked once by pstreams_mktemplate, then stood up any number of times by
+ * pstreams_tmplopen
+ */
+typedef struct p_streamtmpl
+{
+    int devid;
+    P_STREAMCONF conf; /*copy - what it points to must outlive the template*/
+    const P_STREAMTAB *mods[MAXQUEUES/2]; /*pushed in this order*/
+    int nmods;
+    uint32 memsize; /*bytes of mem a stream of this template takes*/
+} P_STREAMTMPL;
+
 /*
  * User level ioctl format for ioctls that go downstream - 
  * like strioctl in stropts.h
@@ -408,7 +728,7 @@ typedef struct p_ioctl
 
 /*public functions*/
 P_STREAMHEAD *
-pstreams_open(int devid, P_MEM *mem, P_MEM *pmem);
+pstreams_open(int devid, P_MEM *mem, P_MEM *pmem, const P_STREAMCONF *conf);
 int
 pstreams_close(P_STREAMHEAD *strmhead);
 int
@@ -416,12 +736,49 @@ pstreams_push(P_STREAMHEAD *strmhead, const P_STREAMTAB *mod);
 int
 pstreams_pop(P_STREAMHEAD *strmhead);
 int
+pstreams_mktemplate(P_STREAMTMPL *tmpl, int devid, const P_STREAMCONF *conf,
+                    const P_STREAMTAB **mods, int nmods, P_MEM *mem, P_MEM *pmem);
+P_STREAMHEAD *
+pstreams_tmplopen(const P_STREAMTMPL *tmpl, P_MEM *mem, P_MEM *pmem);
+int
 pstreams_putmsg(P_STREAMHEAD *strmhead, P_BUF *ctlbuf, P_BUF *msgbuf, int flags);
 int
 pstreams_esmsgput(P_STREAMHEAD *strmhead, P_ESBUF *ctlbuf, P_ESBUF *msgbuf, int flags);
 int
 pstreams_getmsg(P_STREAMHEAD *strmhead, P_BUF *ctlbuf, P_BUF *msgbuf, int*pflags);
 int
+pstreams_putmmsg(P_STREAMHEAD *strmhead, P_MMSG *msgs, int nmsgs, int flags);
+int
+pstreams_getmsgwait(P_STREAMHEAD *strmhead, P_BUF *ctlbuf, P_BUF *msgbuf, int *pflags,
+                    int32 timeout);
+SOCKET
+pstreams_notifyfd(P_STREAMHEAD *strmhead);
+int
+pstreams_getmmsg(P_STREAMHEAD *strmhead, P_MMSG *msgs, int nmsgs, int *pflags);
+int
+pstreams_ingress(P_STREAMHEAD *strmhead, P_BUF *ctlbuf, P_BUF *msgbuf, int flags);
+int
+pstreams_getloan(P_STREAMHEAD *strmhead, P_LOAN *loan, int *pflags);
+#ifdef PSTREAMS_PIPELINE
+int
+pstreams_pin(P_STREAMHEAD *strmhead, ushort mi_idnum);
+#endif
+#ifdef PSTREAMS_SCHED
+int
+pstreams_schedstart(P_SCHED *sched, int nworkers);
+void
+pstreams_schedstop(P_SCHED *sched);
+int
+pstreams_schedadd(P_SCHED *sched, P_STREAMHEAD *strmhead,
+                  void (*run)(P_STREAMHEAD *strmhead, void *arg), void *arg);
+int
+pstreams_schedremove(P_STREAMHEAD *strmhead);
+#endif
+P_BOOL
+pstreams_loanseg(P_MSGB **blk, P_BUF *seg);
+void
+pstreams_loanrelease(P_STREAMHEAD *strmhead, P_LOAN *loan);
+int
 pstreams_msgcount(P_STREAMHEAD *strmhead);
 
 /*private functions*/
@@ -452,8 +809,10 @@ P_MSGB *
 pstreams_getq(P_QUEUE *q);
 int
 pstreams_canput(P_QUEUE *q);
+int
+pstreams_bcanput(P_QUEUE *q, unsigned char band);
 int     
-pstreams_init_queue(P_STREAMHEAD *strmhead, P_QUEUE *q, P_QINIT *qi);
+pstreams_init_queue(P_STREAMHEAD *strmhead, P_QUEUE *q, const P_QINIT *qi);
 int
 pstreams_connect_queue(P_QUEUE *inq, P_QUEUE *outq);
 int
@@ -463,12 +822,48 @@ pstreams_callsrvp(P_STREAMHEAD *strmhead);
 int
 pstreams_srvp(P_QUEUE *q);
 int pstreams_qsize(P_QUEUE *q);
+int
+pstreams_fdregister(P_QUEUE *q, SOCKET fd);
+void
+pstreams_fdunregister(P_QUEUE *q, SOCKET fd);
+P_BOOL
+pstreams_fdready(P_QUEUE *q);
+int
+pstreams_pollwait(P_STREAMHEAD *strmhead, int32 timeout);
+SOCKET
+pstreams_pollfd(P_STREAMHEAD *strmhead);
+void
+pstreams_qenable(P_QUEUE *q);
+void
+pstreams_qtimeout(P_QUEUE *q, int32 ms);
+int32
+pstreams_waittime(P_STREAMHEAD *strmhead);
 
 /*msgdsize - number of bytes in M_DATA blocks attached to a message*/
-ushort 
+uint32 
 pstreams_msg1size(P_MSGB *msg);
-ushort 
+uint32 
 pstreams_msgsize(P_MSGB *msg);
+#ifdef PSTREAMS_SENDMSG
+int
+pstreams_msgtoiov(P_MSGB *msg, struct iovec *iov, int maxiov);
+int
+pstreams_msgroomiov(P_MSGB *msg, struct iovec *iov, int maxiov);
+#endif
+int
+pstreams_msgfill(P_STREAMHEAD *strmhead, P_MSGB *msg, uint32 len);
+
+/*cursor over a message's blocks - peek/read/skip/write without pullup*/
+void
+pstreams_cursorinit(P_MSGCURSOR *cur, P_MSGB *msg);
+void *
+pstreams_cursorpeek(P_MSGCURSOR *cur, void *buf, uint32 len);
+void *
+pstreams_cursorread(P_MSGCURSOR *cur, void *buf, uint32 len);
+int
+pstreams_cursorskip(P_MSGCURSOR *cur, uint32 len);
+int
+pstreams_cursorwrite(P_MSGCURSOR *cur, const void *data, uint32 len);
 
 void
 pstreams_put_strmhead(P_QUEUE *q, P_STREAMHEAD *strmhead);
@@ -522,16 +917,32 @@ int
 pstreams_countmsgcont(P_MSGB *msg);
 int
 pstreams_countmsg(LISTHDR *msglist);
+int
+pstreams_qcountmsg(P_QUEUE *q);
 
 void *
 pstreams_memassign(P_MEM *mem, int32 size);
 P_MSGB *
 pstreams_allocb(P_STREAMHEAD *strmhead, int32 size, uint priority);
 P_MSGB *
+pstreams_allocbr(P_STREAMHEAD *strmhead, int32 size, uint priority);
+P_MSGB *
+pstreams_allocmsg(P_STREAMHEAD *strmhead, int32 size);
+void
+pstreams_reserve(P_STREAMHEAD *strmhead, uint32 headroom, uint32 tailroom);
+P_MSGB *
+pstreams_prepend(P_STREAMHEAD *strmhead, P_MSGB *msg, int32 len);
+P_MSGB *
 pstreams_esballoc(P_STREAMHEAD *strmhead, unsigned char *base, 
                   int32 size, int pri, P_FREE_RTN *free_rtn);
 int32
-pstreams_mpool(int32 size);
+pstreams_mpool(P_STREAMHEAD *strmhead, int32 size);
+int32
+pstreams_rdbufsize(P_STREAMHEAD *strmhead, int32 limit);
+uint32
+pstreams_bufavail(P_STREAMHEAD *strmhead, int32 size);
+int
+pstreams_sizeclass(P_STREAMHEAD *strmhead, int32 size);
 unsigned char *
 pstreams_mem_alloc(P_STREAMHEAD *strmhead, int32 size, int flag);
 void
@@ -559,7 +970,11 @@ pstreams_freemsg(P_STREAMHEAD *strmhead, P_MSGB *msg);
 P_BOOL
 pstreams_comparemsg(P_STREAMHEAD *strm, P_MSGB *msg1, P_MSGB *msg2); /*strictly for debug*/
 int
-pstreams_checkmsg(P_MSGB *msg);
+pstreams_checkmsg(P_STREAMHEAD *strm, P_MSGB *msg);
 void
 pstreams_memstats(P_STREAMHEAD *strm);
+void
+pstreams_cacheflush(P_STREAMHEAD *strm);
+void
+pstreams_trimpools(P_STREAMHEAD *strm);
 #endif
@@ -19,60 +19,31 @@ Activity:
 #include "pstreams.h"
 #include "pstreams_echo.h"
 
-P_QINIT echo_wrinit={0};
-P_QINIT echo_rdinit={0};
-P_STREAMTAB echo_streamtab={0};
-P_MODINFO echo_wrmodinfo={0};
-P_MODINFO echo_rdmodinfo={0};
+static const P_MODINFO echo_wrmodinfo={1, "LOOPBACK WR", 0, 128, 1024, 256};
+static const P_MODINFO echo_rdmodinfo={1, "LOOPBACK_RD", 0, 128, 1024, 256};
+#ifdef M2STRICTTYPES
+static const P_QINIT echo_wrinit={echo_wput, echo_wsrvp,
+    echo_open, NULL, NULL, &echo_wrmodinfo, NULL};
+static const P_QINIT echo_rdinit={echo_rput, echo_rsrvp,
+    echo_open, NULL, NULL, &echo_rdmodinfo, NULL};
+#else
+static const P_QINIT echo_wrinit={(int (*)())echo_wput, (int (*)())echo_wsrvp,
+    (int (*)())echo_open, NULL, NULL, &echo_wrmodinfo, NULL};
+static const P_QINIT echo_rdinit={(int (*)())echo_rput, (int (*)())echo_rsrvp,
+    (int (*)())echo_open, NULL, NULL, &echo_rdmodinfo, NULL};
+#endif
+const P_STREAMTAB echo_streamtab={&echo_rdinit, &echo_wrinit, NULL, NULL};
 
 /******************************************************************************
 Name: echo_init
-Purpose: initialises echo module. This is to be called before pushing this module
-    into the streamhead
+Purpose: kept for existing callers - echo_streamtab is initialised at compile
+    time, so there is nothing to do before pushing it.
 Parameters:
 Caveats:
 ******************************************************************************/
 int
 echo_init()
 {
-    /*first initialize echomodinfo*/
-    echo_wrmodinfo.mi_idnum = 1;
-    echo_wrmodinfo.mi_idname = "LOOPBACK WR";
-    echo_wrmodinfo.mi_minpsz = 0;
-    echo_wrmodinfo.mi_maxpsz = 128;
-    echo_wrmodinfo.mi_hiwat = 1024;
-    echo_wrmodinfo.mi_lowat = 256;
-
-    echo_rdmodinfo.mi_idnum = 1;
-    echo_rdmodinfo.mi_idname = "LOOPBACK_RD";
-    echo_rdmodinfo.mi_minpsz = 0;
-    echo_rdmodinfo.mi_maxpsz = 128;
-    echo_rdmodinfo.mi_hiwat = 1024;
-    echo_rdmodinfo.mi_lowat = 256;
-
-    /*init echo_streamtab*/
-#ifdef M2STRICTTYPES
-    echo_wrinit.qi_qopen = echo_open;
-    echo_wrinit.qi_putp = echo_wput;
-    echo_wrinit.qi_srvp = echo_wsrvp;
-    echo_rdinit.qi_qopen = echo_open;
-    echo_rdinit.qi_putp = echo_rput;
-    echo_rdinit.qi_srvp = echo_rsrvp;
-#else
-    echo_wrinit.qi_qopen = (int (*)())echo_open;
-    echo_wrinit.qi_putp = (int (*)())echo_wput;
-    echo_wrinit.qi_srvp = (int (*)())echo_wsrvp;
-    echo_rdinit.qi_qopen = (int (*)())echo_open;
-    echo_rdinit.qi_putp = (int (*)())echo_rput;
-    echo_rdinit.qi_srvp = (int (*)())echo_rsrvp;
-#endif
-
-    echo_wrinit.qi_minfo = &echo_wrmodinfo;
-    echo_rdinit.qi_minfo = &echo_rdmodinfo;
-
-    echo_streamtab.st_wrinit = &echo_wrinit;
-    echo_streamtab.st_rdinit = &echo_rdinit;
-
     return 0;
 }
 
@@ -161,7 +132,9 @@ echo_wsrvp(P_QUEUE *wq)
 Name: echo_rsrvp
 Purpose: service procedure for the read queue
 Parameters:
-Caveats:
+Caveats: rq is filled by echo_wsrvp, not by the queue below - the back-enable
+    of pstreams_getq goes there. The write side is enabled here instead, once
+    rq is drained.
 ******************************************************************************/
 int
 echo_rsrvp(P_QUEUE *rq)
@@ -179,6 +152,11 @@ echo_rsrvp(P_QUEUE *rq)
         pstreams_putnext(rq, msg);
     }
 
+    if(!msg && pstreams_qsize(WR(rq)))
+    {
+        pstreams_qenable(WR(rq)); /*echo_wsrvp may have held back for room*/
+    }
+
     return P_STREAMS_SUCCESS;
 }
 
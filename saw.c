@@ -20,65 +20,39 @@ Activity:
 #include "pstreams.h"
 #include "saw.h"
 
+static void
+saw_armtimer(P_QUEUE *wq, uint32 timer);
+
 #define PSTREAMS_LT
 
 /*
  * Declare memory for SAW, as required by PSTREAMS framework
  */
-P_STREAMTAB saw_streamtab={0}; /*SAW module*/
-P_MODINFO saw_wrmodinfo={0}; /*SAW module info for writer*/
-P_MODINFO saw_rdmodinfo={0}; /*SAW module infor for reader*/
-P_QINIT saw_wrinit={0}; /*SAW reader queue*/
-P_QINIT saw_rdinit={0}; /*SAW writer queue*/
+static const P_MODINFO saw_wrmodinfo={10, "SAW WR", 0, 128, 64, 32}; /*hiwat is the flow-control cut-off*/
+static const P_MODINFO saw_rdmodinfo={10, "SAW RD", 0, 128, 1024, 256};
+#ifdef M2STRICTTYPES
+static const P_QINIT saw_wrinit={saw_wput, saw_wsrvp,
+    saw_open, NULL, NULL, &saw_wrmodinfo, NULL};
+static const P_QINIT saw_rdinit={saw_rput, saw_rsrvp,
+    saw_open, NULL, NULL, &saw_rdmodinfo, NULL};
+#else
+static const P_QINIT saw_wrinit={(int (*)())saw_wput, (int (*)())saw_wsrvp,
+    (int (*)())saw_open, NULL, NULL, &saw_wrmodinfo, NULL};
+static const P_QINIT saw_rdinit={(int (*)())saw_rput, (int (*)())saw_rsrvp,
+    (int (*)())saw_open, NULL, NULL, &saw_rdmodinfo, NULL};
+#endif
+const P_STREAMTAB saw_streamtab={&saw_rdinit, &saw_wrinit, NULL, NULL}; /*SAW module*/
 
 /******************************************************************************
 Name: saw_init
-Purpose: initialises echo module. This is to be called before pushing this module
-    into the streamhead
+Purpose: kept for existing callers. saw_streamtab is a constant table now,
+    and each SAW instance keeps its state in the SAWAREA off q_ptr.
 Parameters:
-Caveats:
+Caveats: pstreams_push(strm, &saw_streamtab) needs no saw_init() first.
 ******************************************************************************/
 int
 saw_init()
 {
-    /*first initialize SAW modinfo structures*/
-    saw_wrmodinfo.mi_idnum = 10;
-    saw_wrmodinfo.mi_idname = "SAW WR";
-    saw_wrmodinfo.mi_minpsz = 0;
-    saw_wrmodinfo.mi_maxpsz = 128;
-    saw_wrmodinfo.mi_hiwat = 64; //flow-control cut-off
-    saw_wrmodinfo.mi_lowat = 32;
-
-    saw_rdmodinfo.mi_idnum = 10;
-    saw_rdmodinfo.mi_idname = "SAW RD";
-    saw_rdmodinfo.mi_minpsz = 0;
-    saw_rdmodinfo.mi_maxpsz = 128;
-    saw_rdmodinfo.mi_hiwat = 1024; //flow-control cut-off
-    saw_rdmodinfo.mi_lowat = 256;
-
-    /*init saw_streamtab*/
-#ifdef M2STRICTTYPES
-    saw_wrinit.qi_qopen = saw_open;
-    saw_wrinit.qi_putp = saw_wput;
-    saw_wrinit.qi_srvp = saw_wsrvp;
-    saw_rdinit.qi_qopen = saw_open;
-    saw_rdinit.qi_putp = saw_rput;
-    saw_rdinit.qi_srvp = saw_rsrvp;
-#else
-    saw_wrinit.qi_qopen = (int (*)())saw_open;
-    saw_wrinit.qi_putp = (int (*)())saw_wput;
-    saw_wrinit.qi_srvp = (int (*)())saw_wsrvp;
-    saw_rdinit.qi_qopen = (int (*)())saw_open;
-    saw_rdinit.qi_putp = (int (*)())saw_rput;
-    saw_rdinit.qi_srvp = (int (*)())saw_rsrvp;
-#endif
-
-    saw_wrinit.qi_minfo = &saw_wrmodinfo;
-    saw_rdinit.qi_minfo = &saw_rdmodinfo;
-
-    saw_streamtab.st_wrinit = &saw_wrinit;
-    saw_streamtab.st_rdinit = &saw_rdinit;
-
     return 0;
 }
 
@@ -110,6 +84,9 @@ saw_open(P_QUEUE *q)
         sawArea->SendAckTimer = 0;
 
         q->q_ptr = sawArea;
+
+        /*SAW header goes in front of every message sent*/
+        pstreams_reserve(PSTRMHEAD(q), sizeof(SAWHDR), 0);
     }
 
     return P_STREAMS_SUCCESS;
@@ -197,14 +174,13 @@ saw_wsrvp(P_QUEUE *wq)
         ASSERT(msg);
         if(pstreams_canput(wq->q_next))
         {
-            P_MSGB *sawHdrMsg = saw_gethdr(wq);
+            P_MSGB *sawHdrMsg = saw_gethdr(wq, msg);
 
             if(!sawHdrMsg)
             {
                 //TODO:
                 ASSERT(sawHdrMsg);
             }
-            sawHdrMsg->b_cont = msg;
             pstreams_putnext(wq, sawHdrMsg);
 
             sawArea->SendAckTimer = 0;
@@ -216,23 +192,47 @@ saw_wsrvp(P_QUEUE *wq)
     {
         if(my_time() > sawArea->SendAckTimer)
         {
-            P_MSGB *sawHdrMsg = saw_gethdr(wq);
+            P_MSGB *sawHdrMsg = saw_gethdr(wq, msg);
 
             if(!sawHdrMsg)
             {
                 //TODO:
                 ASSERT(sawHdrMsg);
             }
-            sawHdrMsg->b_cont = msg;
             pstreams_putnext(wq, sawHdrMsg);
 
             sawArea->SendAckTimer = 0;
         }
     }
 
+    /*come back for the timers still running*/
+    if(sawArea->AckWaitTimer > 0)
+    {
+        saw_armtimer(wq, sawArea->AckWaitTimer);
+    }
+    if(sawArea->SendAckTimer > 0)
+    {
+        saw_armtimer(wq, sawArea->SendAckTimer);
+    }
+
     return P_STREAMS_SUCCESS;
 }
 
+/******************************************************************************
+Name: saw_armtimer
+Purpose: have saw_wsrvp run again once timer may have expired
+Parameters: timer - a my_time() value, in seconds, as in SAWAREA
+Caveats: with seconds to go q is enabled near the end of them; in the last
+        second it is polled every SAWTIMERPOLL milliseconds
+******************************************************************************/
+static void
+saw_armtimer(P_QUEUE *wq, uint32 timer)
+{
+    uint32 now = my_time();
+
+    pstreams_qtimeout(wq, timer > now ? (timer-now)*1000 : SAWTIMERPOLL);
+}
+
 /******************************************************************************
 Name: saw_rsrvp
 Purpose: service procedure for the read queue
@@ -270,13 +270,16 @@ saw_rput(P_QUEUE *q, P_MSGB *msg)
 {
     SAWAREA *sawArea = (SAWAREA *)q->q_ptr;
     SAWHDR *hdr = NULL;
+    SAWHDR hdrbuf; /*for a header split across blocks*/
+    P_MSGCURSOR cur;
 
     ASSERT(msg);
 
-    if(pstreams_msgsize(msg) >= sizeof(SAWHDR))
+    pstreams_cursorinit(&cur, msg);
+    hdr = (SAWHDR *)pstreams_cursorread(&cur, &hdrbuf, sizeof(SAWHDR));
+    if(hdr)
     {
-        hdr = (SAWHDR *)msg->b_rptr;
-        pstreams_msgconsume(msg, sizeof(SAWHDR));
+        pstreams_msgconsume(msg, cur.c_off);
     }
     else
     {
@@ -304,6 +307,7 @@ saw_rput(P_QUEUE *q, P_MSGB *msg)
             pstreams_log(q, PSTREAMS_LT6, "Advanced SeqNo: SeqNo=%d, AckNo=%d",
                 sawArea->SeqNo, sawArea->AckNo);
             sawArea->AckWaitTimer = 0;
+            pstreams_qenable(WR(q)); /*the next message may go now*/
         }
     }
 
@@ -322,6 +326,7 @@ saw_rput(P_QUEUE *q, P_MSGB *msg)
 
         sawArea->SendAckTimer =
             my_time() + sawArea->SendAckTimeout;
+        saw_armtimer(WR(q), sawArea->SendAckTimer);
         if(pstreams_msgsize(msg) > 0)
         {
             pstreams_putq(q, msg);
@@ -383,29 +388,31 @@ saw_getarea(P_QUEUE *q)
     return sawArea;
 }
 
+/******************************************************************************
+Name: saw_gethdr
+Purpose: puts a SAW header ahead of msg - in the headroom reserved at open
+    when there is some
+Parameters: msg - NULL for a header-only message(ACK)
+Caveats: returns NULL if out of memory
+******************************************************************************/
 P_MSGB *
-saw_gethdr(P_QUEUE *q)
+saw_gethdr(P_QUEUE *q, P_MSGB *msg)
 {
     SAWAREA *sawArea = (SAWAREA *)q->q_ptr;
     P_MSGB *hdrmsg = NULL;
     SAWHDR *hdr = NULL;
 
-    hdrmsg = pstreams_allocb((P_STREAMHEAD *)q->strmhead, sizeof(SAWHDR), 0);
+    hdrmsg = pstreams_prepend((P_STREAMHEAD *)q->strmhead, msg, sizeof(SAWHDR));
     if(!hdrmsg)
     {
-        PSTRMHEAD(q)->perrno = P_OUTOFMEMORY;
         return NULL;
     }
 
-    hdrmsg->b_datap->db_type = P_M_DATA;
-
     /*fill header fields*/
-    hdr = (SAWHDR *)hdrmsg->b_wptr;
+    hdr = (SAWHDR *)hdrmsg->b_rptr;
     fieldassign(&hdr->SeqNo, sawArea->SeqNo, 1);
     fieldassign(&hdr->AckNo, sawArea->AckNo, 1);
 
-    hdrmsg->b_wptr += sizeof(SAWHDR);
-
     return hdrmsg;
 }
 
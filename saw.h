@@ -26,6 +26,9 @@ typedef struct saw_area
     uint32 SendAckTimeout; //holds time-out value for SendAckTimer
 } SAWAREA;
 
+/*milliseconds between looks at a timer in its last second*/
+#define SAWTIMERPOLL 50
+
 typedef struct saw_hdr
 {
     int8 SeqNo;
@@ -49,7 +52,7 @@ saw_myctl(P_QUEUE *q, P_MSGB *msg);
 SAWAREA *
 saw_getarea(P_QUEUE *q);
 P_MSGB *
-saw_gethdr(P_QUEUE *q);
+saw_gethdr(P_QUEUE *q, P_MSGB *msg);
 void
 saw_abort();
 #endif
@@ -24,14 +24,32 @@ varying with the actual device
 #define PDBGTRACE(x) ((void)(x))
 #endif
 
-P_QINIT stdapp_wrinit={0};
-P_QINIT stdapp_rdinit={0};
-P_QINIT stddev_wrinit={0};
-P_QINIT stddev_rdinit={0};
-P_STREAMTAB stdapp_streamtab={0};
-P_STREAMTAB stddev_streamtab={0};
-P_MODINFO stdappmodinfo={0};
-P_MODINFO stddevmodinfo={0};
+static const P_MODINFO stdappmodinfo={1, "STDAPP_RW", 0, 100, 128, 128};
+static const P_MODINFO stddevmodinfo={2, "STDDEV_RW", 0, 100, 1024, 256};
+#ifdef PSTREAMS_STRICTTYPES
+static const P_QINIT stdapp_wrinit={stdapp_wput, NULL,
+    stdapp_open, NULL, NULL, &stdappmodinfo, NULL};
+static const P_QINIT stdapp_rdinit={stdapp_rput, NULL,
+    stdapp_open, NULL, NULL, &stdappmodinfo, NULL};
+#else
+static const P_QINIT stdapp_wrinit={(int (*)())stdapp_wput, NULL,
+    (int (*)())stdapp_open, NULL, NULL, &stdappmodinfo, NULL};
+static const P_QINIT stdapp_rdinit={(int (*)())stdapp_rput, NULL,
+    (int (*)())stdapp_open, NULL, NULL, &stdappmodinfo, NULL};
+#endif
+#ifdef M2STRICTTYPES
+static const P_QINIT stddev_wrinit={stddev_wput, NULL,
+    NULL, NULL, NULL, &stddevmodinfo, NULL};
+static const P_QINIT stddev_rdinit={stddev_rput, NULL,
+    NULL, NULL, NULL, &stddevmodinfo, NULL};
+#else
+static const P_QINIT stddev_wrinit={(int (*)())stddev_wput, NULL,
+    NULL, NULL, NULL, &stddevmodinfo, NULL};
+static const P_QINIT stddev_rdinit={(int (*)())stddev_rput, NULL,
+    NULL, NULL, NULL, &stddevmodinfo, NULL};
+#endif
+const P_STREAMTAB stdapp_streamtab={&stdapp_rdinit, &stdapp_wrinit, NULL, NULL};
+const P_STREAMTAB stddev_streamtab={&stddev_rdinit, &stddev_wrinit, NULL, NULL};
 
 
 /*default stream head routines*/
@@ -133,38 +151,7 @@ stddev_rput(P_QUEUE *q, P_MSGB *msg)
 int
 stdapp_init()
 {
-    PDBGTRACE("stdapp_init: entered");
-
-    /*first initialize stdappmodinfo*/
-    stdappmodinfo.mi_idnum = 1;
-    stdappmodinfo.mi_idname = "STDAPP_RW";
-    stdappmodinfo.mi_minpsz = 0;
-    stdappmodinfo.mi_maxpsz = 100;
-    stdappmodinfo.mi_hiwat = 128;
-    stdappmodinfo.mi_lowat = 128;
-
-
-    /*init stdapp_streamtab*/
-#ifdef PSTREAMS_STRICTTYPES
-    stdapp_wrinit.qi_qopen = stdapp_open;
-    stdapp_wrinit.qi_putp = stdapp_wput;
-    stdapp_rdinit.qi_putp = stdapp_rput;
-    stdapp_rdinit.qi_qopen = stdapp_open;
-#else
-    stdapp_wrinit.qi_qopen = (int (*)())stdapp_open;
-    stdapp_wrinit.qi_putp = (int (*)())stdapp_wput;
-    stdapp_rdinit.qi_putp = (int (*)())stdapp_rput;
-    stdapp_rdinit.qi_qopen = (int (*)())stdapp_open;
-#endif
-
-    stdapp_wrinit.qi_minfo = &stdappmodinfo;
-    stdapp_rdinit.qi_minfo = &stdappmodinfo;
-
-    stdapp_streamtab.st_wrinit = &stdapp_wrinit;
-    stdapp_streamtab.st_rdinit = &stdapp_rdinit;
-
-    PDBGTRACE("stdapp_init: exit");
-
+    /*stdapp_streamtab is a constant table - nothing to set up*/
     return 0;
 }
     
@@ -184,37 +171,7 @@ stdapp_open(P_QUEUE *q)
 int
 stddev_init()
 {
-    PDBGTRACE("stddev_init: entered");
-
-    /*first initialize stddevmodinfo*/
-    stddevmodinfo.mi_idnum = 2;
-    stddevmodinfo.mi_idname = "STDDEV_RW";
-    stddevmodinfo.mi_minpsz = 0;
-    stddevmodinfo.mi_maxpsz = 100;
-    stddevmodinfo.mi_hiwat = 1024;
-    stddevmodinfo.mi_lowat = 256;
-
-    /*init stddev_streamtab*/
-#ifdef M2STRICTTYPES
-    stddev_wrinit.qi_qopen = NULL;
-    stddev_wrinit.qi_putp = stddev_wput;
-    stddev_rdinit.qi_putp = stddev_rput;
-    stddev_rdinit.qi_qopen = NULL;
-#else
-    stddev_wrinit.qi_qopen = (int (*)())NULL;
-    stddev_wrinit.qi_putp = (int (*)())stddev_wput;
-    stddev_rdinit.qi_putp = (int (*)())stddev_rput;
-    stddev_rdinit.qi_qopen = (int (*)())NULL;
-#endif
-
-    stddev_wrinit.qi_minfo = &stddevmodinfo;
-    stddev_rdinit.qi_minfo = &stddevmodinfo;
-
-    stddev_streamtab.st_wrinit = &stddev_wrinit;
-    stddev_streamtab.st_rdinit = &stddev_rdinit;
-
-    PDBGTRACE("stddev_init: entered");
-
+    /*as stdapp_init*/
     return 0;
 }
 
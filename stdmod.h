@@ -20,7 +20,7 @@ stdapp_wput(P_QUEUE *q, P_MSGB *msg);
 int
 stdapp_rput(P_QUEUE *q, P_MSGB *msg);
 int
-stdev_wput(P_QUEUE *q, P_MSGB *msg);
+stddev_wput(P_QUEUE *q, P_MSGB *msg);
 int
 stddev_rput(P_QUEUE *q, P_MSGB *msg);
 int
@@ -10,6 +10,7 @@ FILE: tcpdev.c
 ===========================================================================*/
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "options.h"
 #include "env.h"
 #include "assert.h"
@@ -18,59 +19,38 @@ FILE: tcpdev.c
 #include "tcpdev.h"
 #include "util.h"
 
-P_QINIT tcpdev_wrinit={0};
-P_QINIT tcpdev_rdinit={0};
-P_STREAMTAB tcpdev_streamtab={0};
-P_MODINFO tcpdev_wrmodinfo={0};
-P_MODINFO tcpdev_rdmodinfo={0};
+#ifdef PSTREAMS_SENDMSG
+static int32
+tcpdev_rxmore(P_QUEUE *q, P_MSGB *msg);
+#endif
+static TCPDEVAREA *
+tcpdev_getarea(P_QUEUE *q);
+
+static const P_MODINFO tcpdev_wrmodinfo={1, "TCPDEV WR", 0, 100, 1024, 256};
+static const P_MODINFO tcpdev_rdmodinfo={1, "TCPDEV_RD", 0, 100, 1024, 256};
+#ifdef PSTREAMS_STRICTTYPES
+static const P_QINIT tcpdev_wrinit={tcpdev_wput, NULL,
+    tcpdev_open, NULL, NULL, &tcpdev_wrmodinfo, NULL};
+static const P_QINIT tcpdev_rdinit={tcpdev_rput, tcpdev_rsrvp,
+    tcpdev_open, NULL, NULL, &tcpdev_rdmodinfo, NULL};
+#else
+static const P_QINIT tcpdev_wrinit={(int (*)())tcpdev_wput, NULL,
+    (int (*)())tcpdev_open, NULL, NULL, &tcpdev_wrmodinfo, NULL};
+static const P_QINIT tcpdev_rdinit={(int (*)())tcpdev_rput, (int (*)())tcpdev_rsrvp,
+    (int (*)())tcpdev_open, NULL, NULL, &tcpdev_rdmodinfo, NULL};
+#endif
+const P_STREAMTAB tcpdev_streamtab={&tcpdev_rdinit, &tcpdev_wrinit, NULL, NULL};
 
 /******************************************************************************
 Name: tcpdev_init
-Purpose: initialise this module. constructor for this module.
+Purpose: initialise this module. tcpdev_streamtab is constant, and each stream
+    has its own TCPDEVAREA off q_ptr - nothing to do.
 Parameters:
-Caveats:
+Caveats: no longer called by pstreams_open.
 ******************************************************************************/
 int
 tcpdev_init()
 {
-    /*first initialize tcpdevmodinfo*/
-    tcpdev_wrmodinfo.mi_idnum = 1;
-    tcpdev_wrmodinfo.mi_idname = "TCPDEV WR";
-    tcpdev_wrmodinfo.mi_minpsz = 0;
-    tcpdev_wrmodinfo.mi_maxpsz = 100;
-    tcpdev_wrmodinfo.mi_hiwat = 1024;
-    tcpdev_wrmodinfo.mi_lowat = 256;
-
-    tcpdev_rdmodinfo.mi_idnum = 1;
-    tcpdev_rdmodinfo.mi_idname = "TCPDEV_RD";
-    tcpdev_rdmodinfo.mi_minpsz = 0;
-    tcpdev_rdmodinfo.mi_maxpsz = 100;
-    tcpdev_rdmodinfo.mi_hiwat = 1024;
-    tcpdev_rdmodinfo.mi_lowat = 256;
-
-    /*init tcpdev_streamtab*/
-#ifdef PSTREAMS_STRICTTYPES
-    tcpdev_wrinit.qi_qopen = tcpdev_open;
-    tcpdev_wrinit.qi_putp = tcpdev_wput;
-    tcpdev_wrinit.qi_srvp = NULL;
-    tcpdev_rdinit.qi_qopen = tcpdev_open;
-    tcpdev_rdinit.qi_putp = tcpdev_rput;
-    tcpdev_rdinit.qi_srvp = tcpdev_rsrvp;
-#else
-    tcpdev_wrinit.qi_qopen = (int (*)())tcpdev_open;
-    tcpdev_wrinit.qi_putp = (int (*)())tcpdev_wput;
-    tcpdev_wrinit.qi_srvp = NULL;
-    tcpdev_rdinit.qi_qopen = (int (*)())tcpdev_open;
-    tcpdev_rdinit.qi_putp = (int (*)())tcpdev_rput;
-    tcpdev_rdinit.qi_srvp = (int (*)())tcpdev_rsrvp;
-#endif
-
-    tcpdev_wrinit.qi_minfo = &tcpdev_wrmodinfo;
-    tcpdev_rdinit.qi_minfo = &tcpdev_rdmodinfo;
-
-    tcpdev_streamtab.st_wrinit = &tcpdev_wrinit;
-    tcpdev_streamtab.st_rdinit = &tcpdev_rdinit;
-
     return P_STREAMS_SUCCESS;
 }
 
@@ -95,9 +75,13 @@ tcpdev_open(P_QUEUE *q)
     }
     else
     {
-        area = tcpdev_getarea(NULL);
+        area = tcpdev_getarea(q);
 
-        ASSERT(area); /*TODO - handle*/
+        if(!area)
+        {
+            PSTRMHEAD(q)->perrno = P_OUTOFMEMORY;
+            return P_STREAMS_FAILURE;
+        }
 #ifdef PSTREAMS_WIN32
         /*init winsock*/
         if(PDEV_INIT(MAKEWORD(2,2), &area->wsadata) != 0)
@@ -194,6 +178,10 @@ tcpdev_wput_data(P_QUEUE *q, P_MSGB *msg)
     TCPDEVAREA *area=NULL;
     int32 msgsize=0;
     int sockstatus=0;
+    int niov=-1; /*iovec entries describing msg - -1 if no scatter-gather*/
+#ifdef PSTREAMS_SENDMSG
+    struct iovec iov[PSTREAMS_MAXIOV];
+#endif
 
     ASSERT(msg);
 
@@ -202,10 +190,17 @@ tcpdev_wput_data(P_QUEUE *q, P_MSGB *msg)
     /*process*/
     msgsize = pstreams_msgsize(msg);
 
+#ifdef PSTREAMS_SENDMSG
+    if(pstreams_countmsgcont(msg) > 1)
+    {
+        niov = pstreams_msgtoiov(msg, iov, PSTREAMS_MAXIOV);
+    }
+#endif
+
     /*if we do not have access to scatter write for 
      *TCP send then the following block helps
      */
-    if(pstreams_countmsgcont(msg) > 1)
+    if(niov < 0 && pstreams_countmsgcont(msg) > 1)
     {
         P_MSGB *pullupmsg = pstreams_msgpullup(PSTRMHEAD(q), msg, msgsize);
 
@@ -220,7 +215,7 @@ tcpdev_wput_data(P_QUEUE *q, P_MSGB *msg)
             return P_STREAMS_SUCCESS;
         }
 
-        ASSERT(msgsize == pstreams_msg1size(pullupmsg));
+        ASSERT(msgsize == (int32)pstreams_msg1size(pullupmsg));
 
         pstreams_freemsg(PSTRMHEAD(q), msg);
         msg = pullupmsg;
@@ -228,15 +223,22 @@ tcpdev_wput_data(P_QUEUE *q, P_MSGB *msg)
 
 #ifdef PSTREAMS_TCPDUMP
     {
-        uchar hexbuf[1792*2]={0};
+        uchar hexbuf[MAXTCPDGRAMSIZE*2]={0};
 
-        bintohex(hexbuf, msg->b_rptr, msgsize);
+        bintohex(hexbuf, msg->b_rptr, MIN(pstreams_msg1size(msg), sizeof(hexbuf)/2 - 1));
 
         pstreams_log(q, PSTREAMS_LTINFO, "tcpdev_wput_data: sending %ld bytes\n%s",
             msgsize, hexbuf);
     }
 #endif
 
+#ifdef PSTREAMS_SENDMSG
+    if(niov >= 0)
+    {
+        sockstatus = writev(area->sock, iov, niov);
+    }
+    else
+#endif
     sockstatus = send(area->sock, (char *)msg->b_rptr, msgsize, 0);
     if(sockstatus == SOCKET_ERROR)
     {
@@ -263,7 +265,7 @@ tcpdev_wput_data(P_QUEUE *q, P_MSGB *msg)
     }
 
     /*sockstatus holds bytes sent by send()*/
-    ASSERT(sockstatus <= pstreams_msgsize(msg));
+    ASSERT(sockstatus <= (int)pstreams_msgsize(msg));
 
     pstreams_log(q, PSTREAMS_LTINFO, "TCP socket send succeeded."
             " Device State: 0x%x", area->state);
@@ -412,11 +414,19 @@ tcpdev_wput_ctl(P_QUEUE *q, P_MSGB *msg)
                 }
 
                 area->state = TCPDEVSTATE_DATA;/*ready to connect*/
+
+                /*tcpdev_rsrvp runs when pstreams_pollwait finds the socket readable*/
+                if(pstreams_fdregister(RD(q), area->sock) != P_STREAMS_SUCCESS)
+                {
+                    pstreams_log(q, PSTREAMS_LTERROR, "TCP device: pstreams_fdregister"
+                        " failed. lasterror %d", PSTRMHEAD(q)->perrno);
+                }
                 pstreams_log(q, PSTREAMS_LTINFO, "TCP socket connect succeeded."
                     " Device State: 0x%x", area->state);
                 break;
             
             case TCPDEV_DISCONNECT:
+                pstreams_fdunregister(RD(q), area->sock);
 #if(0)
                 sockstatus = shutdown(area->sock, 2);
 #else
@@ -473,6 +483,7 @@ tcpdev_wput_ctl(P_QUEUE *q, P_MSGB *msg)
                 break;
 
             case TCPDEV_CLOSE:
+                pstreams_fdunregister(RD(q), area->sock);
 #ifdef PSTREAMS_WIN32
                 sockstatus = closesocket(area->sock);
 #else
@@ -508,6 +519,7 @@ tcpdev_wput_ctl(P_QUEUE *q, P_MSGB *msg)
                 break;
             }
         }
+        break;
     
     default:
         ASSERT(0); /*TODO*/
@@ -530,49 +542,23 @@ tcpdev_rsrvp(P_QUEUE *q)
 {
     TCPDEVAREA *area=NULL;
     P_MSGB *msg=NULL;
-    fd_set sockfds={0};
     int activesockets=0;
     int len = 0;
-    struct timeval timeout={0};
+    int32 rdsize = pstreams_rdbufsize(PSTRMHEAD(q), MAXTCPRXBUF);
 
     area = (TCPDEVAREA *)q->q_ptr;
-    FD_ZERO(&sockfds);
-    FD_SET(area->sock, &sockfds);
-
-    activesockets =
-        select(1, &sockfds, NULL, NULL, &timeout);/*last argument => non-blocking*/
 
-    if(activesockets == SOCKET_ERROR)
-    {
-            PSTRMHEAD(q)->perrno = 
-#ifdef PSTREAMS_H8
-                               tfError(area->sock);
-#else
-#ifdef PSTREAMS_WIN32
-                WSAGetLastError();
-#else
-                errno;
-#endif
-#endif
-        pstreams_log(q, PSTREAMS_LTERROR, "rsrvp: select failed."
-                    " retval %d. lasterror %d",
-                    activesockets, PSTRMHEAD(q)->perrno);
-                return P_STREAMS_FAILURE;
-    }
+    /*the socket was found readable by pstreams_pollwait*/
+    activesockets = pstreams_fdready(q) ? 1 : 0;
 
     while(activesockets > 0)
     {
-        if(!FD_ISSET(area->sock, &sockfds))
-        {
-            continue;
-        }
-
         activesockets--; /*this socket is set*/
 
         /*assuming only a read event - though other events are possible
          * if socket is non-blocking
          */
-        msg = pstreams_allocb((P_STREAMHEAD *)q->strmhead, 1792, 0);
+        msg = pstreams_allocb((P_STREAMHEAD *)q->strmhead, rdsize, 0);
         if(!msg)
         {
 #ifdef PSTREAMS_LT
@@ -581,26 +567,46 @@ tcpdev_rsrvp(P_QUEUE *q)
            	return P_STREAMS_SUCCESS;
         }
 
-        len = recv(area->sock, (char *)msg->b_wptr, 1792, 0);
+        len = recv(area->sock, (char *)msg->b_wptr, pstreams_unwrit1bytes(msg), 0);
+
+#ifdef PSTREAMS_SENDMSG
+        /*a full buffer - bulk, likely more waiting. read it into a chain of blocks*/
+        if(len == (int)pstreams_unwrit1bytes(msg))
+        {
+            len += tcpdev_rxmore(q, msg);
+        }
+#endif
+
+        if ( len == 0 )
+        {
+            /*peer closed - stays readable, so stop watching the socket*/
+            pstreams_freemsg(PSTRMHEAD(q), msg);
+            pstreams_fdunregister(q, area->sock);
+            area->state = TCPDEVSTATE_SNDDIS;
+            pstreams_log(q, PSTREAMS_LTINFO, "TCP peer disconnected"
+                " Device State: 0x%x", area->state);
+            return P_STREAMS_SUCCESS;
+        }
 
         if ( len != SOCKET_ERROR )
         {
 #ifdef PSTREAMS_UDPDUMP
         /*the block below is space expensive! - TODO verify if needed*/
         	{
-            	uchar hexbuf[1792*2] = { 0 };
+            	uchar hexbuf[MAXTCPDGRAMSIZE*2] = { 0 };
 
-                bintohex(hexbuf, (uchar *)hexbuf, len);
+                bintohex(hexbuf, (uchar *)hexbuf, MIN(len, (int32)(sizeof(hexbuf)/2 - 1)));
 
                 pstreams_log(q, PSTREAMS_LTINFO, "tcpdev_rsrvp: rx %d bytes\n%s", len, hexbuf);
             }
 #endif 
-            if ( len > 1792 )
+            /*the bytes read go in the blocks' room*/
+            if ( pstreams_msgfill(PSTRMHEAD(q), msg, len) != P_STREAMS_SUCCESS )
             {
             	pstreams_freemsg(PSTRMHEAD(q), msg);
 #ifdef PSTREAMS_LT
                 pstreams_log(q, PSTREAMS_LTWARNING, 
-                    "rsrvp: UDP datagram too large. dropped %d bytes.", len);
+                    "rsrvp: TCP read too large. dropped %d bytes.", len);
 #endif /*PSTREAMS_LT*/
                 return P_STREAMS_SUCCESS;
             }
@@ -609,9 +615,9 @@ tcpdev_rsrvp(P_QUEUE *q)
             pstreams_log(q, PSTREAMS_LTINFO, "tcpdev_wput_data: bytes read=%ld", len);
 #endif /*PSTREAMS_LT*/
 
-            msg->b_wptr += len;
-
-            if ( len < pstreams_mpool(1792)) /*will a smaller buffer do?*/
+            /*will a smaller buffer do? - a chain is left as it is*/
+            if ( !msg->b_cont && 
+                pstreams_mpool(PSTRMHEAD(q), len) < msg->b_datap->db_lim - msg->b_datap->db_base )
             {
             	P_MSGB *msgcpy = pstreams_copymsg(PSTRMHEAD(q), msg); /*will try smallest buffer*/
                 if(msgcpy) /*...and did we get a smaller buffer?*/
@@ -623,7 +629,8 @@ tcpdev_rsrvp(P_QUEUE *q)
                 else
                 {
                 	pstreams_log(q, PSTREAMS_LTINFO+1, "tcpdev_wput_data: "
-                    	"failed in downsizing readbuffer from 1792 to %ld", len);
+                    	"failed in downsizing readbuffer from %ld to %ld",
+                        msg->b_datap->db_lim - msg->b_datap->db_base, len);
                 }
 #endif
 			}
@@ -683,25 +690,78 @@ tcpdev_rput(P_QUEUE *q, P_MSGB *msg)
 }
 
 
+#ifdef PSTREAMS_SENDMSG
+/******************************************************************************
+Name: tcpdev_rxmore
+Purpose: read what else is waiting, after a read that filled msg's buffer,
+    with a single recvmsg straight into a chain of blocks(pstreams_allocmsg)
+    linked behind msg.
+Parameters: msg - the full read buffer
+Caveats: returns bytes read into the chain - 0 if nothing more was waiting,
+    or the chain could not be had, and msg is left as it was. At most
+    MAXTCPRXSIZE bytes are taken in all.
+******************************************************************************/
+static int32
+tcpdev_rxmore(P_QUEUE *q, P_MSGB *msg)
+{
+    TCPDEVAREA *area = (TCPDEVAREA *)q->q_ptr;
+    struct iovec iov[PSTREAMS_MAXIOV];
+    struct msghdr hdr;
+    P_MSGB *more=NULL;
+    int niov=0;
+    int32 len=0;
+
+    /*msg is not filled in yet - its room is what was read*/
+    more = pstreams_allocmsg(PSTRMHEAD(q), MAXTCPRXSIZE - pstreams_unwrit1bytes(msg));
+    if(!more)
+    {
+        return 0;
+    }
+
+    niov = pstreams_msgroomiov(more, iov, PSTREAMS_MAXIOV);
+    ASSERT(niov > 0); /*PSTREAMS_MAXIOV blocks of the largest class hold MAXTCPRXSIZE*/
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = niov;
+
+    /*MSG_DONTWAIT - only what is there now, the socket itself blocks*/
+    len = recvmsg(area->sock, &hdr, MSG_DONTWAIT);
+
+    if(len <= 0)
+    {
+        /*nothing more - or the peer closed, which the next read finds*/
+        pstreams_freemsg(PSTRMHEAD(q), more);
+        return 0;
+    }
+
+    pstreams_linkb(msg, more);
+
+    return len;
+}
+#endif /*PSTREAMS_SENDMSG*/
+
 /******************************************************************************
 Name: tcpdev_getarea
-Purpose: 
+Purpose: get this stream's TCPDEVAREA, from the stream's own memory
 Parameters:
-Caveats:
+Caveats: NULL if the stream's memory is used up - see udpdev_getarea
 ******************************************************************************/
 static TCPDEVAREA *
-tcpdev_getarea(void *key)
+tcpdev_getarea(P_QUEUE *q)
 {
-    static TCPDEVAREA staticmem;
-    TCPDEVAREA *tcpdevarea= (TCPDEVAREA *)&staticmem;
-
-    PDBG(key=NULL); /*unused*/
+    TCPDEVAREA *tcpdevarea=NULL;
 
-    if(tcpdevarea)
+    tcpdevarea = (TCPDEVAREA *)pstreams_memassign(PSTRMHEAD(q)->mem, sizeof(TCPDEVAREA));
+    if(!tcpdevarea)
     {
-        memset(tcpdevarea, 0, sizeof(TCPDEVAREA));
+        pstreams_console("ERROR: given buffer insufficient for local memory. "
+        "buffer size: %d. TCPDEVAREA requires: %d+memory for alignment",
+        PSTRMHEAD(q)->mem->limit-PSTRMHEAD(q)->mem->base, sizeof(TCPDEVAREA));
+        return NULL;
     }
 
+    memset(tcpdevarea, 0, sizeof(TCPDEVAREA));
     tcpdevarea->state = TCPDEVSTATE_INIT;
 
     return tcpdevarea;
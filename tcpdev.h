@@ -5,7 +5,9 @@
 
 enum TCPDEV_DEFINES
 {
-    MAXTCPDGRAMSIZE=2048
+    MAXTCPDGRAMSIZE=2048,
+    MAXTCPRXSIZE=65536, /*most bytes taken by one read - see tcpdev_rsrvp*/
+    MAXTCPRXBUF=4*4096 /*largest read buffer - see pstreams_rdbufsize*/
 };
 
 typedef enum tcpdevstate
@@ -53,7 +55,5 @@ int
 tcpdev_wput_data(P_QUEUE *q, P_MSGB *msg);
 int
 tcpdev_wput_ctl(P_QUEUE *q, P_MSGB *msg);
-static TCPDEVAREA *
-tcpdev_getarea(void *key);
 
 #endif
@@ -19,20 +19,30 @@ int main(int argc, char *argv[])
 		break;
 
 	case 2:
-		if(argc > 1)
+		if(sscanf(argv[1], "%d", &countOfMsgsToSend) != 1)
 		{
-			sscanf(argv[1], "%d", &countOfMsgsToSend);
+			/*not a count - the name of a unit test, or all*/
+			return runtests(argv[1]) == 0 ? 0 : 1;
 		}
 		break;
 
 	default:
-		printf("Usage %s CountOfMsgsToSend\n", argv[0]);
+		printf("Usage %s CountOfMsgsToSend | TestName | all\n", argv[0]);
 		return -1;
 	}
 
-    strm = buildstream();
+    /*separate blocks from fixed pools, then combined from pools with backing*/
+    printf("\nEcho test - separate blocks, fixed pools\n");
+    strm = buildstream(&separateconf);
+    echotest(strm, countOfMsgsToSend);
+    pstreams_close(strm);
+
+    init_test();
 
+    printf("\nEcho test - combined blocks, pools with backing\n");
+    strm = buildstream(&combinedconf);
     echotest(strm, countOfMsgsToSend);
+    pstreams_close(strm);
 
     return 0;
 }
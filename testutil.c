@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdlib.h>
+#include <string.h>
 #include "options.h"
 #include "env.h"
 #include "assert.h"
@@ -10,16 +11,18 @@
 #include "saw.h"
 #include "util.h"
 #include "testutil.h"
+#ifdef PSTREAMS_EVENTFD
+#include <poll.h>
+#endif
 
 
 void my_dummyfree(char *ptr);
-#ifdef PSTREAMS_ECHO
-extern P_STREAMTAB echo_streamtab;
-#endif
-extern P_STREAMTAB saw_streamtab;
+extern const P_STREAMTAB echo_streamtab; /*unit tests loop back through it*/
+extern const P_STREAMTAB saw_streamtab;
 
 #define MAXRMSGS 1
 #define MSGSIZE 32
+#define ECHOWAIT 3000 /*ms to wait on the echoes still out - saw acks on whole seconds*/
 
 /*public*/
 FILE *ltfile=NULL;
@@ -30,6 +33,18 @@ char vmem_region[VMEMSIZE]={0};
 char pmem_region[PMEMSIZE]={0};
 MY_PROTO proto;
 
+/*
+ * the two ways of allocating messages echotest is run with - default size
+ * classes in both:
+ *  combinedconf - pools grow from the heap past vmem_region, idle slabs go
+ *      back after 5s. Message, data block and buffer come as one object
+ *  separateconf - fixed pools carved out of vmem_region only. Message, data
+ *      block and buffer come from pools of their own
+ */
+const LOPBACKING heapbacking = {my_slaballoc, my_slabfree, NULL, 0, 5};
+const P_STREAMCONF combinedconf = {.backing = &heapbacking, .combined = P_TRUE};
+const P_STREAMCONF separateconf = {.backing = NULL, .combined = P_FALSE};
+
 #define LOOPBACKPORT 3000
 #define LOOPBACKIP "127.0.0.1"
 
@@ -100,13 +115,13 @@ init_global_buffers()
 }
 
 /******************************************************************************
-Name: 
-Purpose: 
-Parameters:
-Caveats:
+Name: buildstream
+Purpose: the stream of echotest, in vmem_region and pmem_region
+Parameters: conf - as pstreams_open; combinedconf or separateconf
+Caveats: one at a time - close it, and init_test, before the next
 ******************************************************************************/
 P_STREAMHEAD *
-buildstream()
+buildstream(const P_STREAMCONF *conf)
 {
     P_STREAMHEAD *strm=NULL;
     P_MEM vmem={0};
@@ -132,9 +147,9 @@ buildstream()
     pmem.limit = pmem.base + PMEMSIZE;
 
 #ifdef PSTREAMS_UDP
-    strm = pstreams_open(P_UDP, &vmem, &pmem);
+    strm = pstreams_open(P_UDP, &vmem, &pmem, conf);
 #else
-    strm = pstreams_open(P_NULL, &vmem, &pmem);
+    strm = pstreams_open(P_NULL, &vmem, &pmem, conf);
 #endif
 
     ASSERT(strm);
@@ -156,57 +171,69 @@ buildstream()
         ASSERT(0);
     }
 #else
+    /*the UDP transport talks to itself*/
+    if(setraddrs(strm, LOOPBACKPORT) != P_STREAMS_SUCCESS)
     {
-        /*
-         * This block sets up the UDP transport parameters
-         */
-        struct sockaddr_in sockaddr={0};
-        MY_PROTO proto={0};
-
-        proto.ctlfunc = UDPDEV_RADDR;
-        memcpy(putcbuf.buf, &proto, sizeof(MY_PROTO));
-        putcbuf.len = sizeof(MY_PROTO);
-
-        sockaddr.sin_family = AF_INET;
+        ASSERT(0);
+    }
+#endif
 
-        sockaddr.sin_port = p_htons(LOOPBACKPORT);
-        sockaddr.sin_addr.s_addr = inet_addr(LOOPBACKIP);
+	CONSOLEWRITE("\nPushing SAW module in...\n");
+    if(pstreams_push(strm, &saw_streamtab) != P_STREAMS_SUCCESS)
+    {
+        ASSERT(0);
+    }
 
-        memcpy(&putcbuf.buf[putcbuf.len], &sockaddr, sizeof(struct sockaddr_in));
-        putcbuf.len += sizeof(struct sockaddr_in);
-    
-        lop_checkpool(strm->msgpool);
+    return strm;
+}
 
-        pstreams_putmsg(strm, &putcbuf, NULL, RS_HIPRI);
+/******************************************************************************
+Name: setraddrs
+Purpose: set the local and remote addresses of a UDP stream - both port, so
+    that what it sends comes back to it
+Parameters:
+Caveats:
+******************************************************************************/
+int
+setraddrs(P_STREAMHEAD *strm, ushort port)
+{
+    struct sockaddr_in sockaddr={0};
+    MY_PROTO proto={0};
 
-        proto.ctlfunc = UDPDEV_LADDR;
-        memcpy(putcbuf.buf, &proto, sizeof(MY_PROTO));
-        putcbuf.len = sizeof(MY_PROTO);
+    proto.ctlfunc = UDPDEV_RADDR;
+    memcpy(putcbuf.buf, &proto, sizeof(MY_PROTO));
+    putcbuf.len = sizeof(MY_PROTO);
 
-        sockaddr.sin_family = AF_INET;
+    sockaddr.sin_family = AF_INET;
 
-        sockaddr.sin_port = p_htons(LOOPBACKPORT);
-        sockaddr.sin_addr.s_addr = p_htonl(INADDR_ANY);
+    sockaddr.sin_port = p_htons(port);
+    sockaddr.sin_addr.s_addr = inet_addr(LOOPBACKIP);
 
-        memcpy(&putcbuf.buf[putcbuf.len], &sockaddr, sizeof(struct sockaddr_in));
-        putcbuf.len += sizeof(struct sockaddr_in);
-    
-        lop_checkpool(strm->msgpool);
+    memcpy(&putcbuf.buf[putcbuf.len], &sockaddr, sizeof(struct sockaddr_in));
+    putcbuf.len += sizeof(struct sockaddr_in);
 
-        if(pstreams_putmsg(strm, &putcbuf, NULL, RS_HIPRI) != P_STREAMS_SUCCESS)
-        {
-            ASSERT(0);
-        }
-    }
-#endif
+    lop_checkpool(strm->msgpool);
 
-	CONSOLEWRITE("\nPushing SAW module in...\n");
-    if(pstreams_push(strm, &saw_streamtab) != P_STREAMS_SUCCESS)
+    if(pstreams_putmsg(strm, &putcbuf, NULL, RS_HIPRI) != P_STREAMS_SUCCESS)
     {
-        ASSERT(0);
+        return P_STREAMS_FAILURE;
     }
 
-    return strm;
+    proto.ctlfunc = UDPDEV_LADDR;
+    memcpy(putcbuf.buf, &proto, sizeof(MY_PROTO));
+    putcbuf.len = sizeof(MY_PROTO);
+
+    sockaddr.sin_family = AF_INET;
+
+    sockaddr.sin_port = p_htons(port);
+    sockaddr.sin_addr.s_addr = p_htonl(INADDR_ANY);
+
+    memcpy(&putcbuf.buf[putcbuf.len], &sockaddr, sizeof(struct sockaddr_in));
+    putcbuf.len += sizeof(struct sockaddr_in);
+
+    lop_checkpool(strm->msgpool);
+
+    return pstreams_putmsg(strm, &putcbuf, NULL, RS_HIPRI);
 }
 
 void
@@ -228,6 +255,7 @@ echotest(P_STREAMHEAD *strm, int msgCount)
     int loopcount;
 	int countMsgSent = 0;
 	int countMsgReceived = 0;
+	int countRx = 0;
 
 
 	for(loopcount=10000*msgCount; loopcount>0; loopcount--)
@@ -237,13 +265,25 @@ echotest(P_STREAMHEAD *strm, int msgCount)
 			countMsgSent += send_echomsg(strm);
 		}
 
-		pstreams_callsrvp(strm);
-
-		countMsgReceived += rcv_echomsg(strm);
-
-		if(strm->perrno == P_BUSY)
+		if(countMsgSent == msgCount)
+		{
+			/*all sent - wait on the rest, give up once they stop coming*/
+			countRx = rcv_echomsg(strm, ECHOWAIT);
+			countMsgReceived += countRx;
+			if(countRx == 0)
+			{
+				break;
+			}
+		}
+		else if(strm->perrno == P_BUSY)
 		{
-			Sleep(100); //sleep a while to let UDP/IP to catch up
+			/*wait a while for the echo to let the next one go*/
+			strm->perrno = 0;
+			countMsgReceived += rcv_echomsg(strm, 100);
+		}
+		else
+		{
+			countMsgReceived += rcv_echomsg(strm, 0);
 		}
 
 		if(countMsgReceived == msgCount)
@@ -311,11 +351,11 @@ send_echomsg(P_STREAMHEAD *strm)
  * returns number of messages received
  */
 int
-rcv_echomsg(P_STREAMHEAD *strm)
+rcv_echomsg(P_STREAMHEAD *strm, int32 timeout)
 {
 	int rxMsgs=0; /*received messages count*/
 
-    pstreams_getmsg(strm, &getcbuf, &getdbuf, 0);
+    pstreams_getmsgwait(strm, &getcbuf, &getdbuf, 0, timeout);
 
     if(getcbuf.len > 0)
     {
@@ -338,7 +378,7 @@ rcv_echomsg(P_STREAMHEAD *strm)
 
 	if(rxMsgs > 0)
 	{
-		rxMsgs += rcv_echomsg(strm);
+		rxMsgs += rcv_echomsg(strm, 0);
 	}
 
     return rxMsgs;
@@ -422,3 +462,1657 @@ handle_msgin(P_STREAMHEAD *strm, P_BUF *cbuf, P_BUF *dbuf)
     return 0;
 }
 
+
+/*
+ * Unit tests - run by name, or all of them, from the command line:
+ *      test all
+ * Each opens streams of its own and says RESULT: passed or failed.
+ */
+typedef struct testcase
+{
+    const char *name;
+    int (*run)();
+} TESTCASE;
+
+static const TESTCASE testcases[] =
+{
+    {"ingress", ingresstest},
+    {"pin", pintest},
+    {"sched", schedtest},
+    {"cursor", cursortest},
+    {"mmsg", mmsgtest},
+    {"bigmsg", bigmsgtest},
+    {"mag", magtest},
+    {"tmpl", tmpltest},
+    {"band", bandtest},
+    {"backenable", backenabletest},
+    {"loan", loantest},
+    {"notify", notifytest},
+    {"slab", slabtest},
+};
+
+#define NTESTCASES (sizeof(testcases)/sizeof(testcases[0]))
+#define TESTWAIT 2000 /*ms a unit test waits on a message before it gives up*/
+
+/******************************************************************************
+Name: runtests
+Purpose: run the unit test called name - or all of them for "all"
+Parameters:
+Caveats: returns 0 if they all pass, -1 otherwise
+******************************************************************************/
+int
+runtests(const char *name)
+{
+    unsigned int ii;
+    int nrun=0;
+    int nfailed=0;
+
+    for(ii=0; ii<NTESTCASES; ii++)
+    {
+        if(strcmp(name, "all") && strcmp(name, testcases[ii].name))
+        {
+            continue;
+        }
+
+        CONSOLEWRITE("\nRunning %s...\n", testcases[ii].name);
+        nrun++;
+        if(testcases[ii].run() != 0)
+        {
+            nfailed++;
+        }
+    }
+
+    if(!nrun)
+    {
+        CONSOLEWRITE("No test called %s\n", name);
+        return -1;
+    }
+
+    CONSOLEWRITE("RESULT: Tests run=%d\tFailed=%d\n", nrun, nfailed);
+
+    return nfailed ? -1 : 0;
+}
+
+/******************************************************************************
+Name: openteststream
+Purpose: a stream for a unit test, in memory of its own - on devid, with mod
+    pushed if given. On P_NULL with echo_streamtab what is put down comes
+    back up, with no sockets in the way.
+Parameters: tmem - where the stream's memory is kept, till closeteststream
+Caveats:
+******************************************************************************/
+P_STREAMHEAD *
+openteststream(TESTMEM *tmem, int devid, const P_STREAMTAB *mod)
+{
+    P_STREAMHEAD *strm=NULL;
+
+    tmem->vmem.buf = calloc(1, VMEMSIZE);
+    tmem->vmem.base = (char *)tmem->vmem.buf;
+    tmem->vmem.limit = tmem->vmem.base + VMEMSIZE;
+
+    tmem->pmem.buf = calloc(1, PMEMSIZE);
+    tmem->pmem.base = (char *)tmem->pmem.buf;
+    tmem->pmem.limit = tmem->pmem.base + PMEMSIZE;
+
+    ASSERT(tmem->vmem.buf && tmem->pmem.buf);
+
+    strm = pstreams_open(devid, &tmem->vmem, &tmem->pmem, &combinedconf);
+    ASSERT(strm);
+
+    if(mod && pstreams_push(strm, mod) != P_STREAMS_SUCCESS)
+    {
+        ASSERT(0);
+    }
+
+    return strm;
+}
+
+/******************************************************************************
+Name: closeteststream
+Purpose: close a stream of openteststream, and free its memory
+Parameters:
+Caveats:
+******************************************************************************/
+void
+closeteststream(P_STREAMHEAD *strm, TESTMEM *tmem)
+{
+    pstreams_close(strm);
+
+    free(tmem->vmem.buf);
+    free(tmem->pmem.buf);
+}
+
+#ifdef PSTREAMS_INGRESS
+#define INGPRODUCERS 4 /*threads sending at once in ingresstest*/
+#define INGPERPRODUCER 500 /*messages each of them sends*/
+
+typedef struct ingproducer /*a thread sending through pstreams_ingress*/
+{
+    P_STREAMHEAD *strm;
+    int id;
+    int nbusy; /*times it found the ring full*/
+    int nfailed; /*messages it could not send*/
+} INGPRODUCER;
+
+/******************************************************************************
+Name: ingproducer
+Purpose: thread of ingresstest - sends INGPERPRODUCER messages "id:seq",
+    trying again while the ring is full
+Parameters:
+Caveats:
+******************************************************************************/
+static void *
+ingproducer(void *arg)
+{
+    INGPRODUCER *prod = (INGPRODUCER *)arg;
+    char data[32];
+    P_BUF dbuf;
+    int seq;
+    int err;
+
+    for(seq=0; seq<INGPERPRODUCER; seq++)
+    {
+        sprintf(data, "%d:%d", prod->id, seq);
+        dbuf.buf = data;
+        dbuf.len = dbuf.maxlen = strlen(data)+1;
+
+        while((err = pstreams_ingress(prod->strm, NULL, &dbuf, 0)) == P_BUSY)
+        {
+            prod->nbusy++;
+            my_sleep(1);
+        }
+        if(err != P_NOERROR)
+        {
+            prod->nfailed++;
+        }
+    }
+
+    pstreams_cacheflush(prod->strm); /*buffers this thread cached go back*/
+
+    return NULL;
+}
+
+/******************************************************************************
+Name: ingtake
+Purpose: take upto count messages "id:seq" off strm, and check each id's come
+    in sequence, from next[id] on
+Parameters: next - per id, the seq expected next
+Caveats: returns the count taken - fewer if none comes in TESTWAIT ms.
+    *pbad counts those out of sequence.
+******************************************************************************/
+static int
+ingtake(P_STREAMHEAD *strm, int count, int *next, int nids, int *pbad)
+{
+    char data[32];
+    P_BUF dbuf;
+    int ntaken;
+    int id;
+    int seq;
+
+    for(ntaken=0; ntaken<count; ntaken++)
+    {
+        dbuf.buf = data;
+        dbuf.len = 0;
+        dbuf.maxlen = sizeof(data);
+
+        pstreams_getmsgwait(strm, NULL, &dbuf, 0, TESTWAIT);
+        if(dbuf.len <= 0)
+        {
+            break;
+        }
+
+        if(sscanf(data, "%d:%d", &id, &seq) != 2 || id < 0 || id >= nids || seq != next[id])
+        {
+            (*pbad)++;
+            continue;
+        }
+        next[id]++;
+    }
+
+    return ntaken;
+}
+
+/******************************************************************************
+Name: ingresstest
+Purpose: pstreams_ingress - several threads sending at once get all their
+    messages through, each in the order sent; and a ring filled while the
+    stream is not run refuses the next message with P_BUSY
+Parameters:
+Caveats:
+******************************************************************************/
+int
+ingresstest()
+{
+    TESTMEM tmem;
+    P_STREAMHEAD *strm=NULL;
+    INGPRODUCER prod[INGPRODUCERS];
+    int next[INGPRODUCERS];
+    char data[32];
+    P_BUF dbuf;
+    int nsent=0;
+    int ngot=0;
+    int nbad=0;
+    int nbusy=0;
+    int nfailed=0;
+    int nfilled=0;
+    int fullerr=0;
+    int ii;
+    int passed;
+
+    strm = openteststream(&tmem, P_NULL, &echo_streamtab);
+    memset(prod, 0, sizeof(prod));
+    memset(next, 0, sizeof(next));
+
+#ifndef PSTREAMS_WIN32
+    {
+        pthread_t threads[INGPRODUCERS];
+
+        nsent = INGPRODUCERS*INGPERPRODUCER;
+        for(ii=0; ii<INGPRODUCERS; ii++)
+        {
+            prod[ii].strm = strm;
+            prod[ii].id = ii;
+            pthread_create(&threads[ii], NULL, ingproducer, &prod[ii]);
+        }
+
+        ngot = ingtake(strm, nsent, next, INGPRODUCERS, &nbad);
+
+        for(ii=0; ii<INGPRODUCERS; ii++)
+        {
+            pthread_join(threads[ii], NULL);
+            nbusy += prod[ii].nbusy;
+            nfailed += prod[ii].nfailed;
+        }
+    }
+#endif /*no threads to send from on win32*/
+
+    /*the stream is not run meanwhile - the ring fills*/
+    next[0] = 0;
+    for(nfilled=0; nfilled<PSTREAMS_INGRESS+1; nfilled++)
+    {
+        sprintf(data, "0:%d", nfilled);
+        dbuf.buf = data;
+        dbuf.len = dbuf.maxlen = strlen(data)+1;
+
+        if((fullerr = pstreams_ingress(strm, NULL, &dbuf, 0)) != P_NOERROR)
+        {
+            break;
+        }
+    }
+
+    /*what got in comes up all the same*/
+    ii = ingtake(strm, nfilled, next, 1, &nbad);
+
+    closeteststream(strm, &tmem);
+
+    passed = ngot == nsent && nbad == 0 && nfailed == 0 &&
+        nfilled == PSTREAMS_INGRESS && fullerr == P_BUSY && ii == nfilled;
+
+    CONSOLEWRITE("RESULT: ingresstest %s. got=%d of %d, out of order=%d, ring full %d times;"
+        " full ring took %d of %d, then error %d; got %d back\n",
+        passed ? "passed" : "failed", ngot, nsent, nbad, nbusy,
+        nfilled, PSTREAMS_INGRESS, fullerr, ii);
+
+    return passed ? 0 : -1;
+}
+#else
+int
+ingresstest()
+{
+    CONSOLEWRITE("RESULT: ingresstest skipped. no ingress ring(PSTREAMS_INGRESS)\n");
+    return 0;
+}
+#endif /*PSTREAMS_INGRESS*/
+
+#ifdef PSTREAMS_PIPELINE
+#define PINMSGS 5000 /*messages pintest sends through the pinned module*/
+#define PINHELD 200 /*ms putmsg is to stay P_BUSY for the stream to count as held*/
+
+/******************************************************************************
+Name: pintake
+Purpose: take a message "seq" off strm, waiting upto timeout ms, and check it
+    is *pnext
+Parameters:
+Caveats: returns 1 if one came, 0 if not. *pbad counts those out of sequence.
+******************************************************************************/
+static int
+pintake(P_STREAMHEAD *strm, int32 timeout, int *pnext, int *pbad)
+{
+    char data[MSGSIZE];
+    P_BUF dbuf;
+    int seq;
+
+    dbuf.buf = data;
+    dbuf.len = 0;
+    dbuf.maxlen = sizeof(data);
+
+    strm->perrno = 0; /*a P_BUSY of putmsg would stop the stream being run*/
+    pstreams_getmsgwait(strm, NULL, &dbuf, 0, timeout);
+    if(dbuf.len <= 0)
+    {
+        return 0;
+    }
+
+    if(sscanf(data, "%d", &seq) != 1 || seq != *pnext)
+    {
+        (*pbad)++;
+    }
+    *pnext = seq+1;
+
+    return 1;
+}
+
+/******************************************************************************
+Name: pintest
+Purpose: pstreams_pin - the echo module, run on a thread of its own, carries
+    messages down and back up. First nothing is read: the stream is to back
+    up through both rings till putmsg is refused, and stay so. Then it is
+    read while the rest are sent; all come back, in the order sent.
+Parameters:
+Caveats:
+******************************************************************************/
+int
+pintest()
+{
+    TESTMEM tmem;
+    P_STREAMHEAD *strm=NULL;
+    char data[MSGSIZE];
+    P_BUF dbuf;
+    int32 busysince=0;
+    int nheld=0; /*sent by the time putmsg was held back*/
+    int nsent=0;
+    int ngot=0;
+    int nbad=0;
+    int next=0;
+    int passed;
+
+    strm = openteststream(&tmem, P_NULL, &echo_streamtab);
+
+    if(pstreams_pin(strm, strm->appwrq.q_next->q_qinfo.qi_minfo->mi_idnum) != P_STREAMS_SUCCESS)
+    {
+        CONSOLEWRITE("RESULT: pintest failed. pstreams_pin error %d\n", strm->perrno);
+        closeteststream(strm, &tmem);
+        return -1;
+    }
+
+    dbuf.buf = data;
+    dbuf.maxlen = sizeof(data);
+
+    /*nothing read - sent till flow control holds the application back*/
+    while(!nheld && nsent < PINMSGS)
+    {
+        sprintf(data, "%d", nsent);
+        dbuf.len = strlen(data)+1;
+
+        strm->perrno = 0;
+        if(pstreams_putmsg(strm, NULL, &dbuf, 0) == P_STREAMS_SUCCESS)
+        {
+            nsent++;
+            busysince = 0;
+            continue;
+        }
+        if(strm->perrno != P_BUSY)
+        {
+            break;
+        }
+
+        if(!busysince)
+        {
+            busysince = my_clockticks();
+        }
+        else if(my_clockticks() - busysince >= PINHELD)
+        {
+            nheld = nsent;
+        }
+
+        /*the stream is run meanwhile - its side of the rings*/
+        strm->perrno = 0;
+        pstreams_callsrvp(strm);
+        my_sleep(1);
+    }
+
+    /*read, and send the rest as flow control lets them go*/
+    while(ngot < nsent || nsent < PINMSGS)
+    {
+        if(nsent < PINMSGS)
+        {
+            sprintf(data, "%d", nsent);
+            dbuf.len = strlen(data)+1;
+
+            strm->perrno = 0;
+            if(pstreams_putmsg(strm, NULL, &dbuf, 0) == P_STREAMS_SUCCESS)
+            {
+                nsent++;
+            }
+            else if(strm->perrno != P_BUSY)
+            {
+                break;
+            }
+        }
+
+        if(pintake(strm, nsent < PINMSGS ? 0 : TESTWAIT, &next, &nbad))
+        {
+            ngot++;
+        }
+        else if(nsent == PINMSGS)
+        {
+            break; /*no more coming*/
+        }
+    }
+
+    closeteststream(strm, &tmem);
+
+    passed = nheld > 0 && ngot == PINMSGS && nsent == PINMSGS && nbad == 0;
+
+    CONSOLEWRITE("RESULT: pintest %s. held back after %d, sent=%d got=%d, out of order=%d\n",
+        passed ? "passed" : "failed", nheld, nsent, ngot, nbad);
+
+    return passed ? 0 : -1;
+}
+#else
+int
+pintest()
+{
+    CONSOLEWRITE("RESULT: pintest skipped. no pinned modules(PSTREAMS_PIPELINE)\n");
+    return 0;
+}
+#endif /*PSTREAMS_PIPELINE*/
+
+#ifdef PSTREAMS_SCHED
+#define SCHEDSTREAMS 8 /*streams schedtest runs on the scheduler at once*/
+#define SCHEDWORKERS 4
+#define SCHEDROUNDS 400 /*rounds of one message to each stream*/
+#define SCHEDCHURN 25 /*rounds between taking a stream off, or closing it*/
+
+typedef struct schedstrm /*a stream of schedtest, and what went through it*/
+{
+    TESTMEM tmem;
+    P_STREAMHEAD *strm;
+    int nsent;
+    P_ATOMIC ngot;
+    int next; /*seq expected next*/
+    int nbad; /*messages out of sequence*/
+    P_ATOMIC nrunning; /*threads in schedrun - more than 1 is an error*/
+    int noverlap;
+} SCHEDSTRM;
+
+/******************************************************************************
+Name: schedtake
+Purpose: take the messages "seq" waiting on the stream of ss, and check they
+    come in sequence
+Parameters: timeout - as pstreams_getmsgwait, for the first
+Caveats: from the thread running the stream
+******************************************************************************/
+static void
+schedtake(SCHEDSTRM *ss, int32 timeout)
+{
+    char data[MSGSIZE];
+    P_BUF dbuf;
+    int seq;
+
+    for(;;)
+    {
+        dbuf.buf = data;
+        dbuf.len = 0;
+        dbuf.maxlen = sizeof(data);
+
+        pstreams_getmsgwait(ss->strm, NULL, &dbuf, 0, timeout);
+        if(dbuf.len <= 0)
+        {
+            break;
+        }
+        timeout = 0;
+
+        if(sscanf(data, "%d", &seq) != 1 || seq != ss->next)
+        {
+            ss->nbad++;
+        }
+        ss->next = seq+1;
+        P_ATOMIC_ADD(&ss->ngot, 1);
+    }
+}
+
+/******************************************************************************
+Name: schedrun
+Purpose: the application's part of a stream of schedtest, on the scheduler
+Parameters:
+Caveats:
+******************************************************************************/
+static void
+schedrun(P_STREAMHEAD *strm, void *arg)
+{
+    SCHEDSTRM *ss = (SCHEDSTRM *)arg;
+
+    if(P_ATOMIC_ADD(&ss->nrunning, 1) != 0)
+    {
+        ss->noverlap++;
+    }
+
+    schedtake(ss, 0);
+
+    P_ATOMIC_ADD(&ss->nrunning, -1);
+    PDBG(strm=NULL);/*keep compiler happy*/
+}
+
+/******************************************************************************
+Name: schedopen
+Purpose: open a loopback stream for schedtest, and put it on sched
+Parameters:
+Caveats: returns P_STREAMS_SUCCESS or P_STREAMS_FAILURE, as pstreams_schedadd
+******************************************************************************/
+static int
+schedopen(P_SCHED *sched, SCHEDSTRM *ss)
+{
+    memset(ss, 0, sizeof(*ss));
+    ss->strm = openteststream(&ss->tmem, P_NULL, &echo_streamtab);
+
+    return pstreams_schedadd(sched, ss->strm, schedrun, ss);
+}
+
+/******************************************************************************
+Name: schedtest
+Purpose: the scheduler, with streams coming and going while traffic flows -
+    messages go in through pstreams_ingress from this thread and come back
+    in schedrun. Now and then a stream is taken off with pstreams_schedremove,
+    read dry here, and put back on; or closed while on the scheduler, and a
+    new one put on in its place. Each stream is to be run by one thread at a
+    time, and every message is to come back, in order - but those of a
+    stream closed.
+Parameters:
+Caveats:
+******************************************************************************/
+int
+schedtest()
+{
+    P_SCHED sched;
+    SCHEDSTRM ss[SCHEDSTREAMS];
+    char data[MSGSIZE];
+    P_BUF dbuf;
+    int32 start=0;
+    int round;
+    int nerrors=0; /*calls of the scheduler that failed*/
+    int nremoved=0;
+    int nclosed=0;
+    int nbad=0;
+    int noverlap=0;
+    int nsent=0;
+    int ngot=0;
+    int ii;
+    int passed;
+
+    if(pstreams_schedstart(&sched, SCHEDWORKERS) != P_STREAMS_SUCCESS)
+    {
+        CONSOLEWRITE("RESULT: schedtest failed. pstreams_schedstart failed\n");
+        return -1;
+    }
+
+    for(ii=0; ii<SCHEDSTREAMS; ii++)
+    {
+        nerrors += schedopen(&sched, &ss[ii]) != P_STREAMS_SUCCESS;
+    }
+
+    dbuf.buf = data;
+    dbuf.maxlen = sizeof(data);
+
+    for(round=0; round<SCHEDROUNDS; round++)
+    {
+        for(ii=0; ii<SCHEDSTREAMS; ii++)
+        {
+            sprintf(data, "%d", ss[ii].nsent);
+            dbuf.len = strlen(data)+1;
+
+            if(pstreams_ingress(ss[ii].strm, NULL, &dbuf, 0) == P_NOERROR)
+            {
+                ss[ii].nsent++;
+            }
+        }
+
+        if(round % SCHEDCHURN != SCHEDCHURN-1)
+        {
+            continue;
+        }
+
+        ii = (round/SCHEDCHURN) % SCHEDSTREAMS;
+        if((round/SCHEDCHURN) % 2 == 0)
+        {
+            /*off the scheduler - this thread runs it till it is read dry*/
+            nerrors += pstreams_schedremove(ss[ii].strm) != P_STREAMS_SUCCESS;
+            start = my_clockticks();
+            while(ss[ii].ngot < ss[ii].nsent && my_clockticks() - start < TESTWAIT)
+            {
+                schedtake(&ss[ii], TESTWAIT);
+            }
+            nsent += ss[ii].nsent;
+            ngot += ss[ii].ngot;
+            ss[ii].nsent = 0;
+            ss[ii].ngot = 0;
+            ss[ii].next = 0;
+            nerrors += pstreams_schedadd(&sched, ss[ii].strm, schedrun, &ss[ii]) != P_STREAMS_SUCCESS;
+            nremoved++;
+        }
+        else
+        {
+            /*closed on the scheduler, with messages still in it*/
+            nbad += ss[ii].nbad;
+            noverlap += ss[ii].noverlap;
+            closeteststream(ss[ii].strm, &ss[ii].tmem);
+            nerrors += schedopen(&sched, &ss[ii]) != P_STREAMS_SUCCESS;
+            nclosed++;
+        }
+    }
+
+    /*the last to come back*/
+    start = my_clockticks();
+    for(ii=0; ii<SCHEDSTREAMS; ii++)
+    {
+        while(ss[ii].ngot < ss[ii].nsent && my_clockticks() - start < TESTWAIT)
+        {
+            my_sleep(1);
+        }
+    }
+
+    pstreams_schedstop(&sched);
+
+    for(ii=0; ii<SCHEDSTREAMS; ii++)
+    {
+        nsent += ss[ii].nsent;
+        ngot += ss[ii].ngot;
+        nbad += ss[ii].nbad;
+        noverlap += ss[ii].noverlap;
+        closeteststream(ss[ii].strm, &ss[ii].tmem);
+    }
+
+    passed = nerrors == 0 && ngot == nsent && nbad == 0 && noverlap == 0;
+
+    CONSOLEWRITE("RESULT: schedtest %s. removed=%d closed=%d; sent=%d got=%d,"
+        " out of order=%d, run at once=%d, errors=%d\n",
+        passed ? "passed" : "failed", nremoved, nclosed, nsent, ngot, nbad, noverlap, nerrors);
+
+    return passed ? 0 : -1;
+}
+#else
+int
+schedtest()
+{
+    CONSOLEWRITE("RESULT: schedtest skipped. no scheduler(PSTREAMS_SCHED)\n");
+    return 0;
+}
+#endif /*PSTREAMS_SCHED*/
+
+/******************************************************************************
+Name: cursortest
+Purpose: P_MSGCURSOR over a message of blocks "ab", "", "c", "defg", "hij" -
+    headers split across them are peeked, read, skipped and written as if
+    contiguous; and a cursor asked past the end stays where it was
+Parameters:
+Caveats:
+******************************************************************************/
+int
+cursortest()
+{
+    static const char *parts[] = {"ab", "", "c", "defg", "hij"};
+    TESTMEM tmem;
+    P_STREAMHEAD *strm=NULL;
+    P_MSGB *msg=NULL;
+    P_MSGB *blk=NULL;
+    P_MSGCURSOR cur;
+    char hdr[16];
+    char flat[16];
+    P_BUF fbuf;
+    unsigned char *bytes=NULL;
+    int nfailed=0;
+    unsigned int ii;
+
+    strm = openteststream(&tmem, P_NULL, NULL);
+
+    for(ii=0; ii<sizeof(parts)/sizeof(parts[0]); ii++)
+    {
+        blk = pstreams_allocb(strm, 8, 0);
+        ASSERT(blk);
+        memcpy(blk->b_wptr, parts[ii], strlen(parts[ii]));
+        blk->b_wptr += strlen(parts[ii]);
+
+        if(msg)
+        {
+            pstreams_linkb(msg, blk);
+        }
+        else
+        {
+            msg = blk;
+        }
+    }
+
+    pstreams_cursorinit(&cur, msg);
+
+    /*in the first block - pointed to in place*/
+    bytes = (unsigned char *)pstreams_cursorpeek(&cur, hdr, 2);
+    nfailed += bytes != msg->b_rptr;
+
+    /*across four blocks, one empty - copied out, cursor unmoved*/
+    bytes = (unsigned char *)pstreams_cursorpeek(&cur, hdr, 6);
+    nfailed += bytes != (unsigned char *)hdr || memcmp(hdr, "abcdef", 6) || cur.c_off != 0;
+
+    bytes = (unsigned char *)pstreams_cursorread(&cur, hdr, 3);
+    nfailed += !bytes || memcmp(bytes, "abc", 3) || cur.c_off != 3;
+
+    bytes = (unsigned char *)pstreams_cursorread(&cur, hdr, 4);
+    nfailed += !bytes || memcmp(bytes, "defg", 4) || cur.c_off != 7;
+
+    nfailed += pstreams_cursorskip(&cur, 1) != P_STREAMS_SUCCESS || cur.c_off != 8;
+
+    /*2 bytes left - more is refused, and the cursor stays*/
+    nfailed += pstreams_cursorread(&cur, hdr, 3) != NULL || cur.c_off != 8;
+    nfailed += pstreams_cursorskip(&cur, 3) != P_STREAMS_FAILURE || cur.c_off != 8;
+    bytes = (unsigned char *)pstreams_cursorread(&cur, hdr, 2);
+    nfailed += !bytes || memcmp(bytes, "ij", 2) || cur.c_off != 10;
+
+    /*written across "b", "", "c", "d"; past the end nothing is written*/
+    pstreams_cursorinit(&cur, msg);
+    pstreams_cursorskip(&cur, 1);
+    nfailed += pstreams_cursorwrite(&cur, "XYZ", 3) != P_STREAMS_SUCCESS || cur.c_off != 4;
+    pstreams_cursorskip(&cur, 4);
+    nfailed += pstreams_cursorwrite(&cur, "1234", 4) != P_STREAMS_FAILURE || cur.c_off != 8;
+
+    fbuf.buf = flat;
+    fbuf.maxlen = sizeof(flat);
+    fbuf.len = 0;
+    pstreams_msgread(&fbuf, msg);
+    nfailed += fbuf.len != 10 || memcmp(flat, "aXYZefghij", 10);
+
+    /*the header read is consumed by the cursor's offset*/
+    pstreams_cursorinit(&cur, msg);
+    pstreams_cursorread(&cur, hdr, 5);
+    pstreams_msgconsume(msg, cur.c_off);
+    fbuf.len = 0;
+    pstreams_msgread(&fbuf, msg);
+    nfailed += pstreams_msgsize(msg) != 5 || fbuf.len != 5 || memcmp(flat, "fghij", 5);
+
+    pstreams_freemsg(strm, msg);
+    closeteststream(strm, &tmem);
+
+    CONSOLEWRITE("RESULT: cursortest %s. checks failed=%d\n",
+        nfailed ? "failed" : "passed", nfailed);
+
+    return nfailed ? -1 : 0;
+}
+
+#define MMSGS 3 /*messages of mmsgtest*/
+#define MMSGSMALL 32 /*the buffers mmsgtest reads into first*/
+#define MMSGBIG 100 /*the middle message - too big for them*/
+
+/******************************************************************************
+Name: mmsgtest
+Purpose: pstreams_putmmsg and pstreams_getmmsg, with a message too big for
+    its buffer - it ends the batch and stays first; alone it fails the call
+    with P_READBUF_TOOSMALL; with room enough it comes next, the rest after
+Parameters:
+Caveats:
+******************************************************************************/
+int
+mmsgtest()
+{
+    static const int lens[MMSGS] = {10, MMSGBIG, 10};
+    TESTMEM tmem;
+    P_STREAMHEAD *strm=NULL;
+    P_MMSG msgs[MMSGS];
+    char put[MMSGS][MMSGBIG];
+    char got[MMSGS][MMSGBIG];
+    int32 start=0;
+    int nput=0;
+    int ngot[4];
+    int nfailed=0;
+    int ii;
+
+    strm = openteststream(&tmem, P_NULL, &echo_streamtab);
+
+    memset(msgs, 0, sizeof(msgs));
+    for(ii=0; ii<MMSGS; ii++)
+    {
+        memset(put[ii], 'a'+ii, lens[ii]);
+        msgs[ii].msgbuf.buf = put[ii];
+        msgs[ii].msgbuf.len = msgs[ii].msgbuf.maxlen = lens[ii];
+    }
+    nput = pstreams_putmmsg(strm, msgs, MMSGS, 0);
+
+    /*till all are back at the streamhead*/
+    start = my_clockticks();
+    while(pstreams_msgcount(strm) < MMSGS && my_clockticks() - start < TESTWAIT)
+    {
+        pstreams_callsrvp(strm);
+    }
+
+    for(ii=0; ii<MMSGS; ii++)
+    {
+        msgs[ii].ctlbuf.len = msgs[ii].ctlbuf.maxlen = 0;
+        msgs[ii].ctlbuf.buf = NULL;
+        msgs[ii].msgbuf.buf = got[ii];
+        msgs[ii].msgbuf.len = 0;
+        msgs[ii].msgbuf.maxlen = MMSGSMALL;
+    }
+
+    /*the first fits; the second does not, and ends the batch*/
+    ngot[0] = pstreams_getmmsg(strm, msgs, MMSGS, NULL);
+    nfailed += ngot[0] != 1 || msgs[0].msgbuf.len != lens[0] ||
+        memcmp(got[0], put[0], lens[0]) || msgs[1].msgbuf.len != 0;
+
+    /*first now - the call fails, and leaves it there*/
+    ngot[1] = pstreams_getmmsg(strm, msgs, MMSGS, NULL);
+    nfailed += ngot[1] != -1 || strm->perrno != P_READBUF_TOOSMALL ||
+        msgs[0].msgbuf.len != -1 || pstreams_msgcount(strm) != MMSGS-1;
+    strm->perrno = 0;
+
+    /*room for it - it comes, and the last after it*/
+    msgs[0].msgbuf.maxlen = MMSGBIG;
+    ngot[2] = pstreams_getmmsg(strm, msgs, MMSGS, NULL);
+    nfailed += ngot[2] != 2 || msgs[0].msgbuf.len != lens[1] || memcmp(got[0], put[1], lens[1]) ||
+        msgs[1].msgbuf.len != lens[2] || memcmp(got[1], put[2], lens[2]);
+
+    ngot[3] = pstreams_getmmsg(strm, msgs, MMSGS, NULL);
+    nfailed += ngot[3] != 0;
+
+    closeteststream(strm, &tmem);
+
+    nfailed += nput != MMSGS;
+
+    CONSOLEWRITE("RESULT: mmsgtest %s. put=%d, got %d, %d, %d then %d; checks failed=%d\n",
+        nfailed ? "failed" : "passed", nput, ngot[0], ngot[1], ngot[2], ngot[3], nfailed);
+
+    return nfailed ? -1 : 0;
+}
+
+#ifdef PSTREAMS_UDP
+#define BIGMSGSIZE (60*1024) /*past a ushort's worth less a bit, and any one block*/
+#define BIGMSGPORT (LOOPBACKPORT+1)
+
+/******************************************************************************
+Name: bigmsgtest
+Purpose: a 60 KiB message through the UDP device, back to itself - sent and
+    received as one datagram, and delivered whole as a chain of blocks
+Parameters:
+Caveats:
+******************************************************************************/
+int
+bigmsgtest()
+{
+    static char put[BIGMSGSIZE];
+    TESTMEM tmem;
+    P_STREAMHEAD *strm=NULL;
+    P_BUF dbuf;
+    P_LOAN loan;
+    P_MSGB *blk=NULL;
+    P_BUF seg;
+    int32 start=0;
+    int ngot=0;
+    int nblks=0;
+    int nmatched=0;
+    int passed;
+    int ii;
+
+    for(ii=0; ii<BIGMSGSIZE; ii++)
+    {
+        put[ii] = (char)(ii*7+3);
+    }
+
+    strm = openteststream(&tmem, P_UDP, NULL);
+    if(setraddrs(strm, BIGMSGPORT) != P_STREAMS_SUCCESS)
+    {
+        ASSERT(0);
+    }
+
+    dbuf.buf = put;
+    dbuf.len = dbuf.maxlen = BIGMSGSIZE;
+    if(pstreams_putmsg(strm, NULL, &dbuf, 0) != P_STREAMS_SUCCESS)
+    {
+        CONSOLEWRITE("RESULT: bigmsgtest failed. putmsg error %d\n", strm->perrno);
+        closeteststream(strm, &tmem);
+        return -1;
+    }
+
+    start = my_clockticks();
+    while(!pstreams_msgcount(strm) && my_clockticks() - start < TESTWAIT)
+    {
+        pstreams_callsrvp(strm);
+        my_sleep(1);
+    }
+
+    memset(&loan, 0, sizeof(loan));
+    if(pstreams_getloan(strm, &loan, NULL) == P_STREAMS_SUCCESS)
+    {
+        for(blk = loan.datmsg; pstreams_loanseg(&blk, &seg); nblks++)
+        {
+            if(nmatched + seg.len <= BIGMSGSIZE && !memcmp(seg.buf, &put[nmatched], seg.len))
+            {
+                nmatched += seg.len;
+            }
+        }
+    }
+
+    ngot = loan.datlen;
+    passed = ngot == BIGMSGSIZE && nmatched == BIGMSGSIZE && nblks > 1;
+
+    pstreams_loanrelease(strm, &loan);
+    closeteststream(strm, &tmem);
+
+    CONSOLEWRITE("RESULT: bigmsgtest %s. sent=%d got=%d matched=%d in %d blocks\n",
+        passed ? "passed" : "failed", BIGMSGSIZE, ngot, nmatched, nblks);
+
+    return passed ? 0 : -1;
+}
+#else
+int
+bigmsgtest()
+{
+    CONSOLEWRITE("RESULT: bigmsgtest skipped. no UDP device(PSTREAMS_UDP)\n");
+    return 0;
+}
+#endif /*PSTREAMS_UDP*/
+
+#if(LOP_MAGSIZE > 0) && !defined(PSTREAMS_WIN32)
+#define MAGOBJSIZE 32
+#define MAGBIGCOUNT 64 /*a pool the magazine caches from*/
+#define MAGSMALLCOUNT (LOP_MAGSHARE-1) /*a pool too small to cache*/
+
+/******************************************************************************
+Name: magrelease
+Purpose: thread of magtest - releases the pool it is given, leaving the
+    magazine of the thread that made it stale
+Parameters:
+Caveats:
+******************************************************************************/
+static void *
+magrelease(void *arg)
+{
+    lop_releasepool((POOLHDR *)arg);
+
+    return NULL;
+}
+
+/******************************************************************************
+Name: magtest
+Purpose: a pool released by another thread, and made again at the same place
+    too small to cache - the thread with a magazine for the old pool still
+    gets every object of the new one, and the last one more fails
+Parameters:
+Caveats:
+******************************************************************************/
+int
+magtest()
+{
+    static char area[MAGOBJSIZE*MAGBIGCOUNT*2 + 1024];
+    POOLHDR *big=NULL;
+    POOLHDR *small=NULL;
+    void *objs[MAGSMALLCOUNT];
+    void *obj=NULL;
+    pthread_t thread;
+    int ngot=0;
+    int nfailed=0;
+    int ii;
+
+    ASSERT(lop_getpoolsize(MAGOBJSIZE, MAGBIGCOUNT) <= sizeof(area));
+
+    /*claims a magazine, which keeps the object*/
+    big = lop_allocpool(MAGOBJSIZE, MAGBIGCOUNT, area);
+    obj = lop_cachealloc(big);
+    nfailed += obj == NULL;
+    lop_cacherelease(big, obj);
+
+    pthread_create(&thread, NULL, magrelease, big);
+    pthread_join(thread, NULL);
+
+    small = lop_allocpool(MAGOBJSIZE, MAGSMALLCOUNT, area);
+    nfailed += small != big;
+
+    for(ii=0; ii<MAGSMALLCOUNT; ii++)
+    {
+        objs[ii] = lop_cachealloc(small);
+        ngot += objs[ii] != NULL;
+    }
+    nfailed += lop_cachealloc(small) != NULL;
+
+    for(ii=0; ii<MAGSMALLCOUNT; ii++)
+    {
+        if(objs[ii])
+        {
+            lop_cacherelease(small, objs[ii]);
+        }
+    }
+    nfailed += lop_availcount(small) != MAGSMALLCOUNT;
+
+    lop_releasepool(small);
+
+    nfailed += ngot != MAGSMALLCOUNT;
+
+    CONSOLEWRITE("RESULT: magtest %s. got %d of %d from the re-made pool; checks failed=%d\n",
+        nfailed ? "failed" : "passed", ngot, MAGSMALLCOUNT, nfailed);
+
+    return nfailed ? -1 : 0;
+}
+#else
+int
+magtest()
+{
+    CONSOLEWRITE("RESULT: magtest skipped. no magazines(LOP_MAGSIZE), or no threads\n");
+    return 0;
+}
+#endif /*LOP_MAGSIZE*/
+
+#define TMPLSTREAMS 16 /*streams tmpltest stands up from one template*/
+
+/******************************************************************************
+Name: tmpltest
+Purpose: a template of a loopback stream with the echo module - streams of
+    it stood up, each carrying a message down and back up of its own, and
+    closed. The first goes in the memory the template was made in, which
+    the trial stream is to have given back.
+Parameters:
+Caveats:
+******************************************************************************/
+int
+tmpltest()
+{
+    const P_STREAMTAB *mods[] = {&echo_streamtab};
+    P_STREAMTMPL tmpl;
+    TESTMEM tmem;
+    P_MEM mem[TMPLSTREAMS];
+    P_STREAMHEAD *strm[TMPLSTREAMS];
+    char data[MSGSIZE];
+    char got[MSGSIZE];
+    P_BUF dbuf;
+    char *start=NULL;
+    int32 opentime=0;
+    int32 begin=0;
+    int nopen=0;
+    int ngot=0;
+    int nfailed=0;
+    int ii;
+
+    tmem.vmem.buf = calloc(1, VMEMSIZE);
+    tmem.vmem.base = start = (char *)tmem.vmem.buf;
+    tmem.vmem.limit = tmem.vmem.base + VMEMSIZE;
+    tmem.pmem.buf = calloc(1, PMEMSIZE);
+    tmem.pmem.base = (char *)tmem.pmem.buf;
+    tmem.pmem.limit = tmem.pmem.base + PMEMSIZE;
+    ASSERT(tmem.vmem.buf && tmem.pmem.buf);
+
+    if(pstreams_mktemplate(&tmpl, P_NULL, &combinedconf, mods, 1,
+        &tmem.vmem, &tmem.pmem) != P_STREAMS_SUCCESS)
+    {
+        CONSOLEWRITE("RESULT: tmpltest failed. pstreams_mktemplate\n");
+        free(tmem.vmem.buf);
+        free(tmem.pmem.buf);
+        return -1;
+    }
+    nfailed += tmem.vmem.base != start || tmpl.memsize > VMEMSIZE;
+
+    mem[0] = tmem.vmem;
+    for(ii=1; ii<TMPLSTREAMS; ii++)
+    {
+        mem[ii].buf = calloc(1, tmpl.memsize);
+        mem[ii].base = (char *)mem[ii].buf;
+        mem[ii].limit = mem[ii].base + tmpl.memsize;
+        ASSERT(mem[ii].buf);
+    }
+
+    begin = my_clockticks();
+    for(ii=0; ii<TMPLSTREAMS; ii++)
+    {
+        strm[ii] = pstreams_tmplopen(&tmpl, &mem[ii], &tmem.pmem);
+        nopen += strm[ii] != NULL;
+    }
+    opentime = my_clockticks() - begin;
+
+    for(ii=0; ii<TMPLSTREAMS; ii++)
+    {
+        if(!strm[ii])
+        {
+            continue;
+        }
+
+        sprintf(data, "stream %d", ii);
+        dbuf.buf = data;
+        dbuf.len = dbuf.maxlen = strlen(data)+1;
+        if(pstreams_putmsg(strm[ii], NULL, &dbuf, 0) != P_STREAMS_SUCCESS)
+        {
+            nfailed++;
+            continue;
+        }
+
+        begin = my_clockticks();
+        while(!pstreams_msgcount(strm[ii]) && my_clockticks() - begin < TESTWAIT)
+        {
+            pstreams_callsrvp(strm[ii]);
+        }
+
+        dbuf.buf = got;
+        dbuf.len = 0;
+        dbuf.maxlen = sizeof(got);
+        pstreams_getmsg(strm[ii], NULL, &dbuf, NULL);
+        if(dbuf.len == (int)strlen(data)+1 && !strcmp(got, data))
+        {
+            ngot++;
+        }
+    }
+
+    for(ii=0; ii<TMPLSTREAMS; ii++)
+    {
+        if(strm[ii])
+        {
+            pstreams_close(strm[ii]);
+        }
+        if(ii)
+        {
+            free(mem[ii].buf);
+        }
+    }
+    free(tmem.vmem.buf);
+    free(tmem.pmem.buf);
+
+    nfailed += nopen != TMPLSTREAMS || ngot != TMPLSTREAMS;
+
+    CONSOLEWRITE("RESULT: tmpltest %s. %d bytes a stream; opened %d of %d in %d ms,"
+        " echoed through %d; checks failed=%d\n", nfailed ? "failed" : "passed",
+        (int)tmpl.memsize, nopen, TMPLSTREAMS, (int)opentime, ngot, nfailed);
+
+    return nfailed ? -1 : 0;
+}
+
+#define BANDMSGSIZE 64 /*bytes of each message of bandtest*/
+
+/******************************************************************************
+Name: bandmsg
+Purpose: a message of BANDMSGSIZE bytes of fill, in given band
+Parameters:
+Caveats:
+******************************************************************************/
+static P_MSGB *
+bandmsg(P_STREAMHEAD *strm, unsigned char band, char fill)
+{
+    P_MSGB *msg = pstreams_allocb(strm, BANDMSGSIZE, 0);
+
+    ASSERT(msg);
+    memset(msg->b_wptr, fill, BANDMSGSIZE);
+    msg->b_wptr += BANDMSGSIZE;
+    msg->b_band = band;
+
+    return msg;
+}
+
+/******************************************************************************
+Name: bandtest
+Purpose: priority bands of a queue - band 0 data put first, then bands 2 and
+    1, come off getq as 2, 1, 0. Band 1 is refused by bcanput once it holds
+    its qb_hiwat, while band 0 still has room; drained, it takes again.
+Parameters:
+Caveats: the echo module's write queue is used, and not run meanwhile
+******************************************************************************/
+int
+bandtest()
+{
+    static const unsigned char order[] = {2, 1, 0};
+    TESTMEM tmem;
+    P_STREAMHEAD *strm=NULL;
+    P_QUEUE *q=NULL;
+    P_QBAND *qb=NULL;
+    P_MSGB *msg=NULL;
+    int hiwat=0;
+    int nput=0;
+    int ngot=0;
+    int nfailed=0;
+    unsigned int ii;
+
+    strm = openteststream(&tmem, P_NULL, &echo_streamtab);
+    q = strm->appwrq.q_next;
+
+    pstreams_putq(q, bandmsg(strm, 0, 'a'));
+    pstreams_putq(q, bandmsg(strm, 2, 'c'));
+    pstreams_putq(q, bandmsg(strm, 1, 'b'));
+    nfailed += pstreams_qsize(q) != 3;
+
+    for(ii=0; ii<sizeof(order); ii++)
+    {
+        msg = pstreams_getq(q);
+        nfailed += !msg || msg->b_band != order[ii] || msg->b_rptr[0] != 'a'+order[ii];
+        pstreams_freemsg(strm, msg);
+    }
+    nfailed += pstreams_getq(q) != NULL || q->q_bandmap != 0;
+
+    /*band 1 fills - refused just as it reaches its hiwat*/
+    qb = &q->q_bandinfo[1-1];
+    hiwat = qb->qb_hiwat;
+    while(pstreams_bcanput(q, 1) && nput < 2*hiwat/BANDMSGSIZE)
+    {
+        pstreams_putq(q, bandmsg(strm, 1, 'b'));
+        nput++;
+    }
+    nfailed += qb->qb_count < qb->qb_hiwat || qb->qb_count - BANDMSGSIZE >= qb->qb_hiwat;
+    nfailed += !(qb->qb_flag & QWANTW);
+
+    /*band 0 is flow controlled apart*/
+    nfailed += !pstreams_canput(q) || (q->q_flag & (QFULL|QWANTW));
+
+    while((msg = pstreams_getq(q)) != NULL)
+    {
+        ngot += msg->b_band == 1;
+        pstreams_freemsg(strm, msg);
+    }
+    nfailed += ngot != nput || !pstreams_bcanput(q, 1);
+
+    closeteststream(strm, &tmem);
+
+    CONSOLEWRITE("RESULT: bandtest %s. band 1 took %d of %d bytes before refused, %d back;"
+        " checks failed=%d\n", nfailed ? "failed" : "passed",
+        nput*BANDMSGSIZE, hiwat, ngot, nfailed);
+
+    return nfailed ? -1 : 0;
+}
+
+/******************************************************************************
+Name: runcount
+Purpose: times q is on its stream's run queue
+Parameters:
+Caveats:
+******************************************************************************/
+static int
+runcount(P_STREAMHEAD *strm, P_QUEUE *q)
+{
+    P_QUEUE *rq=NULL;
+    int n=0;
+
+    for(rq = strm->runhead; rq; rq = rq->q_link)
+    {
+        n += rq == q;
+    }
+
+    return n;
+}
+
+/******************************************************************************
+Name: backenabletest
+Purpose: back-enable - a queue filled till canput refuses its writer is
+    marked QWANTW. The writer is not run while the queue stays at or above
+    q_lowat, and is put on the run queue exactly once as getq drains it below
+Parameters:
+Caveats: the writer is the streamhead's write queue, the queue the echo
+    module's write queue; neither is run meanwhile
+******************************************************************************/
+int
+backenabletest()
+{
+    TESTMEM tmem;
+    P_STREAMHEAD *strm=NULL;
+    P_QUEUE *wq=NULL;
+    P_QUEUE *q=NULL;
+    P_MSGB *msg=NULL;
+    int nput=0;
+    int early=0; /*times the writer was run above q_lowat*/
+    int enabledat=-1; /*bytes left on q when the writer was enabled*/
+    int nruns=0;
+    int nfailed=0;
+
+    strm = openteststream(&tmem, P_NULL, &echo_streamtab);
+    wq = &strm->appwrq;
+    q = wq->q_next;
+
+    while(pstreams_canput(q) && nput < 2*(int)(q->q_hiwat/BANDMSGSIZE))
+    {
+        pstreams_putq(q, bandmsg(strm, 0, 'a'));
+        nput++;
+    }
+    nfailed += !(q->q_flag & QWANTW) || runcount(strm, wq) != 0;
+
+    while((msg = pstreams_getq(q)) != NULL)
+    {
+        pstreams_freemsg(strm, msg);
+
+        if(q->q_count >= q->q_lowat && q->q_count > 0)
+        {
+            early += runcount(strm, wq) != 0;
+        }
+        else if(enabledat < 0 && runcount(strm, wq))
+        {
+            enabledat = q->q_count;
+        }
+    }
+    nruns = runcount(strm, wq);
+    nfailed += early || enabledat < 0 || enabledat >= (int)q->q_lowat ||
+        nruns != 1 || !(wq->q_flag & QENAB) || (q->q_flag & QWANTW);
+
+    closeteststream(strm, &tmem);
+
+    CONSOLEWRITE("RESULT: backenabletest %s. %d bytes put; writer run early %d times,"
+        " enabled with %d bytes left, on the run queue %d times; checks failed=%d\n",
+        nfailed ? "failed" : "passed", nput*BANDMSGSIZE, early, enabledat, nruns, nfailed);
+
+    return nfailed ? -1 : 0;
+}
+
+#define LOANMSGS 4 /*messages waiting when loantest takes its loan*/
+#define LOANMORE 64 /*messages through the stream while the loan is out*/
+
+/******************************************************************************
+Name: echoput
+Purpose: put text down strm, and wait till the stream has count messages
+    for the application
+Parameters:
+Caveats: returns P_STREAMS_SUCCESS or P_STREAMS_FAILURE
+******************************************************************************/
+static int
+echoput(P_STREAMHEAD *strm, const char *text, int count)
+{
+    P_BUF dbuf;
+    int32 start=0;
+
+    dbuf.buf = (char *)text;
+    dbuf.len = dbuf.maxlen = strlen(text)+1;
+    if(pstreams_putmsg(strm, NULL, &dbuf, 0) != P_STREAMS_SUCCESS)
+    {
+        return P_STREAMS_FAILURE;
+    }
+
+    start = my_clockticks();
+    while(pstreams_msgcount(strm) < count && my_clockticks() - start < TESTWAIT)
+    {
+        pstreams_callsrvp(strm);
+    }
+
+    return pstreams_msgcount(strm) >= count ? P_STREAMS_SUCCESS : P_STREAMS_FAILURE;
+}
+
+/******************************************************************************
+Name: echogot
+Purpose: is the next message of strm text
+Parameters:
+Caveats:
+******************************************************************************/
+static P_BOOL
+echogot(P_STREAMHEAD *strm, const char *text)
+{
+    char got[MSGSIZE];
+    P_BUF dbuf;
+
+    dbuf.buf = got;
+    dbuf.len = 0;
+    dbuf.maxlen = sizeof(got);
+    pstreams_getmsg(strm, NULL, &dbuf, NULL);
+
+    return dbuf.len == (int)strlen(text)+1 && !strcmp(got, text);
+}
+
+/******************************************************************************
+Name: loantest
+Purpose: a loan kept while the stream is read past it, and many more
+    messages go through - it still holds its message; released, every
+    message block is back, and releasing it again is harmless
+Parameters:
+Caveats:
+******************************************************************************/
+int
+loantest()
+{
+    TESTMEM tmem;
+    P_STREAMHEAD *strm=NULL;
+    P_LOAN loan;
+    P_MSGB *blk=NULL;
+    P_BUF seg;
+    char data[MSGSIZE];
+    char lent[MSGSIZE];
+    int nlent=0;
+    int ngot=0;
+    int nfailed=0;
+    int ii;
+    PDBG(int32 inuse=0);
+
+    strm = openteststream(&tmem, P_NULL, &echo_streamtab);
+    PDBG(inuse = strm->mdbmsgs);
+
+    for(ii=0; ii<LOANMSGS; ii++)
+    {
+        sprintf(data, "loan %d", ii);
+        nfailed += echoput(strm, data, ii+1) != P_STREAMS_SUCCESS;
+    }
+
+    memset(&loan, 0, sizeof(loan));
+    nfailed += pstreams_getloan(strm, &loan, NULL) != P_STREAMS_SUCCESS || !loan.datmsg;
+
+    /*read past it, and put more through - the loan's blocks are not reused*/
+    for(ii=1; ii<LOANMSGS; ii++)
+    {
+        sprintf(data, "loan %d", ii);
+        ngot += echogot(strm, data);
+    }
+    for(ii=0; ii<LOANMORE; ii++)
+    {
+        sprintf(data, "more %d", ii);
+        if(echoput(strm, data, 1) == P_STREAMS_SUCCESS)
+        {
+            ngot += echogot(strm, data);
+        }
+    }
+
+    for(blk = loan.datmsg; pstreams_loanseg(&blk, &seg); )
+    {
+        if(nlent + seg.len <= (int)sizeof(lent))
+        {
+            memcpy(&lent[nlent], seg.buf, seg.len);
+            nlent += seg.len;
+        }
+    }
+    nfailed += loan.datlen != (int)strlen("loan 0")+1 || nlent != loan.datlen ||
+        strcmp(lent, "loan 0");
+
+    pstreams_loanrelease(strm, &loan);
+    nfailed += loan.datmsg != NULL || loan.datlen != 0;
+    pstreams_loanrelease(strm, &loan);
+
+    nfailed += pstreams_msgcount(strm) != 0 || ngot != LOANMSGS-1+LOANMORE;
+    PDBG(nfailed += strm->mdbmsgs != inuse);
+
+    closeteststream(strm, &tmem);
+
+    CONSOLEWRITE("RESULT: loantest %s. lent %d bytes, read %d past it; checks failed=%d\n",
+        nfailed ? "failed" : "passed", nlent, ngot, nfailed);
+
+    return nfailed ? -1 : 0;
+}
+
+#ifdef PSTREAMS_EVENTFD
+/******************************************************************************
+Name: notifyready
+Purpose: is fd readable now
+Parameters:
+Caveats:
+******************************************************************************/
+static P_BOOL
+notifyready(SOCKET fd)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+/******************************************************************************
+Name: notifytest
+Purpose: the streamhead's notify fd - not readable on an empty stream,
+    readable once the first message is up, and so till the last is taken,
+    by getmsg or by a loan. Then not readable again.
+Parameters:
+Caveats:
+******************************************************************************/
+int
+notifytest()
+{
+    TESTMEM tmem;
+    P_STREAMHEAD *strm=NULL;
+    P_LOAN loan;
+    SOCKET fd=INVALID_SOCKET;
+    int nfailed=0;
+
+    strm = openteststream(&tmem, P_NULL, &echo_streamtab);
+
+    fd = pstreams_notifyfd(strm);
+    nfailed += fd == INVALID_SOCKET || pstreams_notifyfd(strm) != fd;
+    nfailed += notifyready(fd);
+
+    nfailed += echoput(strm, "first", 1) != P_STREAMS_SUCCESS || !notifyready(fd);
+    nfailed += echoput(strm, "second", 2) != P_STREAMS_SUCCESS || !notifyready(fd);
+
+    nfailed += !echogot(strm, "first") || !notifyready(fd);
+    nfailed += !echogot(strm, "second") || notifyready(fd);
+
+    /*emptied by a loan as well*/
+    nfailed += echoput(strm, "third", 1) != P_STREAMS_SUCCESS || !notifyready(fd);
+    memset(&loan, 0, sizeof(loan));
+    nfailed += pstreams_getloan(strm, &loan, NULL) != P_STREAMS_SUCCESS || notifyready(fd);
+    pstreams_loanrelease(strm, &loan);
+
+    closeteststream(strm, &tmem);
+
+    CONSOLEWRITE("RESULT: notifytest %s. checks failed=%d\n",
+        nfailed ? "failed" : "passed", nfailed);
+
+    return nfailed ? -1 : 0;
+}
+#else
+int
+notifytest()
+{
+    CONSOLEWRITE("RESULT: notifytest skipped. no eventfd(PSTREAMS_EVENTFD)\n");
+    return 0;
+}
+#endif /*PSTREAMS_EVENTFD*/
+
+#define SLABOBJSIZE 32
+#define SLABBASE 8 /*objects of slabtest's pool in its placement area*/
+#define SLABGROW 8 /*objects of each slab it grows by*/
+#define SLABHELD (SLABBASE+2*SLABGROW+SLABGROW/2) /*objects taken - into a third slab*/
+#define SLABCOOL 5 /*clock ticks a slab stays idle before it is trimmed*/
+
+typedef struct slabcount /*backing allocator calls of slabtest*/
+{
+    int nalloc;
+    int nfree;
+} SLABCOUNT;
+
+/******************************************************************************
+Name: slaballoc, slabfree
+Purpose: backing allocator of slabtest - the heap, counted
+Parameters:
+Caveats:
+******************************************************************************/
+static void *
+slaballoc(void *arg, uint32 size)
+{
+    ((SLABCOUNT *)arg)->nalloc++;
+    return malloc(size);
+}
+
+static void
+slabfree(void *arg, void *ptr, uint32 size)
+{
+    (void)size;
+    ((SLABCOUNT *)arg)->nfree++;
+    free(ptr);
+}
+
+/******************************************************************************
+Name: slabtest
+Purpose: an elastic pool grown past its placement area by three slabs. One
+    emptied slab is trimmed once idle for the cooldown, not before. The
+    objects still held keep their contents, and every free object can be
+    taken again. Emptied, the pool trims back to its placement area.
+Parameters:
+Caveats: objects are taken and given back with lop_alloc and lop_release -
+    a magazine would keep a slab in use
+******************************************************************************/
+int
+slabtest()
+{
+    static char area[SLABBASE*(SLABOBJSIZE+64) + 1024];
+    SLABCOUNT counts = {0, 0};
+    LOPBACKING backing = {slaballoc, slabfree, NULL, SLABGROW, SLABCOOL};
+    POOLHDR *pool=NULL;
+    unsigned char *objs[SLABHELD+SLABGROW];
+    uint32 ntrim[4];
+    uint32 avail=0;
+    int nheld=0;
+    int nlost=0;
+    int nagain=0;
+    int nfailed=0;
+    int ii;
+
+    ASSERT(lop_getpoolsize(SLABOBJSIZE, SLABBASE) <= sizeof(area));
+
+    backing.arg = &counts;
+    pool = lop_allocpool(SLABOBJSIZE, SLABBASE, area);
+    lop_setbacking(pool, &backing);
+    lop_trimpool(pool, 0);
+
+    for(ii=0; ii<SLABHELD; ii++)
+    {
+        objs[ii] = (unsigned char *)lop_alloc(pool);
+        if(objs[ii])
+        {
+            memset(objs[ii], ii, SLABOBJSIZE);
+        }
+    }
+    nfailed += counts.nalloc != 3 || pool->count != SLABBASE+3*SLABGROW;
+
+    /*the first slab's objects back - it idles*/
+    for(ii=SLABBASE; ii<SLABBASE+SLABGROW; ii++)
+    {
+        lop_release(pool, objs[ii]);
+        objs[ii] = NULL;
+    }
+
+    ntrim[0] = lop_trimpool(pool, SLABCOOL-1);
+    ntrim[1] = lop_trimpool(pool, SLABCOOL);
+    nfailed += ntrim[0] != 0 || ntrim[1] != 1 || counts.nfree != 1 ||
+        pool->count != SLABBASE+2*SLABGROW || lop_checkpool(pool) != LISTOP_SUCCESS;
+
+    /*what is held is intact; what is free can be had, with no new slab*/
+    for(ii=0; ii<SLABHELD; ii++)
+    {
+        if(objs[ii])
+        {
+            nheld++;
+            nlost += objs[ii][0] != (unsigned char)ii || objs[ii][SLABOBJSIZE-1] != (unsigned char)ii;
+        }
+    }
+    avail = lop_availcount(pool);
+    nfailed += nheld + (int)avail != (int)pool->count;
+
+    for(ii=SLABBASE; ii<SLABBASE+(int)avail; ii++)
+    {
+        objs[ii] = (unsigned char *)lop_alloc(pool);
+        nagain += objs[ii] != NULL;
+    }
+    nfailed += nagain != (int)avail || counts.nalloc != 3;
+
+    /*all back - the pool trims to its placement area, idle since SLABCOOL*/
+    for(ii=0; ii<SLABHELD; ii++)
+    {
+        if(objs[ii])
+        {
+            lop_release(pool, objs[ii]);
+        }
+    }
+    ntrim[2] = lop_trimpool(pool, 2*SLABCOOL-1);
+    ntrim[3] = lop_trimpool(pool, 2*SLABCOOL);
+    nfailed += ntrim[2] != 0 || ntrim[3] != 2 || counts.nfree != counts.nalloc ||
+        pool->count != SLABBASE || lop_availcount(pool) != SLABBASE;
+
+    lop_releasepool(pool);
+
+    nfailed += nlost;
+
+    CONSOLEWRITE("RESULT: slabtest %s. slabs got=%d given back=%d; trimmed %u, %u, %u then %u;"
+        " %d held, %d lost, %d taken again; checks failed=%d\n",
+        nfailed ? "failed" : "passed", counts.nalloc, counts.nfree,
+        ntrim[0], ntrim[1], ntrim[2], ntrim[3], nheld, nlost, nagain, nfailed);
+
+    return nfailed ? -1 : 0;
+}
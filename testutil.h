@@ -15,23 +15,49 @@ FILE: testutil.h
 
 /*public variables defined in the .c file*/
 extern FILE *ltfile;
+extern const P_STREAMCONF combinedconf;
+extern const P_STREAMCONF separateconf;
+
+typedef struct testmem /*memory a unit test's stream lives in - see openteststream*/
+{
+    P_MEM vmem;
+    P_MEM pmem;
+} TESTMEM;
 
 /*private*/
 void init_global_buffers();
-int setraddrs(P_STREAMHEAD *strm);
+int setraddrs(P_STREAMHEAD *strm, ushort port);
 
 /*public*/
 #ifdef __cplusplus
 extern "C" {
 #endif
-P_STREAMHEAD *buildstream();
+P_STREAMHEAD *buildstream(const P_STREAMCONF *conf);
 int service_strm(P_STREAMHEAD *strm);
 void init_test();
 int echotest(P_STREAMHEAD *strm, int count);
 int send_echomsg(P_STREAMHEAD *strm);
-int rcv_echomsg(P_STREAMHEAD *strm);
+int rcv_echomsg(P_STREAMHEAD *strm, int32 timeout);
 int service_strm(P_STREAMHEAD *strm);
-int handle_msgin(P_STREAMHEAD *strm, P_BUF *cbuf, P_BUF *dbuf);
+int handle_msgin(P_STREAMHEAD *strm, P_BUF *cbuf, P_BUF *dbuf);
+
+/*unit tests*/
+int runtests(const char *name);
+P_STREAMHEAD *openteststream(TESTMEM *tmem, int devid, const P_STREAMTAB *mod);
+void closeteststream(P_STREAMHEAD *strm, TESTMEM *tmem);
+int ingresstest();
+int pintest();
+int schedtest();
+int cursortest();
+int mmsgtest();
+int bigmsgtest();
+int magtest();
+int tmpltest();
+int bandtest();
+int backenabletest();
+int loantest();
+int notifytest();
+int slabtest();
 
 /*defined elsewhere*/
 int mydisplay(const char *fmt,...);
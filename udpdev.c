@@ -8,8 +8,13 @@ FILE: udpdev.c
  Oct.09,2001  tgeorge          Created.
 
 ===========================================================================*/
+/*for recvmmsg(PSTREAMS_RECVMMSG) - has to precede the system headers*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "options.h"
 #include "env.h"
 #include "assert.h"
@@ -18,64 +23,51 @@ FILE: udpdev.c
 #include "udpdev.h"
 #include "util.h"
 
-P_QINIT udpdev_wrinit={0};
-P_QINIT udpdev_rdinit={0};
-P_STREAMTAB udpdev_streamtab={0};
-P_MODINFO udpdev_wrmodinfo={0};
-P_MODINFO udpdev_rdmodinfo={0};
+static int
+udpdev_rxdeliver(P_QUEUE *q, P_MSGB *msg, int32 len);
+#ifdef PSTREAMS_RECVMMSG
+static int
+udpdev_rxbatch(P_QUEUE *q);
+#endif
+#ifdef PSTREAMS_SENDMSG
+static int
+udpdev_rxlarge(P_QUEUE *q, int32 len);
+#endif
+#ifdef PSTREAMS_SENDMMSG
+static int
+udpdev_wflush(P_QUEUE *q);
+#endif
+static UDPDEVAREA *
+udpdev_getarea(P_QUEUE *q);
+
+static const P_MODINFO udpdev_wrmodinfo={1, "UDPDEV WR", 0, 100, 1024, 256};
+static const P_MODINFO udpdev_rdmodinfo={1, "UDPDEV_RD", 0, 100, 1024, 256};
+#ifdef M2STRICTTYPES
+static const P_QINIT udpdev_wrinit={udpdev_wput, udpdev_wsrvp,
+    udpdev_open, NULL, NULL, &udpdev_wrmodinfo, NULL};
+static const P_QINIT udpdev_rdinit={udpdev_rput, udpdev_rsrvp,
+    udpdev_open, udpdev_close, NULL, &udpdev_rdmodinfo, NULL};
+#else
+static const P_QINIT udpdev_wrinit={(int (*)())udpdev_wput, (int (*)())udpdev_wsrvp,
+    (int (*)())udpdev_open, NULL, NULL, &udpdev_wrmodinfo, NULL};
+static const P_QINIT udpdev_rdinit={(int (*)())udpdev_rput, (int (*)())udpdev_rsrvp,
+    (int (*)())udpdev_open, (int (*)())udpdev_close, NULL, &udpdev_rdmodinfo, NULL};
+#endif
+const P_STREAMTAB udpdev_streamtab={&udpdev_rdinit, &udpdev_wrinit, NULL, NULL};
 
 /*DEBUG mode - overriding options.h settings*/
 #define PSTREAMS_LT
 
 /******************************************************************************
 Name: udpdev_init
-Purpose: initialise this module. constructor for this module.
+Purpose: initialise this module. udpdev_streamtab is constant, and the socket
+    and addresses are per stream(UDPDEVAREA off q_ptr) - nothing to do.
 Parameters:
-Caveats:
+Caveats: no longer called by pstreams_open.
 ******************************************************************************/
 int
 udpdev_init()
 {
-    /*first initialize udpdevmodinfo*/
-    udpdev_wrmodinfo.mi_idnum = 1;
-    udpdev_wrmodinfo.mi_idname = "UDPDEV WR";
-    udpdev_wrmodinfo.mi_minpsz = 0;
-    udpdev_wrmodinfo.mi_maxpsz = 100;
-    udpdev_wrmodinfo.mi_hiwat = 1024;
-    udpdev_wrmodinfo.mi_lowat = 256;
-
-    udpdev_rdmodinfo.mi_idnum = 1;
-    udpdev_rdmodinfo.mi_idname = "UDPDEV_RD";
-    udpdev_rdmodinfo.mi_minpsz = 0;
-    udpdev_rdmodinfo.mi_maxpsz = 100;
-    udpdev_rdmodinfo.mi_hiwat = 1024;
-    udpdev_rdmodinfo.mi_lowat = 256;
-
-    /*init udpdev_streamtab*/
-#ifdef M2STRICTTYPES
-    udpdev_wrinit.qi_qopen = udpdev_open;
-    udpdev_wrinit.qi_putp = udpdev_wput;
-    udpdev_wrinit.qi_srvp = NULL;
-    udpdev_rdinit.qi_qopen = udpdev_open;
-    udpdev_rdinit.qi_putp = udpdev_rput;
-    udpdev_rdinit.qi_srvp = udpdev_rsrvp;
-    udpdev_rdinit.qi_qclose = udpdev_close;
-#else
-    udpdev_wrinit.qi_qopen = (int (*)())udpdev_open;
-    udpdev_wrinit.qi_putp = (int (*)())udpdev_wput;
-    udpdev_wrinit.qi_srvp = NULL;
-    udpdev_rdinit.qi_qopen = (int (*)())udpdev_open;
-    udpdev_rdinit.qi_putp = (int (*)())udpdev_rput;
-    udpdev_rdinit.qi_srvp = (int (*)())udpdev_rsrvp;
-    udpdev_rdinit.qi_qclose = (int (*)())udpdev_close;
-#endif
-
-    udpdev_wrinit.qi_minfo = &udpdev_wrmodinfo;
-    udpdev_rdinit.qi_minfo = &udpdev_rdmodinfo;
-
-    udpdev_streamtab.st_wrinit = &udpdev_wrinit;
-    udpdev_streamtab.st_rdinit = &udpdev_rdinit;
-
     return P_STREAMS_SUCCESS;
 }
 
@@ -100,9 +92,13 @@ udpdev_open(P_QUEUE *q)
     }
     else
     {
-        area = udpdev_getarea(NULL);
+        area = udpdev_getarea(q);
 
-        ASSERT(area); /*TODO - handle*/
+        if(!area)
+        {
+            PSTRMHEAD(q)->perrno = P_OUTOFMEMORY;
+            return P_STREAMS_FAILURE;
+        }
 
 #ifdef PSTREAMS_WIN32
         /*init winsock*/
@@ -150,7 +146,22 @@ udpdev_open(P_QUEUE *q)
 
         area->laddr.sin_family = area->raddr.sin_family = AF_INET;
 
+        area->rxbatch = PSTREAMS_UDPRXBATCH;
+        area->txbatch = PSTREAMS_UDPTXBATCH;
+        area->txbytes = PSTREAMS_UDPTXBYTES;
+        area->txdelay = PSTREAMS_UDPTXDELAY;
+
         q->q_ptr = area;
+
+        /*udpdev_rsrvp runs when pstreams_pollwait finds the socket readable*/
+        if(pstreams_fdregister(RD(q), area->sock) != P_STREAMS_SUCCESS)
+        {
+#ifdef PSTREAMS_LT
+            pstreams_log(q, PSTREAMS_LTERROR, "udpdev_open: pstreams_fdregister() failed. error %d",
+                PSTRMHEAD(q)->perrno);
+#endif /*PSTREAMS_LT*/
+            return P_STREAMS_FAILURE;
+        }
     }
 
     return P_STREAMS_SUCCESS;
@@ -172,10 +183,17 @@ udpdev_wput(P_QUEUE *q, P_MSGB *msg)
     switch(msg->b_datap->db_type)
     {
     case P_M_DATA:
-        status = udpdev_wput_data(q, msg);
+        status = udpdev_wsnd(q, msg);
         break;
     case P_M_PROTO:
     case P_M_CTL:
+#ifdef PSTREAMS_SENDMMSG
+        /*datagrams queued for a batched send go out before the control takes effect*/
+        if(q->q_msglist)
+        {
+            udpdev_wflush(q);
+        }
+#endif
         status = udpdev_wput_ctl(q, msg);
         break;
     default:
@@ -206,6 +224,10 @@ udpdev_wput_data(P_QUEUE *q, P_MSGB *msg)
     UDPDEVAREA *area=NULL;
     int32 msgsize=0;
     int sockstatus=0;
+    int niov=-1; /*iovec entries describing msg - -1 if no scatter-gather*/
+#ifdef PSTREAMS_SENDMSG
+    struct iovec iov[PSTREAMS_MAXIOV];
+#endif
 
     ASSERT(msg);
 
@@ -213,7 +235,15 @@ udpdev_wput_data(P_QUEUE *q, P_MSGB *msg)
 
     msgsize = pstreams_msgsize(msg);
 
+#ifdef PSTREAMS_SENDMSG
     if(pstreams_countmsgcont(msg) > 1)
+    {
+        niov = pstreams_msgtoiov(msg, iov, PSTREAMS_MAXIOV);
+    }
+#endif
+
+    /*without scatter-gather a chain has to be made one block*/
+    if(niov < 0 && pstreams_countmsgcont(msg) > 1)
     {
         P_MSGB *pullupmsg = pstreams_msgpullup(PSTRMHEAD(q), msg, msgsize);
 
@@ -225,10 +255,11 @@ udpdev_wput_data(P_QUEUE *q, P_MSGB *msg)
                 msgsize);
 #endif
             pstreams_putq(q, msg);
+            pstreams_qtimeout(q, 0); /*udpdev_wsrvp retries on the next pass*/
             return P_STREAMS_SUCCESS;
         }
 
-        ASSERT(msgsize == pstreams_msg1size(pullupmsg));
+        ASSERT(msgsize == (int32)pstreams_msg1size(pullupmsg));
 
         pstreams_freemsg(PSTRMHEAD(q), msg);
         msg = pullupmsg;
@@ -236,15 +267,30 @@ udpdev_wput_data(P_QUEUE *q, P_MSGB *msg)
 
 #ifdef PSTREAMS_UDPDUMP
     {
-        uchar hexbuf[1792*2]={0};
+        uchar hexbuf[MAXUDPRXBUF*2]={0};
 
-        bintohex(hexbuf, msg->b_rptr, msgsize);
+        bintohex(hexbuf, msg->b_rptr, MIN(pstreams_msg1size(msg), sizeof(hexbuf)/2 - 1));
 
         pstreams_log(q, PSTREAMS_LTINFO, "udpdev_wput_data: sending %ld bytes\n%s",
             msgsize, hexbuf);
     }
 #endif /*PSTREAMS_LT*/
 
+#ifdef PSTREAMS_SENDMSG
+    if(niov >= 0)
+    {
+        struct msghdr mhdr;
+
+        memset(&mhdr, 0, sizeof(mhdr));
+        mhdr.msg_name = (void *)&area->raddr;
+        mhdr.msg_namelen = sizeof(area->raddr);
+        mhdr.msg_iov = iov;
+        mhdr.msg_iovlen = niov;
+
+        sockstatus = sendmsg(area->sock, &mhdr, 0);
+    }
+    else
+#endif
     sockstatus = sendto(area->sock, (char *)msg->b_rptr, msgsize, 0,
                         (struct sockaddr *)&area->raddr, sizeof(area->raddr));
 
@@ -290,11 +336,241 @@ udpdev_wput_data(P_QUEUE *q, P_MSGB *msg)
     {
         /*send later*/
         pstreams_putq(q, msg);
+        pstreams_qtimeout(q, 0);
+    }
+
+    return P_STREAMS_SUCCESS;
+}
+
+/******************************************************************************
+Name: udpdev_wsnd
+Purpose: send a data message - right away, or queued for a batched send when
+    the stream batches(area->txbatch > 1). A batch goes out as soon as
+    txbatch datagrams or txbytes bytes are queued; udpdev_wsrvp sends it
+    once the oldest datagram has waited txdelay milliseconds.
+Parameters:
+Caveats: msg is consumed, as in udpdev_wput_data
+******************************************************************************/
+int
+udpdev_wsnd(P_QUEUE *q, P_MSGB *msg)
+{
+#ifdef PSTREAMS_SENDMMSG
+    UDPDEVAREA *area = (UDPDEVAREA *)q->q_ptr;
+
+    if(area->txbatch > 1)
+    {
+        if(!q->q_msglist)
+        {
+            /*udpdev_wsrvp sends the batch by then*/
+            area->txsince = my_clockticks();
+            pstreams_qtimeout(q, area->txdelay);
+        }
+
+        pstreams_putq(q, msg);
+
+        /*
+         * msg is queued, so taken - a send error dropping some datagram of
+         * the batch is not the putter's failure, and does not stop its srvp
+         */
+        if(pstreams_qsize(q) >= area->txbatch || q->q_count >= (uint32)area->txbytes)
+        {
+            udpdev_wflush(q);
+        }
+
+        return P_STREAMS_SUCCESS;
+    }
+#endif
+
+    return udpdev_wput_data(q, msg);
+}
+
+/******************************************************************************
+Name: udpdev_wsrvp
+Purpose: service procedure for downstream traffic. sends a pending batch that
+    is due, and retries datagrams udpdev_wput_data put back on the queue.
+Parameters:
+Caveats: send errors are logged, and the datagram dropped, by the senders -
+    they do not fail the service pass.
+******************************************************************************/
+int
+udpdev_wsrvp(P_QUEUE *q)
+{
+    UDPDEVAREA *area = (UDPDEVAREA *)q->q_ptr;
+    int n=0;
+
+    if(!area || !q->q_msglist)
+    {
+        return P_STREAMS_SUCCESS;
+    }
+
+#ifdef PSTREAMS_SENDMMSG
+    if(area->txbatch > 1)
+    {
+        int32 waited = my_clockticks() - area->txsince;
+
+        if(pstreams_qsize(q) >= area->txbatch || q->q_count >= (uint32)area->txbytes ||
+            waited >= area->txdelay)
+        {
+            udpdev_wflush(q);
+        }
+        else
+        {
+            pstreams_qtimeout(q, area->txdelay - waited);
+        }
+
+        return P_STREAMS_SUCCESS;
+    }
+#endif
+
+    /*one attempt each - a message may be put back again*/
+    for(n = pstreams_qsize(q); n > 0; n--)
+    {
+        udpdev_wput_data(q, pstreams_getq(q));
     }
 
     return P_STREAMS_SUCCESS;
 }
 
+#ifdef PSTREAMS_SENDMMSG
+/******************************************************************************
+Name: udpdev_wflush
+Purpose: send all datagrams queued on q, upto MAXUDPTXBATCH per sendmmsg.
+    Each is sent straight from its blocks; one with more than PSTREAMS_MAXIOV
+    blocks is pulled up first.
+Parameters:
+Caveats: as in udpdev_wput_data, a datagram that fails with a hard error is
+    dropped, and P_STREAMS_FAILURE returned. When the socket has no room
+    (EAGAIN/ENOBUFS), or takes only part of a batch, nothing is dropped - the
+    rest stays queued for a retry after UDPTXRETRY ms. If a pullup fails the
+    rest stays queued too.
+******************************************************************************/
+static int
+udpdev_wflush(P_QUEUE *q)
+{
+    UDPDEVAREA *area = (UDPDEVAREA *)q->q_ptr;
+    P_MSGB *msgs[MAXUDPTXBATCH];
+    struct mmsghdr hdrs[MAXUDPTXBATCH];
+    struct iovec iov[MAXUDPTXBATCH][PSTREAMS_MAXIOV];
+    int status=P_STREAMS_SUCCESS;
+    P_BOOL stalled=P_FALSE; /*a pullup failed - send what is ready, retry later*/
+    P_BOOL full=P_FALSE; /*the socket took less than offered - retry later*/
+    int nmsgs=0;
+    int nsent=0;
+    int i=0;
+
+    while(q->q_msglist && !stalled && !full)
+    {
+        for(nmsgs = 0; nmsgs < MAXUDPTXBATCH && q->q_msglist; nmsgs++)
+        {
+            P_MSGB *msg = pstreams_getq(q);
+            int niov = pstreams_msgtoiov(msg, iov[nmsgs], PSTREAMS_MAXIOV);
+
+            if(niov < 0)
+            {
+                int32 msgsize = pstreams_msgsize(msg);
+                P_MSGB *pullupmsg = pstreams_msgpullup(PSTRMHEAD(q), msg, msgsize);
+
+                if(!pullupmsg)
+                {
+#ifdef PSTREAMS_LT
+                    pstreams_log(q, (P_LTCODE)PSTREAMS_LTWARNING, "wflush: pullupmsg failed for %ld bytes. Will retry",
+                        msgsize);
+#endif
+                    pstreams_putbq(q, msg);
+                    stalled = P_TRUE;
+                    break;
+                }
+
+                pstreams_freemsg(PSTRMHEAD(q), msg);
+                msg = pullupmsg;
+                niov = pstreams_msgtoiov(msg, iov[nmsgs], PSTREAMS_MAXIOV);
+            }
+
+            msgs[nmsgs] = msg;
+
+            memset(&hdrs[nmsgs], 0, sizeof(hdrs[nmsgs]));
+            hdrs[nmsgs].msg_hdr.msg_name = (void *)&area->raddr;
+            hdrs[nmsgs].msg_hdr.msg_namelen = sizeof(area->raddr);
+            hdrs[nmsgs].msg_hdr.msg_iov = iov[nmsgs];
+            hdrs[nmsgs].msg_hdr.msg_iovlen = niov;
+        }
+
+        if(!nmsgs)
+        {
+            break;
+        }
+
+        /*MSG_DONTWAIT - a full socket buffer is waited out by the retry, not here*/
+        nsent = sendmmsg(area->sock, hdrs, nmsgs, MSG_DONTWAIT);
+
+        if(nsent == SOCKET_ERROR && 
+            (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+        {
+            /*no room now - the whole batch goes back*/
+            nsent = 0;
+        }
+        else if(nsent == SOCKET_ERROR)
+        {
+            PSTRMHEAD(q)->perrno = errno;
+#ifdef PSTREAMS_LT
+            pstreams_log(q, PSTREAMS_LTERROR, "udpdev_wflush: send failed. error %d",
+                PSTRMHEAD(q)->perrno);
+#endif /*PSTREAMS_LT*/
+            /*drop the datagram that failed - see udpdev_wput_data - and go on*/
+            pstreams_freemsg(PSTRMHEAD(q), msgs[0]);
+            msgs[0] = NULL;
+            status = P_STREAMS_FAILURE;
+            nsent = 1;
+
+            /*the rest goes back, and is offered again on the next round*/
+            for(i = nmsgs-1; i >= nsent; i--)
+            {
+                pstreams_putbq(q, msgs[i]);
+            }
+            nmsgs = nsent;
+        }
+
+#ifdef PSTREAMS_LT
+        pstreams_log(q, PSTREAMS_LTINFO, "udpdev_wflush: datagrams sent=%d of %d", nsent, nmsgs);
+#endif /*PSTREAMS_LT*/
+
+        for(i = 0; i < nsent; i++)
+        {
+            if(msgs[i])
+            {
+                pstreams_freemsg(PSTRMHEAD(q), msgs[i]);
+            }
+        }
+
+        /*
+         * unsent datagrams go back in order, ahead of the rest. A short send
+         * means the socket is full - no more sendmmsg this pass
+         */
+        for(i = nmsgs-1; i >= nsent; i--)
+        {
+            pstreams_putbq(q, msgs[i]);
+            full = P_TRUE;
+        }
+    }
+
+    if(full)
+    {
+        /*txsince is left as it is, so udpdev_wsrvp flushes on the retry*/
+        pstreams_qtimeout(q, UDPTXRETRY);
+    }
+    else if(stalled)
+    {
+        pstreams_qtimeout(q, 0); /*retry the pullup on the next pass*/
+    }
+    else
+    {
+        area->txsince = my_clockticks();
+    }
+
+    return status;
+}
+#endif /*PSTREAMS_SENDMMSG*/
+
 /******************************************************************************
 Name: udpdev_wput_ctl
 Purpose: 
@@ -465,6 +741,52 @@ udpdev_wput_ctl(P_QUEUE *q, P_MSGB *msg)
                 }
                 break;
 
+            case UDPDEV_RXBATCH:
+            case UDPDEV_RXADDR:
+                {
+                    int32 val=0;
+
+                    if(pstreams_msgsize(msg) < sizeof(val))
+                    {
+#ifdef PSTREAMS_LT
+                        pstreams_log(q, PSTREAMS_LTERROR, "wput_ctl: ctl msg has "
+                            "invalid payload for command %d", proto.ctlfunc);
+#endif /*PSTREAMS_LT*/
+                        break;
+                    }
+                    memcpy(&val, msg->b_rptr, sizeof(val));
+
+                    if(proto.ctlfunc == UDPDEV_RXADDR)
+                    {
+                        area->rxaddr = val ? P_TRUE : P_FALSE;
+                    }
+                    else
+                    {
+                        area->rxbatch = MAX(0, MIN(val, MAXUDPRXBATCH));
+                    }
+                }
+                break;
+
+            case UDPDEV_TXBATCH:
+                {
+                    UDPTXBATCH txbatch={0};
+
+                    if(pstreams_msgsize(msg) < sizeof(txbatch))
+                    {
+#ifdef PSTREAMS_LT
+                        pstreams_log(q, PSTREAMS_LTERROR, "wput_ctl: ctl msg has "
+                            "invalid payload for UDPDEV_TXBATCH command");
+#endif /*PSTREAMS_LT*/
+                        break;
+                    }
+                    memcpy(&txbatch, msg->b_rptr, sizeof(txbatch));
+
+                    area->txbatch = MAX(0, MIN(txbatch.count, MAXUDPTXBATCH));
+                    area->txbytes = MAX(0, txbatch.bytes);
+                    area->txdelay = MAX(0, txbatch.delay);
+                }
+                break;
+
             default:
 #ifdef PSTREAMS_LT
                 pstreams_log(q, PSTREAMS_LTWARNING, "udpdev_wput_ctl: unknown command %d",
@@ -495,47 +817,19 @@ udpdev_rsrvp(P_QUEUE *q)
 {
     UDPDEVAREA *area=NULL;
     P_MSGB *msg=NULL;
-    fd_set sockfds={0};
     int32 activesockets=0;
     int32 len = 0;
-    struct timeval timeout={0};
+    int32 rdsize = pstreams_rdbufsize(PSTRMHEAD(q), MAXUDPRXBUF);
 
     area = (UDPDEVAREA *)q->q_ptr;
-    FD_ZERO(&sockfds);
-    FD_SET(area->sock, &sockfds);
-
-    activesockets =
-        select(area->sock+1, &sockfds, NULL, NULL, &timeout);/*last argument => non-blocking*/
 
-    if(activesockets == SOCKET_ERROR)
-    {
-            PSTRMHEAD(q)->perrno = 
-#ifdef PSTREAMS_H8
-                               tfGetSocketError(area->sock);
-#else
-#ifdef PSTREAMS_WIN32
-                                WSAGetLastError();
-#else
-                                errno;
-#endif
-#endif
-#ifdef PSTREAMS_LT
-        pstreams_log(q, PSTREAMS_LTERROR, "udpdev_rsrvp: select failed."
-                    " retval %d. lasterror %d",
-                    activesockets, PSTRMHEAD(q)->perrno);
-#endif /*PSTREAMS_LT*/
-                return P_STREAMS_FAILURE;
-    }
+    /*the socket was found readable by pstreams_pollwait*/
+    activesockets = pstreams_fdready(q) ? 1 : 0;
 
     while ( activesockets > 0 )
     {
         int faddrlen=sizeof(area->faddr);/*length of data returned in faddr*/
 
-        if(!FD_ISSET(area->sock, &sockfds))
-        {
-            continue;
-        }
-
         activesockets--; /*this socket is set*/
 
         /*
@@ -543,11 +837,18 @@ udpdev_rsrvp(P_QUEUE *q)
          * if socket is non-blocking
          */
 
+#ifdef PSTREAMS_RECVMMSG
+        if(area->rxbatch > 1)
+        {
+            return udpdev_rxbatch(q);
+        }
+#endif
+
         /*len = recvfrom(area->sock, buf, 0, MSG_PEEK, (struct sockaddr *)&faddr, &faddrlen);*/
 
         {
             /*char __gc *p = new char[len];*/
-            msg = pstreams_allocb((P_STREAMHEAD *)q->strmhead, 1792, 0);
+            msg = pstreams_allocb((P_STREAMHEAD *)q->strmhead, rdsize, 0);
             if(!msg)
             {
 #ifdef PSTREAMS_LT
@@ -556,61 +857,41 @@ udpdev_rsrvp(P_QUEUE *q)
                 return P_STREAMS_SUCCESS;
             }
 
-            len = recvfrom(area->sock, (char *)msg->b_wptr, 1792, 0, (struct sockaddr *)&area->faddr, &faddrlen);
+#ifdef MSG_TRUNC
+            /*
+             * peek into the read buffer - MSG_TRUNC has the full length of the
+             * datagram returned, so one too large for it is not cut short
+             */
+            len = recvfrom(area->sock, (char *)msg->b_wptr, rdsize, MSG_PEEK|MSG_TRUNC, 
+                (struct sockaddr *)&area->faddr, &faddrlen);
 
-            if ( len != SOCKET_ERROR )
+            if ( len != SOCKET_ERROR && len > rdsize )
             {
-#ifdef PSTREAMS_UDPDUMP
-                /*the block below is space expensive! - TODO verify if needed*/
-                {
-                    uchar hexbuf[1792*2] = { 0 };
-
-                    bintohex(hexbuf, (uchar *)hexbuf, len);
-
-                    pstreams_log(q, PSTREAMS_LTINFO, "udpdev_rsrvp: rx %d bytes\n%s", len, hexbuf);
-                }
-#endif 
-                if ( len > 1792 )
-                {
-                    pstreams_freemsg(PSTRMHEAD(q), msg);
-#ifdef PSTREAMS_LT
-                    pstreams_log(q, PSTREAMS_LTWARNING, 
-                        "rsrvp: UDP datagram too large. dropped %d bytes.", len);
-#endif /*PSTREAMS_LT*/
-                    return P_STREAMS_SUCCESS;
-                }
-
+                pstreams_freemsg(PSTRMHEAD(q), msg);
+#ifdef PSTREAMS_SENDMSG
+                return udpdev_rxlarge(q, len);
+#else
+                recv(area->sock, NULL, 0, 0); /*no scatter-gather to read it with*/
 #ifdef PSTREAMS_LT
-                pstreams_log(q, PSTREAMS_LTINFO, "udpdev_wput_data: bytes read=%ld", len);
+                pstreams_log(q, PSTREAMS_LTWARNING, 
+                    "rsrvp: UDP datagram too large. dropped %d bytes.", len);
 #endif /*PSTREAMS_LT*/
-
-                msg->b_wptr += len;
-
-                if ( len < pstreams_mpool(1792)) /*will a smaller buffer do?*/
-                {
-                    P_MSGB *msgcpy = pstreams_copymsg(PSTRMHEAD(q), msg); /*will try smallest buffer*/
-                    if(msgcpy) /*...and did we get a smaller buffer?*/
-                    {
-                        pstreams_freemsg(PSTRMHEAD(q), msg);
-                        msg = msgcpy;
-                    }
-#ifdef PSTREAMS_LT
-                    else
-                    {
-                        pstreams_log(q, PSTREAMS_LTINFO+1, "udpdev_wput_data: "
-                            "failed in downsizing readbuffer from 1792 to %ld", len);
-                    }
+                return P_STREAMS_SUCCESS;
 #endif
-                }
-#ifdef PSTREAMS_LT
-                else
-                {
-                    pstreams_log(q, PSTREAMS_LTINFO, "udpdev_wput_data: "
-                        "read non-downsizable message of length %ld", len);
-                }
+            }
+
+            if ( len != SOCKET_ERROR )
+            {
+                /*the datagram is in msg - take it off the socket*/
+                recv(area->sock, NULL, 0, 0);
+            }
+#else
+            len = recvfrom(area->sock, (char *)msg->b_wptr, rdsize, 0, (struct sockaddr *)&area->faddr, &faddrlen);
 #endif
-    
-                pstreams_putnext(q, msg);
+
+            if ( len != SOCKET_ERROR )
+            {
+                udpdev_rxdeliver(q, msg, len);
                 msg = NULL;
             }
             else
@@ -646,6 +927,314 @@ udpdev_rsrvp(P_QUEUE *q)
 
     return P_STREAMS_SUCCESS;
 }
+
+
+#ifdef PSTREAMS_RECVMMSG
+/******************************************************************************
+Name: udpdev_rxbatch
+Purpose: read a batch of datagrams with one recvmmsg, into message blocks
+    allocated up front, and send each of them up.
+Parameters:
+Caveats: the batch is no larger than the read buffers the pool has to hand
+    (pstreams_bufavail) - at least one, which an elastic pool may grow for.
+    Unfilled buffers are released. Each buffer has a block of the largest
+    size class behind it, where there is one to spare, for a datagram too
+    large for the buffer. The datagram next up is peeked at, and read whole
+    (udpdev_rxlarge) if too large for both - one further into the batch is
+    truncated, and dropped.
+******************************************************************************/
+static int
+udpdev_rxbatch(P_QUEUE *q)
+{
+    UDPDEVAREA *area = (UDPDEVAREA *)q->q_ptr;
+    P_MSGB *msgs[MAXUDPRXBATCH];
+    struct mmsghdr hdrs[MAXUDPRXBATCH];
+    struct iovec iov[MAXUDPRXBATCH][2];
+    struct sockaddr_in from[MAXUDPRXBATCH];
+    int32 rdsize = pstreams_rdbufsize(PSTRMHEAD(q), MAXUDPRXBUF);
+    int32 bigsize = pstreams_rdbufsize(PSTRMHEAD(q), MAXUDPRXSIZE);
+    int32 len=0;
+    int nbatch=0;
+    int nbig=0;
+    int nmsgs=0;
+    int nrecv=0;
+    int i=0;
+
+    ASSERT(area->rxbatch <= MAXUDPRXBATCH);
+
+    /*no more reads than there are buffers for - so none go up by copy*/
+    nbatch = MAX(1, MIN(area->rxbatch, (int)pstreams_bufavail(PSTRMHEAD(q), rdsize)));
+    if(bigsize > rdsize)
+    {
+        nbig = MIN(nbatch, (int)pstreams_bufavail(PSTRMHEAD(q), bigsize));
+    }
+
+    for(nmsgs = 0; nmsgs < nbatch; nmsgs++)
+    {
+        msgs[nmsgs] = pstreams_allocb(PSTRMHEAD(q), rdsize, 0);
+        if(!msgs[nmsgs])
+        {
+            break;
+        }
+
+        iov[nmsgs][0].iov_base = msgs[nmsgs]->b_wptr;
+        iov[nmsgs][0].iov_len = rdsize;
+
+        memset(&hdrs[nmsgs], 0, sizeof(hdrs[nmsgs]));
+        hdrs[nmsgs].msg_hdr.msg_name = &from[nmsgs];
+        hdrs[nmsgs].msg_hdr.msg_namelen = sizeof(from[nmsgs]);
+        hdrs[nmsgs].msg_hdr.msg_iov = iov[nmsgs];
+        hdrs[nmsgs].msg_hdr.msg_iovlen = 1;
+
+        /*overflow for a large datagram - pstreams_msgfill frees it unused*/
+        if(nmsgs < nbig)
+        {
+            P_MSGB *big = pstreams_allocb(PSTRMHEAD(q), bigsize, 0);
+
+            if(big)
+            {
+                pstreams_linkb(msgs[nmsgs], big);
+                iov[nmsgs][1].iov_base = big->b_wptr;
+                iov[nmsgs][1].iov_len = bigsize;
+                hdrs[nmsgs].msg_hdr.msg_iovlen = 2;
+            }
+        }
+    }
+
+    if(!nmsgs)
+    {
+#ifdef PSTREAMS_LT
+        pstreams_log(q, PSTREAMS_LTWARNING, "rsrvp: Unable to allocate read buffer. Not reading");
+#endif
+        return P_STREAMS_SUCCESS;
+    }
+
+#ifdef PSTREAMS_SENDMSG
+    /*MSG_TRUNC - the full length of the datagram next up, whatever the buffer*/
+    len = recv(area->sock, NULL, 0, MSG_PEEK|MSG_TRUNC|MSG_DONTWAIT);
+    if(len != SOCKET_ERROR && (uint32)len > pstreams_unwritbytes(msgs[0]))
+    {
+        for(i = 0; i < nmsgs; i++)
+        {
+            pstreams_freemsg(PSTRMHEAD(q), msgs[i]);
+        }
+        return udpdev_rxlarge(q, len);
+    }
+#endif
+
+    /*MSG_DONTWAIT - take what is queued now, the socket itself blocks*/
+    nrecv = recvmmsg(area->sock, hdrs, nmsgs, MSG_DONTWAIT, NULL);
+
+    if(nrecv == SOCKET_ERROR)
+    {
+        PSTRMHEAD(q)->perrno = errno;
+#ifdef PSTREAMS_LT
+        pstreams_log(q, PSTREAMS_LTERROR, "udpdev_rsrvp: recvmmsg failed." " error %d", 
+            PSTRMHEAD(q)->perrno);
+#endif /*PSTREAMS_LT*/
+        /*ignore socket error - as for recvfrom in udpdev_rsrvp*/
+        PSTRMHEAD(q)->perrno = 0;
+        nrecv = 0;
+    }
+
+    for(i = 0; i < nrecv; i++)
+    {
+        if(hdrs[i].msg_hdr.msg_flags & MSG_TRUNC)
+        {
+            pstreams_freemsg(PSTRMHEAD(q), msgs[i]);
+#ifdef PSTREAMS_LT
+            pstreams_log(q, PSTREAMS_LTWARNING, 
+                "rsrvp: UDP datagram too large. dropped %d bytes.", hdrs[i].msg_len);
+#endif /*PSTREAMS_LT*/
+            continue;
+        }
+
+        /*faddr is kept current for UDPDEV_SHAREFADDR users*/
+        memcpy(&area->faddr, &from[i], sizeof(area->faddr));
+
+        udpdev_rxdeliver(q, msgs[i], hdrs[i].msg_len);
+    }
+
+    for(; i < nmsgs; i++)
+    {
+        pstreams_freemsg(PSTRMHEAD(q), msgs[i]);
+    }
+
+    return P_STREAMS_SUCCESS;
+}
+#endif /*PSTREAMS_RECVMMSG*/
+
+#ifdef PSTREAMS_SENDMSG
+/******************************************************************************
+Name: udpdev_rxlarge
+Purpose: read a datagram too large for one read buffer with a single recvmsg,
+    straight into a chain of blocks(pstreams_allocmsg), and send it up.
+Parameters: len - bytes of the datagram waiting, as told by the peek in
+    udpdev_rsrvp
+Caveats: datagrams beyond MAXUDPRXSIZE are dropped
+******************************************************************************/
+static int
+udpdev_rxlarge(P_QUEUE *q, int32 len)
+{
+    UDPDEVAREA *area = (UDPDEVAREA *)q->q_ptr;
+    struct iovec iov[PSTREAMS_MAXIOV];
+    struct msghdr hdr;
+    P_MSGB *msg=NULL;
+    int niov=0;
+
+    msg = pstreams_allocmsg(PSTRMHEAD(q), MIN(len, MAXUDPRXSIZE));
+    if(!msg)
+    {
+#ifdef PSTREAMS_LT
+        pstreams_log(q, PSTREAMS_LTWARNING, "rsrvp: Unable to allocate %d bytes of read buffer. Not reading", len);
+#endif
+        return P_STREAMS_SUCCESS;
+    }
+
+    niov = pstreams_msgroomiov(msg, iov, PSTREAMS_MAXIOV);
+    ASSERT(niov > 0); /*PSTREAMS_MAXIOV blocks of the largest class hold MAXUDPRXSIZE*/
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = (void *)&area->faddr;
+    hdr.msg_namelen = sizeof(area->faddr);
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = niov;
+
+    len = recvmsg(area->sock, &hdr, MSG_DONTWAIT);
+
+    if(len == SOCKET_ERROR)
+    {
+        pstreams_freemsg(PSTRMHEAD(q), msg);
+        PSTRMHEAD(q)->perrno = errno;
+#ifdef PSTREAMS_LT
+        pstreams_log(q, PSTREAMS_LTERROR, "udpdev_rsrvp: recvmsg failed." " error %d", 
+            PSTRMHEAD(q)->perrno);
+#endif /*PSTREAMS_LT*/
+        /*ignore socket error - as for recvfrom in udpdev_rsrvp*/
+        PSTRMHEAD(q)->perrno = 0;
+        return P_STREAMS_SUCCESS;
+    }
+
+    if(hdr.msg_flags & MSG_TRUNC)
+    {
+        pstreams_freemsg(PSTRMHEAD(q), msg);
+#ifdef PSTREAMS_LT
+        pstreams_log(q, PSTREAMS_LTWARNING, 
+            "rsrvp: UDP datagram too large. dropped %d bytes.", len);
+#endif /*PSTREAMS_LT*/
+        return P_STREAMS_SUCCESS;
+    }
+
+    udpdev_rxdeliver(q, msg, len);
+
+    return P_STREAMS_SUCCESS;
+}
+#endif /*PSTREAMS_SENDMSG*/
+
+/******************************************************************************
+Name: udpdev_rxdeliver
+Purpose: send up a datagram of len bytes read into msg, from area->faddr.
+    msg is downsized when a smaller buffer will do and read buffers are
+    short, and put behind a UDPDEV_FADDR P_M_PROTO if the stream asked for
+    source addresses.
+Parameters:
+Caveats: msg is consumed - sent up or freed
+******************************************************************************/
+static int
+udpdev_rxdeliver(P_QUEUE *q, P_MSGB *msg, int32 len)
+{
+    UDPDEVAREA *area = (UDPDEVAREA *)q->q_ptr;
+
+#ifdef PSTREAMS_UDPDUMP
+    /*the block below is space expensive! - TODO verify if needed*/
+    {
+        uchar hexbuf[MAXUDPRXBUF*2] = { 0 };
+
+        bintohex(hexbuf, (uchar *)hexbuf, MIN(len, (int32)(sizeof(hexbuf)/2 - 1)));
+
+        pstreams_log(q, PSTREAMS_LTINFO, "udpdev_rsrvp: rx %d bytes\n%s", len, hexbuf);
+    }
+#endif 
+    /*the bytes read go in the blocks' room*/
+    if ( pstreams_msgfill(PSTRMHEAD(q), msg, len) != P_STREAMS_SUCCESS )
+    {
+        pstreams_freemsg(PSTRMHEAD(q), msg);
+#ifdef PSTREAMS_LT
+        pstreams_log(q, PSTREAMS_LTWARNING, 
+            "rsrvp: UDP datagram too large. dropped %d bytes.", len);
+#endif /*PSTREAMS_LT*/
+        return P_STREAMS_FAILURE;
+    }
+
+#ifdef PSTREAMS_LT
+    pstreams_log(q, PSTREAMS_LTINFO, "udpdev_wput_data: bytes read=%ld", len);
+#endif /*PSTREAMS_LT*/
+
+    /*
+     * will a smaller buffer do? - the copy is made only while read buffers
+     * run short(see udpdev_rxbatch), else msg goes up in place. A chain is
+     * left as it is
+     */
+    if ( !msg->b_cont && 
+        pstreams_mpool(PSTRMHEAD(q), len) < msg->b_datap->db_lim - msg->b_datap->db_base &&
+        pstreams_bufavail(PSTRMHEAD(q), msg->b_datap->db_lim - msg->b_datap->db_base) < 
+            (uint32)MAX(area->rxbatch, 1) )
+    {
+        P_MSGB *msgcpy = pstreams_copymsg(PSTRMHEAD(q), msg); /*will try smallest buffer*/
+        if(msgcpy) /*...and did we get a smaller buffer?*/
+        {
+            pstreams_freemsg(PSTRMHEAD(q), msg);
+            msg = msgcpy;
+        }
+#ifdef PSTREAMS_LT
+        else
+        {
+            pstreams_log(q, PSTREAMS_LTINFO+1, "udpdev_wput_data: "
+                "failed in downsizing readbuffer from %ld to %ld",
+                msg->b_datap->db_lim - msg->b_datap->db_base, len);
+        }
+#endif
+    }
+#ifdef PSTREAMS_LT
+    else
+    {
+        pstreams_log(q, PSTREAMS_LTINFO, "udpdev_wput_data: "
+            "read message of length %ld, sent up in place", len);
+    }
+#endif
+
+    if(area->rxaddr)
+    {
+        MY_PROTO proto={0};
+        P_MSGB *addrmsg = pstreams_allocb(PSTRMHEAD(q), 
+                                sizeof(MY_PROTO)+sizeof(area->faddr), 0);
+
+        if(!addrmsg)
+        {
+            pstreams_freemsg(PSTRMHEAD(q), msg);
+#ifdef PSTREAMS_LT
+            pstreams_log(q, PSTREAMS_LTWARNING, "rsrvp: out-of-memory for source "
+                "address. dropped %d bytes.", len);
+#endif /*PSTREAMS_LT*/
+            return P_STREAMS_FAILURE;
+        }
+
+        proto.ctlfunc = UDPDEV_FADDR;
+        addrmsg->b_datap->db_type = P_M_PROTO;
+        memcpy(addrmsg->b_wptr, &proto, sizeof(MY_PROTO));
+        addrmsg->b_wptr += sizeof(MY_PROTO);
+        memcpy(addrmsg->b_wptr, &area->faddr, sizeof(area->faddr));
+        addrmsg->b_wptr += sizeof(area->faddr);
+        MSGCHANGED(addrmsg);
+
+        pstreams_linkb(addrmsg, msg);
+        msg = addrmsg;
+    }
+
+    pstreams_putnext(q, msg);
+
+    return P_STREAMS_SUCCESS;
+}
     
 /******************************************************************************
 Name: udpdev_rput
@@ -684,6 +1273,16 @@ udpdev_close(P_QUEUE *q)
     {
         UDPDEVAREA *area=(UDPDEVAREA *)q->q_ptr;
 
+        pstreams_fdunregister(RD(q), area->sock);
+
+#ifdef PSTREAMS_SENDMMSG
+        /*a pending batch is sent before the socket goes*/
+        if(q->q_peer && q->q_peer->q_msglist)
+        {
+            udpdev_wflush(q->q_peer);
+        }
+#endif
+
         /*TODO - orderly release*/
 #ifdef PSTREAMS_WIN32
         closesocket(area->sock);
@@ -691,7 +1290,7 @@ udpdev_close(P_QUEUE *q)
 #ifdef PSTREAMS_H8
         tfClose(area->sock);
 #else
-        /*TODO - general case*/
+        close(area->sock);
 #endif
 #endif
         memset(q->q_ptr, 0, sizeof(UDPDEVAREA));
@@ -713,22 +1312,27 @@ udpdev_close(P_QUEUE *q)
 
 /******************************************************************************
 Name: udpdev_getarea
-Purpose: 
+Purpose: get this stream's UDPDEVAREA - from the stream's own memory, as in
+    saw_getarea, so that any number of UDP streams may be open at once.
 Parameters:
-Caveats:
+Caveats: NULL if the stream's memory is used up. The area is not given back
+    on close; it goes with the stream's memory.
 ******************************************************************************/
 static UDPDEVAREA *
-udpdev_getarea(void *key)
+udpdev_getarea(P_QUEUE *q)
 {
-    static UDPDEVAREA staticmem;
-    UDPDEVAREA *udpdevarea= (UDPDEVAREA *)&staticmem;
-
-    PDBG(key=NULL); /*keep compiler happy*/
+    UDPDEVAREA *udpdevarea=NULL;
 
-    if(udpdevarea)
+    udpdevarea = (UDPDEVAREA *)pstreams_memassign(PSTRMHEAD(q)->mem, sizeof(UDPDEVAREA));
+    if(!udpdevarea)
     {
-        memset(udpdevarea, 0, sizeof(UDPDEVAREA));
+        pstreams_console("ERROR: given buffer insufficient for local memory. "
+        "buffer size: %d. UDPDEVAREA requires: %d+memory for alignment",
+        PSTRMHEAD(q)->mem->limit-PSTRMHEAD(q)->mem->base, sizeof(UDPDEVAREA));
+        return NULL;
     }
 
+    memset(udpdevarea, 0, sizeof(UDPDEVAREA));
+
     return udpdevarea;
 }
@@ -12,14 +12,33 @@ typedef struct udpdevarea
     struct sockaddr_in laddr; /*local address*/
     struct sockaddr_in raddr; /*remote address*/
     struct sockaddr_in faddr; /*from address - i.e., responding address*/
+    int32 rxbatch; /*datagrams read per recvmmsg - 0,1 reads one at a time*/
+    P_BOOL rxaddr; /*each datagram goes up behind a P_M_PROTO with its source address*/
+    int32 txbatch; /*datagrams queued before a sendmmsg - 0,1 sends at once*/
+    int32 txbytes; /*bytes queued before a sendmmsg*/
+    int32 txdelay; /*milliseconds the oldest queued datagram may wait*/
+    int32 txsince; /*my_clockticks() when the queue last became non-empty*/
 #ifdef PSTREAMS_WIN32
     WSADATA wsadata; 
 #endif
 } UDPDEVAREA;
 
+/*payload of UDPDEV_TXBATCH*/
+typedef struct udptxbatch
+{
+    int32 count; /*datagrams - 0,1 turns batching off*/
+    int32 bytes;
+    int32 delay; /*milliseconds*/
+} UDPTXBATCH;
+
 enum UDPDEV_DEFINES
 {
-    MAXUDPDGRAMSIZE=1024
+    MAXUDPDGRAMSIZE=1024,
+    MAXUDPRXSIZE=65535, /*largest datagram read - see udpdev_rxlarge*/
+    MAXUDPRXBUF=2048, /*largest read buffer - see pstreams_rdbufsize*/
+    MAXUDPRXBATCH=32, /*largest batch for a single recvmmsg*/
+    MAXUDPTXBATCH=32, /*largest batch for a single sendmmsg*/
+    UDPTXRETRY=1 /*milliseconds before a batch the socket had no room for is retried*/
 };
 
 int
@@ -42,7 +61,5 @@ int
 udpdev_wsnd(P_QUEUE *q, P_MSGB *msg);
 int
 udpdev_wput_ctl(P_QUEUE *q, P_MSGB *msg);
-static UDPDEVAREA *
-udpdev_getarea(void *key);
 
 #endif
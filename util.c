@@ -237,6 +237,7 @@ senderror(P_QUEUE *q, uchar errcode)
         msg->b_datap->db_type = P_M_ERROR;
         memcpy(msg->b_wptr, &err, sizeof(err));
         msg->b_wptr += sizeof(MY_ERROR);
+        MSGCHANGED(msg);
 
         pstreams_putq(RD(q), msg);
     }
@@ -277,6 +278,7 @@ sendproto(P_QUEUE *q, uchar code, char *data, int16 datalen)
             memcpy(msg->b_wptr, data, datalen);
             msg->b_wptr += datalen;
         }
+        MSGCHANGED(msg);
 
         pstreams_putnext(RD(q), msg);/*ignoring canput()*/
     }
@@ -316,6 +318,7 @@ sendctl(P_QUEUE *q, uchar code, char *data, int16 datalen)
             memcpy(msg->b_wptr, data, datalen);
             msg->b_wptr += datalen;
         }
+        MSGCHANGED(msg);
 
         pstreams_putnext(q, msg);/*send in same direction*/
     }